@@ -4,4 +4,4 @@ copyright = u'2010,2014,2016,2019, Russell Stuart'
 version = '1.0.7'
 release = '1.0.7'
 extensions = ['sphinx.ext.intersphinx']
-intersphinx_mapping = {'python': ('http://docs.python.org/2.7', None)}
+intersphinx_mapping = {'python': ('https://docs.python.org/3', None)}
@@ -0,0 +1,519 @@
+/*
+ * A throughput and latency benchmark.  It runs whole PAM transactions,
+ * pam_start() through pam_end(), in one or more threads and reports how
+ * long each PAM call took.  Best run using the Makefile target
+ * "benchmark".  To compile and run manually:
+ *   gcc -O2 -Wall -o bench bench.c -lpam -lpthread
+ *   ./bench -m ../examples/pam_permit.py
+ *
+ * Without -m it uses an existing PAM service, by default the
+ * test-pam_python.pam used by ctest.  With -m it writes a service that
+ * calls every handler of the given Python module through pam_python.so
+ * to a temporary directory and uses that, which needs Linux-PAM 1.4 or
+ * later but not root.
+ *
+ * The first call of each transaction creates pam_python's handle, so it
+ * is reported separately as a "cold" create if no other transaction was
+ * running in the process at the time (so Python had to be started), or
+ * a "warm" one if there was.  With -r each thread reuses one
+ * pam_handle_t for all its transactions, so only its first is a create.
+ */
+#define	_GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <security/pam_appl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__LINUX_PAM__) && \
+    (__LINUX_PAM__ > 1 || __LINUX_PAM_MINOR__ >= 4)
+#define	HAVE_PAM_START_CONFDIR	1
+#endif
+
+#define	BENCH_SERVICE		"pam_python-bench"
+
+/*
+ * What is timed.  The PAM calls a transaction makes come first, in the
+ * order they are made.
+ */
+enum {
+  OP_AUTHENTICATE,
+  OP_SETCRED,
+  OP_ACCT_MGMT,
+  OP_OPEN_SESSION,
+  OP_CLOSE_SESSION,
+  OP_CHAUTHTOK,
+  OP_CALL_COUNT,
+  OP_START = OP_CALL_COUNT,
+  OP_END,
+  OP_CREATE_COLD,
+  OP_CREATE_WARM,
+  OP_COUNT
+};
+
+static const struct {
+  const char*	name;		/* What it is reported as */
+  const char*	step;		/* Its name in -s */
+  int		(*func)(pam_handle_t*, int);
+} ops[OP_COUNT] = {
+  {"pam_authenticate",	"auth",		pam_authenticate},
+  {"pam_setcred",	"setcred",	pam_setcred},
+  {"pam_acct_mgmt",	"acct",		pam_acct_mgmt},
+  {"pam_open_session",	"open",		pam_open_session},
+  {"pam_close_session",	"close",	pam_close_session},
+  {"pam_chauthtok",	"chauthtok",	pam_chauthtok},
+  {"pam_start",		0,		0},
+  {"pam_end",		0,		0},
+  {"create (cold)",	0,		0},
+  {"create (warm)",	0,		0},
+};
+
+/*
+ * Latencies of one op, in seconds.
+ */
+struct samples {
+  double*	data;
+  long		count;
+  long		size;
+};
+
+struct thread {
+  pthread_t		thread;
+  int			failed;		/* Set if a PAM call failed */
+  struct samples	samples[OP_COUNT];
+  long			transactions;	/* Completed */
+};
+
+static pthread_barrier_t	barrier;
+static const char*		confdir = 0;
+static long			count = 1000;
+static int			finished = 0;	/* Threads that are done */
+static int			live = 0;	/* Transactions running */
+static int			reuse = 0;
+static const char*		service = "test-pam_python.pam";
+static int			steps[OP_CALL_COUNT];
+static int			step_count = 0;
+static const char*		user = "";
+
+static int conv(
+    int num_msg, const struct pam_message** msg, struct pam_response** resp, void *appdata_ptr)
+{
+  int		i;
+
+  (void)appdata_ptr;
+  *resp = malloc(num_msg * sizeof(**resp));
+  for (i = 0; i < num_msg; i += 1)
+  {
+    (*resp)[i].resp = strdup((*msg)[i].msg);
+    (*resp)[i].resp_retcode = (*msg)[i].msg_style;
+  }
+  return 0;
+}
+
+static double now(void)
+{
+  struct timespec	ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long long rss(void)
+{
+  char		buf[128];
+  int		fd;
+  ssize_t	len;
+  unsigned long	resident = 0;
+
+  fd = open("/proc/self/statm", O_RDONLY);
+  if (fd == -1)
+    return -1;
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0)
+    return -1;
+  buf[len] = '\0';
+  if (sscanf(buf, "%*u %lu", &resident) != 1)
+    return -1;
+  return (long long)resident * sysconf(_SC_PAGESIZE);
+}
+
+static void add_sample(struct samples* samples, double seconds)
+{
+  if (samples->count == samples->size)
+  {
+    samples->size = samples->size == 0 ? 1024 : samples->size * 2;
+    samples->data = realloc(samples->data, samples->size * sizeof(double));
+    if (samples->data == 0)
+    {
+      fprintf(stderr, "out of memory\n");
+      exit(2);
+    }
+  }
+  samples->data[samples->count++] = seconds;
+}
+
+static int pam_start_service(pam_handle_t** pamh)
+{
+  static struct pam_conv	convstruct = {conv, 0};
+
+#ifdef HAVE_PAM_START_CONFDIR
+  if (confdir != 0)
+    return pam_start_confdir(service, user, &convstruct, confdir, pamh);
+#endif
+  return pam_start(service, user, &convstruct, pamh);
+}
+
+/*
+ * Make one PAM call, recording how long it took.
+ */
+static int timed_call(
+    struct thread* thread, pam_handle_t* pamh, int op, int* first)
+{
+  double	elapsed;
+  int		pam_result;
+  double	start;
+  int		warm = 0;
+
+  if (*first)
+    warm = __atomic_load_n(&live, __ATOMIC_RELAXED) > 1;
+  start = now();
+  pam_result = ops[op].func(pamh, 0);
+  elapsed = now() - start;
+  if (*first)
+    add_sample(&thread->samples[warm ? OP_CREATE_WARM : OP_CREATE_COLD], elapsed);
+  else
+    add_sample(&thread->samples[op], elapsed);
+  *first = 0;
+  if (pam_result != PAM_SUCCESS)
+  {
+    fprintf(
+      stderr, "%s failed: %d %s\n",
+      ops[op].name, pam_result, pam_strerror(pamh, pam_result));
+    thread->failed = 1;
+  }
+  return pam_result;
+}
+
+static int transaction_start(struct thread* thread, pam_handle_t** pamh)
+{
+  double	start;
+
+  __atomic_add_fetch(&live, 1, __ATOMIC_RELAXED);
+  start = now();
+  if (pam_start_service(pamh) != PAM_SUCCESS)
+  {
+    fprintf(stderr, "pam_start failed\n");
+    __atomic_sub_fetch(&live, 1, __ATOMIC_RELAXED);
+    thread->failed = 1;
+    return -1;
+  }
+  add_sample(&thread->samples[OP_START], now() - start);
+  return 0;
+}
+
+static void transaction_end(struct thread* thread, pam_handle_t* pamh)
+{
+  double	start;
+
+  start = now();
+  pam_end(pamh, PAM_SUCCESS);
+  add_sample(&thread->samples[OP_END], now() - start);
+  __atomic_sub_fetch(&live, 1, __ATOMIC_RELAXED);
+}
+
+static void* run_thread(void* arg)
+{
+  int		first = 1;
+  long		i;
+  pam_handle_t*	pamh = 0;
+  int		step;
+  struct thread* thread = arg;
+
+  pthread_barrier_wait(&barrier);
+  for (i = 0; i < count && !thread->failed; i += 1)
+  {
+    if (pamh == 0)
+    {
+      if (transaction_start(thread, &pamh) == -1)
+	break;
+      first = 1;
+    }
+    for (step = 0; step < step_count; step += 1)
+    {
+      if (timed_call(thread, pamh, steps[step], &first) != PAM_SUCCESS)
+	break;
+    }
+    thread->transactions += 1;
+    if (!reuse)
+    {
+      transaction_end(thread, pamh);
+      pamh = 0;
+    }
+  }
+  if (pamh != 0)
+    transaction_end(thread, pamh);
+  __atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+  double	x = *(const double*)a;
+  double	y = *(const double*)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const struct samples* samples, double p)
+{
+  long		i;
+
+  i = (long)(samples->count * p);
+  if (i >= samples->count)
+    i = samples->count - 1;
+  return samples->data[i];
+}
+
+/*
+ * Write a PAM service that calls every handler in module.
+ */
+static char* make_service(
+    const char* module, const char* pam_python, const char* options)
+{
+  static char	dir[] = "/tmp/pam_python-bench.XXXXXX";
+  FILE*		f;
+  char		path[PATH_MAX];
+  static const char* const types[] = {"auth", "account", "session", "password"};
+  size_t	i;
+
+  if (mkdtemp(dir) == 0)
+  {
+    perror(dir);
+    exit(2);
+  }
+  snprintf(path, sizeof(path), "%s/%s", dir, BENCH_SERVICE);
+  f = fopen(path, "w");
+  if (f == 0)
+  {
+    perror(path);
+    exit(2);
+  }
+  for (i = 0; i < sizeof(types) / sizeof(*types); i += 1)
+  {
+    fprintf(
+      f, "%s required %s %s%s%s\n", types[i], pam_python,
+      options, *options == '\0' ? "" : " ", module);
+  }
+  fclose(f);
+  return dir;
+}
+
+static void remove_service(const char* dir)
+{
+  char		path[PATH_MAX];
+
+  snprintf(path, sizeof(path), "%s/%s", dir, BENCH_SERVICE);
+  unlink(path);
+  rmdir(dir);
+}
+
+static void parse_steps(const char* arg)
+{
+  char*		copy = strdup(arg);
+  int		op;
+  char*		save;
+  char*		word;
+
+  for (word = strtok_r(copy, ",", &save); word != 0; word = strtok_r(0, ",", &save))
+  {
+    for (op = 0; op < OP_CALL_COUNT; op += 1)
+    {
+      if (strcmp(word, ops[op].step) == 0)
+	break;
+    }
+    if (op == OP_CALL_COUNT || step_count == OP_CALL_COUNT)
+    {
+      fprintf(stderr, "unknown step %s\n", word);
+      exit(2);
+    }
+    steps[step_count++] = op;
+  }
+  free(copy);
+}
+
+static void usage(const char* me)
+{
+  fprintf(
+    stderr,
+    "usage: %s [-n count] [-r] [-t threads] [-s steps] [-i interval]\n"
+    "          [-m module [-o options] [-p pam_python.so]] [service [user]]\n"
+    "  -n count     Transactions per thread (default 1000).\n"
+    "  -r           Reuse one pam_handle_t per thread.\n"
+    "  -t threads   Threads making transactions (default 1).\n"
+    "  -s steps     Calls each transaction makes, a comma separated list of\n"
+    "               auth,setcred,acct,open,close,chauthtok\n"
+    "               (default auth,acct,open,close).\n"
+    "  -i interval  Seconds between RSS reports (default 1).\n"
+    "  -m module    Benchmark this Python module rather than a service.\n"
+    "  -o options   pam_python options for -m, eg \"stats log_async\".\n"
+    "  -p path      pam_python.so for -m (default ./pam_python.so).\n"
+    "  service      PAM service (default test-pam_python.pam).\n"
+    "  user         User to authenticate (default none).\n",
+    me);
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  double		elapsed;
+  int			exit_status = 0;
+  long			i;
+  double		interval = 1;
+  const char*		module = 0;
+  double		next;
+  int			op;
+  int			opt;
+  const char*		options = "";
+  char			pam_python[PATH_MAX];
+  const char*		pam_python_arg = "pam_python.so";
+  struct samples	samples;
+  double		start;
+  struct thread*	thread;
+  int			thread_count = 1;
+  struct thread*	threads;
+  long			transactions;
+
+  while ((opt = getopt(argc, argv, "i:m:n:o:p:rs:t:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'i': interval = atof(optarg); break;
+      case 'm': module = optarg; break;
+      case 'n': count = atol(optarg); break;
+      case 'o': options = optarg; break;
+      case 'p': pam_python_arg = optarg; break;
+      case 'r': reuse = 1; break;
+      case 's': parse_steps(optarg); break;
+      case 't': thread_count = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (count <= 0 || thread_count <= 0 || interval <= 0)
+    usage(argv[0]);
+  if (optind < argc)
+    service = argv[optind++];
+  if (optind < argc)
+    user = argv[optind++];
+  if (optind < argc)
+    usage(argv[0]);
+  if (step_count == 0)
+    parse_steps("auth,acct,open,close");
+  if (module != 0)
+  {
+#ifndef HAVE_PAM_START_CONFDIR
+    fprintf(stderr, "-m needs pam_start_confdir(), from Linux-PAM 1.4\n");
+    exit(2);
+#endif
+    if (realpath(pam_python_arg, pam_python) == 0)
+    {
+      perror(pam_python_arg);
+      exit(2);
+    }
+    if (module[0] != '/')
+    {
+      fprintf(stderr, "-m needs an absolute path\n");
+      exit(2);
+    }
+    confdir = make_service(module, pam_python, options);
+    service = BENCH_SERVICE;
+  }
+  threads = calloc(thread_count, sizeof(*threads));
+  if (threads == 0)
+  {
+    fprintf(stderr, "out of memory\n");
+    exit(2);
+  }
+  pthread_barrier_init(&barrier, 0, thread_count + 1);
+  for (thread = threads; thread < threads + thread_count; thread += 1)
+  {
+    if (pthread_create(&thread->thread, 0, run_thread, thread) != 0)
+    {
+      fprintf(stderr, "can't create thread\n");
+      exit(2);
+    }
+  }
+  printf(
+    "%d threads, %ld transactions each, %s pam_handle_t\n",
+    thread_count, count, reuse ? "reusing" : "recreating");
+  printf("%10s %14s\n", "seconds", "rss");
+  printf("%10.1f %14lld\n", 0.0, rss());
+  pthread_barrier_wait(&barrier);
+  start = now();
+  /*
+   * Report the RSS while the threads run.
+   */
+  while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) < thread_count)
+  {
+    next = now() + interval;
+    while (now() < next &&
+	__atomic_load_n(&finished, __ATOMIC_ACQUIRE) < thread_count)
+      usleep(10000);
+    printf("%10.1f %14lld\n", now() - start, rss());
+    fflush(stdout);
+  }
+  for (thread = threads; thread < threads + thread_count; thread += 1)
+    pthread_join(thread->thread, 0);
+  elapsed = now() - start;
+  /*
+   * Merge the threads' samples and report.
+   */
+  transactions = 0;
+  for (thread = threads; thread < threads + thread_count; thread += 1)
+  {
+    if (thread->failed)
+      exit_status = 1;
+    transactions += thread->transactions;
+  }
+  printf(
+    "%ld transactions in %.3fs, %.1f transactions/s, %.1f calls/s\n",
+    transactions, elapsed, transactions / elapsed,
+    transactions * step_count / elapsed);
+  printf(
+    "%-18s %9s %10s %10s %10s %10s %10s\n",
+    "call", "count", "mean us", "p50 us", "p99 us", "p999 us", "max us");
+  for (op = 0; op < OP_COUNT; op += 1)
+  {
+    double	total = 0;
+
+    memset(&samples, '\0', sizeof(samples));
+    for (thread = threads; thread < threads + thread_count; thread += 1)
+    {
+      for (i = 0; i < thread->samples[op].count; i += 1)
+      {
+	add_sample(&samples, thread->samples[op].data[i]);
+	total += thread->samples[op].data[i];
+      }
+      free(thread->samples[op].data);
+    }
+    if (samples.count == 0)
+      continue;
+    qsort(samples.data, samples.count, sizeof(double), compare_double);
+    printf(
+      "%-18s %9ld %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+      ops[op].name, samples.count, total / samples.count * 1e6,
+      percentile(&samples, 0.5) * 1e6, percentile(&samples, 0.99) * 1e6,
+      percentile(&samples, 0.999) * 1e6,
+      samples.data[samples.count - 1] * 1e6);
+    free(samples.data);
+  }
+  free(threads);
+  if (confdir != 0)
+    remove_service(confdir);
+  return exit_status;
+}
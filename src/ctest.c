@@ -98,7 +98,8 @@ int main(int argc, char **argv)
 
   (void)argc;
   (void)argv;
-  if (access("/etc/pam.d/test-pam_python.pam", 0) != 0)
+  if (getenv("FAKEPAM_CONFDIR") == 0 &&
+      access("/etc/pam.d/test-pam_python.pam", 0) != 0)
   {
     fprintf(
       stderr,
@@ -145,7 +146,7 @@ int main(int argc, char **argv)
   }
   else if (walk_info_after.python_seen)
   {
-    fprintf(stderr, "libpythonX.Y.so wasn't uloaded.\n");
+    fprintf(stderr, "libpythonX.Y.so wasn't unloaded.\n");
     exit_status = 1;
   }
   else
@@ -0,0 +1,744 @@
+/*
+ * Copyright (c) 2007-2012,2014,2016,2019 Russell Stuart
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * The copyright holders grant you an additional permission under Section 7
+ * of the GNU Affero General Public License, version 3, exempting you from
+ * the requirement in Section 6 of the GNU General Public License, version 3,
+ * to accompany Corresponding Source with Installation Information for the
+ * Program or any work based on the Program. You are still required to
+ * comply with all other Section 6 requirements to provide Corresponding
+ * Source.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A stand in for libpam, so pam_python.so can be tested and benchmarked
+ * without root, without /etc/pam.d, and without the noise of the real
+ * thing.  It is built as fakepam/libpam.so.0, and anything run with
+ * LD_LIBRARY_PATH=fakepam uses it in place of the real libpam:
+ *
+ *   LD_LIBRARY_PATH=fakepam FAKEPAM_CONFDIR=. ./ctest
+ *
+ * It implements what applications and pam_python.so use.  Services are
+ * read from the directory given to pam_start_confdir(), or else
+ * $FAKEPAM_CONFDIR, or else /etc/pam.d.  Each line is "type control
+ * module args...", where control is one of required, requisite,
+ * sufficient or optional (anything else is taken as required).  Modules
+ * are dlopen()'ed when a handle first needs them and their pam_sm_*
+ * functions are called directly.  pam_fail_delay() is recorded, but
+ * nothing ever sleeps, so timings are repeatable.
+ */
+#define	_GNU_SOURCE
+
+#include <ctype.h>
+#include <dlfcn.h>
+#include <limits.h>
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fakepam.h"
+
+#ifndef	PAM_PRELIM_CHECK
+#define	PAM_PRELIM_CHECK	0x4000
+#endif
+#ifndef	PAM_UPDATE_AUTHTOK
+#define	PAM_UPDATE_AUTHTOK	0x2000
+#endif
+#ifndef	PAM_DATA_REPLACE
+#define	PAM_DATA_REPLACE	0x20000000
+#endif
+
+#define	FAKEPAM_CONFDIR_ENV	"FAKEPAM_CONFDIR"
+#define	FAKEPAM_DEFAULT_CONFDIR	"/etc/pam.d"
+#define	FAKEPAM_ITEM_COUNT	(PAM_AUTHTOK_TYPE + 1)
+#define	FAKEPAM_MAX_ARGS	32
+
+typedef int (*FakePamHandler)(pam_handle_t*, int, int, const char**);
+
+enum {
+  TYPE_AUTH,
+  TYPE_ACCOUNT,
+  TYPE_SESSION,
+  TYPE_PASSWORD
+};
+
+enum {
+  CONTROL_REQUIRED,
+  CONTROL_REQUISITE,
+  CONTROL_SUFFICIENT,
+  CONTROL_OPTIONAL
+};
+
+/*
+ * One line of a service.
+ */
+typedef struct FakePamModule
+{
+  int			argc;
+  char*			argv[FAKEPAM_MAX_ARGS];
+  int			control;	/* CONTROL_... */
+  void*			dlhandle;	/* dlopen() of path */
+  struct FakePamModule*	next;
+  char*			path;
+  int			type;		/* TYPE_... */
+} FakePamModule;
+
+typedef struct FakePamData
+{
+  void			(*cleanup)(pam_handle_t*, void*, int);
+  void*			data;
+  char*			name;
+  struct FakePamData*	next;
+} FakePamData;
+
+struct pam_handle
+{
+  char*			confdir;
+  struct pam_conv	conv;		/* PAM_CONV */
+  FakePamData*		data;		/* pam_set_data() */
+  char**		env;		/* pam_putenv(), 0 terminated */
+  int			env_count;
+  unsigned int		fail_delay;	/* Longest pam_fail_delay() */
+  void*			fail_delay_func;/* PAM_FAIL_DELAY */
+  int			loaded;		/* True once modules is read */
+  FakePamModule*	modules;	/* The service */
+  char*			items[FAKEPAM_ITEM_COUNT];
+  struct pam_xauth_data	xauthdata;	/* PAM_XAUTHDATA */
+};
+
+static const char* const fakepam_errors[] =
+{
+  "Success",
+  "Failed to load module",
+  "Symbol not found",
+  "Error in service module",
+  "System error",
+  "Memory buffer error",
+  "Permission denied",
+  "Authentication failure",
+  "Insufficient credentials to access authentication data",
+  "Authentication service cannot retrieve authentication info",
+  "User not known to the underlying authentication module",
+  "Have exhausted maximum number of retries for service",
+  "Authentication token is no longer valid; new one required",
+  "User account has expired",
+  "Cannot make/remove an entry for the specified session",
+  "Authentication service cannot retrieve user credentials",
+  "User credentials expired",
+  "Failure setting user credentials",
+  "No module specific data is present",
+  "Conversation error",
+  "Authentication token manipulation error",
+  "Authentication information cannot be recovered",
+  "Authentication token lock busy",
+  "Authentication token aging disabled",
+  "Failed preliminary check by password service",
+  "The return value should be ignored by PAM dispatch",
+  "Critical error - immediate abort",
+  "Authentication token expired",
+  "Module is unknown",
+  "Bad item passed to pam_*_item()",
+  "Conversation is waiting for event",
+  "Application needs to call libpam again",
+};
+
+/*
+ * Items that are strings.
+ */
+static int fakepam_string_item(int item_type)
+{
+  switch (item_type)
+  {
+    case PAM_SERVICE:
+    case PAM_USER:
+    case PAM_TTY:
+    case PAM_RHOST:
+    case PAM_AUTHTOK:
+    case PAM_OLDAUTHTOK:
+    case PAM_RUSER:
+    case PAM_USER_PROMPT:
+    case PAM_XDISPLAY:
+    case PAM_AUTHTOK_TYPE:
+      return 1;
+  }
+  return 0;
+}
+
+static void fakepam_free_modules(pam_handle_t* pamh)
+{
+  FakePamModule*	module;
+  int			i;
+
+  while (pamh->modules != 0)
+  {
+    module = pamh->modules;
+    pamh->modules = module->next;
+    if (module->dlhandle != 0)
+      dlclose(module->dlhandle);
+    for (i = 0; i < module->argc; i += 1)
+      free(module->argv[i]);
+    free(module->path);
+    free(module);
+  }
+}
+
+/*
+ * Read the service's file.  Returns a PAM result.
+ */
+static int fakepam_load(pam_handle_t* pamh)
+{
+  static const char* const controls[] =
+      {"required", "requisite", "sufficient", "optional"};
+  static const char* const types[] =
+      {"auth", "account", "session", "password"};
+  const char*		confdir;
+  FILE*			f;
+  char			line[1024];
+  FakePamModule*	module;
+  FakePamModule**	tail = &pamh->modules;
+  char			path[PATH_MAX];
+  char*			save;
+  size_t		i;
+  char*			word;
+
+  if (pamh->loaded)
+    return PAM_SUCCESS;
+  pamh->loaded = 1;
+  confdir = pamh->confdir;
+  if (confdir == 0)
+    confdir = getenv(FAKEPAM_CONFDIR_ENV);
+  if (confdir == 0)
+    confdir = FAKEPAM_DEFAULT_CONFDIR;
+  snprintf(path, sizeof(path), "%s/%s", confdir, pamh->items[PAM_SERVICE]);
+  f = fopen(path, "r");
+  if (f == 0)
+    return PAM_ABORT;
+  while (fgets(line, sizeof(line), f) != 0)
+  {
+    word = strtok_r(line, " \t\n", &save);
+    if (word == 0 || word[0] == '#')
+      continue;
+    for (i = 0; i < sizeof(types) / sizeof(*types); i += 1)
+    {
+      if (strcmp(word, types[i]) == 0)
+	break;
+    }
+    if (i == sizeof(types) / sizeof(*types))
+      continue;
+    module = calloc(1, sizeof(*module));
+    if (module == 0)
+      break;
+    module->type = i;
+    word = strtok_r(0, " \t\n", &save);
+    module->control = CONTROL_REQUIRED;
+    for (i = 0; word != 0 && i < sizeof(controls) / sizeof(*controls); i += 1)
+    {
+      if (strcmp(word, controls[i]) == 0)
+	module->control = i;
+    }
+    word = strtok_r(0, " \t\n", &save);
+    module->path = strdup(word != 0 ? word : "");
+    while ((word = strtok_r(0, " \t\n", &save)) != 0 &&
+	module->argc < FAKEPAM_MAX_ARGS)
+      module->argv[module->argc++] = strdup(word);
+    *tail = module;
+    tail = &module->next;
+  }
+  fclose(f);
+  return PAM_SUCCESS;
+}
+
+/*
+ * Call a handler in every module of a type, combining the results the
+ * way libpam does.
+ */
+static int fakepam_dispatch(
+    pam_handle_t* pamh, int type, const char* handler_name, int flags)
+{
+  FakePamHandler	handler;
+  FakePamModule*	module;
+  int			pam_result;
+  int			result = -1;		/* -1 means nothing decided */
+  int			failed = 0;
+
+  pam_result = fakepam_load(pamh);
+  if (pam_result != PAM_SUCCESS)
+    return pam_result;
+  for (module = pamh->modules; module != 0; module = module->next)
+  {
+    if (module->type != type)
+      continue;
+    if (module->dlhandle == 0)
+      module->dlhandle = dlopen(module->path, RTLD_NOW|RTLD_LOCAL);
+    handler = 0;
+    if (module->dlhandle != 0)
+      *(void**)&handler = dlsym(module->dlhandle, handler_name);
+    if (module->dlhandle == 0)
+      pam_result = PAM_OPEN_ERR;
+    else if (handler == 0)
+      pam_result = PAM_SYMBOL_ERR;
+    else
+    {
+      pam_result = handler(
+	  pamh, flags, module->argc, (const char**)module->argv);
+    }
+    if (pam_result == PAM_IGNORE)
+      continue;
+    switch (module->control)
+    {
+      case CONTROL_SUFFICIENT:
+	if (pam_result == PAM_SUCCESS && !failed)
+	  return PAM_SUCCESS;
+	break;
+      case CONTROL_OPTIONAL:
+	if (result == -1)
+	  result = pam_result;
+	break;
+      default:
+	if (pam_result != PAM_SUCCESS && !failed)
+	{
+	  result = pam_result;
+	  failed = 1;
+	}
+	else if (result == -1 || (!failed && result != PAM_SUCCESS))
+	  result = pam_result;
+	if (failed && module->control == CONTROL_REQUISITE)
+	  return result;
+	break;
+    }
+  }
+  return result == -1 ? PAM_PERM_DENIED : result;
+}
+
+int pam_start_confdir(
+    const char* service_name, const char* user,
+    const struct pam_conv* pam_conversation, const char* confdir,
+    pam_handle_t** pamh)
+{
+  *pamh = calloc(1, sizeof(**pamh));
+  if (*pamh == 0)
+    return PAM_BUF_ERR;
+  if (pam_conversation != 0)
+    (*pamh)->conv = *pam_conversation;
+  if (confdir != 0)
+    (*pamh)->confdir = strdup(confdir);
+  pam_set_item(*pamh, PAM_SERVICE, service_name);
+  if (user != 0 && *user != '\0')
+    pam_set_item(*pamh, PAM_USER, user);
+  return PAM_SUCCESS;
+}
+
+int pam_start(
+    const char* service_name, const char* user,
+    const struct pam_conv* pam_conversation, pam_handle_t** pamh)
+{
+  return pam_start_confdir(service_name, user, pam_conversation, 0, pamh);
+}
+
+int pam_end(pam_handle_t* pamh, int pam_status)
+{
+  FakePamData*		data;
+  int			i;
+
+  if (pamh == 0)
+    return PAM_SYSTEM_ERR;
+  /*
+   * Like libpam, the data goes before the modules, as its cleanup
+   * functions live in them.
+   */
+  while (pamh->data != 0)
+  {
+    data = pamh->data;
+    pamh->data = data->next;
+    if (data->cleanup != 0)
+      data->cleanup(pamh, data->data, pam_status);
+    free(data->name);
+    free(data);
+  }
+  fakepam_free_modules(pamh);
+  for (i = 0; i < FAKEPAM_ITEM_COUNT; i += 1)
+    free(pamh->items[i]);
+  for (i = 0; i < pamh->env_count; i += 1)
+    free(pamh->env[i]);
+  free(pamh->env);
+  free(pamh->xauthdata.name);
+  free(pamh->xauthdata.data);
+  free(pamh->confdir);
+  free(pamh);
+  return PAM_SUCCESS;
+}
+
+int pam_authenticate(pam_handle_t* pamh, int flags)
+{
+  int			pam_result;
+
+  pamh->fail_delay = 0;
+  pam_result = fakepam_dispatch(pamh, TYPE_AUTH, "pam_sm_authenticate", flags);
+  if (pam_result != PAM_SUCCESS && pamh->fail_delay_func != 0)
+  {
+    ((void (*)(int, unsigned int, void*))pamh->fail_delay_func)(
+	pam_result, pamh->fail_delay, pamh->conv.appdata_ptr);
+  }
+  return pam_result;
+}
+
+int pam_setcred(pam_handle_t* pamh, int flags)
+{
+  return fakepam_dispatch(pamh, TYPE_AUTH, "pam_sm_setcred", flags);
+}
+
+int pam_acct_mgmt(pam_handle_t* pamh, int flags)
+{
+  return fakepam_dispatch(pamh, TYPE_ACCOUNT, "pam_sm_acct_mgmt", flags);
+}
+
+int pam_open_session(pam_handle_t* pamh, int flags)
+{
+  return fakepam_dispatch(pamh, TYPE_SESSION, "pam_sm_open_session", flags);
+}
+
+int pam_close_session(pam_handle_t* pamh, int flags)
+{
+  return fakepam_dispatch(pamh, TYPE_SESSION, "pam_sm_close_session", flags);
+}
+
+/*
+ * Like libpam, the password stack is run twice.
+ */
+int pam_chauthtok(pam_handle_t* pamh, int flags)
+{
+  int			pam_result;
+
+  pam_result = fakepam_dispatch(
+      pamh, TYPE_PASSWORD, "pam_sm_chauthtok", flags | PAM_PRELIM_CHECK);
+  if (pam_result != PAM_SUCCESS)
+    return pam_result;
+  return fakepam_dispatch(
+      pamh, TYPE_PASSWORD, "pam_sm_chauthtok", flags | PAM_UPDATE_AUTHTOK);
+}
+
+const char* pam_strerror(pam_handle_t* pamh, int errnum)
+{
+  (void)pamh;
+  if (errnum < 0 || errnum >= (int)(sizeof(fakepam_errors) / sizeof(*fakepam_errors)))
+    return "Unknown PAM error";
+  return fakepam_errors[errnum];
+}
+
+int pam_set_item(pam_handle_t* pamh, int item_type, const void* item)
+{
+  const struct pam_xauth_data* xauthdata;
+
+  if (pamh == 0)
+    return PAM_SYSTEM_ERR;
+  if (fakepam_string_item(item_type))
+  {
+    free(pamh->items[item_type]);
+    pamh->items[item_type] = item == 0 ? 0 : strdup(item);
+    return PAM_SUCCESS;
+  }
+  switch (item_type)
+  {
+    case PAM_CONV:
+      if (item == 0)
+	return PAM_PERM_DENIED;
+      pamh->conv = *(const struct pam_conv*)item;
+      return PAM_SUCCESS;
+    case PAM_FAIL_DELAY:
+      pamh->fail_delay_func = (void*)item;
+      return PAM_SUCCESS;
+    case PAM_XAUTHDATA:
+      xauthdata = item;
+      free(pamh->xauthdata.name);
+      free(pamh->xauthdata.data);
+      memset(&pamh->xauthdata, '\0', sizeof(pamh->xauthdata));
+      if (xauthdata == 0)
+	return PAM_SUCCESS;
+      pamh->xauthdata.namelen = xauthdata->namelen;
+      pamh->xauthdata.datalen = xauthdata->datalen;
+      pamh->xauthdata.name = malloc(xauthdata->namelen + 1);
+      pamh->xauthdata.data = malloc(xauthdata->datalen + 1);
+      if (pamh->xauthdata.name == 0 || pamh->xauthdata.data == 0)
+	return PAM_BUF_ERR;
+      memcpy(pamh->xauthdata.name, xauthdata->name, xauthdata->namelen);
+      pamh->xauthdata.name[xauthdata->namelen] = '\0';
+      memcpy(pamh->xauthdata.data, xauthdata->data, xauthdata->datalen);
+      pamh->xauthdata.data[xauthdata->datalen] = '\0';
+      return PAM_SUCCESS;
+  }
+  return PAM_BAD_ITEM;
+}
+
+int pam_get_item(const pam_handle_t* pamh, int item_type, const void** item)
+{
+  if (pamh == 0)
+    return PAM_SYSTEM_ERR;
+  if (fakepam_string_item(item_type))
+  {
+    *item = pamh->items[item_type];
+    return PAM_SUCCESS;
+  }
+  switch (item_type)
+  {
+    case PAM_CONV:
+      *item = &pamh->conv;
+      return PAM_SUCCESS;
+    case PAM_FAIL_DELAY:
+      *item = pamh->fail_delay_func;
+      return PAM_SUCCESS;
+    case PAM_XAUTHDATA:
+      *item = &pamh->xauthdata;
+      return PAM_SUCCESS;
+  }
+  return PAM_BAD_ITEM;
+}
+
+int pam_get_user(pam_handle_t* pamh, const char** user, const char* prompt)
+{
+  struct pam_message	message;
+  const struct pam_message* messages[1];
+  int			pam_result;
+  struct pam_response*	response = 0;
+
+  if (pamh == 0 || user == 0)
+    return PAM_SYSTEM_ERR;
+  if (pamh->items[PAM_USER] != 0)
+  {
+    *user = pamh->items[PAM_USER];
+    return PAM_SUCCESS;
+  }
+  if (pamh->conv.conv == 0)
+    return PAM_CONV_ERR;
+  if (prompt == 0)
+    prompt = pamh->items[PAM_USER_PROMPT];
+  message.msg_style = PAM_PROMPT_ECHO_ON;
+  message.msg = prompt != 0 ? prompt : "login: ";
+  messages[0] = &message;
+  pam_result = pamh->conv.conv(1, messages, &response, pamh->conv.appdata_ptr);
+  if (pam_result != PAM_SUCCESS || response == 0 || response->resp == 0)
+    pam_result = pam_result != PAM_SUCCESS ? pam_result : PAM_CONV_ERR;
+  else
+    pam_result = pam_set_item(pamh, PAM_USER, response->resp);
+  if (response != 0)
+  {
+    free(response->resp);
+    free(response);
+  }
+  *user = pamh->items[PAM_USER];
+  return pam_result;
+}
+
+int pam_set_data(
+    pam_handle_t* pamh, const char* module_data_name, void* data,
+    void (*cleanup)(pam_handle_t* pamh, void* data, int error_status))
+{
+  FakePamData*		entry;
+
+  if (pamh == 0 || module_data_name == 0)
+    return PAM_SYSTEM_ERR;
+  for (entry = pamh->data; entry != 0; entry = entry->next)
+  {
+    if (strcmp(entry->name, module_data_name) == 0)
+      break;
+  }
+  if (entry != 0)
+  {
+    if (entry->cleanup != 0)
+      entry->cleanup(pamh, entry->data, PAM_DATA_REPLACE | PAM_SUCCESS);
+  }
+  else
+  {
+    entry = calloc(1, sizeof(*entry));
+    if (entry == 0)
+      return PAM_BUF_ERR;
+    entry->name = strdup(module_data_name);
+    entry->next = pamh->data;
+    pamh->data = entry;
+  }
+  entry->data = data;
+  entry->cleanup = cleanup;
+  return PAM_SUCCESS;
+}
+
+int pam_get_data(
+    const pam_handle_t* pamh, const char* module_data_name, const void** data)
+{
+  FakePamData*		entry;
+
+  if (pamh == 0 || module_data_name == 0)
+    return PAM_SYSTEM_ERR;
+  for (entry = pamh->data; entry != 0; entry = entry->next)
+  {
+    if (strcmp(entry->name, module_data_name) == 0)
+    {
+      *data = entry->data;
+      return PAM_SUCCESS;
+    }
+  }
+  return PAM_NO_MODULE_DATA;
+}
+
+/*
+ * The index of name in the environment, or -1.
+ */
+static int fakepam_env_find(const pam_handle_t* pamh, const char* name, size_t len)
+{
+  int			i;
+
+  for (i = 0; i < pamh->env_count; i += 1)
+  {
+    if (strncmp(pamh->env[i], name, len) == 0 && pamh->env[i][len] == '=')
+      return i;
+  }
+  return -1;
+}
+
+/*
+ * "NAME=value" sets, "NAME=" sets to empty, "NAME" deletes.
+ */
+int pam_putenv(pam_handle_t* pamh, const char* name_value)
+{
+  char**		env;
+  const char*		equals;
+  int			i;
+  size_t		len;
+
+  if (pamh == 0 || name_value == 0 || *name_value == '\0' || *name_value == '=')
+    return PAM_PERM_DENIED;
+  equals = strchr(name_value, '=');
+  len = equals != 0 ? (size_t)(equals - name_value) : strlen(name_value);
+  i = fakepam_env_find(pamh, name_value, len);
+  if (equals == 0)
+  {
+    if (i == -1)
+      return PAM_BAD_ITEM;
+    free(pamh->env[i]);
+    pamh->env_count -= 1;
+    memmove(
+	&pamh->env[i], &pamh->env[i + 1],
+	(pamh->env_count - i + 1) * sizeof(*pamh->env));
+    return PAM_SUCCESS;
+  }
+  if (i != -1)
+  {
+    free(pamh->env[i]);
+    pamh->env[i] = strdup(name_value);
+    return pamh->env[i] == 0 ? PAM_BUF_ERR : PAM_SUCCESS;
+  }
+  env = realloc(pamh->env, (pamh->env_count + 2) * sizeof(*env));
+  if (env == 0)
+    return PAM_BUF_ERR;
+  pamh->env = env;
+  env[pamh->env_count] = strdup(name_value);
+  if (env[pamh->env_count] == 0)
+    return PAM_BUF_ERR;
+  pamh->env_count += 1;
+  env[pamh->env_count] = 0;
+  return PAM_SUCCESS;
+}
+
+const char* pam_getenv(pam_handle_t* pamh, const char* name)
+{
+  int			i;
+
+  if (pamh == 0 || name == 0)
+    return 0;
+  i = fakepam_env_find(pamh, name, strlen(name));
+  if (i == -1)
+    return 0;
+  return strchr(pamh->env[i], '=') + 1;
+}
+
+/*
+ * The caller owns and frees the copy returned.
+ */
+char** pam_getenvlist(pam_handle_t* pamh)
+{
+  char**		env;
+  int			i;
+
+  if (pamh == 0)
+    return 0;
+  env = calloc(pamh->env_count + 1, sizeof(*env));
+  if (env == 0)
+    return 0;
+  for (i = 0; i < pamh->env_count; i += 1)
+  {
+    env[i] = strdup(pamh->env[i]);
+    if (env[i] == 0)
+    {
+      while (i > 0)
+	free(env[--i]);
+      free(env);
+      return 0;
+    }
+  }
+  return env;
+}
+
+int pam_fail_delay(pam_handle_t* pamh, unsigned int musec_delay)
+{
+  if (pamh == 0)
+    return PAM_SYSTEM_ERR;
+  if (musec_delay > pamh->fail_delay)
+    pamh->fail_delay = musec_delay;
+  return PAM_SUCCESS;
+}
+
+unsigned int fakepam_fail_delay(pam_handle_t* pamh)
+{
+  return pamh->fail_delay;
+}
+
+int fakepam_conv(
+    int num_msg, const struct pam_message** msg,
+    struct pam_response** resp, void* appdata_ptr)
+{
+  const char*		answer;
+  int			i;
+  FakePamScript*	script = appdata_ptr;
+
+  *resp = calloc(num_msg, sizeof(**resp));
+  if (*resp == 0)
+    return PAM_BUF_ERR;
+  for (i = 0; i < num_msg; i += 1)
+  {
+    if (script != 0)
+      script->messages += 1;
+    if (script == 0 || script->responses == 0)
+      answer = msg[i]->msg;
+    else
+    {
+      answer = script->responses[script->next];
+      if (answer == 0)
+	goto error_exit;
+      script->next += 1;
+    }
+    (*resp)[i].resp = strdup(answer);
+    (*resp)[i].resp_retcode = 0;
+  }
+  return PAM_SUCCESS;
+
+error_exit:
+  for (i = 0; i < num_msg; i += 1)
+    free((*resp)[i].resp);
+  free(*resp);
+  *resp = 0;
+  return PAM_CONV_ERR;
+}
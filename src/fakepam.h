@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2007-2012,2014,2016,2019 Russell Stuart
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * The copyright holders grant you an additional permission under Section 7
+ * of the GNU Affero General Public License, version 3, exempting you from
+ * the requirement in Section 6 of the GNU General Public License, version 3,
+ * to accompany Corresponding Source with Installation Information for the
+ * Program or any work based on the Program. You are still required to
+ * comply with all other Section 6 requirements to provide Corresponding
+ * Source.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The extras fakepam.c's stand in libpam offers programs that know they
+ * are using it.  Programs that don't get the usual libpam API.
+ */
+#ifndef FAKEPAM_H
+#define FAKEPAM_H
+
+#include <security/pam_appl.h>
+
+/*
+ * A conversation script.  Pass one as the appdata_ptr of a pam_conv
+ * whose conv is fakepam_conv.  Each prompt is answered with the next of
+ * responses, and once they run out the conversation fails.  If responses
+ * is 0 each prompt is answered with itself.
+ */
+typedef struct
+{
+  const char* const*	responses;	/* 0 terminated */
+  int			next;		/* Next response to use */
+  int			messages;	/* Messages seen */
+} FakePamScript;
+
+extern int fakepam_conv(
+    int num_msg, const struct pam_message** msg,
+    struct pam_response** resp, void* appdata_ptr);
+
+/*
+ * The longest delay modules asked for with pam_fail_delay() in
+ * microseconds.  The fake never sleeps.
+ */
+extern unsigned int fakepam_fail_delay(pam_handle_t* pamh);
+
+#endif
@@ -0,0 +1,574 @@
+/*
+ * A load generator modelled on sshd.  It forks a fresh process for each
+ * login, which loads pam_python.so, runs pam_authenticate(),
+ * pam_acct_mgmt(), pam_open_session() and pam_close_session() and exits,
+ * so every login starts Python cold.  Best run using the Makefile target
+ * "load-test".  To compile and run manually:
+ *   gcc -O2 -Wall -o loadgen loadgen.c -lpam -ldl
+ *   ./loadgen -m $PWD/../examples/pam_permit.py
+ *
+ * Logins are started at -r a second (or as fast as possible if 0), with
+ * no more than -c running at once.  Like bench's -m it writes a service
+ * to a temporary directory, which needs Linux-PAM 1.4 or later.  It adds
+ * the stats option with the same temporary directory as the state_dir.
+ *
+ * Each login is timed from just before the fork to the child exiting,
+ * and split into phases.  The child times the fork, the dlopen() of
+ * pam_python.so and each PAM call itself, so those percentiles are exact.
+ * Starting Python, loading the module and running the handlers happen
+ * inside pam_python.so, so those come from its stats file, whose
+ * histograms have power of 2 buckets, so their percentiles are upper
+ * bounds.
+ */
+#define	_GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <security/pam_appl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pam_python_stat.h"
+
+#if defined(__LINUX_PAM__) && \
+    (__LINUX_PAM__ > 1 || __LINUX_PAM_MINOR__ >= 4)
+#define	HAVE_PAM_START_CONFDIR	1
+#endif
+
+#define	LOADGEN_POLL_MS		10
+#define	LOADGEN_SERVICE		"pam_python-loadgen"
+
+/*
+ * The phases a child times.
+ */
+enum {
+  PHASE_FORK,
+  PHASE_DLOPEN,
+  PHASE_START,
+  PHASE_AUTHENTICATE,
+  PHASE_ACCT_MGMT,
+  PHASE_OPEN_SESSION,
+  PHASE_CLOSE_SESSION,
+  PHASE_END,
+  PHASE_LOGIN,
+  PHASE_COUNT
+};
+
+static const char* const phase_names[PHASE_COUNT] = {
+  "fork",
+  "dlopen",
+  "pam_start",
+  "pam_authenticate",
+  "pam_acct_mgmt",
+  "pam_open_session",
+  "pam_close_session",
+  "pam_end",
+  "login",
+};
+
+/*
+ * What a child sends back down the pipe.  It is smaller than PIPE_BUF,
+ * so children writing at once don't interleave.
+ */
+struct report {
+  int		failed;		/* PAM result of a call that failed, or 0 */
+  double	seconds[PHASE_COUNT];
+};
+
+/*
+ * Latencies of one phase, in seconds.
+ */
+struct samples {
+  double*	data;
+  long		count;
+  long		size;
+};
+
+static char	confdir[] = "/tmp/pam_python-loadgen.XXXXXX";
+
+static int conv(
+    int num_msg, const struct pam_message** msg, struct pam_response** resp, void *appdata_ptr)
+{
+  int		i;
+
+  (void)appdata_ptr;
+  *resp = malloc(num_msg * sizeof(**resp));
+  for (i = 0; i < num_msg; i += 1)
+  {
+    (*resp)[i].resp = strdup((*msg)[i].msg);
+    (*resp)[i].resp_retcode = (*msg)[i].msg_style;
+  }
+  return 0;
+}
+
+static double now(void)
+{
+  struct timespec	ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_sample(struct samples* samples, double seconds)
+{
+  if (samples->count == samples->size)
+  {
+    samples->size = samples->size == 0 ? 1024 : samples->size * 2;
+    samples->data = realloc(samples->data, samples->size * sizeof(double));
+    if (samples->data == 0)
+    {
+      fprintf(stderr, "out of memory\n");
+      exit(2);
+    }
+  }
+  samples->data[samples->count++] = seconds;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+  double	x = *(const double*)a;
+  double	y = *(const double*)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const struct samples* samples, double p)
+{
+  long		i;
+
+  i = (long)(samples->count * p);
+  if (i >= samples->count)
+    i = samples->count - 1;
+  return samples->data[i];
+}
+
+/*
+ * The upper bound of the histogram bucket percentile p falls in, in
+ * microseconds.
+ */
+static double histogram_percentile(const StatsHistogram* histogram, double p)
+{
+  int			bucket;
+  unsigned long long	seen = 0;
+  unsigned long long	wanted;
+
+  if (histogram->count == 0)
+    return 0;
+  wanted = (unsigned long long)(histogram->count * p + 0.5);
+  if (wanted == 0)
+    wanted = 1;
+  for (bucket = 0; bucket < STATS_LATENCY_BUCKETS - 1; bucket += 1)
+  {
+    seen += histogram->buckets[bucket];
+    if (seen >= wanted)
+      break;
+  }
+  return (double)(1ULL << bucket);
+}
+
+/*
+ * One login.  It runs in the child, and never returns.
+ */
+static void login(
+    int fd, double forked, const char* pam_python, const char* user)
+{
+  static struct pam_conv convstruct = {conv, 0};
+  static int	(*const calls[])(pam_handle_t*, int) = {
+    pam_authenticate, pam_acct_mgmt, pam_open_session, pam_close_session,
+  };
+  void*		dlhandle;
+  size_t	i;
+  double	mark;
+  pam_handle_t*	pamh;
+  int		pam_result = PAM_SUCCESS;
+  struct report	report;
+  double	started;
+
+  memset(&report, '\0', sizeof(report));
+  started = now();
+  report.seconds[PHASE_FORK] = started - forked;
+  /*
+   * libpam would dlopen() pam_python.so in pam_start().  Doing it first
+   * separates the cost of loading it from the rest.  It is opened
+   * RTLD_LOCAL as libpam does, so libpython's symbols aren't global
+   * until pam_python.so promotes them, and that is timed too.
+   */
+  mark = now();
+  dlhandle = dlopen(pam_python, RTLD_NOW|RTLD_LOCAL);
+  report.seconds[PHASE_DLOPEN] = now() - mark;
+  if (dlhandle == 0)
+  {
+    fprintf(stderr, "%s\n", dlerror());
+    report.failed = PAM_OPEN_ERR;
+    goto error_exit;
+  }
+  mark = now();
+#ifdef HAVE_PAM_START_CONFDIR
+  pam_result = pam_start_confdir(
+      LOADGEN_SERVICE, user, &convstruct, confdir, &pamh);
+#else
+  pam_result = PAM_ABORT;
+#endif
+  report.seconds[PHASE_START] = now() - mark;
+  if (pam_result != PAM_SUCCESS)
+  {
+    report.failed = pam_result;
+    goto error_exit;
+  }
+  for (i = 0; i < sizeof(calls) / sizeof(*calls); i += 1)
+  {
+    mark = now();
+    pam_result = calls[i](pamh, 0);
+    report.seconds[PHASE_AUTHENTICATE + i] = now() - mark;
+    if (pam_result != PAM_SUCCESS)
+    {
+      report.failed = pam_result;
+      break;
+    }
+  }
+  mark = now();
+  pam_end(pamh, pam_result);
+  report.seconds[PHASE_END] = now() - mark;
+  dlclose(dlhandle);
+
+error_exit:
+  if (report.failed != 0)
+    fprintf(stderr, "login failed: %s\n", pam_strerror(0, report.failed));
+  report.seconds[PHASE_LOGIN] = now() - forked;
+  if (write(fd, &report, sizeof(report)) != sizeof(report))
+    _exit(2);
+  _exit(report.failed != 0);
+}
+
+/*
+ * Read one child's report.  Failed logins are counted, but not timed.
+ */
+static void read_report(
+    int fd, struct samples* samples, long* completed, long* failed)
+{
+  int		phase;
+  struct report	report;
+
+  if (read(fd, &report, sizeof(report)) != sizeof(report))
+  {
+    fprintf(stderr, "short report from a login\n");
+    exit(2);
+  }
+  *completed += 1;
+  if (report.failed != 0)
+  {
+    *failed += 1;
+    return;
+  }
+  for (phase = 0; phase < PHASE_COUNT; phase += 1)
+    add_sample(&samples[phase], report.seconds[phase]);
+}
+
+/*
+ * Write a PAM service that calls every handler in module.
+ */
+static void make_service(
+    const char* module, const char* pam_python, const char* options)
+{
+  FILE*		f;
+  char		path[PATH_MAX];
+  static const char* const types[] = {"auth", "account", "session", "password"};
+  size_t	i;
+
+  if (mkdtemp(confdir) == 0)
+  {
+    perror(confdir);
+    exit(2);
+  }
+  snprintf(path, sizeof(path), "%s/%s", confdir, LOADGEN_SERVICE);
+  f = fopen(path, "w");
+  if (f == 0)
+  {
+    perror(path);
+    exit(2);
+  }
+  for (i = 0; i < sizeof(types) / sizeof(*types); i += 1)
+  {
+    fprintf(
+      f, "%s required %s stats state_dir=%s %s%s%s\n", types[i], pam_python,
+      confdir, options, *options == '\0' ? "" : " ", module);
+  }
+  fclose(f);
+}
+
+static void remove_service(void)
+{
+  char		path[PATH_MAX];
+
+  snprintf(path, sizeof(path), "%s/%s", confdir, LOADGEN_SERVICE);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/%s", confdir, STATS_FILE_NAME);
+  unlink(path);
+  rmdir(confdir);
+}
+
+static void print_histogram(const char* name, const StatsHistogram* histogram)
+{
+  static const double	percentiles[] = {0.5, 0.99, 0.999};
+  char			bound[3][32];
+  size_t		i;
+
+  if (histogram->count == 0)
+    return;
+  for (i = 0; i < sizeof(percentiles) / sizeof(*percentiles); i += 1)
+  {
+    snprintf(
+      bound[i], sizeof(bound[i]), "<%.0f",
+      histogram_percentile(histogram, percentiles[i]));
+  }
+  printf(
+    "%-18s %9llu %10.1f %10s %10s %10s\n",
+    name, histogram->count, (double)histogram->sum_usec / histogram->count,
+    bound[0], bound[1], bound[2]);
+}
+
+/*
+ * Report the phases pam_python.so timed, from its stats file.
+ */
+static void report_stats(void)
+{
+  int			fd;
+  const StatsFile*	file;
+  size_t		h;
+  char			path[PATH_MAX];
+  size_t		m;
+  const StatsModule*	module;
+
+  snprintf(path, sizeof(path), "%s/%s", confdir, STATS_FILE_NAME);
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+  {
+    fprintf(stderr, "%s: no stats, did pam_python.so run?\n", path);
+    return;
+  }
+  file = mmap(0, sizeof(*file), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED)
+  {
+    perror(path);
+    return;
+  }
+  if (file->magic != STATS_MAGIC || file->version != STATS_VERSION)
+  {
+    fprintf(
+      stderr, "%s: not a version %d stats file\n", path, STATS_VERSION);
+    munmap((void*)file, sizeof(*file));
+    return;
+  }
+  for (m = 0; m < STATS_MODULE_COUNT; m += 1)
+  {
+    module = &file->modules[m];
+    if (module->hash == 0)
+      continue;
+    print_histogram("libpython open", &module->libpython);
+    print_histogram("python init", &module->init);
+    print_histogram("module load", &module->import);
+    for (h = 0; h < STATS_HANDLER_COUNT; h += 1)
+    {
+      print_histogram(
+	stats_handler_names[h] + sizeof("pam_sm_") - 1,
+	&module->handlers[h].latency);
+    }
+  }
+  munmap((void*)file, sizeof(*file));
+}
+
+static void usage(const char* me)
+{
+  fprintf(
+    stderr,
+    "usage: %s [-n logins] [-c concurrency] [-r rate] -m module\n"
+    "          [-o options] [-p pam_python.so] [user]\n"
+    "  -n logins      Logins to make (default 100).\n"
+    "  -c concurrency Most logins running at once (default 4).\n"
+    "  -r rate        Logins started a second, 0 for no limit (default 0).\n"
+    "  -m module      The Python module the logins use.\n"
+    "  -o options     More pam_python options, eg \"log_async\".\n"
+    "  -p path        pam_python.so (default ./pam_python.so).\n"
+    "  user           User to log in (default none).\n",
+    me);
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  long			completed = 0;
+  int			concurrency = 4;
+  double		elapsed;
+  int			exit_status = 0;
+  long			failed = 0;
+  int			fds[2];
+  double*		forked;
+  pid_t			pid;
+  long			logins = 100;
+  const char*		module = 0;
+  double		next_start;
+  int			opt;
+  const char*		options = "";
+  char			pam_python[PATH_MAX];
+  const char*		pam_python_arg = "pam_python.so";
+  int			phase;
+  struct pollfd		pollfd;
+  double		rate = 0;
+  long			reaped = 0;
+  struct samples	samples[PHASE_COUNT];
+  double		start;
+  long			started = 0;
+  int			status;
+  int			timeout;
+  const char*		user = "";
+
+  while ((opt = getopt(argc, argv, "c:m:n:o:p:r:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'c': concurrency = atoi(optarg); break;
+      case 'm': module = optarg; break;
+      case 'n': logins = atol(optarg); break;
+      case 'o': options = optarg; break;
+      case 'p': pam_python_arg = optarg; break;
+      case 'r': rate = atof(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (logins <= 0 || concurrency <= 0 || rate < 0 || module == 0)
+    usage(argv[0]);
+  if (optind < argc)
+    user = argv[optind++];
+  if (optind < argc)
+    usage(argv[0]);
+#ifndef HAVE_PAM_START_CONFDIR
+  fprintf(stderr, "loadgen needs pam_start_confdir(), from Linux-PAM 1.4\n");
+  exit(2);
+#endif
+  if (realpath(pam_python_arg, pam_python) == 0)
+  {
+    perror(pam_python_arg);
+    exit(2);
+  }
+  if (module[0] != '/')
+  {
+    fprintf(stderr, "-m needs an absolute path\n");
+    exit(2);
+  }
+  make_service(module, pam_python, options);
+  memset(samples, '\0', sizeof(samples));
+  /*
+   * Children report in a shared pipe.  Keeping when each was forked in
+   * the parent means the child needn't be trusted to report it.
+   */
+  forked = calloc(logins, sizeof(*forked));
+  if (forked == 0 || pipe(fds) == -1)
+  {
+    perror("loadgen");
+    exit(2);
+  }
+  pollfd.fd = fds[0];
+  pollfd.events = POLLIN;
+  printf(
+    "%ld logins, at most %d at once, %s\n", logins, concurrency,
+    rate == 0 ? "as fast as possible" : "rate limited");
+  fflush(stdout);
+  start = now();
+  next_start = start;
+  while (reaped < logins)
+  {
+    if (started < logins && started - reaped < concurrency &&
+	now() >= next_start)
+    {
+      forked[started] = now();
+      pid = fork();
+      if (pid == -1)
+      {
+	perror("fork");
+	exit(2);
+      }
+      if (pid == 0)
+      {
+	close(fds[0]);
+	login(fds[1], forked[started], pam_python, user);
+      }
+      started += 1;
+      if (rate != 0)
+	next_start += 1 / rate;
+      continue;
+    }
+    /*
+     * Wait for a report, or until it is time to start another login.  A
+     * child exits after it reports, so the wait is kept short to notice.
+     */
+    timeout = LOADGEN_POLL_MS;
+    if (started < logins && started - reaped < concurrency &&
+	next_start - now() < timeout / 1e3)
+    {
+      timeout = (int)((next_start - now()) * 1e3);
+      if (timeout < 0)
+	timeout = 0;
+    }
+    if (poll(&pollfd, 1, timeout) == -1 && errno != EINTR)
+    {
+      perror("poll");
+      exit(2);
+    }
+    if (pollfd.revents & POLLIN)
+      read_report(fds[0], samples, &completed, &failed);
+    while (waitpid(-1, &status, WNOHANG) > 0)
+      reaped += 1;
+  }
+  /*
+   * The children are gone, so their reports are all in the pipe.
+   */
+  pollfd.revents = 0;
+  while (poll(&pollfd, 1, 0) == 1 && (pollfd.revents & POLLIN))
+    read_report(fds[0], samples, &completed, &failed);
+  failed += logins - completed;
+  if (failed != 0)
+    exit_status = 1;
+  elapsed = now() - start;
+  printf(
+    "%ld logins in %.3fs, %.1f logins/s, %ld failed\n",
+    logins, elapsed, logins / elapsed, failed);
+  printf(
+    "%-18s %9s %10s %10s %10s %10s %10s\n",
+    "phase", "count", "mean us", "p50 us", "p99 us", "p999 us", "max us");
+  for (phase = 0; phase < PHASE_COUNT; phase += 1)
+  {
+    double	total = 0;
+    long	i;
+
+    if (samples[phase].count == 0)
+      continue;
+    for (i = 0; i < samples[phase].count; i += 1)
+      total += samples[phase].data[i];
+    qsort(
+      samples[phase].data, samples[phase].count, sizeof(double),
+      compare_double);
+    printf(
+      "%-18s %9ld %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+      phase_names[phase], samples[phase].count,
+      total / samples[phase].count * 1e6,
+      percentile(&samples[phase], 0.5) * 1e6,
+      percentile(&samples[phase], 0.99) * 1e6,
+      percentile(&samples[phase], 0.999) * 1e6,
+      samples[phase].data[samples[phase].count - 1] * 1e6);
+    free(samples[phase].data);
+  }
+  printf("inside pam_python.so:\n");
+  report_stats();
+  free(forked);
+  remove_service();
+  return exit_status;
+}
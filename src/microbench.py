@@ -0,0 +1,241 @@
+#!/usr/bin/python3 -W default
+#
+# Micro benchmarks for the pamh API.  Each Python visible operation
+# pam_python.c implements is timed on its own, so a regression in the C
+# glue shows up as a change in one number rather than being lost in the
+# cost of a PAM transaction.
+#
+# Best run from the Makefile using the target 'microbench'.  It has two
+# halves.  As a PAM module pam_sm_authenticate() runs the benchmarks and
+# writes them as JSON to $MICROBENCH_OUT (default microbench.json).
+# Loading it as a module is bench's job:
+#   MICROBENCH_OUT=new.json ./bench -n 1 -s auth -m $PWD/microbench.py
+# Run from Python it prints the results, and given a baseline compares
+# them with it, exiting with status 1 if any got slower by more than the
+# threshold:
+#   python3 microbench.py [-t percent] new.json [baseline.json]
+#
+import os
+import sys
+import timeit
+
+MICROBENCH_OUT		= "microbench.json"
+MICROBENCH_REPEAT	= 5		# Best of this many runs is reported
+MICROBENCH_RUN_SECONDS	= 0.02		# Each run lasts about this long
+MICROBENCH_ENV_SIZES	= (1, 10, 100, 1000)
+MICROBENCH_THRESHOLD	= 10.0		# Default % slowdown that fails
+
+#
+# Time func(), returning the best of MICROBENCH_REPEAT in nanoseconds per
+# call.  The loop count is grown until a run lasts long enough for the
+# clock to be trusted.
+#
+def measure(func):
+  timer = timeit.default_timer
+  loops = 1
+  while True:
+    start = timer()
+    for _ in range(loops):
+      func()
+    elapsed = timer() - start
+    if elapsed >= MICROBENCH_RUN_SECONDS or loops >= 1 << 24:
+      break
+    loops *= 2
+  best = elapsed
+  for _ in range(MICROBENCH_REPEAT - 1):
+    start = timer()
+    for _ in range(loops):
+      func()
+    best = min(best, timer() - start)
+  return {"loops": loops, "ns": best * 1e9 / loops}
+
+#
+# The benchmarks, as a list of (name, func).  Anything a benchmark needs
+# is built here so only the operation itself is timed.
+#
+def item_benchmarks(pamh):
+  benchmarks = []
+  items = [
+      "authtok", "authtok_type", "oldauthtok", "rhost", "ruser",
+      "service", "tty", "user", "user_prompt", "xdisplay"]
+  for item in items:
+    if not hasattr(pamh, item):
+      continue
+    value = getattr(pamh, item)
+    if value is None:
+      value = "microbench"
+    setattr(pamh, item, value)
+    benchmarks.append(
+	("item.get.%s" % item, lambda item=item: getattr(pamh, item)))
+    benchmarks.append(
+	("item.set.%s" % item,
+	    lambda item=item, value=value: setattr(pamh, item, value)))
+  if hasattr(pamh, "xauthdata"):
+    xauthdata = pamh.XAuthData("name", "data")
+    pamh.xauthdata = xauthdata
+    benchmarks.append(("item.get.xauthdata", lambda: pamh.xauthdata))
+    def set_xauthdata(): pamh.xauthdata = xauthdata
+    benchmarks.append(("item.set.xauthdata", set_xauthdata))
+  return benchmarks
+
+def constant_benchmarks(pamh):
+  return [
+      ("constant.PAM_SUCCESS", lambda: pamh.PAM_SUCCESS),
+      ("constant.PAM_MAX_NUM_MSG", lambda: pamh.PAM_MAX_NUM_MSG),
+      ("constant.LOG_ERR", lambda: pamh.LOG_ERR)]
+
+def env_benchmarks(pamh, size):
+  names = ["MB%d" % i for i in range(size)]
+  for name in names:
+    pamh.env[name] = "value"
+  last = names[-1]
+  def set_env(): pamh.env[last] = "value"
+  def iterate_env():
+    for _ in pamh.env:
+      pass
+  return [
+      ("env.get.%d" % size, lambda: pamh.env[last]),
+      ("env.set.%d" % size, set_env),
+      ("env.iter.%d" % size, iterate_env),
+      ("env.len.%d" % size, lambda: len(pamh.env)),
+      ("env.keys.%d" % size, lambda: pamh.env.keys())]
+
+def env_clear(pamh):
+  for name in list(pamh.env.keys()):
+    if name.startswith("MB"):
+      del pamh.env[name]
+
+def conversation_benchmarks(pamh):
+  benchmarks = []
+  sizes = [1, 8, pamh.PAM_MAX_NUM_MSG]
+  for size in sorted(set(sizes)):
+    messages = [
+	pamh.Message(pamh.PAM_PROMPT_ECHO_ON, "prompt %d" % i)
+	for i in range(size)]
+    if size == 1:
+      messages = messages[0]
+    benchmarks.append(
+	("conversation.%d" % size,
+	    lambda messages=messages: pamh.conversation(messages)))
+  return benchmarks
+
+def misc_benchmarks(pamh):
+  debug_magic = 0x4567abcd		# pam_python.c's test backdoor
+  def raise_exception():
+    try:
+      pamh.strerror(debug_magic + pamh.PAM_AUTH_ERR)
+    except pamh.exception:
+      pass
+  if pamh.user is None:
+    pamh.user = "microbench"
+  return [
+      ("get_user", lambda: pamh.get_user(None)),
+      ("strerror", lambda: pamh.strerror(pamh.PAM_AUTH_ERR)),
+      ("Message", lambda: pamh.Message(pamh.PAM_PROMPT_ECHO_ON, "prompt")),
+      ("Response", lambda: pamh.Response("response", 0)),
+      ("exception", raise_exception)]
+
+def run_benchmarks(pamh):
+  results = {}
+  benchmarks = (
+      item_benchmarks(pamh) +
+      constant_benchmarks(pamh) +
+      conversation_benchmarks(pamh) +
+      misc_benchmarks(pamh))
+  for name, func in benchmarks:
+    results[name] = measure(func)
+  for size in MICROBENCH_ENV_SIZES:
+    for name, func in env_benchmarks(pamh, size):
+      results[name] = measure(func)
+    env_clear(pamh)
+  return results
+
+def pam_sm_authenticate(pamh, flags, argv):
+  import json
+  results = run_benchmarks(pamh)
+  report = {
+      "python": sys.version.split()[0],
+      "results": results}
+  path = os.environ.get("MICROBENCH_OUT", MICROBENCH_OUT)
+  f = open(path, "w")
+  try:
+    json.dump(report, f, indent=1, sort_keys=True)
+    f.write("\n")
+  finally:
+    f.close()
+  return pamh.PAM_SUCCESS
+
+def pam_sm_setcred(pamh, flags, argv):
+  return pamh.PAM_SUCCESS
+
+def pam_sm_acct_mgmt(pamh, flags, argv):
+  return pamh.PAM_SUCCESS
+
+def pam_sm_open_session(pamh, flags, argv):
+  return pamh.PAM_SUCCESS
+
+def pam_sm_close_session(pamh, flags, argv):
+  return pamh.PAM_SUCCESS
+
+def pam_sm_chauthtok(pamh, flags, argv):
+  return pamh.PAM_SUCCESS
+
+#
+# Print a report, comparing it to a baseline if given one.  Returns the
+# number of benchmarks that got slower by more than threshold percent.
+#
+def compare(report, baseline, threshold):
+  regressions = 0
+  results = report["results"]
+  if baseline is None:
+    sys.stdout.write("%-28s %12s\n" % ("benchmark", "ns"))
+  else:
+    sys.stdout.write(
+	"%-28s %12s %12s %8s\n" % ("benchmark", "ns", "baseline", "change"))
+  for name in sorted(results):
+    ns = results[name]["ns"]
+    if baseline is None:
+      sys.stdout.write("%-28s %12.1f\n" % (name, ns))
+      continue
+    if name not in baseline["results"]:
+      sys.stdout.write("%-28s %12.1f %12s %8s\n" % (name, ns, "-", "new"))
+      continue
+    old = baseline["results"][name]["ns"]
+    change = (ns - old) * 100.0 / old if old else 0.0
+    flag = ""
+    if change > threshold:
+      flag = "  SLOWER"
+      regressions += 1
+    sys.stdout.write(
+	"%-28s %12.1f %12.1f %+7.1f%%%s\n" % (name, ns, old, change, flag))
+  return regressions
+
+def main(argv):
+  import getopt
+  import json
+  threshold = MICROBENCH_THRESHOLD
+  try:
+    opts, args = getopt.getopt(argv[1:], "t:")
+  except getopt.GetoptError:
+    opts, args = [], []
+  for opt, value in opts:
+    if opt == "-t":
+      threshold = float(value)
+  if len(args) not in (1, 2):
+    sys.stderr.write(
+	"usage: %s [-t percent] results.json [baseline.json]\n" % argv[0])
+    return 2
+  report = json.load(open(args[0]))
+  baseline = None
+  if len(args) == 2:
+    baseline = json.load(open(args[1]))
+  regressions = compare(report, baseline, threshold)
+  if regressions:
+    sys.stdout.write(
+	"%d benchmarks are more than %g%% slower than the baseline.\n" %
+	(regressions, threshold))
+    return 1
+  return 0
+
+if __name__ == "__main__":
+  sys.exit(main(sys.argv))
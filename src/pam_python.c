@@ -40,11 +40,38 @@
 
 #undef	_POSIX_C_SOURCE
 
+#define	PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <arpa/inet.h>
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <frameobject.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <structmember.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#if __GLIBC_PREREQ(2, 33)
+#define	HAVE_MALLINFO2		1
+#else
+#define	HAVE_MALLINFO		1
+#endif
+#endif
+
+#include "pam_python_rules.h"
+#include "pam_python_stat.h"
 
 #ifndef	MODULE_NAME
 #define	MODULE_NAME		"libpam_python"
@@ -58,51 +85,133 @@
 #endif
 #endif
 
+#ifndef	DEFAULT_FAILURES_WINDOW
+#define	DEFAULT_FAILURES_WINDOW	900	/* Seconds failures are counted for */
+#endif
+
+#ifndef	DEFAULT_LOG_WINDOW
+#define	DEFAULT_LOG_WINDOW	60	/* Seconds between repeated tracebacks */
+#endif
+
+#ifndef	DEFAULT_STATE_DIR
+#define	DEFAULT_STATE_DIR	"/run/pam_python"
+#endif
+
+/*
+ * Static tracepoints, for bpftrace, SystemTap, perf and friends.  Each is
+ * a nop until a tracer attaches to it, and the arguments are only worked
+ * out while one is attached.  They are compiled in if sys/sdt.h (from
+ * systemtap-sdt-dev or systemtap-sdt-devel) is present.  Build with
+ * -DHAVE_SYS_SDT_H=0 to leave them out.  examples/pam_python_latency.bt
+ * shows how to use them.
+ */
+#ifndef	HAVE_SYS_SDT_H
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define	HAVE_SYS_SDT_H		1
+#endif
+#endif
+#endif
+#if defined(HAVE_SYS_SDT_H) && HAVE_SYS_SDT_H
+#define	_SDT_HAS_SEMAPHORES	1
+#include <sys/sdt.h>
+#define	PROBE_SEMAPHORE(name) \
+    unsigned short pam_python_##name##_semaphore \
+	__attribute__((unused, section(".probes")))
+#define	PROBE_ENABLED(name) \
+    __builtin_expect(pam_python_##name##_semaphore != 0, 0)
+#define	PROBE2(name, a, b) \
+    do { \
+      if (PROBE_ENABLED(name)) \
+	DTRACE_PROBE2(pam_python, name, a, b); \
+    } while (0)
+#define	PROBE3(name, a, b, c) \
+    do { \
+      if (PROBE_ENABLED(name)) \
+	DTRACE_PROBE3(pam_python, name, a, b, c); \
+    } while (0)
+#define	PROBE4(name, a, b, c, d) \
+    do { \
+      if (PROBE_ENABLED(name)) \
+	DTRACE_PROBE4(pam_python, name, a, b, c, d); \
+    } while (0)
+#else
+#define	PROBE_SEMAPHORE(name)	struct probe_##name##_unused
+#define	PROBE2(name, a, b)		do { } while (0)
+#define	PROBE3(name, a, b, c)		do { } while (0)
+#define	PROBE4(name, a, b, c, d)	do { } while (0)
+#endif
+
 #define	PAMHANDLE_NAME		"PamHandle"
 
 #define	PAMHANDLEEXCEPTION_NAME	"PamException"
 
 #define arr_size(x)	(sizeof(x) / sizeof(*(x)))
 
-const char libpam_python_version[]	= "1.0.3";
-const char libpam_python_date[]		= "2014-05-05";
+/*
+ * "make pgo" compiles with -fvisibility=hidden, so the symbols libpam
+ * looks up must say they are exported.  pam_python.map lists them.
+ */
+#if defined(__GNUC__)
+#define	PAM_PYTHON_EXPORT	__attribute__((visibility("default")))
+#else
+#define	PAM_PYTHON_EXPORT
+#endif
+
+PAM_PYTHON_EXPORT const char libpam_python_version[]	= "1.0.3";
+PAM_PYTHON_EXPORT const char libpam_python_date[]	= "2014-05-05";
 
 #define	PyCFunctionKwds_cast	(PyCFunction)(Py_ssize_t)
 
 /*
- * Add typedef for Py_ssize_t if it you have an older python.
+ * PyConfig, PyFrame_GetCode() and PyType_FromModuleAndSpec() arrived in
+ * Python 3.9.
  */
-#if (PY_VERSION_HEX < 0x02050000)
-typedef int Py_ssize_t;
+#if PY_VERSION_HEX < 0x03090000
+#error "pam_python needs Python 3.9 or later"
 #endif
 
 /*
- * The python interpreter's shared library.
+ * The python interpreter's shared library.  See libpython_open().
  */
 static char libpython_so[]	= LIBPYTHON_SO;
 
 /*
- * Initialise Python.  How this should be done changed between versions.
+ * Initialise Python.  We are a guest in someone else's process, so the
+ * interpreter is isolated from it: the environment, the command line and
+ * the user's site directory are ignored, the application's signal
+ * handlers are left alone and no bytecode is written.  The pre-config
+ * decides the locale and encodings before anything is allocated, and the
+ * config sets up the interpreter.  Returns -1 if it didn't work.
  */
-static void initialise_python(void)
+static int initialise_python(void)
 {
-#if	PY_MAJOR_VERSION*100 + PY_MINOR_VERSION >= 204
-  Py_DontWriteBytecodeFlag = 1;
-  Py_IgnoreEnvironmentFlag = 1;
-  /* Py_IsolatedFlag = 1; 		Python3 only */
-  Py_NoSiteFlag = 1;
-  Py_NoUserSiteDirectory = 1;
-  Py_InitializeEx(0);
-#else
-  size_t		signum;
-  struct sigaction	oldsigaction[NSIG];
-
-  for (signum = 0; signum < arr_size(oldsigaction); signum += 1)
-    sigaction(signum, 0, &oldsigaction[signum]);
-  Py_Initialize();
-  for (signum = 0; signum < arr_size(oldsigaction); signum += 1)
-    sigaction(signum, &oldsigaction[signum], 0);
-#endif
+  PyConfig		config;
+  PyPreConfig		preconfig;
+  PyStatus		status;
+
+  /*
+   * PyStatus is a struct, which -Waggregate-return objects to.
+   */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+  PyPreConfig_InitIsolatedConfig(&preconfig);
+  preconfig.utf8_mode = 1;
+  status = Py_PreInitialize(&preconfig);
+  if (PyStatus_Exception(status))
+    return -1;
+  PyConfig_InitIsolatedConfig(&config);
+  config.install_signal_handlers = 0;
+  config.parse_argv = 0;
+  config.site_import = 0;
+  config.user_site_directory = 0;
+  config.write_bytecode = 0;
+  status = Py_InitializeFromConfig(&config);
+#pragma GCC diagnostic pop
+  PyConfig_Clear(&config);
+  if (PyStatus_Exception(status))
+    return -1;
+  return 0;
 }
 
 /*
@@ -114,19 +223,57 @@ static void py_xdecref(PyObject* object)
 }
 
 /*
- * Generic traverse function for heap objects.
+ * A frame's code object.  Frames are opaque, so PyFrame_GetCode() hands
+ * out a new reference.  The frame holds one too, so the reference this
+ * returns is borrowed from the frame.
+ */
+static PyCodeObject* frame_code(PyFrameObject* frame)
+{
+  PyCodeObject*		code = PyFrame_GetCode(frame);
+
+  Py_DECREF(code);
+  return code;
+}
+
+/*
+ * A traceback entry's line number.  Since Python 3.11 tb_lineno is only
+ * filled in when the attribute is read, so it is read.  Returns -1 if it
+ * isn't known.
+ */
+static int traceback_lineno(PyTracebackObject* tb)
+{
+  PyObject*		lineno;
+  int			result;
+
+  lineno = PyObject_GetAttrString((PyObject*)tb, "tb_lineno");
+  if (lineno == 0)
+  {
+    PyErr_Clear();
+    return -1;
+  }
+  result = (int)PyLong_AsLong(lineno);
+  Py_DECREF(lineno);
+  if (result == -1)
+    PyErr_Clear();
+  return result;
+}
+
+/*
+ * Generic traverse function for heap objects.  members is the type's
+ * member table, hidden members and all.  The type only keeps a copy of
+ * the visible ones, so each type passes its own via HEAP_TYPE_GC().
  */
-static int generic_traverse(PyObject* self, visitproc visitor, void* arg)
+static int generic_traverse(
+    PyObject* self, PyMemberDef* member, visitproc visitor, void* arg)
 {
-  PyMemberDef*		member;
   int			member_visible;
   PyObject*		object;
   int			py_result;
   PyObject**		slot;
 
-  member = self->ob_type->tp_members;
-  if (member == 0)
-    return 0;
+  py_result = visitor((PyObject*)Py_TYPE(self), arg);
+  if (py_result != 0 || member == 0)
+    return py_result;
   /*
    * Loop for python visible and python non-visible members.
    */
@@ -164,12 +311,10 @@ static void clear_slot(PyObject** slot)
   }
 }
 
-static int generic_clear(PyObject* self)
+static int generic_clear(PyObject* self, PyMemberDef* member)
 {
-  PyMemberDef*		member;
   int			member_visible;
 
-  member = self->ob_type->tp_members;
   if (member == 0)
     return 0;
   /*
@@ -189,19 +334,55 @@ static int generic_clear(PyObject* self)
 }
 
 /*
- * A dealloc for all our objects.
+ * Define the tp_traverse and tp_clear of a type whose member table is
+ * members.
+ */
+#define	HEAP_TYPE_GC(prefix, members) \
+    static int prefix##_traverse(PyObject* self, visitproc visitor, void* arg) \
+    { \
+      return generic_traverse(self, members, visitor, arg); \
+    } \
+    static int prefix##_clear(PyObject* self) \
+    { \
+      return generic_clear(self, members); \
+    }
+
+/*
+ * A dealloc for all our objects.  Instances of heap types own a
+ * reference to their type.
  */
 static void generic_dealloc(PyObject* self)
 {
-  PyTypeObject*		type = self->ob_type;
+  PyTypeObject*		type = Py_TYPE(self);
 
   if (PyObject_IS_GC(self))
     PyObject_GC_UnTrack(self);
   if (type->tp_clear != 0)
     type->tp_clear(self);
   type->tp_free(self);
+  Py_DECREF(type);
 }
 
+/*
+ * How much memory the process is using, for memstats=.  Anything that
+ * can't be found out is MEMSTATS_UNKNOWN.
+ */
+#define	MEMSTATS_UNKNOWN	LLONG_MIN
+
+typedef struct
+{
+  long long		heap;		/* Bytes malloc() has handed out */
+  long long		py_blocks;	/* sys.getallocatedblocks() */
+  long long		py_traced;	/* tracemalloc.get_traced_memory() */
+  long long		rss;		/* Resident set size in bytes */
+} MemSample;
+
+typedef struct
+{
+  unsigned long		calls;		/* Times the handler was called */
+  MemSample		growth;		/* Total growth over those calls */
+} MemHandler;
+
 /*
  * The PamHandleObject - the object passed to all the python module's entry
  * points.
@@ -209,17 +390,49 @@ static void generic_dealloc(PyObject* self)
 typedef struct
 {
   PyObject_HEAD				/* The Python Object Header */
-  void*			dlhandle;	/* dlopen() handle */
+  PyTypeObject*		breaker;	/* The type pamh.breaker() returns */
+  PyObject*		breakers;	/* {name: breaker}, 0 if none yet */
+  PyObject*		cache;		/* pamh.cache */
+  struct Deadline*	deadline;	/* The running handler's, or 0 */
   PyObject*		env;		/* pamh.env */
+  PyObject*		failures;	/* pamh.failures */
   PyObject*		exception;	/* pamh.exception */
   char*			libpam_version;	/* pamh.libpam_version */
+  PyObject*		log_ident;	/* pamh.log_ident */
+  int			log_level;	/* pamh.log_level */
+  int			log_source;	/* Log source lines in tracebacks */
+  int			log_window;	/* Seconds between same exception */
+  int			memstats;	/* memstats=, 0 if not accounting */
+  MemSample		memstats_created;/* When the handle was created */
+  MemHandler		memstats_handlers[STATS_HANDLER_COUNT];
+  MemSample		memstats_start;	/* Before the handle was created */
   PyTypeObject*		message;	/* pamh.Message */
   PyObject*		module;		/* The Python Pam Module */
-  pam_handle_t*		pamh;		/* The pam handle */
-  PyObject*		print_exception;/* traceback.print_exception */
+  pam_handle_t*		pamh;		/* The pam handle, 0 once ended */
+  int			pam_calls;	/* PamCalls using pamh */
+  PyObject*		profile_dir;	/* Where profiles are written */
+  double		profile_next;	/* When to take the next sample */
+  PyObject*		profile_stacks;	/* {stack: samples}, 0 if off */
   int			py_initialized;	/* True if Py_initialize() called */
+  PyObject*		record;		/* Record lines, 0 if not recording */
+  PyObject*		record_path;	/* Where records are written */
   PyTypeObject*		response;	/* pamh.Response */
-  PyObject*		syslogFile;	/* A (the) SyslogFile instance */
+  PyTypeObject*		span;		/* The type pamh.span() returns */
+  PyObject*		state_dir;	/* Where shared state lives */
+  StatsModule*		stats;		/* Our stats, 0 if not kept */
+  StatsFile*		stats_file;	/* The mapped stats file */
+  int			timeout_end;	/* timeout= for pam_sm_end, ms */
+  double		trace_conv;	/* Seconds in the conversation */
+  PyObject*		trace_handlers;	/* Handler calls, 0 if not tracing */
+  PyObject*		trace_id;	/* The transaction's trace id */
+  PyObject*		trace_open;	/* Ids of spans not yet ended */
+  PyObject*		trace_parent;	/* Span id of our parent, or None */
+  PyObject*		trace_path;	/* Where spans are sent */
+  PyObject*		trace_span_id;	/* The transaction's span id */
+  PyObject*		trace_spans;	/* Ended pamh.span()s */
+  double		trace_start;	/* monotonic_time() at start */
+  long long		trace_start_ns;	/* Wall clock at start */
+  PyTypeObject*		task;		/* The type pamh.schedule() returns */
   PyTypeObject*		xauthdata;	/* pamh.XAuthData */
 } PamHandleObject;
 
@@ -229,122 +442,329 @@ typedef struct
 static int call_python_handler(
     PyObject** result, PamHandleObject* pamHandle,
     PyObject* handler_function, const char* handler_name,
-    int flags, int argc, const char** argv);
+    int flags, int argc, const char** argv, int timeout, int* timed_out);
+static PyObject* process_module_find(const char* module_path);
+static void watchdog_pause(struct Deadline* deadline);
+static void watchdog_resume(struct Deadline* deadline, double seconds);
+static void record_conversation(
+    PamHandleObject* pamHandle, int count,
+    const struct pam_message* messages,
+    const struct pam_response* responses, int pam_result);
+
+/*
+ * The tracepoints.  Every probe has a semaphore the tracer increments
+ * while it is attached, which is what PROBE_ENABLED() tests.
+ */
+PROBE_SEMAPHORE(conv__end);
+PROBE_SEMAPHORE(conv__start);
+PROBE_SEMAPHORE(exception);
+PROBE_SEMAPHORE(handle__cold);
+PROBE_SEMAPHORE(handle__warm);
+PROBE_SEMAPHORE(handler__entry);
+PROBE_SEMAPHORE(handler__return);
+PROBE_SEMAPHORE(module__load__end);
+PROBE_SEMAPHORE(module__load__start);
+
+#if defined(HAVE_SYS_SDT_H) && HAVE_SYS_SDT_H
+/*
+ * Probe string arguments are never 0.
+ */
+static const char* probe_string(const char* string)
+{
+  return string != 0 ? string : "";
+}
+
+/*
+ * The PAM service, for probe arguments.
+ */
+static const char* probe_service(pam_handle_t* pamh)
+{
+  const void*		service = 0;
+
+  if (pamh == 0 || pam_get_item(pamh, PAM_SERVICE, &service) != PAM_SUCCESS)
+    return "";
+  return probe_string(service);
+}
+#endif
 
 /*
- * The SyslogfileObject.  It emulates a Python file object (in that it has
- * a write method).  It prints to stuff passed to write() on syslog.
+ * Everything pam_python logs goes through syslog_write().  Normally that
+ * calls syslog() there and then, which means a slow syslog daemon or
+ * journal slows down every login.  If the log_async option is given
+ * messages are formatted and put on a bounded lock free queue instead,
+ * and a thread writes them to syslog.  If the queue is full the message
+ * is counted and dropped rather than waiting.  The queue is a Vyukov
+ * style bounded MPMC queue, with only one consumer.
  */
-#define	SYSLOGFILE_NAME		"SyslogFile"
+#define	LOG_QUEUE_SIZE		256	/* Must be a power of 2 */
+#define	LOG_RECORD_SIZE		512	/* Longest message queued */
+
 typedef struct
 {
-  PyObject_HEAD				/* The Python Object Header */
-  char*			buffer;		/* Line buffer */
-  int			size;		/* Size of the buffer in bytes */
-} SyslogFileObject;
+  unsigned long		sequence;	/* Queue position it is valid for */
+  int			priority;	/* syslog priority */
+  char			ident[128];	/* syslog ident */
+  char			message[LOG_RECORD_SIZE];
+} LogRecord;
+
+static struct
+{
+  LogRecord*		records;	/* The ring, LOG_QUEUE_SIZE long */
+  unsigned long		enqueue_pos;	/* Next slot to write */
+  unsigned long		dequeue_pos;	/* Next slot to read */
+  unsigned long		overflows;	/* Records dropped, queue full */
+  int			enabled;	/* Set by the log_async option */
+  pid_t			pid;		/* Process the writer runs in */
+  sem_t			ready;		/* Posted when a record is queued */
+  int			stop;		/* Tells the writer to exit */
+  pthread_t		thread;		/* The writer */
+} log_queue;
+
+/*
+ * Held while the writer is started or stopped.
+ */
+static pthread_mutex_t	log_queue_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
- * Clear the SyslogFileObject for the garbage collector.
+ * Set by the log_stderr option.
  */
-static int SyslogFile_clear(PyObject* self)
+static int		syslog_stderr = 0;
+
+/*
+ * openlog() sets the ident for the whole process, so the writer and
+ * anything logging directly must take turns.
+ */
+static pthread_mutex_t	syslog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t	syslog_atfork_once = PTHREAD_ONCE_INIT;
+
+/*
+ * fork() copies syslog_lock as it was, so it is held across it.
+ */
+static void syslog_atfork_prepare(void)
+{
+  pthread_mutex_lock(&syslog_lock);
+}
+
+static void syslog_atfork_parent(void)
 {
-  SyslogFileObject*	syslogFile = (SyslogFileObject*)self;
+  pthread_mutex_unlock(&syslog_lock);
+}
 
-  PyMem_Free(syslogFile->buffer);
-  syslogFile->buffer = 0;
-  syslogFile->size = 0;
-  return generic_clear(self);
+static void syslog_atfork(void)
+{
+  pthread_atfork(
+      syslog_atfork_prepare, syslog_atfork_parent, syslog_atfork_parent);
 }
 
 /*
- * Emulate python's file.write(), but write to syslog.
+ * Write one message to syslog.
  */
-static PyObject* SyslogFile_write(
-    PyObject* self, PyObject* args, PyObject* kwds)
+static void syslog_output(const char* ident, int priority, const char* message)
 {
-  SyslogFileObject*	syslogFile = (SyslogFileObject*)self;
-  const char*		c;
-  const char*		data = 0;
-  int			len;
-  const char*		newline;
-  PyObject*		result = 0;
-  static char* kwlist[] = {"data", NULL};
+  pthread_once(&syslog_atfork_once, syslog_atfork);
+  pthread_mutex_lock(&syslog_lock);
+  openlog(
+      ident, LOG_CONS|LOG_PID|(syslog_stderr ? LOG_PERROR : 0), LOG_AUTHPRIV);
+  syslog(LOG_AUTHPRIV|priority, "%s", message);
+  closelog();
+  pthread_mutex_unlock(&syslog_lock);
+}
 
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "s:write", kwlist, &data))
-    goto error_exit;
-  if (syslogFile->buffer == 0)
-    len = 0;
-  else
-    len = strlen(syslogFile->buffer);
-  len += strlen(data) + 1;
-  if (len > syslogFile->size)
+/*
+ * Take the record at the head of the queue and write it.  Returns 0 if
+ * the queue is empty.
+ */
+static int log_queue_dequeue(void)
+{
+  LogRecord*		record;
+  unsigned long		pos = log_queue.dequeue_pos;
+
+  record = &log_queue.records[pos & (LOG_QUEUE_SIZE - 1)];
+  if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != pos + 1)
+    return 0;
+  syslog_output(record->ident, record->priority, record->message);
+  __atomic_store_n(
+      &record->sequence, pos + LOG_QUEUE_SIZE, __ATOMIC_RELEASE);
+  log_queue.dequeue_pos = pos + 1;
+  return 1;
+}
+
+/*
+ * The writer thread.
+ */
+static void* log_queue_writer(void* arg)
+{
+  unsigned long		overflows;
+  unsigned long		reported = 0;
+  char			message[64];
+
+  (void)arg;
+  for (;;)
   {
-    const int new_size = len * 2;
-    syslogFile->buffer = PyMem_Realloc(syslogFile->buffer, new_size);
-    if (syslogFile->buffer == 0)
+    while (sem_wait(&log_queue.ready) == -1)
+      continue;
+    while (log_queue_dequeue())
+      continue;
+    overflows = __atomic_load_n(&log_queue.overflows, __ATOMIC_RELAXED);
+    if (overflows != reported)
     {
-      syslogFile->size = 0;
-      goto error_exit;
+      snprintf(
+          message, sizeof(message),
+	  "log queue full, %lu messages dropped", overflows - reported);
+      syslog_output(MODULE_NAME, LOG_WARNING, message);
+      reported = overflows;
     }
-    if (syslogFile->size == 0)
-      syslogFile->buffer[0] = '\0';
-    syslogFile->size = new_size;
-  }
-  strcat(syslogFile->buffer, data);
-  for (c = syslogFile->buffer; *c != '\0'; c = newline + 1) {
-    newline = strchr(c, '\n');
-    if (newline == 0)
+    if (__atomic_load_n(&log_queue.stop, __ATOMIC_ACQUIRE))
       break;
-    syslog(LOG_AUTHPRIV|LOG_ERR, "%.*s", (int)(newline - c), c);
   }
-  if (c != syslogFile->buffer)
-    strcpy(syslogFile->buffer, c);
-  result = Py_None;
-  Py_INCREF(result);
-
-error_exit:
-  return result;
+  return 0;
 }
 
 /*
- * Emulate python's file.flush(), but write to syslog.
+ * Start the writer.  Returns -1 if that didn't work.
  */
-static void SyslogFile_flush(PyObject* self)
+static int log_queue_start(void)
 {
-  SyslogFileObject*	syslogFile = (SyslogFileObject*)self;
+  unsigned long		i;
 
-  if (syslogFile->buffer != 0 && syslogFile->buffer[0] != '\0')
+  if (log_queue.records == 0)
   {
-    syslog(LOG_AUTHPRIV|LOG_ERR, "%s", syslogFile->buffer);
-    syslogFile->buffer[0] = '\0';
+    log_queue.records = malloc(LOG_QUEUE_SIZE * sizeof(*log_queue.records));
+    if (log_queue.records == 0)
+      return -1;
   }
+  for (i = 0; i < LOG_QUEUE_SIZE; i += 1)
+    log_queue.records[i].sequence = i;
+  log_queue.enqueue_pos = 0;
+  log_queue.dequeue_pos = 0;
+  log_queue.overflows = 0;
+  log_queue.stop = 0;
+  if (sem_init(&log_queue.ready, 0, 0) == -1)
+    return -1;
+  if (pthread_create(&log_queue.thread, 0, log_queue_writer, 0) != 0)
+  {
+    sem_destroy(&log_queue.ready);
+    return -1;
+  }
+  __atomic_store_n(&log_queue.pid, getpid(), __ATOMIC_RELEASE);
+  return 0;
 }
 
-static PyMethodDef SyslogFile_Methods[] =
+/*
+ * Write everything queued and stop the writer.  This must happen before
+ * we can be unloaded, as the writer's code is in this shared library.
+ * Until a PAM handle given log_async turns it on again, messages are
+ * written directly, so nothing logged after this restarts the writer.
+ */
+static void log_queue_stop(void)
 {
+  pthread_mutex_lock(&log_queue_lock);
+  __atomic_store_n(&log_queue.enabled, 0, __ATOMIC_RELEASE);
+  if (log_queue.pid == getpid())
   {
-    "write",
-    PyCFunctionKwds_cast SyslogFile_write,
-    METH_VARARGS|METH_KEYWORDS,
-    0
-  },
-  {0,0,0,0}		/* Sentinal */
-};
+    __atomic_store_n(&log_queue.stop, 1, __ATOMIC_RELEASE);
+    sem_post(&log_queue.ready);
+    pthread_join(log_queue.thread, 0);
+    sem_destroy(&log_queue.ready);
+  }
+  __atomic_store_n(&log_queue.pid, 0, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&log_queue_lock);
+}
+
+static void log_queue_atexit(void)
+{
+  log_queue_stop();
+  free(log_queue.records);
+  log_queue.records = 0;
+}
 
 /*
- * Open syslog.
+ * Put a record on the queue.  Returns -1 if the queue can't be used.
  */
-static void syslog_open(const char* module_path)
+static int log_queue_enqueue(
+    const char* ident, int priority, const char* fmt, va_list ap)
 {
-  openlog(module_path, LOG_CONS|LOG_PID, LOG_AUTHPRIV);
+  long			diff;
+  unsigned long		pos;
+  LogRecord*		record;
+  unsigned long		sequence;
+  static int		atexit_registered = 0;
+
+  /*
+   * A fork()'ed child doesn't get the writer thread.  It discards what it
+   * inherited (the parent will write it) and starts its own.
+   */
+  if (__atomic_load_n(&log_queue.pid, __ATOMIC_ACQUIRE) != getpid())
+  {
+    pthread_mutex_lock(&log_queue_lock);
+    if (!atexit_registered)
+      atexit_registered = atexit(log_queue_atexit) == 0;
+    if (log_queue.pid != getpid() && log_queue_start() == -1)
+    {
+      pthread_mutex_unlock(&log_queue_lock);
+      return -1;
+    }
+    pthread_mutex_unlock(&log_queue_lock);
+  }
+  pos = __atomic_load_n(&log_queue.enqueue_pos, __ATOMIC_RELAXED);
+  for (;;)
+  {
+    record = &log_queue.records[pos & (LOG_QUEUE_SIZE - 1)];
+    sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+    diff = (long)(sequence - pos);
+    if (diff == 0)
+    {
+      if (__atomic_compare_exchange_n(
+	  &log_queue.enqueue_pos, &pos, pos + 1, 1,
+	  __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	break;
+    }
+    else if (diff < 0)
+    {
+      __atomic_fetch_add(&log_queue.overflows, 1, __ATOMIC_RELAXED);
+      return 0;
+    }
+    else
+      pos = __atomic_load_n(&log_queue.enqueue_pos, __ATOMIC_RELAXED);
+  }
+  record->priority = priority;
+  snprintf(record->ident, sizeof(record->ident), "%s", ident);
+  vsnprintf(record->message, sizeof(record->message), fmt, ap);
+  __atomic_store_n(&record->sequence, pos + 1, __ATOMIC_RELEASE);
+  sem_post(&log_queue.ready);
+  return 0;
 }
 
 /*
- * Close syslog.
+ * Log a message to the LOG_AUTHPRIV facility under the ident passed.
  */
-static void syslog_close(void)
+static void syslog_vwrite(
+    const char* ident, int priority, const char* fmt, va_list ap)
 {
-  closelog();
+  char			message[LOG_RECORD_SIZE * 2];
+  va_list		ap_copy;
+
+  if (__atomic_load_n(&log_queue.enabled, __ATOMIC_ACQUIRE))
+  {
+    va_copy(ap_copy, ap);
+    if (log_queue_enqueue(ident, priority, fmt, ap_copy) == 0)
+    {
+      va_end(ap_copy);
+      return;
+    }
+    va_end(ap_copy);
+  }
+  vsnprintf(message, sizeof(message), fmt, ap);
+  syslog_output(ident, priority, message);
+}
+
+static void syslog_write(const char* ident, int priority, const char* fmt, ...)
+{
+  va_list		ap;
+
+  va_start(ap, fmt);
+  syslog_vwrite(ident, priority, fmt, ap);
+  va_end(ap);
 }
 
 /*
@@ -357,1836 +777,7650 @@ static int syslog_python2pam(PyObject* exception_type)
   return PAM_SERVICE_ERR;
 }
 
+/*
+ * Return a str's UTF-8, or otherwise if it isn't a str or has no UTF-8
+ * (eg it holds a lone surrogate, as undecodable file names do).  Any
+ * exception that was already set is left as it was.
+ */
+static const char* unicode_utf8(PyObject* object, const char* otherwise)
+{
+  PyObject*		ptype;
+  PyObject*		ptraceback;
+  PyObject*		pvalue;
+  const char*		result;
+
+  if (object == 0 || !PyUnicode_Check(object))
+    return otherwise;
+  PyErr_Fetch(&ptype, &pvalue, &ptraceback);
+  result = PyUnicode_AsUTF8(object);
+  if (result == 0)
+  {
+    PyErr_Clear();
+    result = otherwise;
+  }
+  PyErr_Restore(ptype, pvalue, ptraceback);
+  return result;
+}
+
 /*
  * Return the modules filename.
  */
 static const char* get_module_path(PamHandleObject* pamHandle)
 {
-  const char* result = PyModule_GetFilename(pamHandle->module);
-  if (result != 0)
-    return result;
-  return MODULE_NAME;
+  if (pamHandle->module == 0)
+    return MODULE_NAME;
+  return unicode_utf8(
+      PyDict_GetItemString(PyModule_GetDict(pamHandle->module), "__file__"),
+      MODULE_NAME);
 }
 
 /*
- * Print an exception to syslog.
+ * Return the directory shared state is kept in.
  */
-static int syslog_path_exception(const char* module_path, const char* errormsg)
+static const char* get_state_dir(PamHandleObject* pamHandle)
 {
-  PyObject*	message = 0;
-  PyObject*	name = 0;
-  PyObject*	ptype = 0;
-  PyObject*	ptraceback = 0;
-  PyObject*	pvalue = 0;
-  int		pam_result = 0;
-  PyObject*	stype = 0;
-  const char*	str_name = 0;
-  const char*	str_message = 0;
-
-  PyErr_Fetch(&ptype, &pvalue, &ptraceback);
-  /*
-   * We don't have a PamHandleObject, so we can't print a full traceback.
-   * Just print the exception in some recognisable form, hopefully.
-   */
-  syslog_open(module_path);
-  if (PyClass_Check(ptype))
-    stype = PyObject_GetAttrString(ptype, "__name__");
-  else
-  {
-    stype = ptype;
-    Py_INCREF(stype);
-  }
-  if (stype != 0)
-  {
-    name = PyObject_Str(stype);
-    if (name != 0)
-      str_name = PyString_AsString(name);
-  }
-  if (pvalue != 0)
-  {
-    message = PyObject_Str(pvalue);
-    if (message != 0)
-      str_message = PyString_AsString(message);
-  }
-  if (errormsg != 0 && str_name != 0 && str_message != 0)
-  {
-    syslog(
-        LOG_AUTHPRIV|LOG_ERR, "%s - %s: %s",
-	errormsg, str_name, str_message);
-  }
-  else if (str_name != 0 && str_message != 0)
-    syslog(LOG_AUTHPRIV|LOG_ERR, "%s: %s", str_name, str_message);
-  else if (errormsg != 0 && str_name != 0)
-    syslog(LOG_AUTHPRIV|LOG_ERR, "%s - %s", errormsg, str_name);
-  else if (errormsg != 0 && str_message != 0)
-    syslog(LOG_AUTHPRIV|LOG_ERR, "%s - %s", errormsg, str_message);
-  else if (errormsg != 0)
-    syslog(LOG_AUTHPRIV|LOG_ERR, "%s", errormsg);
-  else if (str_name != 0)
-    syslog(LOG_AUTHPRIV|LOG_ERR, "%s", str_name);
-  else if (str_message != 0)
-    syslog(LOG_AUTHPRIV|LOG_ERR, "%s", str_message);
-  pam_result = syslog_python2pam(ptype);
-  py_xdecref(message);
-  py_xdecref(name);
-  py_xdecref(ptraceback);
-  py_xdecref(ptype);
-  py_xdecref(pvalue);
-  py_xdecref(stype);
-  syslog_close();
-  return pam_result;
+  if (pamHandle == 0)
+    return DEFAULT_STATE_DIR;
+  return unicode_utf8(pamHandle->state_dir, DEFAULT_STATE_DIR);
 }
 
 /*
- * Print an exception to syslog, once we are initialised.
+ * Return how many seconds must pass before an exception is logged again.
  */
-static int syslog_exception(PamHandleObject* pamHandle, const char* errormsg)
+static int get_log_window(PamHandleObject* pamHandle)
 {
-  return syslog_path_exception(get_module_path(pamHandle), errormsg);
+  if (pamHandle == 0)
+    return DEFAULT_LOG_WINDOW;
+  return pamHandle->log_window;
 }
 
 /*
- * Print an message to syslog.
+ * Return the time in seconds from some arbitrary point.
  */
-static int syslog_path_vmessage(
-    const char* module_path, const char* message, va_list ap)
+static double monotonic_time(void)
 {
-  syslog_open(module_path);
-  vsyslog(LOG_AUTHPRIV|LOG_ERR, message, ap);
-  syslog_close();
-  return PAM_SERVICE_ERR;
+  struct timespec	now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
 }
 
 /*
- * Print an message to syslog.
+ * Return the wall clock time in nanoseconds since the epoch.
  */
-static int syslog_path_message(
-    const char* module_path, const char* message, ...)
+static long long realtime_ns(void)
 {
-  va_list	ap;
-  int		result;
+  struct timespec	now;
 
-  va_start(ap, message);
-  result = syslog_path_vmessage(module_path, message, ap);
-  va_end(ap);
-  return result;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
 }
 
 /*
- * Print an message to syslog, once we are initialised.
+ * Nanoseconds since boot, including time spent suspended.  Unlike the
+ * wall clock it doesn't move when the clock is set, so it is used for
+ * expiry times kept in shared files.  It starts again at each boot, so
+ * such files also keep boot_time_ns() and start afresh when it moves.
  */
-static int syslog_message(PamHandleObject* pamHandle, const char* message, ...)
+static long long boottime_ns(void)
 {
-  va_list	ap;
-  int		result;
+  struct timespec	now;
 
-  va_start(ap, message);
-  result = syslog_path_vmessage(get_module_path(pamHandle), message, ap);
-  va_end(ap);
-  return result;
+#ifdef CLOCK_BOOTTIME
+  clock_gettime(CLOCK_BOOTTIME, &now);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
 }
 
 /*
- * Print a traceback to syslog.
+ * The wall clock time of the last boot.  Setting the clock moves it too,
+ * so two readings are taken as the same boot if they are within
+ * BOOT_TIME_SLACK_NS.
  */
-static int syslog_path_traceback(
-    const char* module_path, PamHandleObject* pamHandle)
+#define	BOOT_TIME_SLACK_NS	(60 * 1000000000LL)
+
+static long long boot_time_ns(void)
 {
-  PyObject*	args = 0;
-  PyObject*	ptraceback = 0;
-  PyObject*	ptype = 0;
-  PyObject*	pvalue = 0;
-  PyObject*	py_resultobj = 0;
-  int		pam_result;
+  return realtime_ns() - boottime_ns();
+}
 
-  PyErr_Fetch(&ptype, &pvalue, &ptraceback);
-  /*
-   * If there isn't a traceback just log the exception.
-   */
-  if (ptraceback == 0)
-  {
-    PyErr_Restore(ptype, pvalue, ptraceback);
-    return syslog_path_exception(module_path, 0);
-  }
-  /*
-   * Bit messy, this.  The easiest way to print a traceback is to use
-   * the traceback module, writing through a dummy file that actually
-   * outputs to syslog.
-   */
-  syslog_open(module_path);
-  if (ptype == 0)
-  {
-    ptype = Py_None;
-    Py_INCREF(ptype);
-  }
-  if (pvalue == 0)
-  {
-    pvalue = Py_None;
-    Py_INCREF(pvalue);
-  }
-  args = Py_BuildValue(
-      "OOOOO", ptype, pvalue, ptraceback, Py_None, pamHandle->syslogFile);
-  if (args != 0)
-  {
-    py_resultobj = PyEval_CallObject(pamHandle->print_exception, args);
-    if (py_resultobj != 0)
-      SyslogFile_flush(pamHandle->syslogFile);
-  }
-  pam_result = syslog_python2pam(ptype);
-  py_xdecref(args);
-  py_xdecref(ptraceback);
-  py_xdecref(ptype);
-  py_xdecref(pvalue);
-  py_xdecref(py_resultobj);
-  syslog_close();
-  return pam_result;
+static int boot_time_same(long long boot_time)
+{
+  long long		difference = boot_time_ns() - boot_time;
+
+  return difference > -BOOT_TIME_SLACK_NS && difference < BOOT_TIME_SLACK_NS;
 }
 
 /*
- * Print an message to syslog, once we are initialised.
+ * Hash some bytes into a running FNV-1a hash.
  */
-static int syslog_traceback(PamHandleObject* pamHandle)
+#define	FNV1A_INIT	14695981039346656037ULL
+
+static unsigned long long fnv1a(
+    unsigned long long hash, const void* data, size_t len)
 {
-  return syslog_path_traceback(get_module_path(pamHandle), pamHandle);
+  const unsigned char*	p = data;
+
+  while (len-- > 0)
+    hash = (hash ^ *p++) * 1099511628211ULL;
+  return hash;
 }
 
 /*
- * The PamMessage object - used in conversations.
+ * SipHash-2-4 of some bytes, with a 16 byte key.  Unlike FNV-1a the hash
+ * can't be reversed, or the input guessed, without the key.
  */
-#define	PAMMESSAGE_NAME	"Message"
-typedef struct
+#define	SIPHASH_ROTL(x, b)	(((x) << (b)) | ((x) >> (64 - (b))))
+
+static void siphash_rounds(unsigned long long v[4], int rounds)
 {
-  PyObject_HEAD				/* The Python Object header */
-  int			msg_style;	/* struct pam_message.msg_style */
-  PyObject*		msg;		/* struct pam_message.msg */
-} PamMessageObject;
+  while (rounds-- > 0)
+  {
+    v[0] += v[1];
+    v[1] = SIPHASH_ROTL(v[1], 13) ^ v[0];
+    v[0] = SIPHASH_ROTL(v[0], 32);
+    v[2] += v[3];
+    v[3] = SIPHASH_ROTL(v[3], 16) ^ v[2];
+    v[0] += v[3];
+    v[3] = SIPHASH_ROTL(v[3], 21) ^ v[0];
+    v[2] += v[1];
+    v[1] = SIPHASH_ROTL(v[1], 17) ^ v[2];
+    v[2] = SIPHASH_ROTL(v[2], 32);
+  }
+}
 
-static char PamMessage_doc[] =
-  MODULE_NAME "." PAMHANDLE_NAME "." PAMMESSAGE_NAME "(msg_style, msg)\n"
-  "  Constructs an immutable object that can be passed to\n"
-  "  " MODULE_NAME "." PAMHANDLE_NAME ".conversation().  The parameters are\n"
-  "  assigned to readonly members of the same name.  msg_style determines what\n"
-  "  is done (eg prompt for input, write a message), and msg is the prompt or\n"
-  "  message.";
+static unsigned long long siphash_le64(const unsigned char* p, size_t len)
+{
+  unsigned long long	result = 0;
 
-static PyMemberDef PamMessage_members[] =
+  while (len-- > 0)
+    result |= (unsigned long long)p[len] << (len * 8);
+  return result;
+}
+
+static unsigned long long siphash24(
+    const unsigned char key[16], const void* data, size_t len)
 {
+  unsigned long long	k0 = siphash_le64(key, 8);
+  unsigned long long	k1 = siphash_le64(key + 8, 8);
+  unsigned long long	m;
+  const unsigned char*	p = data;
+  const size_t		total = len;
+  unsigned long long	v[4];
+
+  v[0] = k0 ^ 0x736f6d6570736575ULL;
+  v[1] = k1 ^ 0x646f72616e646f6dULL;
+  v[2] = k0 ^ 0x6c7967656e657261ULL;
+  v[3] = k1 ^ 0x7465646279746573ULL;
+  for (; len >= 8; len -= 8, p += 8)
   {
-    "msg_style",
-    T_INT,
-    offsetof(PamMessageObject, msg_style),
-    READONLY,
-    "What to do with the msg member, eg display it or use as a prompt.",
-  },
+    m = siphash_le64(p, 8);
+    v[3] ^= m;
+    siphash_rounds(v, 2);
+    v[0] ^= m;
+  }
+  m = siphash_le64(p, len) | (unsigned long long)total << 56;
+  v[3] ^= m;
+  siphash_rounds(v, 2);
+  v[0] ^= m;
+  v[2] ^= 0xff;
+  siphash_rounds(v, 4);
+  return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+/*
+ * Return a new random id, len bytes long, as a hex string.
+ */
+static PyObject* random_hex_id(size_t len)
+{
+  unsigned char		bytes[16];
+  static unsigned long	counter = 0;
+  unsigned long long	hash;
+  char			hex[sizeof(bytes) * 2 + 1];
+  size_t		i;
+  long long		now;
+  pid_t			pid;
+
+  if (len > sizeof(bytes))
+    len = sizeof(bytes);
+  if (getrandom(bytes, len, GRND_NONBLOCK) != (ssize_t)len)
   {
-    "msg",
-    T_OBJECT_EX,
-    offsetof(PamMessageObject, msg),
-    READONLY,
-    "The text to display to the user",
-  },
-  {0,0,0,0,0},        	/* End of Python visible members */
-  {0,0,0,0,0}		/* Sentinal */
-};
+    /*
+     * Ids need to be unique, not secret.
+     */
+    now = realtime_ns();
+    pid = getpid();
+    counter += 1;
+    hash = fnv1a(FNV1A_INIT, &now, sizeof(now));
+    hash = fnv1a(hash, &pid, sizeof(pid));
+    for (i = 0; i < len; i += 1)
+    {
+      if (i % sizeof(hash) == 0)
+	hash = fnv1a(hash, &counter, sizeof(counter));
+      bytes[i] = hash >> (i % sizeof(hash) * 8);
+    }
+  }
+  for (i = 0; i < len; i += 1)
+    sprintf(hex + i * 2, "%02x", bytes[i]);
+  return PyUnicode_FromStringAndSize(hex, len * 2);
+}
 
-static PyObject* PamMessage_new(
-    PyTypeObject* type, PyObject* args, PyObject* kwds)
+/*
+ * The name of an exception's type, or 0 if it isn't obvious.
+ */
+static const char* exception_type_name(PyObject* ptype)
 {
-  int			err;
-  PyObject*		msg = 0;
-  int			msg_style = 0;
-  PamMessageObject*	pamMessage = 0;
-  PyObject*		self = 0;
-  static char*		kwlist[] = {"msg_style", "msg", 0};
+  if (ptype == 0)
+    return 0;
+  if (PyType_Check(ptype))
+    return ((PyTypeObject*)ptype)->tp_name;
+  return 0;
+}
 
-  err = PyArg_ParseTupleAndKeywords(
-      args, kwds, "iO!:Message", kwlist,
-      &msg_style, &PyString_Type, &msg);
-  if (!err)
+/*
+ * Open a file in the state directory, creating the directory and file if
+ * asked to, and make sure the file is at least size bytes long.  The file
+ * is locked for exclusive use.  Returns the fd, or -1 if that didn't work.
+ */
+static int state_file_open(
+    const char* state_dir, const char* name, size_t size, int create)
+{
+  int			fd;
+  char			path[PATH_MAX];
+  struct stat		st;
+
+  if (snprintf(path, sizeof(path), "%s/%s", state_dir, name) >= (int)sizeof(path))
+    return -1;
+  if (create)
+    mkdir(state_dir, 0700);
+  fd = open(
+      path, O_RDWR|O_NOFOLLOW|O_CLOEXEC|(create ? O_CREAT : 0), 0600);
+  if (fd == -1)
+    return -1;
+  if (flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1)
     goto error_exit;
-  pamMessage = (PamMessageObject*)type->tp_alloc(type, 0);
-  if (pamMessage == 0)
+  if ((size_t)st.st_size < size && ftruncate(fd, size) == -1)
     goto error_exit;
-  pamMessage->msg_style = msg_style;
-  pamMessage->msg = msg;
-  Py_INCREF(pamMessage->msg);
-  self = (PyObject*)pamMessage;
-  pamMessage = 0;
+  return fd;
 
 error_exit:
-  py_xdecref((PyObject*)pamMessage);
-  return self;
+  close(fd);
+  return -1;
 }
 
 /*
- * The PamResponse object - used in conversations.
+ * When a backend fails every login raises the same exception.  Logging
+ * the full traceback every time floods syslog exactly when someone needs
+ * to read it, so exceptions are fingerprinted by module, type and where
+ * they were raised, and each fingerprint gets a bucket that lets one
+ * traceback through per window.  Those that don't get through are
+ * counted, and the count is logged before the next one that does, or
+ * when a PAM handle is destroyed after the window has passed.
+ *
+ * sshd and friends fork a process per login, so the buckets live in a
+ * file in the state directory that all processes map.  The file stays
+ * mapped until the last PAM handle goes, and is only locked while a
+ * bucket is being given to a new fingerprint; everything else is done
+ * with atomic operations.  Until the file can be mapped each process uses
+ * buckets of its own, which are merged into the file once it can be.
  */
-#define	PAMRESPONSE_NAME	"Response"
+#define	EXCEPTION_BUCKETS_NAME	"exceptions-2"
+
 typedef struct
 {
-  PyObject_HEAD				/* The Python Object header */
-  PyObject*		resp;		/* struct pam_response.resp */
-  int			resp_retcode;	/* struct pam_response.resp_retcode */
-} PamResponseObject;
+  unsigned long long	fingerprint;	/* 0 if the slot is unused */
+  long long		allowed;	/* monotonic_ns() next one is logged */
+  long long		used;		/* monotonic_ns() of last occurrence */
+  unsigned long		suppressed;	/* Occurrences not logged */
+  long long		suppressed_since;/* When suppressing started */
+  char			ident[128];	/* Module path it was logged for */
+  char			where[192];	/* "Type at file:line" */
+} ExceptionBucket;
 
-static char PamResponse_doc[] =
-  MODULE_NAME "." PAMHANDLE_NAME "." PAMRESPONSE_NAME "(resp, resp_retcode)\n"
-  "  Constructs an immutable object that is returned by\n"
-  "  " MODULE_NAME "." PAMHANDLE_NAME ".conversation().  The parameters are\n"
-  "  assigned to readonly members of the same name.  resp is the response from\n"
-  "  the user (if one was asked for), and resp_retcode says what it means.";
+#define	EXCEPTION_BUCKET_COUNT	64
 
-static PyMemberDef PamResponse_members[] =
-{
-  {
-    "resp",
-    T_OBJECT_EX,
-    offsetof(PamResponseObject, resp),
-    READONLY,
-    "The response from the user.",
-  },
-  {
-    "resp_retcode",
-    T_INT,
-    offsetof(PamResponseObject, resp_retcode),
-    READONLY,
-    "The type of response.",
-  },
-  {0,0,0,0,0},        	/* End of Python visible members */
-  {0,0,0,0,0}		/* Sentinal */
-};
+static ExceptionBucket	exception_buckets_private[EXCEPTION_BUCKET_COUNT];
 
-static PyObject* PamResponse_new(
-    PyTypeObject* type, PyObject* args, PyObject* kwds)
+static struct
 {
-  int			err;
-  PyObject*		resp = 0;
-  int			resp_retcode = 0;
-  PamResponseObject*	pamResponse = 0;
-  PyObject*		self = 0;
-  static char*		kwlist[] = {"resp", "resp_retcode", 0};
+  ExceptionBucket*	buckets;	/* The mapped file, or 0 */
+  int			fd;		/* Its fd, for locking */
+  pid_t			pid;		/* Process that opened fd */
+  char			state_dir[PATH_MAX];
+} exception_buckets_shared = {0, -1, 0, ""};
 
-  err = PyArg_ParseTupleAndKeywords(
-      args, kwds, "Oi:Response", kwlist,
-      &resp, &resp_retcode);
-  if (!err)
-    goto error_exit;
-  if (resp != Py_None && !PyString_Check(resp))
-  {
-    PyErr_SetString(PyExc_TypeError, "resp must be a string or None");
-    goto error_exit;
-  }
-  pamResponse = (PamResponseObject*)type->tp_alloc(type, 0);
-  if (pamResponse == 0)
-    goto error_exit;
-  pamResponse->resp_retcode = resp_retcode;
-  pamResponse->resp = resp;
-  Py_INCREF(pamResponse->resp);
-  self = (PyObject*)pamResponse;
-  pamResponse = 0;
+static pthread_mutex_t	exception_buckets_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t	exception_buckets_atfork_once = PTHREAD_ONCE_INIT;
 
-error_exit:
-  py_xdecref((PyObject*)pamResponse);
-  return self;
+/*
+ * Return the time in nanoseconds from some arbitrary point.
+ */
+static long long monotonic_ns(void)
+{
+  struct timespec	now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
 }
 
 /*
- * The PamXAuthData object - used by PAM_XAUTHDATA item.
+ * fork() copies exception_buckets_lock as it was, so it is held across
+ * it.
  */
-#define	PAMXAUTHDATA_NAME	"XAuthData"
-typedef struct
+static void exception_buckets_atfork_prepare(void)
 {
-  PyObject_HEAD				/* The Python Object header */
-  PyObject*		name;		/* struct pam_xauth_data.name */
-  PyObject*		data;		/* struct pam_xauth_data.data */
-} PamXAuthDataObject;
-
-static char PamXAuthData_doc[] =
-  MODULE_NAME "." PAMHANDLE_NAME "." PAMXAUTHDATA_NAME "(name, data)\n"
-  "  Constructs an immutable object is returned by and can be passed to\n"
-  "  the " MODULE_NAME ".xauthdata property.  The parameters are\n"
-  "  assigned to readonly members of the same name.";
+  pthread_mutex_lock(&exception_buckets_lock);
+}
 
-static PyMemberDef PamXAuthData_members[] =
+static void exception_buckets_atfork_parent(void)
 {
-  {
-    "data",
-    T_OBJECT_EX,
-    offsetof(PamXAuthDataObject, data),
-    READONLY,
-    "The value of the data item. A string or None.",
-  },
-  {
-    "name",
-    T_OBJECT_EX,
-    offsetof(PamXAuthDataObject, name),
-    READONLY,
-    "The name of the data item.  A string or None.",
-  },
-  {0,0,0,0,0},        	/* End of Python visible members */
-  {0,0,0,0,0}		/* Sentinal */
-};
+  pthread_mutex_unlock(&exception_buckets_lock);
+}
 
-static PyObject* PamXAuthData_new(
-    PyTypeObject* type, PyObject* args, PyObject* kwds)
+static void exception_buckets_atfork_child(void)
 {
-  int			err;
-  PyObject*		name = 0;
-  PyObject*		data = 0;
-  PamXAuthDataObject*	pamXAuthData = 0;
-  PyObject*		self = 0;
-  static char*		kwlist[] = {"name", "data", 0};
+  pthread_mutex_unlock(&exception_buckets_lock);
+}
 
-  err = PyArg_ParseTupleAndKeywords(
-      args, kwds, "SS:XAuthData", kwlist,
-      &name, &data);
-  if (!err)
-    goto error_exit;
-  pamXAuthData = (PamXAuthDataObject*)type->tp_alloc(type, 0);
-  if (pamXAuthData == 0)
-    goto error_exit;
-  pamXAuthData->name = name;
-  Py_INCREF(pamXAuthData->name);
-  pamXAuthData->data = data;
-  Py_INCREF(pamXAuthData->data);
-  self = (PyObject*)pamXAuthData;
-  pamXAuthData = 0;
+static void exception_buckets_atfork(void)
+{
+  pthread_atfork(
+      exception_buckets_atfork_prepare, exception_buckets_atfork_parent,
+      exception_buckets_atfork_child);
+}
 
-error_exit:
-  py_xdecref((PyObject*)pamXAuthData);
-  return self;
+/*
+ * Log how many times an exception wasn't logged.
+ */
+static void exception_bucket_flush(ExceptionBucket* bucket, long long now)
+{
+  char			message[384];
+  unsigned long		suppressed;
+
+  suppressed = __atomic_exchange_n(&bucket->suppressed, 0, __ATOMIC_ACQ_REL);
+  if (suppressed == 0)
+    return;
+  snprintf(
+      message, sizeof(message),
+      "%lu more occurrences of %s in the last %.0fs",
+      suppressed, bucket->where,
+      (now - __atomic_load_n(&bucket->suppressed_since, __ATOMIC_RELAXED)) /
+	  1e9);
+  syslog_write(bucket->ident, LOG_ERR, "%s", message);
 }
 
 /*
- * Check a PAM return value.  If the function failed raise an exception
- * and return -1.
+ * Find the bucket for a fingerprint.  Returns 0 if it doesn't have one.
  */
-static int check_pam_result(PamHandleObject* pamHandle, int pam_result)
+static ExceptionBucket* exception_bucket_find(
+    ExceptionBucket* buckets, unsigned long long fingerprint)
 {
-  if (pam_result == PAM_SUCCESS)
-    return 0;
-  if (!PyErr_Occurred())
+  ExceptionBucket*	bucket;
+
+  for (bucket = buckets; bucket < buckets + EXCEPTION_BUCKET_COUNT; bucket += 1)
   {
-    PyObject* ptype;
-    PyObject* pvalue;
-    PyObject* ptraceback;
-    PyObject* error_code = 0;
-    const char* error_string = pam_strerror(pamHandle->pamh, pam_result);
-
-    PyErr_SetString(pamHandle->exception, error_string);
-    PyErr_Fetch(&ptype, &pvalue, &ptraceback);
-    PyErr_NormalizeException(&ptype, &pvalue, &ptraceback);
-    error_code = PyInt_FromLong(pam_result);
-    if (error_code != NULL)
-      PyObject_SetAttrString(pvalue, "pam_result", error_code);
-    PyErr_Restore(ptype, pvalue, ptraceback);
-    py_xdecref(error_code);
-  }
-  return -1;
-}
+    if (__atomic_load_n(&bucket->fingerprint, __ATOMIC_ACQUIRE) == fingerprint)
+      return bucket;
+  }
+  return 0;
+}
 
 /*
- * Python getters / setters are used to manipulate PAM's items.
+ * Give the least recently used bucket to a fingerprint, logging what was
+ * suppressed for the one it had.  If the buckets are shared the caller
+ * must hold the lock on the file.
  */
-static PyObject* PamHandle_get_item(PyObject* self, int item_type)
+static ExceptionBucket* exception_bucket_alloc(
+    ExceptionBucket* buckets, unsigned long long fingerprint,
+    const char* ident, const char* where, long long now)
 {
-  PamHandleObject*	pamHandle = (PamHandleObject*)self;
-  const char*		value;
-  PyObject*		result = 0;
-  int			pam_result;
+  ExceptionBucket*	bucket;
+  ExceptionBucket*	victim = buckets;
 
-  pam_result = pam_get_item(pamHandle->pamh, item_type, (const void**)&value);
-  if (check_pam_result(pamHandle, pam_result) == -1)
-    goto error_exit;
-  if (value != 0)
-    result = PyString_FromString(value);
-  else
+  for (bucket = buckets; bucket < buckets + EXCEPTION_BUCKET_COUNT; bucket += 1)
   {
-    result = Py_None;
-    Py_INCREF(result);
+    if (bucket->fingerprint == 0)
+    {
+      victim = bucket;
+      break;
+    }
+    if (bucket->used < victim->used)
+      victim = bucket;
   }
-
-error_exit:
-  return result;
+  bucket = victim;
+  exception_bucket_flush(bucket, now);
+  __atomic_store_n(&bucket->fingerprint, 0, __ATOMIC_RELEASE);
+  bucket->allowed = now;
+  bucket->used = now;
+  bucket->suppressed_since = now;
+  snprintf(bucket->ident, sizeof(bucket->ident), "%s", ident);
+  snprintf(bucket->where, sizeof(bucket->where), "%s", where);
+  __atomic_store_n(&bucket->fingerprint, fingerprint, __ATOMIC_RELEASE);
+  return bucket;
 }
 
-static int PamHandle_set_item(
-    PyObject* self, int item_type, char* item_name, PyObject* pyValue)
+/*
+ * Move what the private buckets know into the shared ones, whose file
+ * the caller has locked.
+ */
+static void exception_buckets_merge(ExceptionBucket* buckets)
 {
-  PamHandleObject*	pamHandle = (PamHandleObject*)self;
-  int			pam_result;
-  int			result = -1;
-  char*			value;
-  char			error_message[64];
+  ExceptionBucket*	bucket;
+  ExceptionBucket*	private;
 
-  if (pyValue == Py_None)
-    value = 0;
-  else
+  for (private = exception_buckets_private;
+       private < exception_buckets_private + EXCEPTION_BUCKET_COUNT;
+       private += 1)
   {
-    value = PyString_AsString(pyValue);
-    if (value == 0)
+    if (private->fingerprint == 0)
+      continue;
+    bucket = exception_bucket_find(buckets, private->fingerprint);
+    if (bucket == 0)
     {
-      snprintf(
-          error_message, sizeof(error_message),
-	  "PAM item %s must be set to a string", item_name);
-      PyErr_SetString(PyExc_TypeError, error_message);
-      goto error_exit;
+      bucket = exception_bucket_alloc(
+	  buckets, private->fingerprint, private->ident, private->where,
+	  private->used);
     }
-    value = strdup(value);
-    if (value == 0)
+    if (private->allowed > bucket->allowed)
+      bucket->allowed = private->allowed;
+    if (private->used > bucket->used)
+      bucket->used = private->used;
+    if (private->suppressed != 0)
     {
-      PyErr_NoMemory();
-      goto error_exit;
+      if (bucket->suppressed == 0 ||
+	  private->suppressed_since < bucket->suppressed_since)
+	bucket->suppressed_since = private->suppressed_since;
+      __atomic_add_fetch(
+	  &bucket->suppressed, private->suppressed, __ATOMIC_ACQ_REL);
     }
   }
-  pam_result = pam_set_item(pamHandle->pamh, item_type, value);
-  if (pam_result == PAM_SUCCESS)
-    value = 0;
-  result = check_pam_result(pamHandle, pam_result);
-
-error_exit:
-  if (value != 0)
-    free(value);
-  return result;
+  memset(exception_buckets_private, 0, sizeof(exception_buckets_private));
 }
 
 /*
- * The PAM Environment Object & its iterator.
+ * Forget the shared buckets.  The caller holds exception_buckets_lock.
  */
-#define	PAMENV_NAME	"PamEnv"
-typedef struct
+static void exception_buckets_unmap(void)
 {
-  PyObject_HEAD				/* The Python Object header */
-  PamHandleObject*	pamHandle;	/* The PamHandle that owns us */
-  PyTypeObject*		pamEnvIter_type;/* A class for our iterators */
-} PamEnvObject;
+  if (exception_buckets_shared.buckets == 0)
+    return;
+  munmap(exception_buckets_shared.buckets, sizeof(exception_buckets_private));
+  close(exception_buckets_shared.fd);
+  exception_buckets_shared.buckets = 0;
+  exception_buckets_shared.fd = -1;
+}
 
-static PyMemberDef PamEnv_Members[] =
+/*
+ * Get the buckets, mapping them from the state directory if we can and
+ * haven't already.  If create is false the file isn't created.  The
+ * caller must hold exception_buckets_lock until it is done with them.
+ */
+static ExceptionBucket* exception_buckets_get(const char* state_dir, int create)
 {
-  {0,0,0,0,0},        	/* End of Python visible members */
+  const size_t		size = sizeof(exception_buckets_private);
+  void*			buckets;
+  int			fd;
+
+  if (exception_buckets_shared.buckets != 0 &&
+      strcmp(exception_buckets_shared.state_dir, state_dir) != 0)
+    exception_buckets_unmap();
+  if (exception_buckets_shared.buckets != 0)
+    return exception_buckets_shared.buckets;
+  fd = state_file_open(state_dir, EXCEPTION_BUCKETS_NAME, size, create);
+  if (fd == -1)
+    return exception_buckets_private;
+  buckets = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (buckets == MAP_FAILED)
   {
-    "Iter",
-    T_OBJECT_EX,
-    offsetof(PamEnvObject, pamEnvIter_type),
-    READONLY,
-    "Iterator class for " PAMENV_NAME
-  },
-  {0,0,0,0,0}        	/* Sentinel */
-};
+    close(fd);
+    return exception_buckets_private;
+  }
+  exception_buckets_merge(buckets);
+  flock(fd, LOCK_UN);
+  exception_buckets_shared.buckets = buckets;
+  exception_buckets_shared.fd = fd;
+  exception_buckets_shared.pid = getpid();
+  snprintf(
+      exception_buckets_shared.state_dir,
+      sizeof(exception_buckets_shared.state_dir), "%s", state_dir);
+  return buckets;
+}
 
-#define	PAMENVITER_NAME	"PamEnvIter"
-typedef struct
+/*
+ * Lock the file the shared buckets are in.  A child shares its parent's
+ * open file, and so its lock, so it needs one of its own.  Returns false
+ * if that can't be done.
+ */
+static int exception_buckets_lock_file(const char* state_dir)
 {
-  PyObject_HEAD
-  PamEnvObject*		env;		/* The PamEnvObject we are iterating */
-  int			pos;		/* Nest position to return */
-  PyObject*		(*get_entry)(const char* entry); /* What to return */
-} PamEnvIterObject;
+  const size_t		size = sizeof(exception_buckets_private);
+  int			fd;
 
-static PyMemberDef PamEnvIter_Members[] =
-{
-  {0,0,0,0,0},        	/* End of Python visible members */
+  if (exception_buckets_shared.pid != getpid())
   {
-    "env",
-    T_OBJECT_EX,
-    offsetof(PamEnvIterObject, env),
-    READONLY,
-    "Dictionary to iterate"
-  },
-  {0,0,0,0,0}        	/* Sentinel */
-};
+    fd = state_file_open(state_dir, EXCEPTION_BUCKETS_NAME, size, 1);
+    if (fd == -1)
+      return 0;
+    close(exception_buckets_shared.fd);
+    exception_buckets_shared.fd = fd;
+    exception_buckets_shared.pid = getpid();
+    return 1;
+  }
+  return flock(exception_buckets_shared.fd, LOCK_EX) != -1;
+}
 
 /*
- * Create a new iterator for a PamEnv.
+ * Called when the last PAM handle goes, because we may be unloaded.
  */
-static PyObject* PamEnvIter_create(
-  PamEnvObject* pamEnv, PyObject* (*get_entry)(const char* entry))
+static void exception_buckets_close(void)
 {
-  PyTypeObject*		type = pamEnv->pamEnvIter_type;
-  PamEnvIterObject*	pamEnvIter;
-  PyObject*		result = 0;
-
-  pamEnvIter = (PamEnvIterObject*)type->tp_alloc(type, 0);
-  if (pamEnvIter == 0)
-    goto error_exit;
-  pamEnvIter->env = pamEnv;
-  Py_INCREF(pamEnvIter->env);
-  pamEnvIter->get_entry = get_entry;
-  pamEnvIter->pos = 0;
-  result = (PyObject*)pamEnvIter;
-  Py_INCREF(result);
-
-error_exit:
-  py_xdecref((PyObject*)pamEnvIter);
-  return result;
+  pthread_mutex_lock(&exception_buckets_lock);
+  exception_buckets_unmap();
+  pthread_mutex_unlock(&exception_buckets_lock);
 }
 
 /*
- * Return the next object in the iteration.
+ * Log the counts of buckets whose window has passed.
  */
-static PyObject* PamEnvIter_iternext(PyObject* self)
+static void exception_buckets_flush(const char* state_dir, int window)
 {
-  PamEnvIterObject*	pamEnvIter = (PamEnvIterObject*)self;
-  char**		env;
-  int			i;
-  PyObject*		result;
+  ExceptionBucket*	bucket;
+  ExceptionBucket*	buckets;
+  long long		now;
+
+  if (window <= 0)
+    return;
+  pthread_mutex_lock(&exception_buckets_lock);
+  buckets = exception_buckets_get(state_dir, 0);
+  now = monotonic_ns();
+  for (bucket = buckets; bucket < buckets + EXCEPTION_BUCKET_COUNT; bucket += 1)
+  {
+    if (__atomic_load_n(&bucket->suppressed, __ATOMIC_ACQUIRE) != 0 &&
+	now - bucket->suppressed_since >= window * 1000000000LL)
+      exception_bucket_flush(bucket, now);
+  }
+  pthread_mutex_unlock(&exception_buckets_lock);
+}
 
-  if (pamEnvIter->env == 0)
-    goto error_exit;
-  env = pam_getenvlist(pamEnvIter->env->pamHandle->pamh);
-  if (env == 0)
-    goto error_exit;
-  for (i = 0; env[i] != 0 && i < pamEnvIter->pos; i += 1)
-    continue;
-  if (env[i] == 0)
-    goto error_exit;
-  result = pamEnvIter->get_entry(env[i]);
-  if (result == 0)
-    goto error_exit;
-  pamEnvIter->pos += 1;
+/*
+ * Decide if this exception should be logged.  Returns true if it should.
+ */
+static int exception_ratelimit(
+    const char* state_dir, const char* module_path,
+    PyObject* ptype, PyObject* ptraceback, int window)
+{
+  long long		allowed;
+  ExceptionBucket*	bucket;
+  ExceptionBucket*	buckets;
+  PyCodeObject*		code = 0;
+  long long		expected;
+  const char*		filename = "?";
+  unsigned long long	fingerprint;
+  int			lineno = 0;
+  int			locked;
+  long long		now;
+  int			result;
+  PyTracebackObject*	tb;
+  const char*		type_name;
+  char			where[192];
+  const long long	window_ns = window * 1000000000LL;
+
+  if (window <= 0)
+    return 1;
+  /*
+   * Code objects are recreated every time the module is loaded, so the
+   * fingerprint must be made from names.  The message is left out, as it
+   * often holds a host, errno or time that differs each occurrence.
+   */
+  fingerprint = fnv1a(FNV1A_INIT, module_path, strlen(module_path) + 1);
+  type_name = exception_type_name(ptype);
+  if (type_name != 0)
+    fingerprint = fnv1a(fingerprint, type_name, strlen(type_name) + 1);
+  if (ptraceback != 0 && PyTraceBack_Check(ptraceback))
+  {
+    for (tb = (PyTracebackObject*)ptraceback; tb != 0; tb = tb->tb_next)
+    {
+      code = frame_code(tb->tb_frame);
+      lineno = traceback_lineno(tb);
+      filename = unicode_utf8(code->co_filename, "?");
+      fingerprint = fnv1a(fingerprint, filename, strlen(filename) + 1);
+      fingerprint = fnv1a(fingerprint, &lineno, sizeof(lineno));
+    }
+  }
+  if (fingerprint == 0)
+    fingerprint = 1;
+  pthread_once(&exception_buckets_atfork_once, exception_buckets_atfork);
+  pthread_mutex_lock(&exception_buckets_lock);
+  buckets = exception_buckets_get(state_dir, 1);
+  now = monotonic_ns();
+  /*
+   * Find its bucket, or failing that give it one.  Only the latter needs
+   * the file locked.
+   */
+  bucket = exception_bucket_find(buckets, fingerprint);
+  if (bucket == 0)
+  {
+    if (code == 0)
+    {
+      snprintf(
+          where, sizeof(where), "%s",
+	  type_name != 0 ? type_name : "an exception");
+    }
+    else
+    {
+      snprintf(
+          where, sizeof(where), "%s at %s:%d",
+	  type_name != 0 ? type_name : "an exception", filename, lineno);
+    }
+    locked = buckets != exception_buckets_private &&
+	exception_buckets_lock_file(state_dir);
+    bucket = exception_bucket_find(buckets, fingerprint);
+    if (bucket == 0)
+    {
+      bucket = exception_bucket_alloc(
+	  buckets, fingerprint, module_path, where, now);
+    }
+    if (locked)
+      flock(exception_buckets_shared.fd, LOCK_UN);
+  }
+  __atomic_store_n(&bucket->used, now, __ATOMIC_RELAXED);
+  /*
+   * One traceback is let through per window.  The file may have outlived
+   * a reboot, which resets the clock.
+   */
+  expected = __atomic_load_n(&bucket->allowed, __ATOMIC_ACQUIRE);
+  for (;;)
+  {
+    allowed = expected;
+    if (allowed - now > window_ns)
+      allowed = now;
+    if (now < allowed)
+    {
+      if (__atomic_fetch_add(&bucket->suppressed, 1, __ATOMIC_ACQ_REL) == 0)
+	__atomic_store_n(&bucket->suppressed_since, now, __ATOMIC_RELAXED);
+      result = 0;
+      break;
+    }
+    if (__atomic_compare_exchange_n(
+	  &bucket->allowed, &expected, now + window_ns, 0,
+	  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      exception_bucket_flush(bucket, now);
+      result = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&exception_buckets_lock);
   return result;
-
-error_exit:
-  clear_slot((PyObject**)&pamEnvIter->env);
-  return 0;
 }
 
 /*
- * Return a python object for the key part.
+ * Usage statistics, kept if the stats option is given.  The layout of the
+ * file is in pam_python_stat.h.  The lock on the file is only held while
+ * it is mapped and a slot is found for the module, after that counters
+ * are updated with atomic adds so processes never wait on each other.
  */
-static PyObject* PamEnvIter_key_entry(const char* entry)
+
+/*
+ * Map the stats file and find (or allocate) module_path's slot in it.
+ * Returns 0 if that can't be done, in which case stats aren't kept.
+ */
+static StatsModule* stats_open(
+    const char* state_dir, const char* module_path, StatsFile** stats_file)
 {
-  const char*		equals;
+  int			fd;
+  StatsFile*		file;
+  unsigned long long	hash;
+  StatsModule*		module;
+  StatsModule*		result = 0;
+  size_t		i;
+
+  *stats_file = 0;
+  fd = state_file_open(state_dir, STATS_FILE_NAME, sizeof(*file), 1);
+  if (fd == -1)
+    return 0;
+  file = mmap(0, sizeof(*file), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (file == MAP_FAILED)
+  {
+    close(fd);
+    return 0;
+  }
+  /*
+   * A new file is all zeros.  One that is neither that nor ours is left
+   * alone, as whatever wrote it may still be using it.
+   */
+  if (file->magic == 0 && file->version == 0)
+  {
+    file->magic = STATS_MAGIC;
+    file->version = STATS_VERSION;
+  }
+  else if (file->magic != STATS_MAGIC || file->version != STATS_VERSION)
+  {
+    syslog_write(
+	module_path, LOG_ERR, "%s/%s isn't a version %d stats file",
+	state_dir, STATS_FILE_NAME, STATS_VERSION);
+    goto unlock_exit;
+  }
+  hash = fnv1a(FNV1A_INIT, module_path, strlen(module_path));
+  if (hash == 0)
+    hash = 1;
+  for (i = 0; i < STATS_MODULE_COUNT; i += 1)
+  {
+    module = &file->modules[(hash + i) % STATS_MODULE_COUNT];
+    if (module->hash == 0)
+    {
+      snprintf(module->path, sizeof(module->path), "%s", module_path);
+      __atomic_store_n(&module->hash, hash, __ATOMIC_RELEASE);
+    }
+    if (module->hash == hash && strcmp(module->path, module_path) == 0)
+    {
+      result = module;
+      break;
+    }
+  }
+unlock_exit:
+  /*
+   * The mapping keeps the open file, and so the lock, alive after the
+   * close, so it must be dropped explicitly.
+   */
+  flock(fd, LOCK_UN);
+  close(fd);
+  if (result == 0)
+    munmap(file, sizeof(*file));
+  else
+    *stats_file = file;
+  return result;
+}
 
-  equals = strchr(entry, '=');
-  if (equals == 0)
-    return PyString_FromString(entry);
-  return PyString_FromStringAndSize(entry, equals - entry);
+static void stats_close(StatsFile* stats_file)
+{
+  if (stats_file != 0)
+    munmap(stats_file, sizeof(*stats_file));
 }
 
 /*
- * Return a python object for the value part.
+ * Add a sample to a histogram.
  */
-static PyObject* PamEnvIter_value_entry(const char* entry)
+static void stats_histogram_add(StatsHistogram* histogram, double seconds)
 {
-  const char*		equals;
+  unsigned long long	usec;
 
-  equals = strchr(entry, '=');
-  if (equals == 0)
-    return PyString_FromString("");
-  return PyString_FromString(equals + 1);
+  usec = seconds > 0 ? (unsigned long long)(seconds * 1e6) : 0;
+  __atomic_fetch_add(
+      &histogram->buckets[stats_latency_bucket(usec)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->sum_usec, usec, __ATOMIC_RELAXED);
 }
 
 /*
- * Return a python object entire item.
+ * The index of a handler in stats_handler_names, or STATS_HANDLER_COUNT
+ * if it isn't there.
  */
-static PyObject* PamEnvIter_item_entry(const char* entry)
+static size_t stats_handler_index(const char* handler_name)
 {
-  PyObject*		key = 0;
-  PyObject*		result = 0;
-  PyObject*		tuple = 0;
-  PyObject*		value = 0;
+  size_t		i;
 
-  key = PamEnvIter_key_entry(entry);
-  if (key == 0)
-    goto error_exit;
-  value = PamEnvIter_value_entry(entry);
-  if (key == 0)
-    goto error_exit;
-  tuple = PyTuple_New(2);
-  if (tuple == 0)
-    goto error_exit;
-  if (PyTuple_SetItem(tuple, 0, key) == -1)
-    goto error_exit;
-  key = 0;			/* was stolen */
-  if (PyTuple_SetItem(tuple, 1, value) == -1)
-    goto error_exit;
-  value = 0;			/* was stolen */
-  result = tuple;
-  tuple = 0;
-
-error_exit:
-  py_xdecref(key);
-  py_xdecref(tuple);
-  py_xdecref(value);
-  return result;
+  for (i = 0; i < STATS_HANDLER_COUNT; i += 1)
+  {
+    if (strcmp(handler_name, stats_handler_names[i]) == 0)
+      break;
+  }
+  return i;
 }
 
 /*
- * Create an iterator.
+ * Record a call to a Python handler.
  */
-static PyObject* PamEnv_iter(PyObject* self)
+static void stats_handler_call(
+    StatsModule* stats, const char* handler_name, int pam_result,
+    int exception, int timed_out, double seconds)
 {
-  PamEnvObject*		pamEnv = (PamEnvObject*)self;
-
-  return PamEnvIter_create(pamEnv, PamEnvIter_key_entry);
+  StatsHandler*		handler;
+  size_t		i;
+
+  if (stats == 0)
+    return;
+  i = stats_handler_index(handler_name);
+  if (i == STATS_HANDLER_COUNT)
+    return;
+  handler = &stats->handlers[i];
+  if (pam_result < 0 || pam_result >= STATS_RESULT_COUNT)
+    pam_result = STATS_RESULT_COUNT - 1;
+  __atomic_fetch_add(&handler->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&handler->results[pam_result], 1, __ATOMIC_RELAXED);
+  if (exception)
+    __atomic_fetch_add(&handler->exceptions, 1, __ATOMIC_RELAXED);
+  if (timed_out)
+    __atomic_fetch_add(&handler->timeouts, 1, __ATOMIC_RELAXED);
+  stats_histogram_add(&handler->latency, seconds);
 }
 
 /*
- * Get the value of a environment key.
+ * Circuit breakers, made by pamh.breaker(name).  They live in the
+ * module's slot in the stats file so every process using the module sees
+ * the same state, and pam_python_stat shows it.  A closed breaker lets
+ * calls through and counts failures in a row.  At the threshold it opens
+ * and refuses calls until the reset time has passed, then lets one trial
+ * call through each reset time until one succeeds and closes it.  All
+ * of it is atomic operations on the shared state, so checking a breaker
+ * never waits.
  */
-static const char* PamEnv_getkey(PyObject* key)
-{
-  const char*		result;
-
-  if (!PyString_Check(key))
-  {
-    PyErr_SetString(PyExc_TypeError, "PAM environment key must be a string");
-    return 0;
-  }
-  result = PyString_AS_STRING(key);
-  if (*result == '\0')
-  {
-    PyErr_SetString(
-        PyExc_ValueError,
-	"PAM environment key mustn't be 0 length");
-    return 0;
-  }
-  if (strchr(result, '=') != 0)
-  {
-    PyErr_SetString(PyExc_ValueError, "PAM environment key can't contain '='");
-    return 0;
-  }
-  return result;
-}
 
 /*
- * Return the length.
+ * Find the breaker called name in module, claiming a free one if it
+ * isn't there.  Returns 0 if they are all taken.  A slot is claimed by
+ * setting its hash to STATS_BREAKER_CLAIMED, and the real hash is only
+ * stored once the name is written, so nothing sees a half written name.
+ * A slot whose claimer died before then stays claimed and is skipped.
  */
-static Py_ssize_t PamEnv_mp_length(PyObject* self)
-{
-  PamEnvObject*		pamEnv = (PamEnvObject*)self;
-  char**		env;
-  int			length;
-
-  env = pam_getenvlist(pamEnv->pamHandle->pamh);
-  if (env == 0)
-    return 0;
-  for (length = 0; env[length] != 0; length += 1)
-    continue;
-  return length;
-}
+#define	BREAKER_SPIN		1000	/* Waits for a claimed slot's name */
 
-/*
- * Lookup a key returning its value.
- */
-static PyObject* PamEnv_mp_subscript(PyObject* self, PyObject* key)
+static StatsBreaker* breaker_find(StatsModule* module, const char* name)
 {
-  PamEnvObject*		pamEnv = (PamEnvObject*)self;
-  PyObject*		result = 0;
-  const char*		key_str;
-  const char*		value;
-
-  key_str = PamEnv_getkey(key);
-  if (key_str == 0)
-    goto error_exit;
-  value = pam_getenv(pamEnv->pamHandle->pamh, key_str);
-  if (value == 0)
+  StatsBreaker*		breaker;
+  unsigned long long	expected;
+  unsigned long long	hash;
+  int			spin;
+
+  hash = fnv1a(FNV1A_INIT, name, strlen(name));
+  if (hash == 0 || hash == STATS_BREAKER_CLAIMED)
+    hash = 1;
+  for (breaker = module->breakers; breaker < module->breakers + STATS_BREAKER_COUNT; breaker += 1)
   {
-    PyErr_SetString(PyExc_KeyError, key_str);
-    goto error_exit;
+    for (spin = 0; spin < BREAKER_SPIN; spin += 1)
+    {
+      expected = __atomic_load_n(&breaker->hash, __ATOMIC_ACQUIRE);
+      if (expected == 0 &&
+	  __atomic_compare_exchange_n(
+	      &breaker->hash, &expected, STATS_BREAKER_CLAIMED, 0,
+	      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      {
+	snprintf(breaker->name, sizeof(breaker->name), "%s", name);
+	__atomic_store_n(&breaker->hash, hash, __ATOMIC_RELEASE);
+	return breaker;
+      }
+      if (expected != 0 && expected != STATS_BREAKER_CLAIMED)
+	break;
+    }
+    if (expected == hash && strcmp(breaker->name, name) == 0)
+      return breaker;
   }
-  result = PyString_FromString(value);
-
-error_exit:
-  return result;
+  return 0;
 }
 
 /*
- * Assign a value to a key, or delete it.
+ * True if a call may go to the backend.
  */
-static int PamEnv_mp_assign(PyObject* self, PyObject* key, PyObject* value)
+static int breaker_allow(StatsBreaker* breaker, long long reset_ns)
 {
-  PamEnvObject*		pamEnv = (PamEnvObject*)self;
-  char*			value_str = 0;
-  int			result = -1;
-  const char*		key_str;
-  int			pam_result;
+  long long		now;
+  long long		retry_ns;
+  unsigned int		state;
 
-  key_str = PamEnv_getkey(key);
-  if (key_str == 0)
-    goto error_exit;
-  if (value == 0)
-    value_str = (char*)key_str;
-  else
-  {
-    if (!PyString_Check(value))
-    {
-      PyErr_SetString(
-          PyExc_TypeError, "PAM environment value must be a string");
-      goto error_exit;
-    }
-    value_str = malloc(PyString_Size(key) + 1 + PyString_Size(value) + 1);
-    if (value_str == 0)
-    {
-      PyErr_NoMemory();
-      goto error_exit;
-    }
-    strcat(strcat(strcpy(value_str, key_str), "="), PyString_AS_STRING(value));
-  }
-  pam_result = pam_putenv(pamEnv->pamHandle->pamh, value_str);
-  if (pam_result != PAM_SUCCESS) // PAM_BAD_ITEM in Linux = PAM_BUF_ERR,PAM_SYSTEM_ERR
+  state = __atomic_load_n(&breaker->state, __ATOMIC_ACQUIRE);
+  if (state == STATS_BREAKER_CLOSED)
+    return 1;
+  /*
+   * Whoever moves retry_ns on makes the trial call.  A retry_ns more
+   * than reset_ns away was set before a reboot restarted boottime_ns(),
+   * so it is due now.
+   */
+  now = boottime_ns();
+  retry_ns = __atomic_load_n(&breaker->retry_ns, __ATOMIC_RELAXED);
+  if ((now >= retry_ns || retry_ns - now > reset_ns) &&
+      __atomic_compare_exchange_n(
+	  &breaker->retry_ns, &retry_ns, now + reset_ns, 0,
+	  __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
   {
-    PyErr_SetString(PyExc_KeyError, key_str);
-    goto error_exit;
+    __atomic_compare_exchange_n(
+	&breaker->state, &state, STATS_BREAKER_HALF_OPEN, 0,
+	__ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    return 1;
   }
-  if (check_pam_result(pamEnv->pamHandle, pam_result) == -1)
-    goto error_exit;
-  value_str = 0;
-  result = 0;
-
-error_exit:
-  if (value_str != key_str && value_str != 0)
-    free(value_str);
-  return result;
+  __atomic_fetch_add(&breaker->rejected, 1, __ATOMIC_RELAXED);
+  return 0;
 }
 
-static PyMappingMethods PamEnv_as_mapping =
+static void breaker_success(StatsBreaker* breaker)
 {
-  PamEnv_mp_length,	/* mp_length */
-  PamEnv_mp_subscript,	/* mp_subscript */
-  PamEnv_mp_assign,	/* mp_ass_subscript */
-};
+  __atomic_store_n(&breaker->failures, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&breaker->state, STATS_BREAKER_CLOSED, __ATOMIC_RELEASE);
+}
 
 /*
- * Check if a key is in the environment.
+ * A call failed.  Open the breaker if that was one too many, or was the
+ * trial call.
  */
-static PyObject* PamEnv_has_key(
-    PyObject* self, PyObject* args, PyObject* kwds)
+static void breaker_failure(
+    StatsBreaker* breaker, unsigned int threshold, long long reset_ns)
 {
-  PamEnvObject*		pamEnv = (PamEnvObject*)self;
-  PyObject*		key;
-  PyObject*		result = 0;
-  const char*		key_str;
-  const char*		value_str;
-  static char*		kwlist[] = {"key", NULL};
-
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:has_key", kwlist, &key))
-    goto error_exit;
-  key_str = PamEnv_getkey(key);
-  if (key_str == 0)
-    goto error_exit;
-  value_str = pam_getenv(pamEnv->pamHandle->pamh, key_str);
-  result = value_str != 0 ? Py_True : Py_False;
-  Py_INCREF(result);
-
-error_exit:
-  return result;
+  unsigned int		state;
+
+  state = __atomic_load_n(&breaker->state, __ATOMIC_ACQUIRE);
+  if (state == STATS_BREAKER_OPEN)
+    return;
+  if (state == STATS_BREAKER_CLOSED &&
+      __atomic_add_fetch(&breaker->failures, 1, __ATOMIC_RELAXED) < threshold)
+    return;
+  __atomic_store_n(&breaker->retry_ns, boottime_ns() + reset_ns, __ATOMIC_RELAXED);
+  if (__atomic_exchange_n(&breaker->state, STATS_BREAKER_OPEN, __ATOMIC_ACQ_REL) != STATS_BREAKER_OPEN)
+    __atomic_fetch_add(&breaker->opened, 1, __ATOMIC_RELAXED);
 }
 
 /*
- * Lookup a key and return its value, throwing KeyError if the key
- * doesn't exist.
+ * pamh.cache, turned on by cache=N.  A fixed size hash table with N
+ * slots, kept in a file in the state directory named after the Python
+ * module, so every process using the module shares it.  A key can be in
+ * any of CACHE_PROBE slots from where it hashes to.  Each slot is a
+ * seqlock: a writer makes its sequence number odd while it changes the
+ * slot, and a reader copies the slot and tries again if the number was
+ * odd or changed meanwhile, so readers never take a lock.  A process that
+ * dies mid write leaves its slot odd, and that slot is skipped from then
+ * on.  A set that finds no free slot evicts the one expiring soonest.
+ * Expiry times are boottime_ns(), so the cache is emptied after a reboot.
+ * The version is in the file name, so processes still running an older
+ * pam_python after an upgrade keep a cache of their own.
  */
-static PyObject* PamEnv_getitem(
-    PyObject* self, PyObject* args, PyObject* kwds)
-{
-  PyObject*		result = 0;
-  PyObject*		key;
-  static char*		kwlist[] = {"key", NULL};
+#define	CACHE_VERSION		2
+#define	CACHE_FILE_PREFIX_(v)	"cache-" STATS_STRING(v) "-"
+#define	CACHE_FILE_PREFIX	CACHE_FILE_PREFIX_(CACHE_VERSION)
+#define	CACHE_MAGIC		0x70796361	/* "pyca" */
+#define	CACHE_PROBE		8	/* Slots a key may be in */
+#define	CACHE_DATA_SIZE		232	/* Bytes for key and value */
+#define	CACHE_SPIN		1000	/* Tries to get a consistent slot */
 
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:__getitem__", kwlist, &key))
-    goto error_exit;
-  result = PamEnv_mp_subscript(self, key);
+#define	CACHE_STR		1	/* Value was a str */
+#define	CACHE_BYTES		2	/* Value was bytes */
 
-error_exit:
-  return result;
-}
+typedef struct
+{
+  unsigned int		seq;		/* Odd while being written */
+  unsigned char		key_len;	/* Length of the key in data */
+  unsigned char		type;		/* CACHE_STR or CACHE_BYTES */
+  unsigned short	value_len;	/* Length of the value after it */
+  unsigned long long	hash;		/* Hash of the key, 0 if free */
+  long long		expires_ns;	/* boottime_ns() it expires */
+  char			data[CACHE_DATA_SIZE];	/* The key then the value */
+} CacheSlot;
+
+typedef struct
+{
+  unsigned int		magic;		/* CACHE_MAGIC */
+  unsigned int		version;	/* CACHE_VERSION */
+  unsigned int		slot_count;	/* A power of 2 */
+  unsigned int		unused;
+  long long		boot_time_ns;	/* boot_time_ns() when started */
+  CacheSlot		slots[];
+} CacheFile;
 
 /*
- * Lookup a key and return its value, returning None or a default if it
- * doesn't exist.
+ * Map module_path's cache, creating it with slot_count slots if it
+ * doesn't exist.  The size an existing file was created with wins.  If
+ * the state directory can't be used the cache is private to the process,
+ * which is logged.  Returns 0 if there is no memory for even that.
  */
-static PyObject* PamEnv_get(
-    PyObject* self, PyObject* args, PyObject* kwds)
+static CacheFile* cache_open(
+    const char* state_dir, const char* module_path, unsigned int slot_count,
+    size_t* size)
 {
-  int			err;
-  PamEnvObject*		pamEnv = (PamEnvObject*)self;
-  PyObject*		default_value = 0;
-  PyObject*		result = 0;
-  PyObject*		key;
-  const char*		key_str;
-  const char*		value_str;
-  static char*		kwlist[] = {"key", "default", NULL};
-
-  err = PyArg_ParseTupleAndKeywords(
-      args, kwds, "O|O:get", kwlist,
-      &key, &default_value);
-  if (!err)
-    goto error_exit;
-  key_str = PamEnv_getkey(key);
-  if (key_str == 0)
-    goto error_exit;
-  value_str = pam_getenv(pamEnv->pamHandle->pamh, key_str);
-  if (value_str != 0)
-    result = PyString_FromString(value_str);
-  else
+  int			fd;
+  CacheFile*		file;
+  unsigned long long	hash;
+  char			name[sizeof(CACHE_FILE_PREFIX) + 16];
+  struct stat		st;
+
+  while ((slot_count & (slot_count - 1)) != 0)
+    slot_count += slot_count & -slot_count;
+  if (slot_count < CACHE_PROBE)
+    slot_count = CACHE_PROBE;
+  *size = sizeof(*file) + slot_count * sizeof(*file->slots);
+  hash = fnv1a(FNV1A_INIT, module_path, strlen(module_path));
+  snprintf(name, sizeof(name), CACHE_FILE_PREFIX "%016llx", hash);
+  fd = state_file_open(state_dir, name, *size, 1);
+  file = MAP_FAILED;
+  if (fd != -1)
+    file = mmap(0, *size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (file != MAP_FAILED && file->magic == CACHE_MAGIC &&
+      file->version == CACHE_VERSION && file->slot_count > slot_count &&
+      (file->slot_count & (file->slot_count - 1)) == 0 &&
+      fstat(fd, &st) == 0 && (size_t)st.st_size >=
+	  sizeof(*file) + (size_t)file->slot_count * sizeof(*file->slots))
   {
-    result = default_value != 0 ? default_value : Py_None;
-    Py_INCREF(result);
+    /*
+     * A bigger cache made by someone else.  It is all in the file, or
+     * the mapping would fault past its end.
+     */
+    slot_count = file->slot_count;
+    munmap(file, *size);
+    *size = sizeof(*file) + slot_count * sizeof(*file->slots);
+    file = mmap(0, *size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (file == MAP_FAILED)
+  {
+    syslog_write(
+	module_path, LOG_ERR, "can't map %s/%s, pamh.cache isn't shared",
+	state_dir, name);
+    file = mmap(
+        0, *size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  }
+  /*
+   * The file is still locked, so only one process starts it afresh.
+   * After a reboot no process can still be using it.  If setting the
+   * clock makes it look like a reboot, a process using it may lose what
+   * it was writing, which for a cache is no loss.
+   */
+  if (file != MAP_FAILED &&
+      (file->magic != CACHE_MAGIC || file->version != CACHE_VERSION ||
+       file->slot_count == 0 ||
+       (file->slot_count & (file->slot_count - 1)) != 0 ||
+       sizeof(*file) + file->slot_count * sizeof(*file->slots) > *size ||
+       !boot_time_same(file->boot_time_ns)))
+  {
+    memset(file, '\0', *size);
+    file->magic = CACHE_MAGIC;
+    file->version = CACHE_VERSION;
+    file->slot_count = slot_count;
+    file->boot_time_ns = boot_time_ns();
+  }
+  if (fd != -1)
+  {
+    flock(fd, LOCK_UN);
+    close(fd);
   }
+  return file == MAP_FAILED ? 0 : file;
+}
 
-error_exit:
-  return result;
+/*
+ * The hash of a key.  0 marks a free slot so is never used.
+ */
+static unsigned long long cache_hash(const char* key, size_t key_len)
+{
+  unsigned long long	hash;
+
+  hash = fnv1a(FNV1A_INIT, key, key_len);
+  return hash == 0 ? 1 : hash;
 }
 
 /*
- * Return all objects in the environment as a sequence.
+ * Copy a slot without locking it.  Returns -1 if no consistent copy
+ * could be had.
  */
-static PyObject* PamEnv_as_sequence(
-    PyObject* self, PyObject* (*get_entry)(const char* entry))
+static int cache_slot_read(CacheSlot* slot, CacheSlot* copy)
 {
-  PamEnvObject*		pamEnv = (PamEnvObject*)self;
-  PyObject*		list = 0;
-  PyObject*		result = 0;
-  PyObject*		entry = 0;
-  char**		env;
-  int			i;
-  int			length;
+  int			spin;
+  unsigned int		seq;
 
-  env = pam_getenvlist(pamEnv->pamHandle->pamh);
-  if (env == 0)
-    length = 0;
-  else
+  for (spin = 0; spin < CACHE_SPIN; spin += 1)
   {
-    for (length = 0; env[length] != 0; length += 1)
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if ((seq & 1) != 0)
       continue;
+    memcpy(copy, slot, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+      return 0;
   }
-  list = PyList_New(length);
-  if (list == 0)
-    goto error_exit;
-  for (i = 0; env[i] != 0; i += 1)
-  {
-    entry = get_entry(env[i]);
-    if (entry == 0)
-      goto error_exit;
-    if (PyList_SetItem(list, i, entry) == -1)
-      goto error_exit;
-    entry = 0;			/* was stolen */
-  }
-  result = list;
-  list = 0;
-
-error_exit:
-  py_xdecref(list);
-  py_xdecref(entry);
-  return result;
+  return -1;
 }
 
 /*
- * Return all (key, value) pairs.
+ * Make a slot's sequence number odd so we may change it.  Returns the
+ * even number to hand to cache_slot_unlock(), or -1 if someone else is
+ * writing it.
  */
-static PyObject* PamEnv_items(
-    PyObject* self, PyObject* args, PyObject* kwds)
+static long long cache_slot_lock(CacheSlot* slot)
 {
-  static char*		kwlist[] = {NULL};
+  unsigned int		seq;
+
+  seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+  if ((seq & 1) != 0 ||
+      !__atomic_compare_exchange_n(
+	  &slot->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return -1;
+  return seq;
+}
 
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, ":items", kwlist))
-    return 0;
-  return PamEnv_as_sequence(self, PamEnvIter_item_entry);
+static void cache_slot_unlock(CacheSlot* slot, long long seq)
+{
+  __atomic_store_n(&slot->seq, (unsigned int)seq + 2, __ATOMIC_RELEASE);
 }
 
 /*
- * An iterator for all (key, value) pairs.
+ * True if copy, a consistent copy of a slot, holds the key and hasn't
+ * expired.  A now of 0 ignores expiry.
  */
-static PyObject* PamEnv_iteritems(
-    PyObject* self, PyObject* args, PyObject* kwds)
+static int cache_slot_holds(
+    const CacheSlot* copy, unsigned long long hash,
+    const char* key, size_t key_len, long long now)
 {
-  PamEnvObject*		pamEnv = (PamEnvObject*)self;
-  static char*		kwlist[] = {NULL};
-
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, ":iteritems", kwlist))
-    return 0;
-  return PamEnvIter_create(pamEnv, PamEnvIter_item_entry);
+  return
+      copy->hash == hash && copy->key_len == key_len &&
+      memcmp(copy->data, key, key_len) == 0 &&
+      (now == 0 || copy->expires_ns > now);
 }
 
 /*
- * An iterator for the keys.
+ * Look up key.  Returns 0 and fills in *copy if it is there.
  */
-static PyObject* PamEnv_iterkeys(
-    PyObject* self, PyObject* args, PyObject* kwds)
+static int cache_get(
+    CacheFile* file, const char* key, size_t key_len, CacheSlot* copy)
 {
-  PamEnvObject*		pamEnv = (PamEnvObject*)self;
-  static char*		kwlist[] = {NULL};
+  unsigned long long	hash = cache_hash(key, key_len);
+  size_t		i;
+  unsigned int		mask = file->slot_count - 1;
+  long long		now = boottime_ns();
+  CacheSlot*		slot;
 
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, ":iterkeys", kwlist))
-    return 0;
-  return PamEnvIter_create(pamEnv, PamEnvIter_key_entry);
+  for (i = 0; i < CACHE_PROBE; i += 1)
+  {
+    slot = &file->slots[(hash + i) & mask];
+    if (__atomic_load_n(&slot->hash, __ATOMIC_RELAXED) != hash)
+      continue;
+    if (cache_slot_read(slot, copy) == 0 &&
+        cache_slot_holds(copy, hash, key, key_len, now))
+      return 0;
+  }
+  return -1;
 }
 
 /*
- * An iterator for the values.
+ * Remove key from every slot it is in, except keep.  A slot someone else
+ * is writing is tried again until they are done.  Returns -1 if they
+ * never were, so the key may still be there.
  */
-static PyObject* PamEnv_itervalues(
-    PyObject* self, PyObject* args, PyObject* kwds)
+static int cache_delete(
+    CacheFile* file, const char* key, size_t key_len, CacheSlot* keep)
 {
-  PamEnvObject*		pamEnv = (PamEnvObject*)self;
-  static char*		kwlist[] = {NULL};
-
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, ":itervalues", kwlist))
-    return 0;
-  return PamEnvIter_create(pamEnv, PamEnvIter_value_entry);
+  CacheSlot		copy;
+  unsigned long long	hash = cache_hash(key, key_len);
+  size_t		i;
+  unsigned int		mask = file->slot_count - 1;
+  int			result = 0;
+  long long		seq;
+  CacheSlot*		slot;
+  int			spin;
+
+  for (i = 0; i < CACHE_PROBE; i += 1)
+  {
+    slot = &file->slots[(hash + i) & mask];
+    for (spin = 0; spin < CACHE_SPIN; spin += 1)
+    {
+      if (slot == keep ||
+	  __atomic_load_n(&slot->hash, __ATOMIC_RELAXED) != hash)
+	break;
+      seq = cache_slot_lock(slot);
+      if (seq == -1)
+	continue;
+      memcpy(&copy, slot, sizeof(copy));
+      if (cache_slot_holds(&copy, hash, key, key_len, 0))
+	__atomic_store_n(&slot->hash, 0, __ATOMIC_RELAXED);
+      cache_slot_unlock(slot, seq);
+      break;
+    }
+    if (spin == CACHE_SPIN)
+      result = -1;
+  }
+  return result;
 }
 
 /*
- * Return all keys.
+ * Store value under key for ttl_ns.  Prefers the slot that already holds
+ * the key, then a free or expired one, then the one expiring soonest.
+ * Returns -1 if every slot it could use was being written.
  */
-static PyObject* PamEnv_keys(
-    PyObject* self, PyObject* args, PyObject* kwds)
+static int cache_set(
+    CacheFile* file, const char* key, size_t key_len,
+    int type, const char* value, size_t value_len, long long ttl_ns)
 {
-  static char*		kwlist[] = {NULL};
-
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, ":keys", kwlist))
-    return 0;
-  return PamEnv_as_sequence(self, PamEnvIter_key_entry);
+  CacheSlot		copy;
+  unsigned long long	hash = cache_hash(key, key_len);
+  size_t		i;
+  unsigned int		mask = file->slot_count - 1;
+  long long		now = boottime_ns();
+  int			rank;
+  long long		seq = -1;
+  CacheSlot*		slot;
+  int			victim_rank = -1;
+  CacheSlot*		victim = 0;
+  long long		victim_expires = 0;
+
+  for (i = 0; i < CACHE_PROBE; i += 1)
+  {
+    slot = &file->slots[(hash + i) & mask];
+    if (cache_slot_read(slot, &copy) == -1)
+      continue;
+    if (cache_slot_holds(&copy, hash, key, key_len, 0))
+      rank = 3;
+    else if (copy.hash == 0 || copy.expires_ns <= now)
+      rank = 2;
+    else
+      rank = 1;
+    if (rank > victim_rank ||
+        (rank == 1 && victim_rank == 1 && copy.expires_ns < victim_expires))
+    {
+      victim = slot;
+      victim_rank = rank;
+      victim_expires = copy.expires_ns;
+    }
+  }
+  if (victim != 0)
+    seq = cache_slot_lock(victim);
+  if (seq == -1)
+    return -1;
+  __atomic_store_n(&victim->hash, hash, __ATOMIC_RELAXED);
+  victim->key_len = key_len;
+  victim->type = type;
+  victim->value_len = value_len;
+  victim->expires_ns = now + ttl_ns;
+  memcpy(victim->data, key, key_len);
+  memcpy(victim->data + key_len, value, value_len);
+  cache_slot_unlock(victim, seq);
+  /*
+   * Another process setting the same key at the same time may have
+   * picked another slot.  The last one in wins.
+   */
+  cache_delete(file, key, key_len, victim);
+  return 0;
 }
 
 /*
- * Return all (key, value) pairs.
+ * pamh.failures, turned on by failures=N.  Counts of recent failures,
+ * for brute force protection, kept the way pamh.cache is: a table of N
+ * slots in a file named after the Python module that every process using
+ * it maps.  A slot belongs to the hash of a key, eg a user or rhost, and
+ * counts failures over a sliding window as FAILURES_BUCKETS buckets, each
+ * covering 1/FAILURES_BUCKETS of it.  A bucket is one word, the period it
+ * counts for and the count, updated by compare and swap, so counting a
+ * failure is a few atomic operations.  When a key finds no slot the one
+ * with the fewest failures is taken.
+ *
+ * The hash is keyed with a random key made with the file, so no one can
+ * pick keys that share another key's slot.  Times are boottime_ns() plus
+ * the wall clock time of the boot, so setting the clock doesn't move
+ * them, yet after a reboot they carry on from where they were and the
+ * file can be kept on disk, where the kernel writes it back now and then.
+ * The window is in the file's name, so counts kept over different
+ * windows are separate.
  */
-static PyObject* PamEnv_values(
-    PyObject* self, PyObject* args, PyObject* kwds)
-{
-  static char*		kwlist[] = {NULL};
+#define	FAILURES_VERSION	2
+#define	FAILURES_FILE_PREFIX_(v) "failures-" STATS_STRING(v) "-"
+#define	FAILURES_FILE_PREFIX	FAILURES_FILE_PREFIX_(FAILURES_VERSION)
+#define	FAILURES_MAGIC		0x70796661	/* "pyfa" */
+#define	FAILURES_BUCKETS	16
+#define	FAILURES_PROBE		8	/* Slots a key may be in */
+#define	FAILURES_COUNT_BITS	24	/* Low bits of a bucket: the count */
+#define	FAILURES_COUNT_MAX	((1ULL << FAILURES_COUNT_BITS) - 1)
+#define	FAILURES_KEY_SIZE	16
 
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, ":values", kwlist))
-    return 0;
-  return PamEnv_as_sequence(self, PamEnvIter_value_entry);
-}
+typedef struct
+{
+  unsigned long long	hash;		/* Hash of the key, 0 if free */
+  unsigned long long	buckets[FAILURES_BUCKETS];/* Period << bits | count */
+} FailuresSlot;
 
-static PyMethodDef PamEnv_Methods[] =
+typedef struct
 {
-  {"__contains__",  PyCFunctionKwds_cast PamEnv_has_key,METH_VARARGS|METH_KEYWORDS, 0},
-  {"__getitem__",   PyCFunctionKwds_cast PamEnv_getitem,METH_VARARGS|METH_KEYWORDS, 0},
-  {"get",	    PyCFunctionKwds_cast PamEnv_get,	METH_VARARGS|METH_KEYWORDS, 0},
-  {"has_key",	    PyCFunctionKwds_cast PamEnv_has_key,METH_VARARGS|METH_KEYWORDS, 0},
-  {"items",	    PyCFunctionKwds_cast PamEnv_items,	METH_VARARGS|METH_KEYWORDS, 0},
-  {"iteritems",	    PyCFunctionKwds_cast PamEnv_iteritems,METH_VARARGS|METH_KEYWORDS, 0},
-  {"iterkeys",	    PyCFunctionKwds_cast PamEnv_iterkeys,METH_VARARGS|METH_KEYWORDS, 0},
-  {"itervalues",    PyCFunctionKwds_cast PamEnv_itervalues,METH_VARARGS|METH_KEYWORDS, 0},
-  {"keys",	    PyCFunctionKwds_cast PamEnv_keys,	METH_VARARGS|METH_KEYWORDS, 0},
-  {"values",	    PyCFunctionKwds_cast PamEnv_values,	METH_VARARGS|METH_KEYWORDS, 0},
-  {0,0,0,0}        	/* Sentinel */
-};
+  unsigned int		magic;		/* FAILURES_MAGIC */
+  unsigned int		version;	/* FAILURES_VERSION */
+  unsigned int		slot_count;	/* A power of 2 */
+  unsigned int		window;		/* Seconds failures are counted for */
+  long long		boot_time_ns;	/* boot_time_ns() times are from */
+  unsigned char		key[FAILURES_KEY_SIZE];	/* For siphash24() */
+  FailuresSlot		slots[];
+} FailuresFile;
 
 /*
- * Python Getter's for the constants.
+ * Map module_path's failure counts over window seconds in directory,
+ * creating them with slot_count slots if they don't exist.  Whoever
+ * creates the file decides how many slots it has.  If the file can't be
+ * used that is logged, *shared is set to 0 and the counts are private to
+ * the process.  Returns 0 if even that fails.
  */
-#define	DECLARE_CONSTANT_GET_VALUE(x, v) \
-  static PyObject* PamHandle_Constant_ ## x(PyObject* object, void* closure) { \
-    object = object; \
-    closure = closure; \
-    return PyLong_FromLong(v); \
+static FailuresFile* failures_open(
+    const char* directory, const char* module_path,
+    unsigned int slot_count, unsigned int window, size_t* size, int* shared)
+{
+  int			fd;
+  FailuresFile*		file;
+  unsigned long long	hash;
+  unsigned char		key[FAILURES_KEY_SIZE];
+  char			name[sizeof(FAILURES_FILE_PREFIX) + 16 + 1 + 10];
+  struct stat		st;
+
+  while ((slot_count & (slot_count - 1)) != 0)
+    slot_count += slot_count & -slot_count;
+  if (slot_count < FAILURES_PROBE)
+    slot_count = FAILURES_PROBE;
+  if (window == 0)
+    window = 1;
+  *size = sizeof(*file) + slot_count * sizeof(*file->slots);
+  *shared = 1;
+  hash = fnv1a(FNV1A_INIT, module_path, strlen(module_path));
+  snprintf(
+      name, sizeof(name), FAILURES_FILE_PREFIX "%016llx-%u", hash, window);
+  fd = state_file_open(directory, name, *size, 1);
+  file = MAP_FAILED;
+  if (fd != -1)
+    file = mmap(0, *size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (file != MAP_FAILED && file->magic == FAILURES_MAGIC &&
+      file->version == FAILURES_VERSION && file->slot_count > slot_count &&
+      (file->slot_count & (file->slot_count - 1)) == 0 &&
+      fstat(fd, &st) == 0 && (size_t)st.st_size >=
+	  sizeof(*file) + (size_t)file->slot_count * sizeof(*file->slots))
+  {
+    slot_count = file->slot_count;
+    munmap(file, *size);
+    *size = sizeof(*file) + slot_count * sizeof(*file->slots);
+    file = mmap(0, *size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (file == MAP_FAILED)
+  {
+    syslog_write(
+	module_path, LOG_ERR,
+	"can't map %s/%s, pamh.failures counts for this process only",
+	directory, name);
+    *shared = 0;
+    file = mmap(
+        0, *size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  }
+  if (file != MAP_FAILED &&
+      (file->magic != FAILURES_MAGIC || file->version != FAILURES_VERSION ||
+       file->slot_count == 0 ||
+       (file->slot_count & (file->slot_count - 1)) != 0 ||
+       file->window != window ||
+       sizeof(*file) + file->slot_count * sizeof(*file->slots) > *size))
+  {
+    if (getrandom(key, sizeof(key), 0) != sizeof(key))
+    {
+      munmap(file, *size);
+      file = MAP_FAILED;
+      goto error_exit;
+    }
+    memset(file, '\0', *size);
+    file->magic = FAILURES_MAGIC;
+    file->version = FAILURES_VERSION;
+    file->slot_count = slot_count;
+    file->window = window;
+    file->boot_time_ns = boot_time_ns();
+    memcpy(file->key, key, sizeof(key));
   }
+  /*
+   * After a reboot boottime_ns() starts again, so times carry on from the
+   * wall clock time of this boot.
+   */
+  if (file != MAP_FAILED && !boot_time_same(file->boot_time_ns))
+    __atomic_store_n(&file->boot_time_ns, boot_time_ns(), __ATOMIC_RELAXED);
 
-#define	DECLARE_CONSTANT_GET(x)	\
-  static PyObject* PamHandle_Constant_ ## x(PyObject* object, void* closure) { \
-    object = object; \
-    closure = closure; \
-    return PyLong_FromLong(x); \
+error_exit:
+  if (fd != -1)
+  {
+    flock(fd, LOCK_UN);
+    close(fd);
   }
+  return file == MAP_FAILED ? 0 : file;
+}
 
-#ifdef	HAVE_PAM_FAIL_DELAY
-DECLARE_CONSTANT_GET_VALUE(HAVE_PAM_FAIL_DELAY, 1)
-#else
-DECLARE_CONSTANT_GET_VALUE(HAVE_PAM_FAIL_DELAY, 0)
-#endif
-DECLARE_CONSTANT_GET(PAM_ABORT)
-DECLARE_CONSTANT_GET(PAM_ACCT_EXPIRED)
-DECLARE_CONSTANT_GET(PAM_AUTH_ERR)
-DECLARE_CONSTANT_GET(PAM_AUTHINFO_UNAVAIL)
-DECLARE_CONSTANT_GET(PAM_AUTHTOK)
-DECLARE_CONSTANT_GET(PAM_AUTHTOK_DISABLE_AGING)
-DECLARE_CONSTANT_GET(PAM_AUTHTOK_ERR)
-DECLARE_CONSTANT_GET(PAM_AUTHTOK_EXPIRED)
-DECLARE_CONSTANT_GET(PAM_AUTHTOK_LOCK_BUSY)
-#ifdef	PAM_AUTHTOK_RECOVERY_ERR
-DECLARE_CONSTANT_GET(PAM_AUTHTOK_RECOVERY_ERR)
-#endif
-#ifdef	PAM_AUTHTOK_RECOVER_ERR
-DECLARE_CONSTANT_GET(PAM_AUTHTOK_RECOVER_ERR)
-#endif
-#ifdef	PAM_AUTHTOK_TYPE
-DECLARE_CONSTANT_GET(PAM_AUTHTOK_TYPE)
-#endif
-#ifdef PAM_BAD_ITEM
-DECLARE_CONSTANT_GET(PAM_BAD_ITEM)
-#endif
-#ifdef PAM_BINARY_PROMPT
-DECLARE_CONSTANT_GET(PAM_BINARY_PROMPT)
-#endif
-DECLARE_CONSTANT_GET(PAM_BUF_ERR)
-DECLARE_CONSTANT_GET(PAM_CHANGE_EXPIRED_AUTHTOK)
-DECLARE_CONSTANT_GET(PAM_CONV)
-#ifdef PAM_CONV_AGAIN
-DECLARE_CONSTANT_GET(PAM_CONV_AGAIN)
-#endif
-DECLARE_CONSTANT_GET(PAM_CONV_ERR)
-DECLARE_CONSTANT_GET(PAM_CRED_ERR)
-DECLARE_CONSTANT_GET(PAM_CRED_EXPIRED)
-DECLARE_CONSTANT_GET(PAM_CRED_INSUFFICIENT)
-DECLARE_CONSTANT_GET(PAM_CRED_UNAVAIL)
-#ifdef PAM_DATA_REPLACE
-DECLARE_CONSTANT_GET(PAM_DATA_REPLACE)
-#endif
-#ifdef PAM_DATA_SILENT
-DECLARE_CONSTANT_GET(PAM_DATA_SILENT)
-#endif
-DECLARE_CONSTANT_GET(PAM_DELETE_CRED)
-DECLARE_CONSTANT_GET(PAM_DISALLOW_NULL_AUTHTOK)
-DECLARE_CONSTANT_GET(PAM_ERROR_MSG)
-DECLARE_CONSTANT_GET(PAM_ESTABLISH_CRED)
-#ifdef PAM_FAIL_DELAY
-DECLARE_CONSTANT_GET(PAM_FAIL_DELAY)
-#endif
-DECLARE_CONSTANT_GET(PAM_IGNORE)
-#ifdef PAM_INCOMPLETE
-DECLARE_CONSTANT_GET(PAM_INCOMPLETE)
-#endif
-DECLARE_CONSTANT_GET(PAM_MAX_MSG_SIZE)
-DECLARE_CONSTANT_GET(PAM_MAX_NUM_MSG)
-DECLARE_CONSTANT_GET(PAM_MAX_RESP_SIZE)
-DECLARE_CONSTANT_GET(PAM_MAXTRIES)
-DECLARE_CONSTANT_GET(PAM_MODULE_UNKNOWN)
-DECLARE_CONSTANT_GET(PAM_NEW_AUTHTOK_REQD)
-DECLARE_CONSTANT_GET(PAM_NO_MODULE_DATA)
-DECLARE_CONSTANT_GET(PAM_OLDAUTHTOK)
-DECLARE_CONSTANT_GET(PAM_OPEN_ERR)
-DECLARE_CONSTANT_GET(PAM_PERM_DENIED)
-DECLARE_CONSTANT_GET(PAM_PRELIM_CHECK)
-DECLARE_CONSTANT_GET(PAM_PROMPT_ECHO_OFF)
-DECLARE_CONSTANT_GET(PAM_PROMPT_ECHO_ON)
-#ifdef PAM_RADIO_TYPE
-DECLARE_CONSTANT_GET(PAM_RADIO_TYPE)
-#endif
-DECLARE_CONSTANT_GET(PAM_REFRESH_CRED)
-DECLARE_CONSTANT_GET(PAM_REINITIALIZE_CRED)
-DECLARE_CONSTANT_GET(_PAM_RETURN_VALUES)
-DECLARE_CONSTANT_GET(PAM_RHOST)
-DECLARE_CONSTANT_GET(PAM_RUSER)
-DECLARE_CONSTANT_GET(PAM_SERVICE)
-DECLARE_CONSTANT_GET(PAM_SERVICE_ERR)
-DECLARE_CONSTANT_GET(PAM_SESSION_ERR)
-DECLARE_CONSTANT_GET(PAM_SILENT)
-DECLARE_CONSTANT_GET(PAM_SUCCESS)
-DECLARE_CONSTANT_GET(PAM_SYMBOL_ERR)
-DECLARE_CONSTANT_GET(PAM_SYSTEM_ERR)
-DECLARE_CONSTANT_GET(PAM_TEXT_INFO)
-DECLARE_CONSTANT_GET(PAM_TRY_AGAIN)
-DECLARE_CONSTANT_GET(PAM_TTY)
-DECLARE_CONSTANT_GET(PAM_UPDATE_AUTHTOK)
-DECLARE_CONSTANT_GET(PAM_USER)
-DECLARE_CONSTANT_GET(PAM_USER_PROMPT)
-DECLARE_CONSTANT_GET(PAM_USER_UNKNOWN)
-#ifdef	PAM_XAUTHDATA
-DECLARE_CONSTANT_GET(PAM_XAUTHDATA)
-#endif
-#ifdef	PAM_XDISPLAY
-DECLARE_CONSTANT_GET(PAM_XDISPLAY)
-#endif
+/*
+ * The period a bucket counts for now.  Each lasts window / buckets.
+ */
+static unsigned long long failures_period(const FailuresFile* file)
+{
+  long long		now;
 
-#define	CONSTANT_GETSET(x) {#x,    PamHandle_Constant_ ## x, 0, 0, 0}
+  now = boottime_ns() + __atomic_load_n(&file->boot_time_ns, __ATOMIC_RELAXED);
+  return now / (file->window * 1000000000LL / FAILURES_BUCKETS);
+}
 
-#define	MAKE_GETSET_ITEM(t) \
-  static PyObject* PamHandle_get_##t(PyObject* self, void* closure) \
-  { \
-    closure = closure; \
-    return PamHandle_get_item(self, PAM_##t); \
-  } \
-  static int PamHandle_set_##t(PyObject* self, PyObject* pyValue, void* closure) \
-  { \
-    closure = closure; \
-    return PamHandle_set_item(self, PAM_##t, "PAM_" #t, pyValue); \
-  }
+/*
+ * The failures a slot has counted in the window.
+ */
+static unsigned long long failures_slot_count(
+    const FailuresSlot* slot, unsigned long long period)
+{
+  unsigned long long	bucket;
+  unsigned long long	count = 0;
+  size_t		i;
 
-MAKE_GETSET_ITEM(AUTHTOK)
-#ifdef	PAM_AUTHTOK_TYPE
-MAKE_GETSET_ITEM(AUTHTOK_TYPE)
-#endif
-MAKE_GETSET_ITEM(OLDAUTHTOK)
-MAKE_GETSET_ITEM(RHOST)
-MAKE_GETSET_ITEM(RUSER)
-MAKE_GETSET_ITEM(SERVICE)
-MAKE_GETSET_ITEM(TTY)
-MAKE_GETSET_ITEM(USER)
-MAKE_GETSET_ITEM(USER_PROMPT)
-#ifdef	PAM_XDISPLAY
-MAKE_GETSET_ITEM(XDISPLAY)
-#endif
+  for (i = 0; i < FAILURES_BUCKETS; i += 1)
+  {
+    bucket = __atomic_load_n(&slot->buckets[i], __ATOMIC_RELAXED);
+    if (period - (bucket >> FAILURES_COUNT_BITS) < FAILURES_BUCKETS)
+      count += bucket & FAILURES_COUNT_MAX;
+  }
+  return count;
+}
 
-#ifdef	PAM_XAUTHDATA
 /*
- * The PAM_XAUTHDATA item doesn't take strings like the rest of them.
- * It wants a pam_xauth_data structure.
+ * Find key's slot.  If it has none and create is true take the first free
+ * one, or failing that the one with the fewest failures.
  */
-static PyObject* PamHandle_get_XAUTHDATA(PyObject* self, void* closure)
+static FailuresSlot* failures_slot(
+    FailuresFile* file, const char* key, size_t key_len, int create)
 {
-  PamHandleObject*	pamHandle = (PamHandleObject*)self;
-  PyObject*		newargs = 0;
-  PyObject*		result = 0;
-  int			pam_result;
-  struct pam_xauth_data* xauth_data = 0;
-
-  closure = closure;
-  pam_result = pam_get_item(
-      pamHandle->pamh, PAM_XAUTHDATA, (const void**)&xauth_data);
-  if (check_pam_result(pamHandle, pam_result) == -1)
-    goto error_exit;
-  if (xauth_data == 0)
+  unsigned long long	count;
+  unsigned long long	expected;
+  FailuresSlot*		free_slot = 0;
+  unsigned long long	hash;
+  size_t		i;
+  unsigned int		mask = file->slot_count - 1;
+  unsigned long long	period = failures_period(file);
+  FailuresSlot*		slot;
+  FailuresSlot*		victim = 0;
+  unsigned long long	victim_count = ULLONG_MAX;
+  unsigned long long	victim_hash = 0;
+
+  hash = siphash24(file->key, key, key_len);
+  if (hash == 0)
+    hash = 1;
+  for (i = 0; i < FAILURES_PROBE; i += 1)
   {
-    result = Py_None;
-    Py_INCREF(result);
+    slot = &file->slots[(hash + i) & mask];
+    expected = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+    if (expected == hash)
+      return slot;
+    if (expected == 0)
+    {
+      if (free_slot == 0)
+	free_slot = slot;
+      continue;
+    }
+    count = failures_slot_count(slot, period);
+    if (count < victim_count)
+    {
+      victim = slot;
+      victim_count = count;
+      victim_hash = expected;
+    }
   }
-  else
+  if (!create)
+    return 0;
+  if (free_slot != 0)
   {
-    newargs = Py_BuildValue(
-        "s#s#",
-	xauth_data->name, xauth_data->namelen,
-	xauth_data->data, xauth_data->datalen);
-    if (newargs == 0)
-      goto error_exit;
-    result = pamHandle->xauthdata->tp_new(pamHandle->xauthdata, newargs, 0);
-    if (result == 0)
-      goto error_exit;
+    victim = free_slot;
+    victim_hash = 0;
   }
-
-error_exit:
-  py_xdecref(newargs);
-  return result;
+  /*
+   * Someone else may have claimed it first, maybe for the same key.
+   */
+  expected = victim_hash;
+  if (!__atomic_compare_exchange_n(
+      &victim->hash, &expected, hash, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return expected == hash ? victim : 0;
+  if (victim_hash != 0)
+  {
+    for (i = 0; i < FAILURES_BUCKETS; i += 1)
+      __atomic_store_n(&victim->buckets[i], 0, __ATOMIC_RELAXED);
+  }
+  return victim;
 }
 
-static int PamHandle_set_XAUTHDATA(
-    PyObject* self, PyObject* pyValue, void* closure)
+/*
+ * Count a failure for key.  Returns the failures in the window,
+ * including this one.
+ */
+static unsigned long long failures_add(
+    FailuresFile* file, const char* key, size_t key_len)
 {
-  PamHandleObject*	pamHandle = (PamHandleObject*)self;
-  PyObject*		name = 0;
-  PyObject*		data = 0;
-  int			result = -1;
-  const char*		data_str;
-  const char*		name_str;
-  int			pam_result;
-  struct pam_xauth_data	xauth_data;
+  unsigned long long	bucket;
+  unsigned long long*	bucketp;
+  unsigned long long	period = failures_period(file);
+  unsigned long long	next;
+  FailuresSlot*		slot;
+
+  slot = failures_slot(file, key, key_len, 1);
+  if (slot == 0)
+    return 1;
+  bucketp = &slot->buckets[period % FAILURES_BUCKETS];
+  bucket = __atomic_load_n(bucketp, __ATOMIC_RELAXED);
+  do
+  {
+    if ((bucket >> FAILURES_COUNT_BITS) != period)
+      next = (period << FAILURES_COUNT_BITS) | 1;
+    else if ((bucket & FAILURES_COUNT_MAX) == FAILURES_COUNT_MAX)
+      next = bucket;
+    else
+      next = bucket + 1;
+  } while (!__atomic_compare_exchange_n(
+      bucketp, &bucket, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return failures_slot_count(slot, period);
+}
 
-  closure = closure;
-  xauth_data.name = 0;
-  xauth_data.data = 0;
+/*
+ * The failures counted for key in the window.
+ */
+static unsigned long long failures_get(
+    FailuresFile* file, const char* key, size_t key_len)
+{
+  FailuresSlot*		slot;
+
+  slot = failures_slot(file, key, key_len, 0);
+  return slot == 0 ? 0 : failures_slot_count(slot, failures_period(file));
+}
+
+/*
+ * Forget key's failures.  The slot is kept, as it will likely be back.
+ */
+static void failures_reset(FailuresFile* file, const char* key, size_t key_len)
+{
+  size_t		i;
+  FailuresSlot*		slot;
+
+  slot = failures_slot(file, key, key_len, 0);
+  if (slot == 0)
+    return;
+  for (i = 0; i < FAILURES_BUCKETS; i += 1)
+    __atomic_store_n(&slot->buckets[i], 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Memory accounting, turned on by memstats=N.  The malloc heap, the
+ * resident set and Python's allocator are sampled before and after a
+ * handle is created, around each handler call, and after the handle is
+ * destroyed, and the growth between them is logged.  Python is
+ * finalised when the last handle goes, so a leak that survives that
+ * only shows as a process that grows every transaction.  The last
+ * sample of each transaction is kept in a file in the state directory
+ * with one slot per process, and a warning is logged when a process has
+ * grown N transactions in a row.
+ */
+#define	MEMSTATS_FILE_NAME	"memstats"
+#define	MEMSTATS_PROCESS_COUNT	64
+
+typedef struct
+{
+  pid_t			pid;		/* 0 if the slot is unused */
+  unsigned long long	started;	/* Process start time, for pid reuse */
+  double		updated;	/* realtime of the last update */
+  unsigned long		transactions;	/* Handles destroyed */
+  unsigned long		growing;	/* Consecutive ones that grew */
+  MemSample		before;		/* Before it started growing */
+  MemSample		last;		/* After the last one */
+} MemProcess;
+
+/*
+ * Read a file in /proc.  stdio isn't used because it allocates memory,
+ * which would disturb what is being measured.
+ */
+static ssize_t memstats_read_proc(const char* path, char* buf, size_t size)
+{
+  int			fd;
+  ssize_t		len;
+
+  fd = open(path, O_RDONLY|O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  len = read(fd, buf, size - 1);
+  close(fd);
+  if (len < 0)
+    return -1;
+  buf[len] = '\0';
+  return len;
+}
+
+/*
+ * Call a method that returns a number, or a tuple starting with one.
+ */
+static long long memstats_python_number(PyObject* object, const char* method)
+{
+  PyObject*		item;
+  long long		number = MEMSTATS_UNKNOWN;
+  PyObject*		result;
+
+  result = PyObject_CallMethod(object, (char*)method, 0);
+  if (result == 0)
+    goto error_exit;
+  item = result;
+  if (PyTuple_Check(result) && PyTuple_GET_SIZE(result) > 0)
+    item = PyTuple_GET_ITEM(result, 0);
+  number = PyLong_AsLongLong(item);
+  if (number == -1 && PyErr_Occurred())
+    number = MEMSTATS_UNKNOWN;
+
+error_exit:
+  py_xdecref(result);
+  PyErr_Clear();
+  return number;
+}
+
+/*
+ * Take a sample.  Python is only asked if python is true, in which case
+ * the caller must hold the GIL.
+ */
+static void memstats_sample(MemSample* sample, int python)
+{
+  char			buf[128];
+#if defined(HAVE_MALLINFO2)
+  struct mallinfo2	info;
+#elif defined(HAVE_MALLINFO)
+  struct mallinfo	info;
+#endif
+  PyObject*		module;
+  PyObject*		ptraceback;
+  PyObject*		ptype;
+  PyObject*		pvalue;
+  unsigned long		resident;
+
+  sample->heap = MEMSTATS_UNKNOWN;
+  sample->py_blocks = MEMSTATS_UNKNOWN;
+  sample->py_traced = MEMSTATS_UNKNOWN;
+  sample->rss = MEMSTATS_UNKNOWN;
   /*
-   * Get the name.
+   * mallinfo() returns a struct, which -Waggregate-return objects to.
    */
-  name = PyObject_GetAttrString(pyValue, "name");
-  if (name == 0)
-    goto error_exit;
-  name_str = PyString_AsString(name);
-  if (name_str == 0)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+#if defined(HAVE_MALLINFO2)
+  info = mallinfo2();
+  sample->heap = info.uordblks + info.hblkhd;
+#elif defined(HAVE_MALLINFO)
+  info = mallinfo();
+  sample->heap = (unsigned int)info.uordblks + (unsigned int)info.hblkhd;
+#endif
+#pragma GCC diagnostic pop
+  if (memstats_read_proc("/proc/self/statm", buf, sizeof(buf)) > 0 &&
+      sscanf(buf, "%*u %lu", &resident) == 1)
+    sample->rss = (long long)resident * sysconf(_SC_PAGESIZE);
+  if (!python)
+    return;
+  /*
+   * sys.getallocatedblocks() is pymalloc's count, and appeared in Python
+   * 3.4.  tracemalloc is only asked if the module has started it.
+   */
+  PyErr_Fetch(&ptype, &pvalue, &ptraceback);
+  module = PyImport_AddModule((char*)"sys");
+  if (module != 0 && PyObject_HasAttrString(module, "getallocatedblocks"))
+    sample->py_blocks = memstats_python_number(module, "getallocatedblocks");
+  module = PyDict_GetItemString(PyImport_GetModuleDict(), "tracemalloc");
+  if (module != 0 && memstats_python_number(module, "is_tracing") > 0)
+    sample->py_traced = memstats_python_number(module, "get_traced_memory");
+  PyErr_Clear();
+  PyErr_Restore(ptype, pvalue, ptraceback);
+}
+
+/*
+ * Add the growth from one value to another to a total.
+ */
+static void memstats_add(long long* total, long long from, long long to)
+{
+  if (*total == MEMSTATS_UNKNOWN)
+    return;
+  if (from == MEMSTATS_UNKNOWN || to == MEMSTATS_UNKNOWN)
+    *total = MEMSTATS_UNKNOWN;
+  else
+    *total += to - from;
+}
+
+/*
+ * Describe the growth from one sample to another in buf, leaving out
+ * what isn't known for both.
+ */
+static void memstats_describe(
+    char* buf, size_t size, const MemSample* from, const MemSample* to)
+{
+  static const struct {
+    const char*		name;
+    size_t		offset;
+  } fields[] = {
+    {"heap",		offsetof(MemSample, heap)},
+    {"rss",		offsetof(MemSample, rss)},
+    {"py_blocks",	offsetof(MemSample, py_blocks)},
+    {"py_traced",	offsetof(MemSample, py_traced)},
+  };
+  long long		growth;
+  size_t		i;
+  size_t		len = 0;
+
+  buf[0] = '\0';
+  for (i = 0; i < arr_size(fields) && len < size; i += 1)
   {
-    PyErr_SetString(PyExc_TypeError, "xauthdata.name must be a string");
-    goto error_exit;
+    growth = 0;
+    memstats_add(
+        &growth, *(const long long*)((const char*)from + fields[i].offset),
+	*(const long long*)((const char*)to + fields[i].offset));
+    if (growth == MEMSTATS_UNKNOWN)
+      continue;
+    len += snprintf(
+	buf + len, size - len, "%s%s %+lld",
+	len == 0 ? "" : " ", fields[i].name, growth);
   }
-  xauth_data.name = strdup(name_str);
-  if (xauth_data.name == 0)
+}
+
+/*
+ * Record the growth over a call to a Python handler.
+ */
+static void memstats_handler_call(
+    PamHandleObject* pamHandle, const char* handler_name,
+    const MemSample* before)
+{
+  MemSample		after;
+  MemHandler*		handler;
+  size_t		i;
+
+  i = stats_handler_index(handler_name);
+  if (i == STATS_HANDLER_COUNT)
+    return;
+  memstats_sample(&after, 1);
+  handler = &pamHandle->memstats_handlers[i];
+  handler->calls += 1;
+  memstats_add(&handler->growth.heap, before->heap, after.heap);
+  memstats_add(&handler->growth.py_blocks, before->py_blocks, after.py_blocks);
+  memstats_add(&handler->growth.py_traced, before->py_traced, after.py_traced);
+  memstats_add(&handler->growth.rss, before->rss, after.rss);
+}
+
+/*
+ * Log the growth caused by creating the handle and by each handler.
+ * Called just before the handle is destroyed.
+ */
+static void memstats_log_handle(PamHandleObject* pamHandle)
+{
+  char			buf[256];
+  MemHandler*		handler;
+  const char*		module_path = get_module_path(pamHandle);
+  MemSample		now;
+  size_t		i;
+  static const MemSample zero;
+
+  memstats_describe(
+      buf, sizeof(buf), &pamHandle->memstats_start,
+      &pamHandle->memstats_created);
+  syslog_write(module_path, LOG_INFO, "memstats create: %s", buf);
+  for (i = 0; i < STATS_HANDLER_COUNT; i += 1)
   {
-    PyErr_NoMemory();
-    goto error_exit;
+    handler = &pamHandle->memstats_handlers[i];
+    if (handler->calls == 0)
+      continue;
+    memstats_describe(buf, sizeof(buf), &zero, &handler->growth);
+    syslog_write(
+        module_path, LOG_INFO, "memstats %s: %s (%lu calls)",
+	stats_handler_names[i], buf, handler->calls);
   }
-  xauth_data.namelen = PyString_GET_SIZE(name);
+  memstats_sample(&now, 1);
+  memstats_describe(buf, sizeof(buf), &pamHandle->memstats_created, &now);
+  syslog_write(module_path, LOG_INFO, "memstats handle: %s", buf);
+}
+
+/*
+ * Log what the whole transaction left behind, and look for a process
+ * that has grown in each of the last window transactions.  Called once
+ * the handle is gone and Python has been finalised.
+ */
+static void memstats_log_end(
+    const char* state_dir, const char* module_path, int window,
+    const MemSample* start)
+{
+  char			buf[256];
+  int			fd;
+  MemSample		now;
+  pid_t			pid = getpid();
+  MemProcess*		process;
+  MemProcess*		processes;
+  const size_t		size = sizeof(*processes) * MEMSTATS_PROCESS_COUNT;
+  unsigned long long	started = 0;
+  char*			stat_end;
+  char			stat[1024];
+  MemProcess*		victim;
+
+  memstats_sample(&now, 0);
+  memstats_describe(buf, sizeof(buf), start, &now);
+  syslog_write(module_path, LOG_INFO, "memstats transaction: %s", buf);
   /*
-   * Get the data.
+   * Field 22 of /proc/self/stat is when the process started, which
+   * tells a reused pid from the process that had it before.
    */
-  data = PyObject_GetAttrString(pyValue, "data");
-  if (data == 0)
-    goto error_exit;
-  data_str = PyString_AsString(data);
-  if (data_str == 0)
+  if (memstats_read_proc("/proc/self/stat", stat, sizeof(stat)) > 0)
   {
-    PyErr_SetString(PyExc_TypeError, "xauthdata.data must be a string");
-    goto error_exit;
+    stat_end = strrchr(stat, ')');
+    if (stat_end != 0)
+    {
+      sscanf(
+	  stat_end + 1,
+	  " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u"
+	  " %*d %*d %*d %*d %*d %*d %llu",
+	  &started);
+    }
   }
-  xauth_data.data = strdup(data_str);
-  if (xauth_data.data == 0)
+  fd = state_file_open(state_dir, MEMSTATS_FILE_NAME, size, 1);
+  if (fd == -1)
+    return;
+  processes = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (processes == MAP_FAILED)
   {
-    PyErr_NoMemory();
-    goto error_exit;
+    close(fd);
+    return;
   }
-  xauth_data.datalen = PyString_GET_SIZE(data);
-  /*
-   * Set the item.  If that worked PAM will have swallowed the strings inside
-   * of it, so we must not free them.
-   */
-  pam_result = pam_set_item(pamHandle->pamh, PAM_XAUTHDATA, &xauth_data);
-  if (pam_result == PAM_SUCCESS)
+  victim = processes;
+  for (process = processes; process < processes + MEMSTATS_PROCESS_COUNT; process += 1)
   {
-    xauth_data.name = 0;
-    xauth_data.data = 0;
+    if (process->pid == pid && process->started == started)
+      break;
+    if (process->updated < victim->updated)
+      victim = process;
   }
-  result = check_pam_result(pamHandle, pam_result);
+  if (process == processes + MEMSTATS_PROCESS_COUNT)
+  {
+    process = victim;
+    memset(process, '\0', sizeof(*process));
+    process->pid = pid;
+    process->started = started;
+  }
+  else if ((now.heap != MEMSTATS_UNKNOWN && now.heap > process->last.heap) ||
+      (now.rss != MEMSTATS_UNKNOWN && now.rss > process->last.rss))
+  {
+    if (process->growing == 0)
+      process->before = process->last;
+    process->growing += 1;
+    if (process->growing >= (unsigned long)window)
+    {
+      memstats_describe(buf, sizeof(buf), &process->before, &now);
+      syslog_write(
+	  module_path, LOG_WARNING,
+	  "memstats: process %ld grew in each of its last %lu transactions: %s",
+	  (long)pid, process->growing, buf);
+      process->growing = 0;
+    }
+  }
+  else
+    process->growing = 0;
+  process->last = now;
+  process->transactions += 1;
+  process->updated = realtime_ns() / 1e9;
+  munmap(processes, size);
+  close(fd);			/* This also drops the lock */
+}
 
-error_exit:
-  py_xdecref(data);
+/*
+ * Print the last line of a traceback, ie the exception's name and value,
+ * in some recognisable form, hopefully.
+ */
+static void syslog_exception_value(
+    const char* module_path, const char* errormsg,
+    PyObject* ptype, PyObject* pvalue)
+{
+  PyObject*	message = 0;
+  PyObject*	name = 0;
+  PyObject*	stype = 0;
+  const char*	str_name = 0;
+  const char*	str_message = 0;
+
+  if (ptype == 0)
+    stype = 0;
+  else if (PyType_Check(ptype))
+    stype = PyObject_GetAttrString(ptype, "__name__");
+  else
+  {
+    stype = ptype;
+    Py_INCREF(stype);
+  }
+  if (stype != 0)
+  {
+    name = PyObject_Str(stype);
+    if (name != 0)
+      str_name = PyUnicode_AsUTF8(name);
+  }
+  if (pvalue != 0)
+  {
+    message = PyObject_Str(pvalue);
+    if (message != 0)
+      str_message = PyUnicode_AsUTF8(message);
+  }
+  if (errormsg != 0 && str_name != 0 && str_message != 0)
+  {
+    syslog_write(
+        module_path, LOG_ERR, "%s - %s: %s",
+	errormsg, str_name, str_message);
+  }
+  else if (str_name != 0 && str_message != 0)
+    syslog_write(module_path, LOG_ERR, "%s: %s", str_name, str_message);
+  else if (errormsg != 0 && str_name != 0)
+    syslog_write(module_path, LOG_ERR, "%s - %s", errormsg, str_name);
+  else if (errormsg != 0 && str_message != 0)
+    syslog_write(module_path, LOG_ERR, "%s - %s", errormsg, str_message);
+  else if (errormsg != 0)
+    syslog_write(module_path, LOG_ERR, "%s", errormsg);
+  else if (str_name != 0)
+    syslog_write(module_path, LOG_ERR, "%s", str_name);
+  else if (str_message != 0)
+    syslog_write(module_path, LOG_ERR, "%s", str_message);
+  PyErr_Clear();
+  py_xdecref(message);
   py_xdecref(name);
-  if (xauth_data.name != 0)
-    free(xauth_data.name);
-  if (xauth_data.data != 0)
-    free(xauth_data.data);
+  py_xdecref(stype);
+}
+
+/*
+ * Print an exception to syslog, unless the same one has been printed too
+ * recently.  pamHandle is 0 if we don't have one yet.
+ */
+static int syslog_path_exception_limited(
+    const char* module_path, const char* errormsg,
+    PamHandleObject* pamHandle)
+{
+  PyObject*	ptype = 0;
+  PyObject*	ptraceback = 0;
+  PyObject*	pvalue = 0;
+  int		pam_result = 0;
+
+  PyErr_Fetch(&ptype, &pvalue, &ptraceback);
+  PROBE2(exception, module_path, probe_string(exception_type_name(ptype)));
+  if (exception_ratelimit(
+	get_state_dir(pamHandle), module_path, ptype, ptraceback,
+	get_log_window(pamHandle)))
+  {
+    syslog_exception_value(module_path, errormsg, ptype, pvalue);
+  }
+  pam_result = syslog_python2pam(ptype);
+  py_xdecref(ptraceback);
+  py_xdecref(ptype);
+  py_xdecref(pvalue);
+  return pam_result;
+}
+
+/*
+ * Print an exception to syslog, before we are initialised.
+ */
+static int syslog_path_exception(const char* module_path, const char* errormsg)
+{
+  return syslog_path_exception_limited(module_path, errormsg, 0);
+}
+
+/*
+ * Print an exception to syslog, once we are initialised.
+ */
+static int syslog_exception(PamHandleObject* pamHandle, const char* errormsg)
+{
+  return syslog_path_exception_limited(
+      get_module_path(pamHandle), errormsg, pamHandle);
+}
+
+/*
+ * Print an message to syslog.
+ */
+static int syslog_path_vmessage(
+    const char* module_path, const char* message, va_list ap)
+{
+  syslog_vwrite(module_path, LOG_ERR, message, ap);
+  return PAM_SERVICE_ERR;
+}
+
+/*
+ * Print an message to syslog.
+ */
+static int syslog_path_message(
+    const char* module_path, const char* message, ...)
+{
+  va_list	ap;
+  int		result;
+
+  va_start(ap, message);
+  result = syslog_path_vmessage(module_path, message, ap);
+  va_end(ap);
   return result;
 }
-#endif
 
 /*
- * Getters and setters.
+ * Print an message to syslog, once we are initialised.
  */
-static PyGetSetDef PamHandle_Getset[] =
+static int syslog_message(PamHandleObject* pamHandle, const char* message, ...)
 {
-  /*
-   * Items.
-   */
-  {"authtok",     PamHandle_get_AUTHTOK,     PamHandle_set_AUTHTOK,     "Authentication token", 0},
-#ifdef	PAM_AUTHTOK_TYPE
-  {"authtok_type",PamHandle_get_AUTHTOK_TYPE,PamHandle_set_AUTHTOK_TYPE,"XXX in the \"New XXX password:\" prompt", 0},
-#endif
-  {"oldauthtok",  PamHandle_get_OLDAUTHTOK,  PamHandle_set_OLDAUTHTOK,  "Old authentication token", 0},
-  {"rhost",       PamHandle_get_RHOST,       PamHandle_set_RHOST,       "Requesting host name", 0},
-  {"ruser",       PamHandle_get_RUSER,       PamHandle_set_RUSER,       "Requesting user name", 0},
-  {"service",     PamHandle_get_SERVICE,     PamHandle_set_SERVICE,     "Service (pam stack) name", 0},
-  {"tty",         PamHandle_get_TTY,         PamHandle_set_TTY,         "Terminal name", 0},
-  {"user",        PamHandle_get_USER,        PamHandle_set_USER,        "Authorized user name", 0},
-  {"user_prompt", PamHandle_get_USER_PROMPT, PamHandle_set_USER_PROMPT, "Prompt asking for users name", 0},
-#ifdef	PAM_XAUTHDATA
-  {"xauthdata",	  PamHandle_get_XAUTHDATA,   PamHandle_set_XAUTHDATA,   "The name of the X display ($DISPLAY)", 0},
-#endif
-#ifdef	PAM_XDISPLAY
-  {"xdisplay",	  PamHandle_get_XDISPLAY,    PamHandle_set_XDISPLAY,    "The name of the X display ($DISPLAY)", 0},
-#endif
-  /*
-   * Constants.
-   */
-  CONSTANT_GETSET(HAVE_PAM_FAIL_DELAY),
-  CONSTANT_GETSET(PAM_ABORT),
-  CONSTANT_GETSET(PAM_ACCT_EXPIRED),
-  CONSTANT_GETSET(PAM_AUTH_ERR),
-  CONSTANT_GETSET(PAM_AUTHINFO_UNAVAIL),
-  CONSTANT_GETSET(PAM_AUTHTOK),
-  CONSTANT_GETSET(PAM_AUTHTOK_DISABLE_AGING),
+  va_list	ap;
+  int		result;
+
+  va_start(ap, message);
+  result = syslog_path_vmessage(get_module_path(pamHandle), message, ap);
+  va_end(ap);
+  return result;
+}
+
+/*
+ * Read line number lineno from a source file, skipping leading white
+ * space and dropping the newline.  Returns 0 if it can't be read.  This
+ * deliberately avoids linecache, which would keep every file it reads
+ * in memory.
+ */
+static const char* traceback_source_line(
+    const char* filename, int lineno, char* buffer, size_t size)
+{
+  FILE*		fp;
+  size_t	len;
+  int		line = 1;
+  char*		result = 0;
+  char*		start;
+
+  fp = fopen(filename, "r");
+  if (fp == 0)
+    return 0;
+  while (fgets(buffer, size, fp) != 0)
+  {
+    len = strlen(buffer);
+    if (line == lineno)
+    {
+      while (len > 0 && (buffer[len - 1] == '\n' || buffer[len - 1] == '\r'))
+	buffer[--len] = '\0';
+      for (start = buffer; *start == ' ' || *start == '\t'; start += 1)
+	continue;
+      result = start;
+      break;
+    }
+    if (len > 0 && buffer[len - 1] == '\n')
+      line += 1;
+  }
+  fclose(fp);
+  return result;
+}
+
+/*
+ * Print a traceback's frames to syslog, one line per frame.  The source
+ * line is only read if the log_source option was given.
+ */
+static void syslog_traceback_frames(
+    const char* module_path, PamHandleObject* pamHandle,
+    PyObject* ptraceback)
+{
+  PyCodeObject*		code;
+  const char*		filename;
+  const char*		function;
+  int			lineno;
+  const char*		source;
+  char			source_buffer[256];
+  PyTracebackObject*	tb;
+
+  syslog_write(module_path, LOG_ERR, "Traceback (most recent call last):");
+  for (tb = (PyTracebackObject*)ptraceback; tb != 0; tb = tb->tb_next)
+  {
+    code = frame_code(tb->tb_frame);
+    filename = unicode_utf8(code->co_filename, "?");
+    function = unicode_utf8(code->co_name, "?");
+    lineno = traceback_lineno(tb);
+    source = 0;
+    if (pamHandle != 0 && pamHandle->log_source)
+    {
+      source = traceback_source_line(
+	  filename, lineno, source_buffer, sizeof(source_buffer));
+    }
+    if (source == 0)
+    {
+      syslog_write(
+	  module_path, LOG_ERR, "  %s:%d in %s",
+	  filename, lineno, function);
+    }
+    else
+    {
+      syslog_write(
+	  module_path, LOG_ERR, "  %s:%d in %s: %s",
+	  filename, lineno, function, source);
+    }
+  }
+}
+
+/*
+ * Print an exception to syslog, preceded by the exceptions it was raised
+ * from or while handling, oldest first, the way Python does.  The chain
+ * can be a loop, so how far back it goes is limited.
+ */
+#define	EXCEPTION_CHAIN_MAX	8
+
+static void syslog_exception_chain(
+    const char* module_path, PamHandleObject* pamHandle,
+    PyObject* ptype, PyObject* pvalue, PyObject* ptraceback, int depth)
+{
+  PyObject*		chained = 0;
+  PyObject*		chained_traceback = 0;
+  const char*		heading = 0;
+  PyObject*		suppress_context;
+
+  if (pvalue != 0 && PyExceptionInstance_Check(pvalue) &&
+      depth < EXCEPTION_CHAIN_MAX)
+  {
+    chained = PyException_GetCause(pvalue);
+    heading =
+	"The above exception was the direct cause of the following exception:";
+    if (chained == 0)
+    {
+      suppress_context = PyObject_GetAttrString(pvalue, "__suppress_context__");
+      if (suppress_context == 0)
+	PyErr_Clear();
+      else if (!PyObject_IsTrue(suppress_context))
+	chained = PyException_GetContext(pvalue);
+      py_xdecref(suppress_context);
+      heading =
+	  "During handling of the above exception, another exception occurred:";
+    }
+  }
+  if (chained != 0)
+  {
+    chained_traceback = PyException_GetTraceback(chained);
+    syslog_exception_chain(
+	module_path, pamHandle, (PyObject*)Py_TYPE(chained), chained,
+	chained_traceback, depth + 1);
+    syslog_write(module_path, LOG_ERR, "%s", heading);
+  }
+  if (ptraceback != 0)
+    syslog_traceback_frames(module_path, pamHandle, ptraceback);
+  syslog_exception_value(module_path, 0, ptype, pvalue);
+  py_xdecref(chained_traceback);
+  py_xdecref(chained);
+}
+
+/*
+ * Print a traceback to syslog, one line per frame.  The source line is
+ * only read if the log_source option was given.  pamHandle is 0 if we
+ * don't have one.
+ */
+static int syslog_path_traceback(
+    const char* module_path, PamHandleObject* pamHandle)
+{
+  PyObject*		ptraceback = 0;
+  PyObject*		ptype = 0;
+  PyObject*		pvalue = 0;
+  int			pam_result;
+
+  PyErr_Fetch(&ptype, &pvalue, &ptraceback);
+  /*
+   * If there isn't a traceback just log the exception.
+   */
+  if (ptraceback == 0)
+  {
+    PyErr_Restore(ptype, pvalue, ptraceback);
+    return syslog_path_exception_limited(module_path, 0, pamHandle);
+  }
+  PROBE2(exception, module_path, probe_string(exception_type_name(ptype)));
+  if (!exception_ratelimit(
+	get_state_dir(pamHandle), module_path, ptype, ptraceback,
+	get_log_window(pamHandle)))
+    goto error_exit;
+  PyErr_NormalizeException(&ptype, &pvalue, &ptraceback);
+  syslog_exception_chain(module_path, pamHandle, ptype, pvalue, ptraceback, 0);
+
+error_exit:
+  pam_result = syslog_python2pam(ptype);
+  py_xdecref(ptraceback);
+  py_xdecref(ptype);
+  py_xdecref(pvalue);
+  return pam_result;
+}
+
+/*
+ * Print an message to syslog, once we are initialised.
+ */
+static int syslog_traceback(PamHandleObject* pamHandle)
+{
+  return syslog_path_traceback(get_module_path(pamHandle), pamHandle);
+}
+
+/*
+ * The PamMessage object - used in conversations.
+ */
+#define	PAMMESSAGE_NAME	"Message"
+typedef struct
+{
+  PyObject_HEAD				/* The Python Object header */
+  int			msg_style;	/* struct pam_message.msg_style */
+  PyObject*		msg;		/* struct pam_message.msg */
+} PamMessageObject;
+
+static char PamMessage_doc[] =
+  MODULE_NAME "." PAMHANDLE_NAME "." PAMMESSAGE_NAME "(msg_style, msg)\n"
+  "  Constructs an immutable object that can be passed to\n"
+  "  " MODULE_NAME "." PAMHANDLE_NAME ".conversation().  The parameters are\n"
+  "  assigned to readonly members of the same name.  msg_style determines what\n"
+  "  is done (eg prompt for input, write a message), and msg is the prompt or\n"
+  "  message.";
+
+static PyMemberDef PamMessage_members[] =
+{
+  {
+    "msg_style",
+    T_INT,
+    offsetof(PamMessageObject, msg_style),
+    READONLY,
+    "What to do with the msg member, eg display it or use as a prompt.",
+  },
+  {
+    "msg",
+    T_OBJECT_EX,
+    offsetof(PamMessageObject, msg),
+    READONLY,
+    "The text to display to the user",
+  },
+  {0,0,0,0,0},        	/* End of Python visible members */
+  {0,0,0,0,0}		/* Sentinal */
+};
+
+HEAP_TYPE_GC(PamMessage, PamMessage_members)
+
+static PyObject* PamMessage_new(
+    PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+  int			err;
+  PyObject*		msg = 0;
+  int			msg_style = 0;
+  PamMessageObject*	pamMessage = 0;
+  PyObject*		self = 0;
+  static char*		kwlist[] = {"msg_style", "msg", 0};
+
+  err = PyArg_ParseTupleAndKeywords(
+      args, kwds, "iO!:Message", kwlist,
+      &msg_style, &PyUnicode_Type, &msg);
+  if (!err)
+    goto error_exit;
+  pamMessage = (PamMessageObject*)type->tp_alloc(type, 0);
+  if (pamMessage == 0)
+    goto error_exit;
+  pamMessage->msg_style = msg_style;
+  pamMessage->msg = msg;
+  Py_INCREF(pamMessage->msg);
+  self = (PyObject*)pamMessage;
+  pamMessage = 0;
+
+error_exit:
+  py_xdecref((PyObject*)pamMessage);
+  return self;
+}
+
+/*
+ * The PamResponse object - used in conversations.
+ */
+#define	PAMRESPONSE_NAME	"Response"
+typedef struct
+{
+  PyObject_HEAD				/* The Python Object header */
+  PyObject*		resp;		/* struct pam_response.resp */
+  int			resp_retcode;	/* struct pam_response.resp_retcode */
+} PamResponseObject;
+
+static char PamResponse_doc[] =
+  MODULE_NAME "." PAMHANDLE_NAME "." PAMRESPONSE_NAME "(resp, resp_retcode)\n"
+  "  Constructs an immutable object that is returned by\n"
+  "  " MODULE_NAME "." PAMHANDLE_NAME ".conversation().  The parameters are\n"
+  "  assigned to readonly members of the same name.  resp is the response from\n"
+  "  the user (if one was asked for), and resp_retcode says what it means.";
+
+static PyMemberDef PamResponse_members[] =
+{
+  {
+    "resp",
+    T_OBJECT_EX,
+    offsetof(PamResponseObject, resp),
+    READONLY,
+    "The response from the user.",
+  },
+  {
+    "resp_retcode",
+    T_INT,
+    offsetof(PamResponseObject, resp_retcode),
+    READONLY,
+    "The type of response.",
+  },
+  {0,0,0,0,0},        	/* End of Python visible members */
+  {0,0,0,0,0}		/* Sentinal */
+};
+
+HEAP_TYPE_GC(PamResponse, PamResponse_members)
+
+static PyObject* PamResponse_new(
+    PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+  int			err;
+  PyObject*		resp = 0;
+  int			resp_retcode = 0;
+  PamResponseObject*	pamResponse = 0;
+  PyObject*		self = 0;
+  static char*		kwlist[] = {"resp", "resp_retcode", 0};
+
+  err = PyArg_ParseTupleAndKeywords(
+      args, kwds, "Oi:Response", kwlist,
+      &resp, &resp_retcode);
+  if (!err)
+    goto error_exit;
+  if (resp != Py_None && !PyUnicode_Check(resp))
+  {
+    PyErr_SetString(PyExc_TypeError, "resp must be a string or None");
+    goto error_exit;
+  }
+  pamResponse = (PamResponseObject*)type->tp_alloc(type, 0);
+  if (pamResponse == 0)
+    goto error_exit;
+  pamResponse->resp_retcode = resp_retcode;
+  pamResponse->resp = resp;
+  Py_INCREF(pamResponse->resp);
+  self = (PyObject*)pamResponse;
+  pamResponse = 0;
+
+error_exit:
+  py_xdecref((PyObject*)pamResponse);
+  return self;
+}
+
+/*
+ * The PamXAuthData object - used by PAM_XAUTHDATA item.
+ */
+#define	PAMXAUTHDATA_NAME	"XAuthData"
+typedef struct
+{
+  PyObject_HEAD				/* The Python Object header */
+  PyObject*		name;		/* struct pam_xauth_data.name */
+  PyObject*		data;		/* struct pam_xauth_data.data */
+} PamXAuthDataObject;
+
+static char PamXAuthData_doc[] =
+  MODULE_NAME "." PAMHANDLE_NAME "." PAMXAUTHDATA_NAME "(name, data)\n"
+  "  Constructs an immutable object is returned by and can be passed to\n"
+  "  the " MODULE_NAME ".xauthdata property.  The parameters are\n"
+  "  assigned to readonly members of the same name.";
+
+static PyMemberDef PamXAuthData_members[] =
+{
+  {
+    "data",
+    T_OBJECT_EX,
+    offsetof(PamXAuthDataObject, data),
+    READONLY,
+    "The value of the data item. A string or None.",
+  },
+  {
+    "name",
+    T_OBJECT_EX,
+    offsetof(PamXAuthDataObject, name),
+    READONLY,
+    "The name of the data item.  A string or None.",
+  },
+  {0,0,0,0,0},        	/* End of Python visible members */
+  {0,0,0,0,0}		/* Sentinal */
+};
+
+HEAP_TYPE_GC(PamXAuthData, PamXAuthData_members)
+
+static PyObject* PamXAuthData_new(
+    PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+  int			err;
+  PyObject*		name = 0;
+  PyObject*		data = 0;
+  PamXAuthDataObject*	pamXAuthData = 0;
+  PyObject*		self = 0;
+  static char*		kwlist[] = {"name", "data", 0};
+
+  err = PyArg_ParseTupleAndKeywords(
+      args, kwds, "UU:XAuthData", kwlist,
+      &name, &data);
+  if (!err)
+    goto error_exit;
+  pamXAuthData = (PamXAuthDataObject*)type->tp_alloc(type, 0);
+  if (pamXAuthData == 0)
+    goto error_exit;
+  pamXAuthData->name = name;
+  Py_INCREF(pamXAuthData->name);
+  pamXAuthData->data = data;
+  Py_INCREF(pamXAuthData->data);
+  self = (PyObject*)pamXAuthData;
+  pamXAuthData = 0;
+
+error_exit:
+  py_xdecref((PyObject*)pamXAuthData);
+  return self;
+}
+
+/*
+ * The PamSpanObject - returned by pamh.span(), it times a block of code.
+ */
+#define	PAMSPAN_NAME	"Span"
+typedef struct
+{
+  PyObject_HEAD				/* The Python Object header */
+  PyObject*		name;		/* What it is timing */
+  PyObject*		pamHandle;	/* The pamh it was created by */
+  PyObject*		parent_id;	/* Span it is part of */
+  PyObject*		span_id;	/* Its id */
+  double		start;		/* monotonic_time() at __enter__ */
+  long long		start_ns;	/* Wall clock at __enter__ */
+} PamSpanObject;
+
+static char PamSpan_doc[] =
+  MODULE_NAME "." PAMHANDLE_NAME "." PAMSPAN_NAME "\n"
+  "  Returned by " MODULE_NAME "." PAMHANDLE_NAME ".span().  Use it in a with\n"
+  "  statement to record how long the block took in the transaction's span.";
+
+static PyMemberDef PamSpan_members[] =
+{
+  {
+    "name",
+    T_OBJECT,
+    offsetof(PamSpanObject, name),
+    READONLY,
+    "The name given to " MODULE_NAME "." PAMHANDLE_NAME ".span().",
+  },
+  {
+    "span_id",
+    T_OBJECT,
+    offsetof(PamSpanObject, span_id),
+    READONLY,
+    "The span's id, or None if spans aren't being recorded.",
+  },
+  {
+    "parent_id",
+    T_OBJECT,
+    offsetof(PamSpanObject, parent_id),
+    READONLY,
+    "The id of the span this one is part of, or None.",
+  },
+  {0,0,0,0,0},        	/* End of Python visible members */
+  {
+    "pamHandle",
+    T_OBJECT,
+    offsetof(PamSpanObject, pamHandle),
+    READONLY,
+    "The pamh the span belongs to",
+  },
+  {0,0,0,0,0}		/* Sentinal */
+};
+
+HEAP_TYPE_GC(PamSpan, PamSpan_members)
+
+/*
+ * span.__enter__().
+ */
+static PyObject* PamSpan_enter(PyObject* self, PyObject* args)
+{
+  PamSpanObject*	pamSpan = (PamSpanObject*)self;
+  PamHandleObject*	pamHandle = (PamHandleObject*)pamSpan->pamHandle;
+  Py_ssize_t		open_count;
+
+  (void)args;
+  if (pamHandle->trace_spans != 0 && pamSpan->span_id == 0)
+  {
+    open_count = PyList_GET_SIZE(pamHandle->trace_open);
+    if (open_count > 0)
+      pamSpan->parent_id = PyList_GET_ITEM(pamHandle->trace_open, open_count - 1);
+    else
+      pamSpan->parent_id = pamHandle->trace_span_id;
+    Py_INCREF(pamSpan->parent_id);
+    pamSpan->span_id = random_hex_id(8);
+    if (pamSpan->span_id == 0)
+      return 0;
+    if (PyList_Append(pamHandle->trace_open, pamSpan->span_id) == -1)
+      return 0;
+  }
+  pamSpan->start = monotonic_time();
+  pamSpan->start_ns = realtime_ns();
+  Py_INCREF(self);
+  return self;
+}
+
+/*
+ * span.__exit__(type, value, traceback).
+ */
+static PyObject* PamSpan_exit(PyObject* self, PyObject* args)
+{
+  PamSpanObject*	pamSpan = (PamSpanObject*)self;
+  PamHandleObject*	pamHandle = (PamHandleObject*)pamSpan->pamHandle;
+  PyObject*		error = Py_None;
+  PyObject*		exc_type = Py_None;
+  PyObject*		exc_traceback = Py_None;
+  PyObject*		exc_value = Py_None;
+  Py_ssize_t		i;
+  PyObject*		record = 0;
+  PyObject*		result = 0;
+  const char*		type_name;
+
+  if (!PyArg_UnpackTuple(
+      args, "__exit__", 0, 3, &exc_type, &exc_value, &exc_traceback))
+    goto error_exit;
+  if (pamHandle->trace_spans == 0 || pamSpan->span_id == 0)
+  {
+    result = Py_False;
+    Py_INCREF(result);
+    goto error_exit;
+  }
+  /*
+   * Spans are normally ended in the reverse order they were started,
+   * but don't assume it.
+   */
+  for (i = PyList_GET_SIZE(pamHandle->trace_open) - 1; i >= 0; i -= 1)
+  {
+    if (PyList_GET_ITEM(pamHandle->trace_open, i) == pamSpan->span_id)
+    {
+      PySequence_DelItem(pamHandle->trace_open, i);
+      break;
+    }
+  }
+  type_name = exc_type != Py_None ? exception_type_name(exc_type) : 0;
+  if (type_name != 0)
+    error = PyUnicode_FromString(type_name);
+  else
+    Py_INCREF(error);
+  if (error == 0)
+    goto error_exit;
+  record = Py_BuildValue(
+      "OOOLLN", pamSpan->name, pamSpan->span_id, pamSpan->parent_id,
+      pamSpan->start_ns,
+      pamSpan->start_ns +
+	  (long long)((monotonic_time() - pamSpan->start) * 1e9),
+      error);
+  if (record == 0)
+    goto error_exit;
+  if (PyList_Append(pamHandle->trace_spans, record) == -1)
+    goto error_exit;
+  result = Py_False;
+  Py_INCREF(result);
+
+error_exit:
+  py_xdecref(record);
+  return result;
+}
+
+static PyMethodDef PamSpan_Methods[] =
+{
+  {"__enter__",	PamSpan_enter,	METH_NOARGS,	0},
+  {"__exit__",	PamSpan_exit,	METH_VARARGS,	0},
+  {0,0,0,0}		/* Sentinal */
+};
+
+/*
+ * The circuit breaker pamh.breaker() returns.  It maps the stats file
+ * itself, so it still works if the module keeps it past the end of the
+ * PAM handle.
+ */
+#define	PAMBREAKER_NAME	"Breaker"
+typedef struct
+{
+  PyObject_HEAD
+  StatsBreaker*		breaker;	/* The shared state */
+  StatsFile*		file;		/* The mapped stats file, or 0 */
+  PyObject*		name;		/* breaker.name */
+  StatsBreaker		private_breaker;/* Once cleared */
+  double		reset;		/* breaker.reset */
+  int			threshold;	/* breaker.threshold */
+} PamBreakerObject;
+
+static char PamBreaker_doc[] =
+  MODULE_NAME "." PAMHANDLE_NAME "." PAMBREAKER_NAME "\n"
+  "  A circuit breaker shared by every process using the module, returned by\n"
+  "  " MODULE_NAME "." PAMHANDLE_NAME ".breaker().";
+
+static PyMemberDef PamBreaker_members[] =
+{
+  {
+    "name",
+    T_OBJECT,
+    offsetof(PamBreakerObject, name),
+    READONLY,
+    "The name given to " MODULE_NAME "." PAMHANDLE_NAME ".breaker().",
+  },
+  {
+    "reset",
+    T_DOUBLE,
+    offsetof(PamBreakerObject, reset),
+    READONLY,
+    "Seconds the breaker stays open before a trial call is allowed.",
+  },
+  {
+    "threshold",
+    T_INT,
+    offsetof(PamBreakerObject, threshold),
+    READONLY,
+    "Failures in a row that open the breaker.",
+  },
+  {0,0,0,0,0},        	/* End of Python visible members */
+  {0,0,0,0,0}		/* Sentinal */
+};
+
+static int PamBreaker_traverse(PyObject* self, visitproc visitor, void* arg)
+{
+  return generic_traverse(self, PamBreaker_members, visitor, arg);
+}
+
+static int PamBreaker_clear(PyObject* self)
+{
+  PamBreakerObject*	pamBreaker = (PamBreakerObject*)self;
+
+  stats_close(pamBreaker->file);
+  pamBreaker->file = 0;
+  pamBreaker->breaker = &pamBreaker->private_breaker;
+  return generic_clear(self, PamBreaker_members);
+}
+
+static PyObject* PamBreaker_allow(PyObject* self, PyObject* args)
+{
+  PamBreakerObject*	pamBreaker = (PamBreakerObject*)self;
+  PyObject*		result;
+
+  (void)args;
+  result = breaker_allow(
+      pamBreaker->breaker,
+      (long long)(pamBreaker->reset * 1e9)) ? Py_True : Py_False;
+  Py_INCREF(result);
+  return result;
+}
+
+static PyObject* PamBreaker_success(PyObject* self, PyObject* args)
+{
+  PamBreakerObject*	pamBreaker = (PamBreakerObject*)self;
+
+  (void)args;
+  breaker_success(pamBreaker->breaker);
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject* PamBreaker_failure(PyObject* self, PyObject* args)
+{
+  PamBreakerObject*	pamBreaker = (PamBreakerObject*)self;
+
+  (void)args;
+  breaker_failure(
+      pamBreaker->breaker, pamBreaker->threshold,
+      (long long)(pamBreaker->reset * 1e9));
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject* PamBreaker_get_state(PyObject* self, void* closure)
+{
+  PamBreakerObject*	pamBreaker = (PamBreakerObject*)self;
+  unsigned int		state;
+
+  (void)closure;
+  state = __atomic_load_n(&pamBreaker->breaker->state, __ATOMIC_ACQUIRE);
+  if (state >= arr_size(stats_breaker_states))
+    state = STATS_BREAKER_CLOSED;
+  return PyUnicode_FromString(stats_breaker_states[state]);
+}
+
+static PyMethodDef PamBreaker_Methods[] =
+{
+  {
+    "allow",
+    PamBreaker_allow,
+    METH_NOARGS,
+    MODULE_NAME "." PAMHANDLE_NAME "." PAMBREAKER_NAME "." "allow()\n"
+    "  Return True if a call may be made to the backend.  Its outcome must\n"
+    "  be reported with success() or failure()."
+  },
+  {
+    "failure",
+    PamBreaker_failure,
+    METH_NOARGS,
+    MODULE_NAME "." PAMHANDLE_NAME "." PAMBREAKER_NAME "." "failure()\n"
+    "  Report a call to the backend failed."
+  },
+  {
+    "success",
+    PamBreaker_success,
+    METH_NOARGS,
+    MODULE_NAME "." PAMHANDLE_NAME "." PAMBREAKER_NAME "." "success()\n"
+    "  Report a call to the backend worked, which closes the breaker."
+  },
+  {0,0,0,0}		/* Sentinal */
+};
+
+static PyGetSetDef PamBreaker_Getset[] =
+{
+  {
+    "state",
+    PamBreaker_get_state,
+    0,
+    "'closed', 'open' or 'half_open'.",
+    0
+  },
+  {0,0,0,0,0}		/* Sentinal */
+};
+
+/*
+ * The task pamh.schedule() returns.  While it is scheduled it is on
+ * scheduler.tasks, which holds a reference to it.
+ */
+#define	PAMTASK_NAME	"Task"
+typedef struct PamTaskObject
+{
+  PyObject_HEAD
+  char			cancelled;	/* task.cancelled */
+  struct timespec	due;		/* When it next runs, CLOCK_MONOTONIC */
+  unsigned long		failures;	/* task.failures */
+  PyObject*		function;	/* task.function */
+  double		interval;	/* task.interval */
+  double		jitter;		/* task.jitter */
+  PyObject*		module_path;	/* Who exceptions are logged as */
+  struct PamTaskObject*	next;		/* Next on scheduler.tasks */
+  void*			owner;		/* PAM handle it ends with, or 0 */
+  int			running;	/* The scheduler thread is running it */
+  unsigned long		runs;		/* task.runs */
+  PyObject*		value;		/* task.value */
+} PamTaskObject;
+
+static int scheduler_add(PamTaskObject* task);
+static void scheduler_cancel(PamTaskObject* task, void* owner);
+
+static char PamTask_doc[] =
+  MODULE_NAME "." PAMHANDLE_NAME "." PAMTASK_NAME "\n"
+  "  A function run every interval seconds by the scheduler thread, returned\n"
+  "  by " MODULE_NAME "." PAMHANDLE_NAME ".schedule().";
+
+static PyMemberDef PamTask_members[] =
+{
+  {
+    "cancelled",
+    T_BOOL,
+    offsetof(PamTaskObject, cancelled),
+    READONLY,
+    "True once the task won't be run again.",
+  },
+  {
+    "failures",
+    T_ULONG,
+    offsetof(PamTaskObject, failures),
+    READONLY,
+    "Times the function raised an exception.",
+  },
+  {
+    "function",
+    T_OBJECT,
+    offsetof(PamTaskObject, function),
+    READONLY,
+    "The function given to " MODULE_NAME "." PAMHANDLE_NAME ".schedule().",
+  },
+  {
+    "interval",
+    T_DOUBLE,
+    offsetof(PamTaskObject, interval),
+    READONLY,
+    "Seconds between runs, before jitter is applied.",
+  },
+  {
+    "jitter",
+    T_DOUBLE,
+    offsetof(PamTaskObject, jitter),
+    READONLY,
+    "The fraction of interval each wait is randomly varied by.",
+  },
+  {
+    "runs",
+    T_ULONG,
+    offsetof(PamTaskObject, runs),
+    READONLY,
+    "Times the function returned.",
+  },
+  {
+    "value",
+    T_OBJECT,
+    offsetof(PamTaskObject, value),
+    READONLY,
+    "What the function last returned, or None if it hasn't yet.",
+  },
+  {0,0,0,0,0},        	/* End of Python visible members */
+  {
+    "module_path",
+    T_OBJECT,
+    offsetof(PamTaskObject, module_path),
+    READONLY,
+    "Who exceptions are logged as",
+  },
+  {0,0,0,0,0}		/* Sentinal */
+};
+
+HEAP_TYPE_GC(PamTask, PamTask_members)
+
+static PyObject* PamTask_cancel(PyObject* self, PyObject* args)
+{
+  (void)args;
+  scheduler_cancel((PamTaskObject*)self, 0);
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyMethodDef PamTask_Methods[] =
+{
+  {
+    "cancel",
+    PamTask_cancel,
+    METH_NOARGS,
+    MODULE_NAME "." PAMHANDLE_NAME "." PAMTASK_NAME "." "cancel()\n"
+    "  Stop running the function.  If it is running now it finishes first."
+  },
+  {0,0,0,0}		/* Sentinal */
+};
+
+/*
+ * Check a PAM return value.  If the function failed raise an exception
+ * and return -1.
+ */
+static int check_pam_result(PamHandleObject* pamHandle, int pam_result)
+{
+  if (pam_result == PAM_SUCCESS)
+    return 0;
+  if (!PyErr_Occurred())
+  {
+    PyObject* ptype;
+    PyObject* pvalue;
+    PyObject* ptraceback;
+    PyObject* error_code = 0;
+    const char* error_string = pam_strerror(pamHandle->pamh, pam_result);
+
+    PyErr_SetString(pamHandle->exception, error_string);
+    PyErr_Fetch(&ptype, &pvalue, &ptraceback);
+    PyErr_NormalizeException(&ptype, &pvalue, &ptraceback);
+    error_code = PyLong_FromLong(pam_result);
+    if (error_code != NULL)
+      PyObject_SetAttrString(pvalue, "pam_result", error_code);
+    PyErr_Restore(ptype, pvalue, ptraceback);
+    py_xdecref(error_code);
+  }
+  return -1;
+}
+
+/*
+ * Python getters / setters are used to manipulate PAM's items.
+ */
+static PyObject* PamHandle_get_item(PyObject* self, int item_type)
+{
+  PamHandleObject*	pamHandle = (PamHandleObject*)self;
+  const char*		value;
+  PyObject*		result = 0;
+  int			pam_result;
+
+  pam_result = pam_get_item(pamHandle->pamh, item_type, (const void**)&value);
+  if (check_pam_result(pamHandle, pam_result) == -1)
+    goto error_exit;
+  if (value != 0)
+    result = PyUnicode_FromString(value);
+  else
+  {
+    result = Py_None;
+    Py_INCREF(result);
+  }
+
+error_exit:
+  return result;
+}
+
+static int PamHandle_set_item(
+    PyObject* self, int item_type, char* item_name, PyObject* pyValue)
+{
+  PamHandleObject*	pamHandle = (PamHandleObject*)self;
+  int			pam_result;
+  int			result = -1;
+  const char*		str_value;
+  char*			value = 0;
+  char			error_message[64];
+
+  if (pyValue != Py_None)
+  {
+    str_value = PyUnicode_Check(pyValue) ? PyUnicode_AsUTF8(pyValue) : 0;
+    if (str_value == 0)
+    {
+      snprintf(
+          error_message, sizeof(error_message),
+	  "PAM item %s must be set to a string", item_name);
+      PyErr_SetString(PyExc_TypeError, error_message);
+      goto error_exit;
+    }
+    value = strdup(str_value);
+    if (value == 0)
+    {
+      PyErr_NoMemory();
+      goto error_exit;
+    }
+  }
+  pam_result = pam_set_item(pamHandle->pamh, item_type, value);
+  if (pam_result == PAM_SUCCESS)
+    value = 0;
+  result = check_pam_result(pamHandle, pam_result);
+
+error_exit:
+  if (value != 0)
+    free(value);
+  return result;
+}
+
+/*
+ * The PAM Environment Object & its iterator.
+ */
+#define	PAMENV_NAME	"PamEnv"
+typedef struct
+{
+  PyObject_HEAD				/* The Python Object header */
+  PamHandleObject*	pamHandle;	/* The PamHandle that owns us */
+  PyTypeObject*		pamEnvIter_type;/* A class for our iterators */
+} PamEnvObject;
+
+static PyMemberDef PamEnv_Members[] =
+{
+  {0,0,0,0,0},        	/* End of Python visible members */
+  {
+    "Iter",
+    T_OBJECT_EX,
+    offsetof(PamEnvObject, pamEnvIter_type),
+    READONLY,
+    "Iterator class for " PAMENV_NAME
+  },
+  {0,0,0,0,0}        	/* Sentinel */
+};
+
+HEAP_TYPE_GC(PamEnv, PamEnv_Members)
+
+#define	PAMENVITER_NAME	"PamEnvIter"
+typedef struct
+{
+  PyObject_HEAD
+  PamEnvObject*		env;		/* The PamEnvObject we are iterating */
+  int			pos;		/* Nest position to return */
+  PyObject*		(*get_entry)(const char* entry); /* What to return */
+} PamEnvIterObject;
+
+static PyMemberDef PamEnvIter_Members[] =
+{
+  {0,0,0,0,0},        	/* End of Python visible members */
+  {
+    "env",
+    T_OBJECT_EX,
+    offsetof(PamEnvIterObject, env),
+    READONLY,
+    "Dictionary to iterate"
+  },
+  {0,0,0,0,0}        	/* Sentinel */
+};
+
+HEAP_TYPE_GC(PamEnvIter, PamEnvIter_Members)
+
+/*
+ * Create a new iterator for a PamEnv.
+ */
+static PyObject* PamEnvIter_create(
+  PamEnvObject* pamEnv, PyObject* (*get_entry)(const char* entry))
+{
+  PyTypeObject*		type = pamEnv->pamEnvIter_type;
+  PamEnvIterObject*	pamEnvIter;
+  PyObject*		result = 0;
+
+  pamEnvIter = (PamEnvIterObject*)type->tp_alloc(type, 0);
+  if (pamEnvIter == 0)
+    goto error_exit;
+  pamEnvIter->env = pamEnv;
+  Py_INCREF(pamEnvIter->env);
+  pamEnvIter->get_entry = get_entry;
+  pamEnvIter->pos = 0;
+  result = (PyObject*)pamEnvIter;
+  Py_INCREF(result);
+
+error_exit:
+  py_xdecref((PyObject*)pamEnvIter);
+  return result;
+}
+
+/*
+ * Free what pam_getenvlist() returned.  The caller owns both the array
+ * and the strings in it.
+ */
+static void free_envlist(char** env)
+{
+  int			i;
+
+  if (env == 0)
+    return;
+  for (i = 0; env[i] != 0; i += 1)
+    free(env[i]);
+  free(env);
+}
+
+/*
+ * Return the next object in the iteration.
+ */
+static PyObject* PamEnvIter_iternext(PyObject* self)
+{
+  PamEnvIterObject*	pamEnvIter = (PamEnvIterObject*)self;
+  char**		env = 0;
+  int			i;
+  PyObject*		result = 0;
+
+  if (pamEnvIter->env == 0)
+    goto error_exit;
+  env = pam_getenvlist(pamEnvIter->env->pamHandle->pamh);
+  if (env == 0)
+    goto error_exit;
+  for (i = 0; env[i] != 0 && i < pamEnvIter->pos; i += 1)
+    continue;
+  if (env[i] == 0)
+    goto error_exit;
+  result = pamEnvIter->get_entry(env[i]);
+  if (result == 0)
+    goto error_exit;
+  pamEnvIter->pos += 1;
+  free_envlist(env);
+  return result;
+
+error_exit:
+  free_envlist(env);
+  clear_slot((PyObject**)&pamEnvIter->env);
+  return 0;
+}
+
+static PyType_Slot PamEnvIter_slots[] =
+{
+  {Py_tp_iter,		PyObject_SelfIter},
+  {Py_tp_iternext,	PamEnvIter_iternext},
+  {0, 0}
+};
+
+/*
+ * Return a python object for the key part.
+ */
+static PyObject* PamEnvIter_key_entry(const char* entry)
+{
+  const char*		equals;
+
+  equals = strchr(entry, '=');
+  if (equals == 0)
+    return PyUnicode_FromString(entry);
+  return PyUnicode_FromStringAndSize(entry, equals - entry);
+}
+
+/*
+ * Return a python object for the value part.
+ */
+static PyObject* PamEnvIter_value_entry(const char* entry)
+{
+  const char*		equals;
+
+  equals = strchr(entry, '=');
+  if (equals == 0)
+    return PyUnicode_FromString("");
+  return PyUnicode_FromString(equals + 1);
+}
+
+/*
+ * Return a python object entire item.
+ */
+static PyObject* PamEnvIter_item_entry(const char* entry)
+{
+  PyObject*		key = 0;
+  PyObject*		result = 0;
+  PyObject*		tuple = 0;
+  PyObject*		value = 0;
+
+  key = PamEnvIter_key_entry(entry);
+  if (key == 0)
+    goto error_exit;
+  value = PamEnvIter_value_entry(entry);
+  if (key == 0)
+    goto error_exit;
+  tuple = PyTuple_New(2);
+  if (tuple == 0)
+    goto error_exit;
+  if (PyTuple_SetItem(tuple, 0, key) == -1)
+    goto error_exit;
+  key = 0;			/* was stolen */
+  if (PyTuple_SetItem(tuple, 1, value) == -1)
+    goto error_exit;
+  value = 0;			/* was stolen */
+  result = tuple;
+  tuple = 0;
+
+error_exit:
+  py_xdecref(key);
+  py_xdecref(tuple);
+  py_xdecref(value);
+  return result;
+}
+
+/*
+ * Create an iterator.
+ */
+static PyObject* PamEnv_iter(PyObject* self)
+{
+  PamEnvObject*		pamEnv = (PamEnvObject*)self;
+
+  return PamEnvIter_create(pamEnv, PamEnvIter_key_entry);
+}
+
+/*
+ * Get the value of a environment key.
+ */
+static const char* PamEnv_getkey(PyObject* key)
+{
+  const char*		result;
+
+  if (!PyUnicode_Check(key))
+  {
+    PyErr_SetString(PyExc_TypeError, "PAM environment key must be a string");
+    return 0;
+  }
+  result = PyUnicode_AsUTF8(key);
+  if (result == 0)
+    return 0;
+  if (*result == '\0')
+  {
+    PyErr_SetString(
+        PyExc_ValueError,
+	"PAM environment key mustn't be 0 length");
+    return 0;
+  }
+  if (strchr(result, '=') != 0)
+  {
+    PyErr_SetString(PyExc_ValueError, "PAM environment key can't contain '='");
+    return 0;
+  }
+  return result;
+}
+
+/*
+ * Return the length.
+ */
+static Py_ssize_t PamEnv_mp_length(PyObject* self)
+{
+  PamEnvObject*		pamEnv = (PamEnvObject*)self;
+  char**		env;
+  int			length;
+
+  env = pam_getenvlist(pamEnv->pamHandle->pamh);
+  if (env == 0)
+    return 0;
+  for (length = 0; env[length] != 0; length += 1)
+    continue;
+  free_envlist(env);
+  return length;
+}
+
+/*
+ * Lookup a key returning its value.
+ */
+static PyObject* PamEnv_mp_subscript(PyObject* self, PyObject* key)
+{
+  PamEnvObject*		pamEnv = (PamEnvObject*)self;
+  PyObject*		result = 0;
+  const char*		key_str;
+  const char*		value;
+
+  key_str = PamEnv_getkey(key);
+  if (key_str == 0)
+    goto error_exit;
+  value = pam_getenv(pamEnv->pamHandle->pamh, key_str);
+  if (value == 0)
+  {
+    PyErr_SetString(PyExc_KeyError, key_str);
+    goto error_exit;
+  }
+  result = PyUnicode_FromString(value);
+
+error_exit:
+  return result;
+}
+
+/*
+ * Assign a value to a key, or delete it.
+ */
+static int PamEnv_mp_assign(PyObject* self, PyObject* key, PyObject* value)
+{
+  PamEnvObject*		pamEnv = (PamEnvObject*)self;
+  char*			value_str = 0;
+  int			result = -1;
+  const char*		key_str;
+  int			pam_result;
+  const char*		value_utf8;
+  Py_ssize_t		value_len;
+
+  key_str = PamEnv_getkey(key);
+  if (key_str == 0)
+    goto error_exit;
+  if (value == 0)
+    value_str = (char*)key_str;
+  else
+  {
+    if (!PyUnicode_Check(value))
+    {
+      PyErr_SetString(
+          PyExc_TypeError, "PAM environment value must be a string");
+      goto error_exit;
+    }
+    value_utf8 = PyUnicode_AsUTF8AndSize(value, &value_len);
+    if (value_utf8 == 0)
+      goto error_exit;
+    value_str = malloc(strlen(key_str) + 1 + value_len + 1);
+    if (value_str == 0)
+    {
+      PyErr_NoMemory();
+      goto error_exit;
+    }
+    strcat(strcat(strcpy(value_str, key_str), "="), value_utf8);
+  }
+  pam_result = pam_putenv(pamEnv->pamHandle->pamh, value_str);
+  if (pam_result != PAM_SUCCESS) // PAM_BAD_ITEM in Linux = PAM_BUF_ERR,PAM_SYSTEM_ERR
+  {
+    PyErr_SetString(PyExc_KeyError, key_str);
+    goto error_exit;
+  }
+  if (check_pam_result(pamEnv->pamHandle, pam_result) == -1)
+    goto error_exit;
+  value_str = 0;
+  result = 0;
+
+error_exit:
+  if (value_str != key_str && value_str != 0)
+    free(value_str);
+  return result;
+}
+
+static PyType_Slot PamEnv_slots[] =
+{
+  {Py_mp_ass_subscript,	PamEnv_mp_assign},
+  {Py_mp_length,	PamEnv_mp_length},
+  {Py_mp_subscript,	PamEnv_mp_subscript},
+  {Py_tp_iter,		PamEnv_iter},
+  {0, 0}
+};
+
+/*
+ * Check if a key is in the environment.
+ */
+static PyObject* PamEnv_has_key(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  PamEnvObject*		pamEnv = (PamEnvObject*)self;
+  PyObject*		key;
+  PyObject*		result = 0;
+  const char*		key_str;
+  const char*		value_str;
+  static char*		kwlist[] = {"key", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:has_key", kwlist, &key))
+    goto error_exit;
+  key_str = PamEnv_getkey(key);
+  if (key_str == 0)
+    goto error_exit;
+  value_str = pam_getenv(pamEnv->pamHandle->pamh, key_str);
+  result = value_str != 0 ? Py_True : Py_False;
+  Py_INCREF(result);
+
+error_exit:
+  return result;
+}
+
+/*
+ * Lookup a key and return its value, throwing KeyError if the key
+ * doesn't exist.
+ */
+static PyObject* PamEnv_getitem(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  PyObject*		result = 0;
+  PyObject*		key;
+  static char*		kwlist[] = {"key", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:__getitem__", kwlist, &key))
+    goto error_exit;
+  result = PamEnv_mp_subscript(self, key);
+
+error_exit:
+  return result;
+}
+
+/*
+ * Lookup a key and return its value, returning None or a default if it
+ * doesn't exist.
+ */
+static PyObject* PamEnv_get(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  int			err;
+  PamEnvObject*		pamEnv = (PamEnvObject*)self;
+  PyObject*		default_value = 0;
+  PyObject*		result = 0;
+  PyObject*		key;
+  const char*		key_str;
+  const char*		value_str;
+  static char*		kwlist[] = {"key", "default", NULL};
+
+  err = PyArg_ParseTupleAndKeywords(
+      args, kwds, "O|O:get", kwlist,
+      &key, &default_value);
+  if (!err)
+    goto error_exit;
+  key_str = PamEnv_getkey(key);
+  if (key_str == 0)
+    goto error_exit;
+  value_str = pam_getenv(pamEnv->pamHandle->pamh, key_str);
+  if (value_str != 0)
+    result = PyUnicode_FromString(value_str);
+  else
+  {
+    result = default_value != 0 ? default_value : Py_None;
+    Py_INCREF(result);
+  }
+
+error_exit:
+  return result;
+}
+
+/*
+ * Return all objects in the environment as a sequence.
+ */
+static PyObject* PamEnv_as_sequence(
+    PyObject* self, PyObject* (*get_entry)(const char* entry))
+{
+  PamEnvObject*		pamEnv = (PamEnvObject*)self;
+  PyObject*		list = 0;
+  PyObject*		result = 0;
+  PyObject*		entry = 0;
+  char**		env;
+  int			i;
+  int			length;
+
+  env = pam_getenvlist(pamEnv->pamHandle->pamh);
+  if (env == 0)
+    length = 0;
+  else
+  {
+    for (length = 0; env[length] != 0; length += 1)
+      continue;
+  }
+  list = PyList_New(length);
+  if (list == 0)
+    goto error_exit;
+  for (i = 0; i < length; i += 1)
+  {
+    entry = get_entry(env[i]);
+    if (entry == 0)
+      goto error_exit;
+    if (PyList_SetItem(list, i, entry) == -1)
+      goto error_exit;
+    entry = 0;			/* was stolen */
+  }
+  result = list;
+  list = 0;
+
+error_exit:
+  free_envlist(env);
+  py_xdecref(list);
+  py_xdecref(entry);
+  return result;
+}
+
+/*
+ * Return all (key, value) pairs.
+ */
+static PyObject* PamEnv_items(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  static char*		kwlist[] = {NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, ":items", kwlist))
+    return 0;
+  return PamEnv_as_sequence(self, PamEnvIter_item_entry);
+}
+
+/*
+ * An iterator for all (key, value) pairs.
+ */
+static PyObject* PamEnv_iteritems(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  PamEnvObject*		pamEnv = (PamEnvObject*)self;
+  static char*		kwlist[] = {NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, ":iteritems", kwlist))
+    return 0;
+  return PamEnvIter_create(pamEnv, PamEnvIter_item_entry);
+}
+
+/*
+ * An iterator for the keys.
+ */
+static PyObject* PamEnv_iterkeys(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  PamEnvObject*		pamEnv = (PamEnvObject*)self;
+  static char*		kwlist[] = {NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, ":iterkeys", kwlist))
+    return 0;
+  return PamEnvIter_create(pamEnv, PamEnvIter_key_entry);
+}
+
+/*
+ * An iterator for the values.
+ */
+static PyObject* PamEnv_itervalues(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  PamEnvObject*		pamEnv = (PamEnvObject*)self;
+  static char*		kwlist[] = {NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, ":itervalues", kwlist))
+    return 0;
+  return PamEnvIter_create(pamEnv, PamEnvIter_value_entry);
+}
+
+/*
+ * Return all keys.
+ */
+static PyObject* PamEnv_keys(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  static char*		kwlist[] = {NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, ":keys", kwlist))
+    return 0;
+  return PamEnv_as_sequence(self, PamEnvIter_key_entry);
+}
+
+/*
+ * Return all (key, value) pairs.
+ */
+static PyObject* PamEnv_values(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  static char*		kwlist[] = {NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, ":values", kwlist))
+    return 0;
+  return PamEnv_as_sequence(self, PamEnvIter_value_entry);
+}
+
+static PyMethodDef PamEnv_Methods[] =
+{
+  {"__contains__",  PyCFunctionKwds_cast PamEnv_has_key,METH_VARARGS|METH_KEYWORDS, 0},
+  {"__getitem__",   PyCFunctionKwds_cast PamEnv_getitem,METH_VARARGS|METH_KEYWORDS, 0},
+  {"get",	    PyCFunctionKwds_cast PamEnv_get,	METH_VARARGS|METH_KEYWORDS, 0},
+  {"has_key",	    PyCFunctionKwds_cast PamEnv_has_key,METH_VARARGS|METH_KEYWORDS, 0},
+  {"items",	    PyCFunctionKwds_cast PamEnv_items,	METH_VARARGS|METH_KEYWORDS, 0},
+  {"iteritems",	    PyCFunctionKwds_cast PamEnv_iteritems,METH_VARARGS|METH_KEYWORDS, 0},
+  {"iterkeys",	    PyCFunctionKwds_cast PamEnv_iterkeys,METH_VARARGS|METH_KEYWORDS, 0},
+  {"itervalues",    PyCFunctionKwds_cast PamEnv_itervalues,METH_VARARGS|METH_KEYWORDS, 0},
+  {"keys",	    PyCFunctionKwds_cast PamEnv_keys,	METH_VARARGS|METH_KEYWORDS, 0},
+  {"values",	    PyCFunctionKwds_cast PamEnv_values,	METH_VARARGS|METH_KEYWORDS, 0},
+  {0,0,0,0}        	/* Sentinel */
+};
+
+/*
+ * pamh.cache, a view of the shared cache.  It owns the mapping, so a
+ * module that keeps it past the end of the PAM handle still works.
+ */
+#define	PAMCACHE_NAME	"PamCache"
+typedef struct
+{
+  PyObject_HEAD				/* The Python Object header */
+  CacheFile*		file;		/* The mapped cache */
+  size_t		size;		/* How much of it is mapped */
+} PamCacheObject;
+
+static int PamCache_traverse(PyObject* self, visitproc visitor, void* arg)
+{
+  return generic_traverse(self, 0, visitor, arg);
+}
+
+static int PamCache_clear(PyObject* self)
+{
+  PamCacheObject*	pamCache = (PamCacheObject*)self;
+
+  if (pamCache->file != 0)
+    munmap(pamCache->file, pamCache->size);
+  pamCache->file = 0;
+  return 0;
+}
+
+/*
+ * Get the bytes of a cache key, which must be a str.
+ */
+static const char* PamCache_getkey(PyObject* key, Py_ssize_t* key_len)
+{
+  const char*		result;
+
+  if (!PyUnicode_Check(key))
+  {
+    PyErr_SetString(PyExc_TypeError, "cache keys must be strings");
+    return 0;
+  }
+  result = PyUnicode_AsUTF8AndSize(key, key_len);
+  if (result != 0 && *key_len > UCHAR_MAX)
+  {
+    PyErr_SetString(PyExc_ValueError, "cache key is too long");
+    return 0;
+  }
+  return result;
+}
+
+/*
+ * Lookup a key and return its value, or None or a default if it isn't
+ * there or has expired.
+ */
+static PyObject* PamCache_get(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  CacheSlot		copy;
+  PyObject*		default_value = Py_None;
+  PyObject*		key;
+  const char*		key_str;
+  Py_ssize_t		key_len;
+  PamCacheObject*	pamCache = (PamCacheObject*)self;
+  PyObject*		result = 0;
+  const char*		value;
+  static char*		kwlist[] = {"key", "default", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(
+      args, kwds, "O|O:get", kwlist, &key, &default_value))
+    goto error_exit;
+  key_str = PamCache_getkey(key, &key_len);
+  if (key_str == 0)
+    goto error_exit;
+  if (cache_get(pamCache->file, key_str, key_len, &copy) == -1)
+  {
+    result = default_value;
+    Py_INCREF(result);
+    goto error_exit;
+  }
+  value = copy.data + copy.key_len;
+  if (copy.type == CACHE_STR)
+    result = PyUnicode_DecodeUTF8(value, copy.value_len, 0);
+  else
+    result = PyBytes_FromStringAndSize(value, copy.value_len);
+
+error_exit:
+  return result;
+}
+
+/*
+ * Store a value, a str or bytes, under a key for ttl seconds.
+ */
+static PyObject* PamCache_set(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  PyObject*		key;
+  const char*		key_str;
+  Py_ssize_t		key_len;
+  PamCacheObject*	pamCache = (PamCacheObject*)self;
+  PyObject*		result = 0;
+  double		ttl;
+  int			type;
+  PyObject*		value;
+  char*			value_str;
+  Py_ssize_t		value_len;
+  static char*		kwlist[] = {"key", "value", "ttl", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(
+      args, kwds, "OOd:set", kwlist, &key, &value, &ttl))
+    goto error_exit;
+  key_str = PamCache_getkey(key, &key_len);
+  if (key_str == 0)
+    goto error_exit;
+  if (PyUnicode_Check(value))
+  {
+    type = CACHE_STR;
+    value_str = (char*)PyUnicode_AsUTF8AndSize(value, &value_len);
+    if (value_str == 0)
+      goto error_exit;
+  }
+  else if (PyBytes_Check(value))
+  {
+    type = CACHE_BYTES;
+    PyBytes_AsStringAndSize(value, &value_str, &value_len);
+  }
+  else
+  {
+    PyErr_SetString(PyExc_TypeError, "cache values must be str or bytes");
+    goto error_exit;
+  }
+  if (key_len + value_len > CACHE_DATA_SIZE)
+  {
+    PyErr_Format(
+        PyExc_ValueError, "cache key and value are over %d bytes",
+	CACHE_DATA_SIZE);
+    goto error_exit;
+  }
+  if (!(ttl > 0))
+  {
+    PyErr_SetString(PyExc_ValueError, "cache ttl must be positive");
+    goto error_exit;
+  }
+  result = cache_set(
+      pamCache->file, key_str, key_len, type, value_str, value_len,
+      (long long)(ttl * 1e9)) == 0 ? Py_True : Py_False;
+  Py_INCREF(result);
+
+error_exit:
+  return result;
+}
+
+/*
+ * Remove a key.
+ */
+static PyObject* PamCache_delete(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  PyObject*		key;
+  const char*		key_str;
+  Py_ssize_t		key_len;
+  PamCacheObject*	pamCache = (PamCacheObject*)self;
+  PyObject*		result = 0;
+  static char*		kwlist[] = {"key", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:delete", kwlist, &key))
+    goto error_exit;
+  key_str = PamCache_getkey(key, &key_len);
+  if (key_str == 0)
+    goto error_exit;
+  result = cache_delete(pamCache->file, key_str, key_len, 0) == 0 ?
+      Py_True : Py_False;
+  Py_INCREF(result);
+
+error_exit:
+  return result;
+}
+
+static PyMethodDef PamCache_Methods[] =
+{
+  {
+    "delete",
+    PyCFunctionKwds_cast PamCache_delete,
+    METH_VARARGS|METH_KEYWORDS,
+    MODULE_NAME "." PAMCACHE_NAME "." "delete(key)\n"
+    "  Remove key from the cache.  Returns False if other writers held\n"
+    "  a slot it is in throughout, so it may still be there."
+  },
+  {
+    "get",
+    PyCFunctionKwds_cast PamCache_get,
+    METH_VARARGS|METH_KEYWORDS,
+    MODULE_NAME "." PAMCACHE_NAME "." "get(key, default=None)\n"
+    "  Return the value stored under the string key, or default if it isn't\n"
+    "  there or has expired."
+  },
+  {
+    "set",
+    PyCFunctionKwds_cast PamCache_set,
+    METH_VARARGS|METH_KEYWORDS,
+    MODULE_NAME "." PAMCACHE_NAME "." "set(key, value, ttl)\n"
+    "  Store value, a str or bytes, under the string key for ttl seconds.\n"
+    "  Returns False if the slots it could go in were all busy."
+  },
+  {0,0,0,0}        	/* Sentinel */
+};
+
+/*
+ * pamh.failures, a view of the shared failure counts.  Like pamh.cache it
+ * owns the mapping.
+ */
+#define	PAMFAILURES_NAME	"PamFailures"
+typedef struct
+{
+  PyObject_HEAD				/* The Python Object header */
+  FailuresFile*		file;		/* The mapped failure counts */
+  size_t		size;		/* How much of it is mapped */
+  char			shared;		/* Not private to the process */
+  int			window;		/* file->window, for Python */
+} PamFailuresObject;
+
+static PyMemberDef PamFailures_Members[] =
+{
+  {
+    "shared",
+    T_BOOL,
+    offsetof(PamFailuresObject, shared),
+    READONLY,
+    "False if the counts couldn't be shared and are this process's own."
+  },
+  {
+    "window",
+    T_INT,
+    offsetof(PamFailuresObject, window),
+    READONLY,
+    "Seconds failures are counted for."
+  },
+  {0,0,0,0,0}        	/* Sentinel */
+};
+
+static int PamFailures_traverse(PyObject* self, visitproc visitor, void* arg)
+{
+  return generic_traverse(self, 0, visitor, arg);
+}
+
+static int PamFailures_clear(PyObject* self)
+{
+  PamFailuresObject*	pamFailures = (PamFailuresObject*)self;
+
+  if (pamFailures->file != 0)
+    munmap(pamFailures->file, pamFailures->size);
+  pamFailures->file = 0;
+  return 0;
+}
+
+/*
+ * Count a failure for a key.
+ */
+static PyObject* PamFailures_increment(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  const char*		key;
+  Py_ssize_t		key_len;
+  PamFailuresObject*	pamFailures = (PamFailuresObject*)self;
+  PyObject*		result = 0;
+  static char*		kwlist[] = {"key", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(
+      args, kwds, "s#:increment", kwlist, &key, &key_len))
+    goto error_exit;
+  result = PyLong_FromUnsignedLongLong(
+      failures_add(pamFailures->file, key, key_len));
+
+error_exit:
+  return result;
+}
+
+/*
+ * Return the failures counted for a key.
+ */
+static PyObject* PamFailures_count(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  const char*		key;
+  Py_ssize_t		key_len;
+  PamFailuresObject*	pamFailures = (PamFailuresObject*)self;
+  PyObject*		result = 0;
+  static char*		kwlist[] = {"key", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(
+      args, kwds, "s#:count", kwlist, &key, &key_len))
+    goto error_exit;
+  result = PyLong_FromUnsignedLongLong(
+      failures_get(pamFailures->file, key, key_len));
+
+error_exit:
+  return result;
+}
+
+/*
+ * Forget the failures counted for a key.
+ */
+static PyObject* PamFailures_reset(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  const char*		key;
+  Py_ssize_t		key_len;
+  PamFailuresObject*	pamFailures = (PamFailuresObject*)self;
+  PyObject*		result = 0;
+  static char*		kwlist[] = {"key", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(
+      args, kwds, "s#:reset", kwlist, &key, &key_len))
+    goto error_exit;
+  failures_reset(pamFailures->file, key, key_len);
+  result = Py_None;
+  Py_INCREF(result);
+
+error_exit:
+  return result;
+}
+
+static PyMethodDef PamFailures_Methods[] =
+{
+  {
+    "count",
+    PyCFunctionKwds_cast PamFailures_count,
+    METH_VARARGS|METH_KEYWORDS,
+    MODULE_NAME "." PAMFAILURES_NAME "." "count(key)\n"
+    "  Return the failures counted for the string key in the last window\n"
+    "  seconds."
+  },
+  {
+    "increment",
+    PyCFunctionKwds_cast PamFailures_increment,
+    METH_VARARGS|METH_KEYWORDS,
+    MODULE_NAME "." PAMFAILURES_NAME "." "increment(key)\n"
+    "  Count a failure for the string key, and return count(key)."
+  },
+  {
+    "reset",
+    PyCFunctionKwds_cast PamFailures_reset,
+    METH_VARARGS|METH_KEYWORDS,
+    MODULE_NAME "." PAMFAILURES_NAME "." "reset(key)\n"
+    "  Forget the failures counted for the string key."
+  },
+  {0,0,0,0}        	/* Sentinel */
+};
+
+/*
+ * Python Getter's for the constants.
+ */
+#define	DECLARE_CONSTANT_GET_VALUE(x, v) \
+  static PyObject* PamHandle_Constant_ ## x(PyObject* object, void* closure) { \
+    object = object; \
+    closure = closure; \
+    return PyLong_FromLong(v); \
+  }
+
+#define	DECLARE_CONSTANT_GET(x)	\
+  static PyObject* PamHandle_Constant_ ## x(PyObject* object, void* closure) { \
+    object = object; \
+    closure = closure; \
+    return PyLong_FromLong(x); \
+  }
+
+#ifdef	HAVE_PAM_FAIL_DELAY
+DECLARE_CONSTANT_GET_VALUE(HAVE_PAM_FAIL_DELAY, 1)
+#else
+DECLARE_CONSTANT_GET_VALUE(HAVE_PAM_FAIL_DELAY, 0)
+#endif
+DECLARE_CONSTANT_GET(LOG_ALERT)
+DECLARE_CONSTANT_GET(LOG_CRIT)
+DECLARE_CONSTANT_GET(LOG_DEBUG)
+DECLARE_CONSTANT_GET(LOG_EMERG)
+DECLARE_CONSTANT_GET(LOG_ERR)
+DECLARE_CONSTANT_GET(LOG_INFO)
+DECLARE_CONSTANT_GET(LOG_NOTICE)
+DECLARE_CONSTANT_GET(LOG_WARNING)
+DECLARE_CONSTANT_GET(PAM_ABORT)
+DECLARE_CONSTANT_GET(PAM_ACCT_EXPIRED)
+DECLARE_CONSTANT_GET(PAM_AUTH_ERR)
+DECLARE_CONSTANT_GET(PAM_AUTHINFO_UNAVAIL)
+DECLARE_CONSTANT_GET(PAM_AUTHTOK)
+DECLARE_CONSTANT_GET(PAM_AUTHTOK_DISABLE_AGING)
+DECLARE_CONSTANT_GET(PAM_AUTHTOK_ERR)
+DECLARE_CONSTANT_GET(PAM_AUTHTOK_EXPIRED)
+DECLARE_CONSTANT_GET(PAM_AUTHTOK_LOCK_BUSY)
+#ifdef	PAM_AUTHTOK_RECOVERY_ERR
+DECLARE_CONSTANT_GET(PAM_AUTHTOK_RECOVERY_ERR)
+#endif
+#ifdef	PAM_AUTHTOK_RECOVER_ERR
+DECLARE_CONSTANT_GET(PAM_AUTHTOK_RECOVER_ERR)
+#endif
+#ifdef	PAM_AUTHTOK_TYPE
+DECLARE_CONSTANT_GET(PAM_AUTHTOK_TYPE)
+#endif
+#ifdef PAM_BAD_ITEM
+DECLARE_CONSTANT_GET(PAM_BAD_ITEM)
+#endif
+#ifdef PAM_BINARY_PROMPT
+DECLARE_CONSTANT_GET(PAM_BINARY_PROMPT)
+#endif
+DECLARE_CONSTANT_GET(PAM_BUF_ERR)
+DECLARE_CONSTANT_GET(PAM_CHANGE_EXPIRED_AUTHTOK)
+DECLARE_CONSTANT_GET(PAM_CONV)
+#ifdef PAM_CONV_AGAIN
+DECLARE_CONSTANT_GET(PAM_CONV_AGAIN)
+#endif
+DECLARE_CONSTANT_GET(PAM_CONV_ERR)
+DECLARE_CONSTANT_GET(PAM_CRED_ERR)
+DECLARE_CONSTANT_GET(PAM_CRED_EXPIRED)
+DECLARE_CONSTANT_GET(PAM_CRED_INSUFFICIENT)
+DECLARE_CONSTANT_GET(PAM_CRED_UNAVAIL)
+#ifdef PAM_DATA_REPLACE
+DECLARE_CONSTANT_GET(PAM_DATA_REPLACE)
+#endif
+#ifdef PAM_DATA_SILENT
+DECLARE_CONSTANT_GET(PAM_DATA_SILENT)
+#endif
+DECLARE_CONSTANT_GET(PAM_DELETE_CRED)
+DECLARE_CONSTANT_GET(PAM_DISALLOW_NULL_AUTHTOK)
+DECLARE_CONSTANT_GET(PAM_ERROR_MSG)
+DECLARE_CONSTANT_GET(PAM_ESTABLISH_CRED)
+#ifdef PAM_FAIL_DELAY
+DECLARE_CONSTANT_GET(PAM_FAIL_DELAY)
+#endif
+DECLARE_CONSTANT_GET(PAM_IGNORE)
+#ifdef PAM_INCOMPLETE
+DECLARE_CONSTANT_GET(PAM_INCOMPLETE)
+#endif
+DECLARE_CONSTANT_GET(PAM_MAX_MSG_SIZE)
+DECLARE_CONSTANT_GET(PAM_MAX_NUM_MSG)
+DECLARE_CONSTANT_GET(PAM_MAX_RESP_SIZE)
+DECLARE_CONSTANT_GET(PAM_MAXTRIES)
+DECLARE_CONSTANT_GET(PAM_MODULE_UNKNOWN)
+DECLARE_CONSTANT_GET(PAM_NEW_AUTHTOK_REQD)
+DECLARE_CONSTANT_GET(PAM_NO_MODULE_DATA)
+DECLARE_CONSTANT_GET(PAM_OLDAUTHTOK)
+DECLARE_CONSTANT_GET(PAM_OPEN_ERR)
+DECLARE_CONSTANT_GET(PAM_PERM_DENIED)
+DECLARE_CONSTANT_GET(PAM_PRELIM_CHECK)
+DECLARE_CONSTANT_GET(PAM_PROMPT_ECHO_OFF)
+DECLARE_CONSTANT_GET(PAM_PROMPT_ECHO_ON)
+#ifdef PAM_RADIO_TYPE
+DECLARE_CONSTANT_GET(PAM_RADIO_TYPE)
+#endif
+DECLARE_CONSTANT_GET(PAM_REFRESH_CRED)
+DECLARE_CONSTANT_GET(PAM_REINITIALIZE_CRED)
+DECLARE_CONSTANT_GET(_PAM_RETURN_VALUES)
+DECLARE_CONSTANT_GET(PAM_RHOST)
+DECLARE_CONSTANT_GET(PAM_RUSER)
+DECLARE_CONSTANT_GET(PAM_SERVICE)
+DECLARE_CONSTANT_GET(PAM_SERVICE_ERR)
+DECLARE_CONSTANT_GET(PAM_SESSION_ERR)
+DECLARE_CONSTANT_GET(PAM_SILENT)
+DECLARE_CONSTANT_GET(PAM_SUCCESS)
+DECLARE_CONSTANT_GET(PAM_SYMBOL_ERR)
+DECLARE_CONSTANT_GET(PAM_SYSTEM_ERR)
+DECLARE_CONSTANT_GET(PAM_TEXT_INFO)
+DECLARE_CONSTANT_GET(PAM_TRY_AGAIN)
+DECLARE_CONSTANT_GET(PAM_TTY)
+DECLARE_CONSTANT_GET(PAM_UPDATE_AUTHTOK)
+DECLARE_CONSTANT_GET(PAM_USER)
+DECLARE_CONSTANT_GET(PAM_USER_PROMPT)
+DECLARE_CONSTANT_GET(PAM_USER_UNKNOWN)
+#ifdef	PAM_XAUTHDATA
+DECLARE_CONSTANT_GET(PAM_XAUTHDATA)
+#endif
+#ifdef	PAM_XDISPLAY
+DECLARE_CONSTANT_GET(PAM_XDISPLAY)
+#endif
+
+#define	CONSTANT_GETSET(x) {#x,    PamHandle_Constant_ ## x, 0, 0, 0}
+
+#define	MAKE_GETSET_ITEM(t) \
+  static PyObject* PamHandle_get_##t(PyObject* self, void* closure) \
+  { \
+    closure = closure; \
+    return PamHandle_get_item(self, PAM_##t); \
+  } \
+  static int PamHandle_set_##t(PyObject* self, PyObject* pyValue, void* closure) \
+  { \
+    closure = closure; \
+    return PamHandle_set_item(self, PAM_##t, "PAM_" #t, pyValue); \
+  }
+
+MAKE_GETSET_ITEM(AUTHTOK)
+#ifdef	PAM_AUTHTOK_TYPE
+MAKE_GETSET_ITEM(AUTHTOK_TYPE)
+#endif
+MAKE_GETSET_ITEM(OLDAUTHTOK)
+MAKE_GETSET_ITEM(RHOST)
+MAKE_GETSET_ITEM(RUSER)
+MAKE_GETSET_ITEM(SERVICE)
+MAKE_GETSET_ITEM(TTY)
+MAKE_GETSET_ITEM(USER)
+MAKE_GETSET_ITEM(USER_PROMPT)
+#ifdef	PAM_XDISPLAY
+MAKE_GETSET_ITEM(XDISPLAY)
+#endif
+
+#ifdef	PAM_XAUTHDATA
+/*
+ * The PAM_XAUTHDATA item doesn't take strings like the rest of them.
+ * It wants a pam_xauth_data structure.
+ */
+static PyObject* PamHandle_get_XAUTHDATA(PyObject* self, void* closure)
+{
+  PamHandleObject*	pamHandle = (PamHandleObject*)self;
+  PyObject*		newargs = 0;
+  PyObject*		result = 0;
+  int			pam_result;
+  struct pam_xauth_data* xauth_data = 0;
+
+  closure = closure;
+  pam_result = pam_get_item(
+      pamHandle->pamh, PAM_XAUTHDATA, (const void**)&xauth_data);
+  if (check_pam_result(pamHandle, pam_result) == -1)
+    goto error_exit;
+  /*
+   * Linux-PAM hands back an empty pam_xauth_data if it isn't set.
+   */
+  if (xauth_data == 0 || xauth_data->name == 0)
+  {
+    result = Py_None;
+    Py_INCREF(result);
+  }
+  else
+  {
+    newargs = Py_BuildValue(
+        "s#s#",
+	xauth_data->name, (Py_ssize_t)xauth_data->namelen,
+	xauth_data->data, (Py_ssize_t)xauth_data->datalen);
+    if (newargs == 0)
+      goto error_exit;
+    result = pamHandle->xauthdata->tp_new(pamHandle->xauthdata, newargs, 0);
+    if (result == 0)
+      goto error_exit;
+  }
+
+error_exit:
+  py_xdecref(newargs);
+  return result;
+}
+
+static int PamHandle_set_XAUTHDATA(
+    PyObject* self, PyObject* pyValue, void* closure)
+{
+  PamHandleObject*	pamHandle = (PamHandleObject*)self;
+  PyObject*		name = 0;
+  PyObject*		data = 0;
+  int			result = -1;
+  Py_ssize_t		data_len;
+  const char*		data_str;
+  Py_ssize_t		name_len;
+  const char*		name_str;
+  int			pam_result;
+  struct pam_xauth_data	xauth_data;
+
+  closure = closure;
+  xauth_data.name = 0;
+  xauth_data.data = 0;
+  /*
+   * Get the name.
+   */
+  name = PyObject_GetAttrString(pyValue, "name");
+  if (name == 0)
+    goto error_exit;
+  name_str = PyUnicode_Check(name) ?
+      PyUnicode_AsUTF8AndSize(name, &name_len) : 0;
+  if (name_str == 0)
+  {
+    PyErr_SetString(PyExc_TypeError, "xauthdata.name must be a string");
+    goto error_exit;
+  }
+  xauth_data.name = strdup(name_str);
+  if (xauth_data.name == 0)
+  {
+    PyErr_NoMemory();
+    goto error_exit;
+  }
+  xauth_data.namelen = name_len;
+  /*
+   * Get the data.
+   */
+  data = PyObject_GetAttrString(pyValue, "data");
+  if (data == 0)
+    goto error_exit;
+  data_str = PyUnicode_Check(data) ?
+      PyUnicode_AsUTF8AndSize(data, &data_len) : 0;
+  if (data_str == 0)
+  {
+    PyErr_SetString(PyExc_TypeError, "xauthdata.data must be a string");
+    goto error_exit;
+  }
+  xauth_data.data = strdup(data_str);
+  if (xauth_data.data == 0)
+  {
+    PyErr_NoMemory();
+    goto error_exit;
+  }
+  xauth_data.datalen = data_len;
+  /*
+   * Set the item.  If that worked PAM will have swallowed the strings inside
+   * of it, so we must not free them.
+   */
+  pam_result = pam_set_item(pamHandle->pamh, PAM_XAUTHDATA, &xauth_data);
+  if (pam_result == PAM_SUCCESS)
+  {
+    xauth_data.name = 0;
+    xauth_data.data = 0;
+  }
+  result = check_pam_result(pamHandle, pam_result);
+
+error_exit:
+  py_xdecref(data);
+  py_xdecref(name);
+  if (xauth_data.name != 0)
+    free(xauth_data.name);
+  if (xauth_data.data != 0)
+    free(xauth_data.data);
+  return result;
+}
+#endif
+
+/*
+ * Getters and setters.
+ */
+static PyGetSetDef PamHandle_Getset[] =
+{
+  /*
+   * Items.
+   */
+  {"authtok",     PamHandle_get_AUTHTOK,     PamHandle_set_AUTHTOK,     "Authentication token", 0},
+#ifdef	PAM_AUTHTOK_TYPE
+  {"authtok_type",PamHandle_get_AUTHTOK_TYPE,PamHandle_set_AUTHTOK_TYPE,"XXX in the \"New XXX password:\" prompt", 0},
+#endif
+  {"oldauthtok",  PamHandle_get_OLDAUTHTOK,  PamHandle_set_OLDAUTHTOK,  "Old authentication token", 0},
+  {"rhost",       PamHandle_get_RHOST,       PamHandle_set_RHOST,       "Requesting host name", 0},
+  {"ruser",       PamHandle_get_RUSER,       PamHandle_set_RUSER,       "Requesting user name", 0},
+  {"service",     PamHandle_get_SERVICE,     PamHandle_set_SERVICE,     "Service (pam stack) name", 0},
+  {"tty",         PamHandle_get_TTY,         PamHandle_set_TTY,         "Terminal name", 0},
+  {"user",        PamHandle_get_USER,        PamHandle_set_USER,        "Authorized user name", 0},
+  {"user_prompt", PamHandle_get_USER_PROMPT, PamHandle_set_USER_PROMPT, "Prompt asking for users name", 0},
+#ifdef	PAM_XAUTHDATA
+  {"xauthdata",	  PamHandle_get_XAUTHDATA,   PamHandle_set_XAUTHDATA,   "The name of the X display ($DISPLAY)", 0},
+#endif
+#ifdef	PAM_XDISPLAY
+  {"xdisplay",	  PamHandle_get_XDISPLAY,    PamHandle_set_XDISPLAY,    "The name of the X display ($DISPLAY)", 0},
+#endif
+  /*
+   * Constants.
+   */
+  CONSTANT_GETSET(HAVE_PAM_FAIL_DELAY),
+  CONSTANT_GETSET(LOG_ALERT),
+  CONSTANT_GETSET(LOG_CRIT),
+  CONSTANT_GETSET(LOG_DEBUG),
+  CONSTANT_GETSET(LOG_EMERG),
+  CONSTANT_GETSET(LOG_ERR),
+  CONSTANT_GETSET(LOG_INFO),
+  CONSTANT_GETSET(LOG_NOTICE),
+  CONSTANT_GETSET(LOG_WARNING),
+  CONSTANT_GETSET(PAM_ABORT),
+  CONSTANT_GETSET(PAM_ACCT_EXPIRED),
+  CONSTANT_GETSET(PAM_AUTH_ERR),
+  CONSTANT_GETSET(PAM_AUTHINFO_UNAVAIL),
+  CONSTANT_GETSET(PAM_AUTHTOK),
+  CONSTANT_GETSET(PAM_AUTHTOK_DISABLE_AGING),
   CONSTANT_GETSET(PAM_AUTHTOK_ERR),
   CONSTANT_GETSET(PAM_AUTHTOK_EXPIRED),
   CONSTANT_GETSET(PAM_AUTHTOK_LOCK_BUSY),
 #ifdef	PAM_AUTHTOK_RECOVERY_ERR
   CONSTANT_GETSET(PAM_AUTHTOK_RECOVERY_ERR),
 #endif
-#ifdef 	PAM_AUTHTOK_RECOVER_ERR
-  CONSTANT_GETSET(PAM_AUTHTOK_RECOVER_ERR),
+#ifdef 	PAM_AUTHTOK_RECOVER_ERR
+  CONSTANT_GETSET(PAM_AUTHTOK_RECOVER_ERR),
+#endif
+#ifdef	PAM_AUTHTOK_TYPE
+  CONSTANT_GETSET(PAM_AUTHTOK_TYPE),
+#endif
+#ifdef PAM_BAD_ITEM
+  CONSTANT_GETSET(PAM_BAD_ITEM),
+#endif
+#ifdef PAM_BINARY_PROMPT
+  CONSTANT_GETSET(PAM_BINARY_PROMPT),
+#endif
+  CONSTANT_GETSET(PAM_BUF_ERR),
+  CONSTANT_GETSET(PAM_CHANGE_EXPIRED_AUTHTOK),
+  CONSTANT_GETSET(PAM_CONV),
+#ifdef PAM_CONV_AGAIN
+  CONSTANT_GETSET(PAM_CONV_AGAIN),
+#endif
+  CONSTANT_GETSET(PAM_CONV_ERR),
+  CONSTANT_GETSET(PAM_CRED_ERR),
+  CONSTANT_GETSET(PAM_CRED_EXPIRED),
+  CONSTANT_GETSET(PAM_CRED_INSUFFICIENT),
+  CONSTANT_GETSET(PAM_CRED_UNAVAIL),
+#ifdef PAM_DATA_REPLACE
+  CONSTANT_GETSET(PAM_DATA_REPLACE),
+#endif
+#ifdef PAM_DATA_SILENT
+  CONSTANT_GETSET(PAM_DATA_SILENT),
+#endif
+  CONSTANT_GETSET(PAM_DELETE_CRED),
+  CONSTANT_GETSET(PAM_DISALLOW_NULL_AUTHTOK),
+  CONSTANT_GETSET(PAM_ERROR_MSG),
+  CONSTANT_GETSET(PAM_ESTABLISH_CRED),
+#ifdef PAM_FAIL_DELAY
+  CONSTANT_GETSET(PAM_FAIL_DELAY),
+#endif
+  CONSTANT_GETSET(PAM_IGNORE),
+#ifdef PAM_INCOMPLETE
+  CONSTANT_GETSET(PAM_INCOMPLETE),
+#endif
+  CONSTANT_GETSET(PAM_MAX_MSG_SIZE),
+  CONSTANT_GETSET(PAM_MAX_NUM_MSG),
+  CONSTANT_GETSET(PAM_MAX_RESP_SIZE),
+  CONSTANT_GETSET(PAM_MAXTRIES),
+  CONSTANT_GETSET(PAM_MODULE_UNKNOWN),
+  CONSTANT_GETSET(PAM_NEW_AUTHTOK_REQD),
+  CONSTANT_GETSET(PAM_NO_MODULE_DATA),
+  CONSTANT_GETSET(PAM_OLDAUTHTOK),
+  CONSTANT_GETSET(PAM_OPEN_ERR),
+  CONSTANT_GETSET(PAM_PERM_DENIED),
+  CONSTANT_GETSET(PAM_PRELIM_CHECK),
+  CONSTANT_GETSET(PAM_PROMPT_ECHO_OFF),
+  CONSTANT_GETSET(PAM_PROMPT_ECHO_ON),
+#ifdef PAM_RADIO_TYPE
+  CONSTANT_GETSET(PAM_RADIO_TYPE),
+#endif
+  CONSTANT_GETSET(PAM_REFRESH_CRED),
+  CONSTANT_GETSET(PAM_REINITIALIZE_CRED),
+  CONSTANT_GETSET(_PAM_RETURN_VALUES),
+  CONSTANT_GETSET(PAM_RHOST),
+  CONSTANT_GETSET(PAM_RUSER),
+  CONSTANT_GETSET(PAM_SERVICE),
+  CONSTANT_GETSET(PAM_SERVICE_ERR),
+  CONSTANT_GETSET(PAM_SESSION_ERR),
+  CONSTANT_GETSET(PAM_SILENT),
+  CONSTANT_GETSET(PAM_SUCCESS),
+  CONSTANT_GETSET(PAM_SYMBOL_ERR),
+  CONSTANT_GETSET(PAM_SYSTEM_ERR),
+  CONSTANT_GETSET(PAM_TEXT_INFO),
+  CONSTANT_GETSET(PAM_TRY_AGAIN),
+  CONSTANT_GETSET(PAM_TTY),
+  CONSTANT_GETSET(PAM_UPDATE_AUTHTOK),
+  CONSTANT_GETSET(PAM_USER),
+  CONSTANT_GETSET(PAM_USER_PROMPT),
+  CONSTANT_GETSET(PAM_USER_UNKNOWN),
+#ifdef  PAM_XAUTHDATA
+  CONSTANT_GETSET(PAM_XAUTHDATA),
+#endif
+#ifdef	PAM_XDISPLAY
+  CONSTANT_GETSET(PAM_XDISPLAY),
+#endif
+  {0,0,0,0,0}        	/* Sentinel */
+};
+
+/*
+ * Convert a PamHandleObject.Message style object to a pam_message structure.
+ */
+static int PamHandle_conversation_2message(
+    struct pam_message* message, PyObject* object)
+{
+  PyObject*		msg = 0;
+  PyObject*		msg_style = 0;
+  int			result = -1;
+
+  msg_style = PyObject_GetAttrString(object, "msg_style");
+  if (msg_style == 0)
+    goto error_exit;
+  if (!PyLong_Check(msg_style))
+  {
+    PyErr_SetString(PyExc_TypeError, "message.msg_style must be an int");
+    goto error_exit;
+  }
+  message->msg_style = PyLong_AsLong(msg_style);
+  msg = PyObject_GetAttrString(object, "msg");
+  if (msg == 0)
+    goto error_exit;
+  message->msg = PyUnicode_AsUTF8(msg);
+  if (message->msg == 0)
+  {
+    PyErr_SetString(PyExc_TypeError, "message.msg must be a string");
+    goto error_exit;
+  }
+  result = 0;
+
+error_exit:
+  py_xdecref(msg);
+  py_xdecref(msg_style);
+  return result;
+}
+
+/*
+ * Convert a pam_response structure to a PamHandleObject.Response object.
+ */
+static PyObject* PamHandle_conversation_2response(
+    PamHandleObject* pamHandle, struct pam_response* pam_response)
+{
+  PyObject*		newargs;
+  PyObject*  		result = 0;
+
+  newargs = Py_BuildValue("si", pam_response->resp, pam_response->resp_retcode);
+  if (newargs == 0)
+    goto error_exit;
+  result = pamHandle->response->tp_new(pamHandle->response, newargs, 0);
+  if (result == 0)
+    goto error_exit;
+
+error_exit:
+  py_xdecref(newargs);
+  return result;
+}
+
+/*
+ * Overwrite a malloc'ed string then free it.  The writes go through a
+ * volatile pointer so the compiler can't drop them as dead stores.
+ */
+static void wipe_free(char* string)
+{
+  volatile char*	p;
+
+  for (p = string; *p != '\0'; p += 1)
+    *p = '\0';
+  free(string);
+}
+
+/*
+ * A call that may use pamh with the GIL released, on its thread's list
+ * of them.  cleanup_pamHandle() waits for the calls other threads are
+ * making, but not its own thread's, as the conversation function may
+ * well call pam_end().
+ */
+typedef struct PamCall
+{
+  struct PamCall*	next;		/* Next on pam_calls_here */
+  PamHandleObject*	pamHandle;	/* The handle it uses */
+} PamCall;
+
+static __thread PamCall*	pam_calls_here = 0;
+
+static void pam_call_enter(PamCall* call, PamHandleObject* pamHandle)
+{
+  call->pamHandle = pamHandle;
+  call->next = pam_calls_here;
+  pam_calls_here = call;
+  pamHandle->pam_calls += 1;
+}
+
+static void pam_call_leave(PamCall* call)
+{
+  pam_calls_here = call->next;
+  call->pamHandle->pam_calls -= 1;
+}
+
+/*
+ * Return how many of the handle's calls are being made by this thread.
+ */
+static int pam_calls_own(PamHandleObject* pamHandle)
+{
+  PamCall*		call;
+  int			count = 0;
+
+  for (call = pam_calls_here; call != 0; call = call->next)
+    count += call->pamHandle == pamHandle;
+  return count;
+}
+
+/*
+ * Run a PAM "conversation".
+ */
+static PyObject* PamHandle_conversation(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  PamCall		call;
+  int			err;
+  PamHandleObject*	pamHandle = (PamHandleObject*)self;
+  PyObject*		prompts = 0;
+  PyObject*		result_tuple = 0;
+  struct pam_message*	message_array = 0;
+  struct pam_message**	message_vector = 0;
+  struct pam_response*	response_array = 0;
+  PyObject*		result = 0;
+  PyObject*		response = 0;
+  const struct pam_conv*conv;
+  double		conv_seconds;
+  double		conv_start;
+  int			prompt_count = 0;
+  int			i;
+  int			pam_result;
+  int			prompts_is_sequence;
+  int			py_result;
+  static char*		kwlist[] = {"prompts", NULL};
+
+  pam_call_enter(&call, pamHandle);
+  err = PyArg_ParseTupleAndKeywords(
+      args, kwds, "O:conversation", kwlist,
+      &prompts);
+  if (!err)
+    goto error_exit;
+  pam_result = pam_get_item(pamHandle->pamh, PAM_CONV, (const void**)&conv);
+  if (check_pam_result(pamHandle, pam_result) == -1)
+    goto error_exit;
+  prompts_is_sequence = PySequence_Check(prompts);
+  if (!prompts_is_sequence)
+    prompt_count = 1;
+  else
+  {
+    prompt_count = PySequence_Size(prompts);
+    if (prompt_count == 0)
+    {
+      result = prompts;
+      Py_INCREF(result);
+      goto error_exit;
+    }
+  }
+  message_array = PyMem_Malloc(prompt_count * sizeof(*message_array));
+  if (message_array == 0)
+  {
+    PyErr_NoMemory();
+    goto error_exit;
+  }
+  if (!prompts_is_sequence)
+  {
+    py_result = PamHandle_conversation_2message(message_array, prompts);
+    if (py_result == -1)
+      goto error_exit;
+  }
+  else
+  {
+    for (i = 0; i < prompt_count; i += 1)
+    {
+      PyObject* message = PySequence_ITEM(prompts, i);
+      if (message == 0)
+        goto error_exit;
+      py_result = PamHandle_conversation_2message(&message_array[i], message);
+      Py_DECREF(message);
+      if (py_result == -1)
+        goto error_exit;
+    }
+  }
+  message_vector = PyMem_Malloc(prompt_count * sizeof(*message_vector));
+  if (message_vector == 0)
+  {
+    PyErr_NoMemory();
+    goto error_exit;
+  }
+  for (i = 0; i < prompt_count; i += 1)
+    message_vector[i] = &message_array[i];
+  PROBE3(
+      conv__start, get_module_path(pamHandle),
+      probe_service(pamHandle->pamh), prompt_count);
+  if (pamHandle->deadline != 0)
+    watchdog_pause(pamHandle->deadline);
+  conv_start = monotonic_time();
+  Py_BEGIN_ALLOW_THREADS
+  pam_result = conv->conv(
+    prompt_count, (const struct pam_message**)message_vector,
+    &response_array, conv->appdata_ptr);
+  Py_END_ALLOW_THREADS
+  conv_seconds = monotonic_time() - conv_start;
+  pamHandle->trace_conv += conv_seconds;
+  if (pamHandle->deadline != 0)
+    watchdog_resume(pamHandle->deadline, conv_seconds);
+  if (pamHandle->record != 0)
+  {
+    record_conversation(
+        pamHandle, prompt_count, message_array, response_array, pam_result);
+  }
+  PROBE3(
+      conv__end, get_module_path(pamHandle),
+      probe_service(pamHandle->pamh), pam_result);
+  if (check_pam_result(pamHandle, pam_result) == -1)
+    goto error_exit;
+  if (!prompts_is_sequence)
+    result = PamHandle_conversation_2response(pamHandle, response_array);
+  else
+  {
+    result_tuple = PyTuple_New(prompt_count);
+    if (result_tuple == 0)
+      goto error_exit;
+    for (i = 0; i < prompt_count; i += 1)
+    {
+      response = PamHandle_conversation_2response(
+          pamHandle, &response_array[i]);
+      if (response == 0)
+        goto error_exit;
+      if (PyTuple_SetItem(result_tuple, i, response) == -1)
+	goto error_exit;
+      response = 0;			/* was stolen */
+    }
+    result = result_tuple;
+    result_tuple = 0;
+  }
+
+error_exit:
+  py_xdecref(response);
+  py_xdecref(result_tuple);
+  PyMem_Free(message_array);
+  PyMem_Free(message_vector);
+  /*
+   * The conversation function mallocs each response as well as the
+   * array.  They are usually passwords, so wipe them on the way out.
+   */
+  if (response_array != 0)
+  {
+    for (i = 0; i < prompt_count; i += 1)
+    {
+      if (response_array[i].resp != 0)
+	wipe_free(response_array[i].resp);
+    }
+    free(response_array);
+  }
+  pam_call_leave(&call);
+  return result;
+}
+
+/*
+ * Set the fail delay.
+ */
+static PyObject* PamHandle_fail_delay(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  int			err;
+  int			micro_sec = 0;
+  int			pam_result;
+  PyObject*		result = 0;
+  static char*		kwlist[] = {"micro_sec", NULL};
+
+  err = PyArg_ParseTupleAndKeywords(
+      args, kwds, "i:fail_delay", kwlist,
+      &micro_sec);
+  if (!err)
+    goto error_exit;
+#ifndef HAVE_PAM_FAIL_DELAY
+  (void)self;
+#else
+  {
+    PamHandleObject*	pamHandle = (PamHandleObject*)self;
+    pam_result = pam_fail_delay(pamHandle->pamh, micro_sec);
+    if (check_pam_result(pamHandle, pam_result) == -1)
+      goto error_exit;
+  }
 #endif
+  result = Py_None;
+  Py_INCREF(result);
+
+error_exit:
+  return result;
+}
+
+/*
+ * Get the user's name, promping if it isn't known.
+ */
+static PyObject* PamHandle_get_user(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  PamCall		call;
+  PamHandleObject*	pamHandle = (PamHandleObject*)self;
+  char*			prompt = 0;
+  PyObject*		result = 0;
+  int			pam_result;
+  const char*		user = 0;
+  static char*		kwlist[] = {"prompt", NULL};
+
+  pam_call_enter(&call, pamHandle);
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|z:get_user", kwlist, &prompt))
+    goto error_exit;
+  Py_BEGIN_ALLOW_THREADS
+  pam_result = pam_get_user(pamHandle->pamh, &user, prompt);
+  Py_END_ALLOW_THREADS
+  if (check_pam_result(pamHandle, pam_result) == -1)
+    goto error_exit;
+  if (user != 0)
+    result = PyUnicode_FromString(user);
+  else
+  {
+    result = Py_None;
+    Py_INCREF(result);
+  }
+  if (result == 0)
+    goto error_exit;
+
+error_exit:
+  pam_call_leave(&call);
+  return result;
+}
+
+/*
+ * Return an awaitable that runs self.method_name(*args, **kwds) in the
+ * running event loop's default executor, so a coroutine handler isn't
+ * stalled while PAM blocks.  Cancelling the awaitable doesn't stop the
+ * executor thread, so it may still be in the method when the handle is
+ * destroyed.  It is a PamCall, so cleanup_pamHandle() waits for it.
+ */
+static PyObject* PamHandle_run_in_executor(
+    PyObject* self, const char* method_name, PyObject* args, PyObject* kwds)
+{
+  PyObject*		asyncio = 0;
+  PyObject*		call = 0;
+  PyObject*		call_args = 0;
+  PyObject*		functools = 0;
+  PyObject*		loop = 0;
+  PyObject*		method = 0;
+  PyObject*		method_tuple = 0;
+  PyObject*		partial = 0;
+  PyObject*		result = 0;
+
+  asyncio = PyImport_ImportModule("asyncio");
+  if (asyncio == 0)
+    goto error_exit;
+  loop = PyObject_CallMethod(asyncio, "get_running_loop", 0);
+  if (loop == 0)
+    goto error_exit;
+  functools = PyImport_ImportModule("functools");
+  if (functools == 0)
+    goto error_exit;
+  partial = PyObject_GetAttrString(functools, "partial");
+  if (partial == 0)
+    goto error_exit;
+  method = PyObject_GetAttrString(self, method_name);
+  if (method == 0)
+    goto error_exit;
+  method_tuple = PyTuple_Pack(1, method);
+  if (method_tuple == 0)
+    goto error_exit;
+  call_args = PySequence_Concat(method_tuple, args);
+  if (call_args == 0)
+    goto error_exit;
+  call = PyObject_Call(partial, call_args, kwds);
+  if (call == 0)
+    goto error_exit;
+  result = PyObject_CallMethod(loop, "run_in_executor", "OO", Py_None, call);
+
+error_exit:
+  py_xdecref(asyncio);
+  py_xdecref(call);
+  py_xdecref(call_args);
+  py_xdecref(functools);
+  py_xdecref(loop);
+  py_xdecref(method);
+  py_xdecref(method_tuple);
+  py_xdecref(partial);
+  return result;
+}
+
+static PyObject* PamHandle_conversation_async(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  return PamHandle_run_in_executor(self, "conversation", args, kwds);
+}
+
+static PyObject* PamHandle_get_user_async(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  return PamHandle_run_in_executor(self, "get_user", args, kwds);
+}
+
+/*
+ * Translate between Python's logging levels and syslog priorities.
+ */
+static int log_logging2priority(long levelno)
+{
+  if (levelno >= 50)			/* logging.CRITICAL */
+    return LOG_CRIT;
+  if (levelno >= 40)			/* logging.ERROR */
+    return LOG_ERR;
+  if (levelno >= 30)			/* logging.WARNING */
+    return LOG_WARNING;
+  if (levelno >= 20)			/* logging.INFO */
+    return LOG_INFO;
+  return LOG_DEBUG;
+}
+
+static long log_priority2logging(int priority)
+{
+  if (priority >= LOG_DEBUG)
+    return 10;				/* logging.DEBUG */
+  if (priority >= LOG_NOTICE)
+    return 20;				/* logging.INFO */
+  if (priority >= LOG_WARNING)
+    return 30;				/* logging.WARNING */
+  if (priority >= LOG_ERR)
+    return 40;				/* logging.ERROR */
+  return 50;				/* logging.CRITICAL */
+}
+
+/*
+ * Write a message to syslog using the modules ident.  The message may not
+ * be a string (eg a class's __mod__ returned something else) so coerce it.
+ */
+static int log_write(
+    PamHandleObject* pamHandle, int priority, PyObject* message)
+{
+  const char*		ident;
+  PyObject*		str_message = 0;
+  const char*		utf8_message;
+
+  if (PyUnicode_Check(message))
+  {
+    str_message = message;
+    Py_INCREF(str_message);
+  }
+  else
+  {
+    str_message = PyObject_Str(message);
+    if (str_message == 0)
+      return -1;
+  }
+  ident = PyUnicode_AsUTF8(pamHandle->log_ident);
+  utf8_message = PyUnicode_AsUTF8(str_message);
+  if (ident == 0 || utf8_message == 0)
+  {
+    Py_DECREF(str_message);
+    return -1;
+  }
+  syslog_write(ident, priority, "%s", utf8_message);
+  Py_DECREF(str_message);
+  return 0;
+}
+
+/*
+ * Log a message.  The level is checked before anything else is looked at,
+ * so a disabled message costs little more than the call itself.
+ */
+static PyObject* PamHandle_log(PyObject* self, PyObject* args)
+{
+  PamHandleObject*	pamHandle = (PamHandleObject*)self;
+  PyObject*		fmt;
+  PyObject*		fmt_args = 0;
+  long			level;
+  PyObject*		message = 0;
+  PyObject*		result = 0;
+
+  if (PyTuple_GET_SIZE(args) < 2)
+  {
+    PyErr_SetString(
+        PyExc_TypeError, "log() takes at least 2 arguments (level, fmt)");
+    goto error_exit;
+  }
+  level = PyLong_AsLong(PyTuple_GET_ITEM(args, 0));
+  if (level == -1 && PyErr_Occurred())
+    goto error_exit;
+  if (level > pamHandle->log_level)
+  {
+    result = Py_None;
+    Py_INCREF(result);
+    goto error_exit;
+  }
+  if (level < LOG_EMERG || level > LOG_DEBUG)
+  {
+    PyErr_SetString(PyExc_ValueError, "log() level must be a pamh.LOG_???");
+    goto error_exit;
+  }
+  fmt = PyTuple_GET_ITEM(args, 1);
+  if (!PyUnicode_Check(fmt))
+  {
+    PyErr_SetString(PyExc_TypeError, "log() fmt must be a string");
+    goto error_exit;
+  }
+  /*
+   * Like the logging module, fmt is only used as a format if there are
+   * arguments for it.
+   */
+  if (PyTuple_GET_SIZE(args) == 2)
+  {
+    message = fmt;
+    Py_INCREF(message);
+  }
+  else
+  {
+    fmt_args = PyTuple_GetSlice(args, 2, PyTuple_GET_SIZE(args));
+    if (fmt_args == 0)
+      goto error_exit;
+    message = PyNumber_Remainder(fmt, fmt_args);
+    if (message == 0)
+      goto error_exit;
+  }
+  if (log_write(pamHandle, level, message) == -1)
+    goto error_exit;
+  result = Py_None;
+  Py_INCREF(result);
+
+error_exit:
+  py_xdecref(fmt_args);
+  py_xdecref(message);
+  return result;
+}
+
+/*
+ * logging.Handler.emit() for the handler returned by pamh.log_handler().
+ * It is bound to the PamHandle, not the handler.
+ */
+static PyObject* PamHandle_log_emit(PyObject* self, PyObject* record)
+{
+  PamHandleObject*	pamHandle = (PamHandleObject*)self;
+  PyObject*		levelno = 0;
+  PyObject*		message = 0;
+  int			priority;
+  PyObject*		result = 0;
+
+  levelno = PyObject_GetAttrString(record, "levelno");
+  if (levelno == 0)
+    goto error_exit;
+  priority = log_logging2priority(PyLong_AsLong(levelno));
+  if (PyErr_Occurred())
+    goto error_exit;
+  if (priority <= pamHandle->log_level)
+  {
+    message = PyObject_CallMethod(record, "getMessage", 0);
+    if (message == 0 || log_write(pamHandle, priority, message) == -1)
+    {
+      /*
+       * Logging must not fail the caller, so report it the way we report
+       * everything else.
+       */
+      syslog_exception(pamHandle, "pamh.log_handler() can't log a record");
+    }
+  }
+  result = Py_None;
+  Py_INCREF(result);
+
+error_exit:
+  py_xdecref(levelno);
+  py_xdecref(message);
+  return result;
+}
+
+static PyMethodDef PamHandle_log_emit_def =
+{
+  "emit",
+  PamHandle_log_emit,
+  METH_O,
+  "Log the logging.LogRecord passed using " MODULE_NAME "." PAMHANDLE_NAME ".log()"
+};
+
+/*
+ * Return a logging.Handler that writes to pamh.log().  The logging module
+ * is only imported if this is called.
+ */
+static PyObject* PamHandle_log_handler(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  PamHandleObject*	pamHandle = (PamHandleObject*)self;
+  PyObject*		emit = 0;
+  PyObject*		handler = 0;
+  PyObject*		logging_module = 0;
+  PyObject*		result = 0;
+  static char*		kwlist[] = {NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, ":log_handler", kwlist))
+    goto error_exit;
+  logging_module = PyImport_ImportModule("logging");
+  if (logging_module == 0)
+    goto error_exit;
+  handler = PyObject_CallMethod(
+      logging_module, "Handler", "l",
+      log_priority2logging(pamHandle->log_level));
+  if (handler == 0)
+    goto error_exit;
+  /*
+   * An instance attribute overrides the method defined by the class.
+   */
+  emit = PyCFunction_New(&PamHandle_log_emit_def, self);
+  if (emit == 0)
+    goto error_exit;
+  if (PyObject_SetAttrString(handler, "emit", emit) == -1)
+    goto error_exit;
+  result = handler;
+  handler = 0;
+
+error_exit:
+  py_xdecref(emit);
+  py_xdecref(handler);
+  py_xdecref(logging_module);
+  return result;
+}
+
+/*
+ * Return a Span that records how long a with block took.
+ */
+static PyObject* PamHandle_span(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  PamHandleObject*	pamHandle = (PamHandleObject*)self;
+  PyObject*		name = 0;
+  PamSpanObject*	pamSpan = 0;
+  static char*		kwlist[] = {"name", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(
+      args, kwds, "U:span", kwlist, &name))
+    return 0;
+  pamSpan = (PamSpanObject*)pamHandle->span->tp_alloc(pamHandle->span, 0);
+  if (pamSpan == 0)
+    return 0;
+  pamSpan->name = name;
+  Py_INCREF(pamSpan->name);
+  pamSpan->pamHandle = self;
+  Py_INCREF(pamSpan->pamHandle);
+  return (PyObject*)pamSpan;
+}
+
+/*
+ * Return the circuit breaker called name, making it if this is the first
+ * time this handle has asked for it.  A threshold or reset given when
+ * asking again replaces the one it was made with.
+ */
+static PyObject* PamHandle_breaker(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  StatsModule*		module;
+  PyObject*		name = 0;
+  const char*		name_str;
+  PamBreakerObject*	pamBreaker = 0;
+  PamHandleObject*	pamHandle = (PamHandleObject*)self;
+  double		reset = 30;
+  PyObject*		reset_obj = 0;
+  PyObject*		result = 0;
+  long			threshold = 5;
+  PyObject*		threshold_obj = 0;
+  static char*		kwlist[] = {"name", "threshold", "reset", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(
+      args, kwds, "U|OO:breaker", kwlist, &name, &threshold_obj, &reset_obj))
+    goto error_exit;
+  name_str = PyUnicode_AsUTF8(name);
+  if (name_str == 0)
+    goto error_exit;
+  if (threshold_obj != 0)
+  {
+    threshold = PyLong_AsLong(threshold_obj);
+    if (threshold == -1 && PyErr_Occurred())
+      goto error_exit;
+  }
+  if (reset_obj != 0)
+  {
+    reset = PyFloat_AsDouble(reset_obj);
+    if (reset == -1 && PyErr_Occurred())
+      goto error_exit;
+  }
+  if (strlen(name_str) >= sizeof(pamBreaker->private_breaker.name) ||
+      threshold <= 0 || threshold > INT_MAX || !(reset > 0))
+  {
+    PyErr_SetString(
+        PyExc_ValueError, "breaker name too long, or threshold or reset not positive");
+    goto error_exit;
+  }
+  if (pamHandle->breakers == 0)
+  {
+    pamHandle->breakers = PyDict_New();
+    if (pamHandle->breakers == 0)
+      goto error_exit;
+  }
+  result = PyDict_GetItem(pamHandle->breakers, name);
+  if (result != 0)
+  {
+    if (threshold_obj != 0)
+      ((PamBreakerObject*)result)->threshold = (int)threshold;
+    if (reset_obj != 0)
+      ((PamBreakerObject*)result)->reset = reset;
+    Py_INCREF(result);
+    goto error_exit;
+  }
+  pamBreaker = (PamBreakerObject*)pamHandle->breaker->tp_alloc(
+      pamHandle->breaker, 0);
+  if (pamBreaker == 0)
+    goto error_exit;
+  pamBreaker->name = name;
+  Py_INCREF(pamBreaker->name);
+  pamBreaker->reset = reset;
+  pamBreaker->threshold = (int)threshold;
+  pamBreaker->breaker = &pamBreaker->private_breaker;
+  /*
+   * A breaker that isn't shared would start afresh each transaction and
+   * never open, so not being able to share it is an error.
+   */
+  module = stats_open(
+      get_state_dir(pamHandle), get_module_path(pamHandle), &pamBreaker->file);
+  if (module == 0)
+  {
+    PyErr_Format(
+	PyExc_RuntimeError, "breaker %s can't be shared, no stats file in %s",
+	name_str, get_state_dir(pamHandle));
+    goto error_exit;
+  }
+  pamBreaker->breaker = breaker_find(module, name_str);
+  if (pamBreaker->breaker == 0)
+  {
+    pamBreaker->breaker = &pamBreaker->private_breaker;
+    PyErr_Format(
+	PyExc_RuntimeError, "breaker %s can't be shared, the module has %d already",
+	name_str, STATS_BREAKER_COUNT);
+    goto error_exit;
+  }
+  if (PyDict_SetItem(pamHandle->breakers, name, (PyObject*)pamBreaker) == -1)
+    goto error_exit;
+  result = (PyObject*)pamBreaker;
+  pamBreaker = 0;
+
+error_exit:
+  py_xdecref((PyObject*)pamBreaker);
+  return result;
+}
+
+/*
+ * Run function every interval seconds on the scheduler thread.
+ */
+static PyObject* PamHandle_schedule(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  PyObject*		function = 0;
+  double		interval = 0;
+  double		jitter = 0.1;
+  PyObject*		module;
+  PamHandleObject*	pamHandle = (PamHandleObject*)self;
+  PamTaskObject*	pamTask = 0;
+  PyObject*		result = 0;
+  static char*		kwlist[] = {"interval", "function", "jitter", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(
+      args, kwds, "dO|d:schedule", kwlist, &interval, &function, &jitter))
+    goto error_exit;
+  if (!PyCallable_Check(function))
+  {
+    PyErr_SetString(PyExc_TypeError, "schedule function isn't callable");
+    goto error_exit;
+  }
+  if (!(interval > 0) || !(jitter >= 0 && jitter < 1))
+  {
+    PyErr_SetString(
+        PyExc_ValueError, "schedule interval not positive, or jitter not in [0, 1)");
+    goto error_exit;
+  }
+  pamTask = (PamTaskObject*)pamHandle->task->tp_alloc(pamHandle->task, 0);
+  if (pamTask == 0)
+    goto error_exit;
+  pamTask->function = function;
+  Py_INCREF(pamTask->function);
+  pamTask->interval = interval;
+  pamTask->jitter = jitter;
+  pamTask->module_path = PyUnicode_FromString(get_module_path(pamHandle));
+  if (pamTask->module_path == 0)
+    goto error_exit;
+  pamTask->value = Py_None;
+  Py_INCREF(pamTask->value);
+  module = process_module_find(get_module_path(pamHandle));
+  pamTask->owner = module == pamHandle->module ? 0 : pamHandle;
+  py_xdecref(module);
+  if (scheduler_add(pamTask) == -1)
+    goto error_exit;
+  result = (PyObject*)pamTask;
+  pamTask = 0;
+
+error_exit:
+  py_xdecref((PyObject*)pamTask);
+  return result;
+}
+
+/*
+ * Set a PAM environment variable.
+ */
+static PyObject* PamHandle_strerror(
+    PyObject* self, PyObject* args, PyObject* kwds)
+{
+  PamHandleObject*	pamHandle = (PamHandleObject*)self;
+  const char*		err;
+  int			errnum;
+  PyObject*		result = 0;
+  const int		debug_magic = 0x4567abcd;
+  static char*		kwlist[] = {"errnum", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "i:strerror", kwlist, &errnum))
+    goto error_exit;
+  /*
+   * A kludge so we can test exceptions.
+   */
+  if (errnum >= debug_magic && errnum < debug_magic + _PAM_RETURN_VALUES)
+  {
+    if (check_pam_result(pamHandle, errnum - debug_magic) == -1)
+      goto error_exit;
+  }
+  err = pam_strerror(pamHandle->pamh, errnum);
+  if (err == 0)
+  {
+    result = Py_None;
+    Py_INCREF(result);
+  }
+  else
+  {
+    result = PyUnicode_FromString(err);
+    if (result == 0)
+      goto error_exit;
+  }
+
+error_exit:
+  return result;
+}
+
+static PyMethodDef PamHandle_Methods[] =
+{
+  {
+    "breaker",
+    PyCFunctionKwds_cast PamHandle_breaker,
+    METH_VARARGS|METH_KEYWORDS,
+    MODULE_NAME "." PAMHANDLE_NAME "." "breaker(name, threshold=5, reset=30)\n"
+    "  Return the circuit breaker called name, shared by every process using\n"
+    "  the module.  It opens after threshold failures in a row, and lets a\n"
+    "  trial call through every reset seconds while open."
+  },
+  {
+    "conversation",
+    PyCFunctionKwds_cast PamHandle_conversation,
+    METH_VARARGS|METH_KEYWORDS,
+    MODULE_NAME "." PAMHANDLE_NAME "." "conversation(prompts)\n"
+    "  Ask the application to issue the prompts to the user and return the\n"
+    "  users responses.  The 'prompts' can be one, or a list of\n"
+    "  " MODULE_NAME "." PAMHANDLE_NAME "." PAMMESSAGE_NAME " objects.  The return value is one,\n"
+    "  or an array of " MODULE_NAME "." PAMHANDLE_NAME "." PAMRESPONSE_NAME " objects."
+  },
+  {
+    "conversation_async",
+    PyCFunctionKwds_cast PamHandle_conversation_async,
+    METH_VARARGS|METH_KEYWORDS,
+    MODULE_NAME "." PAMHANDLE_NAME "." "conversation_async(prompts)\n"
+    "  Return an awaitable that runs conversation(prompts) in the running\n"
+    "  event loop's default executor."
+  },
+  {
+    "fail_delay",
+    PyCFunctionKwds_cast PamHandle_fail_delay,
+    METH_VARARGS|METH_KEYWORDS,
+    MODULE_NAME "." PAMHANDLE_NAME "." "fail_delay(micro_sec)\n"
+    "  Sets the amount of time a failed authenticate attempt should delay for\n"
+    "  in micro seconds.  This amount reset to 0 after every authenticate\n"
+    "  attempt."
+  },
+  {
+    "get_user",
+    PyCFunctionKwds_cast PamHandle_get_user,
+    METH_VARARGS|METH_KEYWORDS,
+    MODULE_NAME "." PAMHANDLE_NAME "." "getuser([prompt])\n"
+    "  If " PAMHANDLE_NAME ".user isn't None return it, otherwise ask the\n"
+    "  application to display the string 'prompt' and enter the user name.  The\n"
+    "  user name (a string) is returned.  It will be None if it isn't known."
+  },
+  {
+    "get_user_async",
+    PyCFunctionKwds_cast PamHandle_get_user_async,
+    METH_VARARGS|METH_KEYWORDS,
+    MODULE_NAME "." PAMHANDLE_NAME "." "get_user_async([prompt])\n"
+    "  Return an awaitable that runs get_user(prompt) in the running event\n"
+    "  loop's default executor."
+  },
+  {
+    "log",
+    PamHandle_log,
+    METH_VARARGS,
+    MODULE_NAME "." PAMHANDLE_NAME "." "log(level, fmt, *args)\n"
+    "  If level (a " PAMHANDLE_NAME ".LOG_??? constant) is at or below\n"
+    "  " PAMHANDLE_NAME ".log_level write fmt % args to syslog using\n"
+    "  " PAMHANDLE_NAME ".log_ident.  Otherwise do nothing, quickly."
+  },
+  {
+    "log_handler",
+    PyCFunctionKwds_cast PamHandle_log_handler,
+    METH_VARARGS|METH_KEYWORDS,
+    MODULE_NAME "." PAMHANDLE_NAME "." "log_handler()\n"
+    "  Return a logging.Handler that writes the records it is given using\n"
+    "  " PAMHANDLE_NAME ".log()."
+  },
+  {
+    "span",
+    PyCFunctionKwds_cast PamHandle_span,
+    METH_VARARGS|METH_KEYWORDS,
+    MODULE_NAME "." PAMHANDLE_NAME "." "span(name)\n"
+    "  Return a " PAMSPAN_NAME " to use in a with statement.  If the trace= option\n"
+    "  is in effect how long the block took is recorded as a child of the\n"
+    "  transaction's span, otherwise it does nothing."
+  },
+  {
+    "schedule",
+    PyCFunctionKwds_cast PamHandle_schedule,
+    METH_VARARGS|METH_KEYWORDS,
+    MODULE_NAME "." PAMHANDLE_NAME "." "schedule(interval, function, jitter=0.1)\n"
+    "  Call function() on a thread of its own now and every interval seconds\n"
+    "  after that, each wait varied by up to jitter of it.  Returns a\n"
+    "  " PAMTASK_NAME " whose value is what it last returned."
+  },
+  {
+    "strerror",
+    PyCFunctionKwds_cast PamHandle_strerror,
+    METH_VARARGS|METH_KEYWORDS,
+    MODULE_NAME "." PAMHANDLE_NAME "." "strerror(errnum)\n"
+    "  Return a string describing the pam error errnum."
+  },
+  {0,0,0,0}        	/* Sentinel */
+};
+
+static PyMemberDef PamHandle_Members[] =
+{
+  {
+    "cache",
+    T_OBJECT_EX,
+    offsetof(PamHandleObject, cache),
+    READONLY,
+    "The cache shared by every process using the module, None without cache=."
+  },
+  {
+    "env",
+    T_OBJECT_EX,
+    offsetof(PamHandleObject, env),
+    READONLY,
+    "The PAM environment mapping."
+  },
+  {
+    "exception",
+    T_OBJECT_EX,
+    offsetof(PamHandleObject, exception),
+    READONLY,
+    "Exception raised when a call to PAM fails."
+  },
+  {
+    "failures",
+    T_OBJECT_EX,
+    offsetof(PamHandleObject, failures),
+    READONLY,
+    "Failure counts shared by every process using the module, None without failures=."
+  },
+  {
+    "libpam_version",
+    T_STRING,
+    offsetof(PamHandleObject, libpam_version),
+    READONLY,
+    "The runtime PAM version."
+  },
+  {
+    "log_ident",
+    T_OBJECT,
+    offsetof(PamHandleObject, log_ident),
+    READONLY,
+    "The syslog ident " MODULE_NAME "." PAMHANDLE_NAME ".log() uses."
+  },
+  {
+    "log_level",
+    T_INT,
+    offsetof(PamHandleObject, log_level),
+    0,
+    "Messages " MODULE_NAME "." PAMHANDLE_NAME ".log() is given above this LOG_??? level are discarded."
+  },
+  {
+    "Message",
+    T_OBJECT,
+    offsetof(PamHandleObject, message),
+    READONLY,
+    "Message class that can be passed to " MODULE_NAME "." PAMHANDLE_NAME ".conversation()"
+  },
+  {
+    "module",
+    T_OBJECT,
+    offsetof(PamHandleObject, module),
+    READONLY,
+    "The user module (ie you!)"
+  },
+  {
+    "pamh",
+    T_LONG,
+    offsetof(PamHandleObject, pamh),
+    READONLY,
+    "The PAM handle."
+  },
+  {
+    "py_initialized",
+    T_INT,
+    offsetof(PamHandleObject, py_initialized),
+    READONLY,
+    "True if Py_Initialize was called."
+  },
+  {
+    "Response",
+    T_OBJECT,
+    offsetof(PamHandleObject, response),
+    READONLY,
+    "Response class returned by " MODULE_NAME "." PAMHANDLE_NAME ".conversation()"
+  },
+  {
+    "XAuthData",
+    T_OBJECT,
+    offsetof(PamHandleObject, xauthdata),
+    READONLY,
+    "XAuthData class used by " MODULE_NAME "." PAMHANDLE_NAME ".xauthdata"
+  },
+  {0,0,0,0,0},        	/* End of Python visible members */
+  {
+    "breaker_type",
+    T_OBJECT,
+    offsetof(PamHandleObject, breaker),
+    READONLY,
+    "The type pamh.breaker() returns"
+  },
+  {
+    "breakers",
+    T_OBJECT,
+    offsetof(PamHandleObject, breakers),
+    READONLY,
+    "The breakers pamh.breaker() has returned"
+  },
+  {
+    "profile_dir",
+    T_OBJECT,
+    offsetof(PamHandleObject, profile_dir),
+    READONLY,
+    "Directory profiles are written to"
+  },
+  {
+    "profile_stacks",
+    T_OBJECT,
+    offsetof(PamHandleObject, profile_stacks),
+    READONLY,
+    "Profile samples, keyed by collapsed stack"
+  },
+  {
+    "record",
+    T_OBJECT,
+    offsetof(PamHandleObject, record),
+    READONLY,
+    "The transaction's record so far"
+  },
+  {
+    "record_path",
+    T_OBJECT,
+    offsetof(PamHandleObject, record_path),
+    READONLY,
+    "Where transaction records are written"
+  },
+  {
+    "span_type",
+    T_OBJECT,
+    offsetof(PamHandleObject, span),
+    READONLY,
+    "The type pamh.span() returns"
+  },
+  {
+    "state_dir",
+    T_OBJECT,
+    offsetof(PamHandleObject, state_dir),
+    READONLY,
+    "Directory shared state is kept in"
+  },
+  {
+    "task_type",
+    T_OBJECT,
+    offsetof(PamHandleObject, task),
+    READONLY,
+    "The type pamh.schedule() returns"
+  },
+  {
+    "trace_handlers",
+    T_OBJECT,
+    offsetof(PamHandleObject, trace_handlers),
+    READONLY,
+    "Handler calls recorded for the transaction's span"
+  },
+  {
+    "trace_id",
+    T_OBJECT,
+    offsetof(PamHandleObject, trace_id),
+    READONLY,
+    "The transaction's trace id"
+  },
+  {
+    "trace_open",
+    T_OBJECT,
+    offsetof(PamHandleObject, trace_open),
+    READONLY,
+    "Ids of pamh.span()s not yet ended"
+  },
+  {
+    "trace_parent",
+    T_OBJECT,
+    offsetof(PamHandleObject, trace_parent),
+    READONLY,
+    "Span id of the transaction's parent"
+  },
+  {
+    "trace_path",
+    T_OBJECT,
+    offsetof(PamHandleObject, trace_path),
+    READONLY,
+    "Where spans are sent"
+  },
+  {
+    "trace_span_id",
+    T_OBJECT,
+    offsetof(PamHandleObject, trace_span_id),
+    READONLY,
+    "The transaction's span id"
+  },
+  {
+    "trace_spans",
+    T_OBJECT,
+    offsetof(PamHandleObject, trace_spans),
+    READONLY,
+    "Ended pamh.span()s"
+  },
+  {0,0,0,0,0}		/* Sentinal */
+};
+
+HEAP_TYPE_GC(PamHandle, PamHandle_Members)
+
+static char PamHandle_Doc[] =
+  MODULE_NAME "." PAMHANDLE_NAME "\n"
+  "  A an instance of this class makes the PAM API available to the Python\n"
+  "  module.  It is the first argument to every method PAM calls in the module.";
+
+/*
+ * Options understood by pam_python itself.  They are given in the PAM rule
+ * before the Python module's path, so the Python module's argv is
+ * unaffected by them, eg:
+ *
+ *   auth required pam_python.so log_level=debug module.py module-args
+ *
+ * An argument that isn't a recognised option is the Python module's path.
+ */
+typedef struct
+{
+  int			cache;		/* cache=, slots in pamh.cache */
+  int			failures;	/* failures=, slots in pamh.failures */
+  const char*		failures_dir;	/* failures_dir=, 0 for state_dir */
+  int			failures_window;/* failures_window=, seconds */
+  int			libpython_local;/* libpython_local, don't export it */
+  int			log_async;	/* log_async, queue syslog writes */
+  const char*		log_ident;	/* log_ident=, pamh.log_ident */
+  int			log_level;	/* log_level=, pamh.log_level */
+  int			log_source;	/* log_source, source in tracebacks */
+  int			log_stderr;	/* log_stderr, copy syslog to stderr */
+  int			log_window;	/* log_window=, seconds */
+  int			memstats;	/* memstats=, growth warning window */
+  const char*		profile;	/* profile=, directory for profiles */
+  int			profile_rate;	/* profile_rate=, 1 in N profiled */
+  const char*		record;		/* record=, where records are written */
+  const char*		rules;		/* rules=, compiled native rules */
+  const char*		state_dir;	/* state_dir=, shared state */
+  int			stats;		/* stats, keep usage statistics */
+  int			timeouts[STATS_HANDLER_COUNT];/* timeout=, ms */
+  int			timeout_result;	/* timeout_result=, PAM code */
+  const char*		trace;		/* trace=, where spans are sent */
+} PamOptions;
+
+typedef struct
+{
+  const char*		name;		/* Option name, '=' if it has a value */
+  int			(*parse)(void* field, const char* value);
+  size_t		offset;		/* Offset of the field in PamOptions */
+} PamOptionDef;
+
+/*
+ * Parse a flag, ie an option without a value.
+ */
+static int parse_option_flag(void* field, const char* value)
+{
+  (void)value;
+  *(int*)field = 1;
+  return 0;
+}
+
+/*
+ * Parse a string option.
+ */
+static int parse_option_string(void* field, const char* value)
+{
+  *(const char**)field = value;
+  return 0;
+}
+
+/*
+ * Parse a non-negative integer option.
+ */
+static int parse_option_uint(void* field, const char* value)
+{
+  char*			end;
+  long			number;
+
+  number = strtol(value, &end, 10);
+  if (*value == '\0' || *end != '\0' || number < 0 || number > INT_MAX)
+    return -1;
+  *(int*)field = number;
+  return 0;
+}
+
+/*
+ * Parse a syslog priority, given either by name or number.
+ */
+static int parse_option_priority(void* field, const char* value)
+{
+  static const struct {
+    const char*		name;
+    int			priority;
+  } priorities[] = {
+    {"emerg",	LOG_EMERG},
+    {"alert",	LOG_ALERT},
+    {"crit",	LOG_CRIT},
+    {"err",	LOG_ERR},
+    {"warning",	LOG_WARNING},
+    {"notice",	LOG_NOTICE},
+    {"info",	LOG_INFO},
+    {"debug",	LOG_DEBUG},
+  };
+  size_t		i;
+
+  for (i = 0; i < arr_size(priorities); i += 1)
+  {
+    if (strcmp(value, priorities[i].name) == 0)
+    {
+      *(int*)field = priorities[i].priority;
+      return 0;
+    }
+  }
+  if (value[0] >= '0' + LOG_EMERG && value[0] <= '0' + LOG_DEBUG &&
+      value[1] == '\0')
+  {
+    *(int*)field = value[0] - '0';
+    return 0;
+  }
+  return -1;
+}
+
+/*
+ * Parse the handler timeouts, a comma separated list of milliseconds.  A
+ * bare number applies to every handler, handler:ms (eg setcred:500) to
+ * pam_sm_handler.  Later entries win, and 0 means no timeout.
+ */
+static int parse_option_timeout(void* field, const char* value)
+{
+  int*			timeouts = (int*)field;
+  char*			colon;
+  const char*		comma;
+  char			entry[32];
+  size_t		first;
+  size_t		h;
+  size_t		last;
+  size_t		len;
+  int			ms;
+  const char*		number;
+  static const char	prefix[] = "pam_sm_";
+
+  for (;;)
+  {
+    comma = strchr(value, ',');
+    len = comma == 0 ? strlen(value) : (size_t)(comma - value);
+    if (len >= sizeof(entry))
+      return -1;
+    memcpy(entry, value, len);
+    entry[len] = '\0';
+    colon = strchr(entry, ':');
+    first = 0;
+    last = STATS_HANDLER_COUNT;
+    number = entry;
+    if (colon != 0)
+    {
+      *colon = '\0';
+      for (first = 0; first < STATS_HANDLER_COUNT; first += 1)
+      {
+	if (strcmp(stats_handler_names[first] + sizeof(prefix) - 1, entry) == 0)
+	  break;
+      }
+      if (first == STATS_HANDLER_COUNT)
+	return -1;
+      last = first + 1;
+      number = colon + 1;
+    }
+    if (parse_option_uint(&ms, number) == -1)
+      return -1;
+    for (h = first; h < last; h += 1)
+      timeouts[h] = ms;
+    if (comma == 0)
+      return 0;
+    value = comma + 1;
+  }
+}
+
+/*
+ * Parse the PAM result a handler that timed out returns, given either by
+ * name (without the PAM_ prefix, in lower case) or number.  A handler
+ * that didn't finish mustn't let anyone in, or be passed over, so
+ * PAM_SUCCESS and PAM_IGNORE aren't allowed.
+ */
+static int parse_option_pam_result(void* field, const char* value)
+{
+  size_t		i;
+  int			pam_result = -1;
+
+  for (i = 0; i < RULES_RESULT_COUNT; i += 1)
+  {
+    if (rules_results[i].pam_result != RULES_PYTHON &&
+	strcmp(value, rules_results[i].name) == 0)
+      pam_result = rules_results[i].pam_result;
+  }
+  if (pam_result == -1 &&
+      (parse_option_uint(&pam_result, value) == -1 ||
+	  pam_result >= _PAM_RETURN_VALUES))
+    return -1;
+  if (pam_result == PAM_SUCCESS || pam_result == PAM_IGNORE)
+    return -1;
+  *(int*)field = pam_result;
+  return 0;
+}
+
+static const PamOptionDef pam_option_defs[] =
+{
+  {"cache=",		parse_option_uint,	offsetof(PamOptions, cache)},
+  {"failures=",		parse_option_uint,	offsetof(PamOptions, failures)},
+  {"failures_dir=",	parse_option_string,	offsetof(PamOptions, failures_dir)},
+  {"failures_window=",	parse_option_uint,	offsetof(PamOptions, failures_window)},
+  {"libpython_local",	parse_option_flag,	offsetof(PamOptions, libpython_local)},
+  {"log_async",		parse_option_flag,	offsetof(PamOptions, log_async)},
+  {"log_ident=",	parse_option_string,	offsetof(PamOptions, log_ident)},
+  {"log_level=",	parse_option_priority,	offsetof(PamOptions, log_level)},
+  {"log_source",	parse_option_flag,	offsetof(PamOptions, log_source)},
+  {"log_stderr",	parse_option_flag,	offsetof(PamOptions, log_stderr)},
+  {"log_window=",	parse_option_uint,	offsetof(PamOptions, log_window)},
+  {"memstats=",		parse_option_uint,	offsetof(PamOptions, memstats)},
+  {"profile=",		parse_option_string,	offsetof(PamOptions, profile)},
+  {"profile_rate=",	parse_option_uint,	offsetof(PamOptions, profile_rate)},
+  {"record=",		parse_option_string,	offsetof(PamOptions, record)},
+  {"rules=",		parse_option_string,	offsetof(PamOptions, rules)},
+  {"state_dir=",	parse_option_string,	offsetof(PamOptions, state_dir)},
+  {"stats",		parse_option_flag,	offsetof(PamOptions, stats)},
+  {"timeout=",		parse_option_timeout,	offsetof(PamOptions, timeouts)},
+  {"timeout_result=",	parse_option_pam_result,offsetof(PamOptions, timeout_result)},
+  {"trace=",		parse_option_string,	offsetof(PamOptions, trace)},
+};
+
+/*
+ * Parse the options at the start of argv.  Returns the number of arguments
+ * consumed, or -1 if an option is invalid.
+ */
+static int parse_options(PamOptions* options, int argc, const char** argv)
+{
+  const PamOptionDef*	def;
+  int			i;
+  size_t		len;
+
+  options->cache = 0;
+  options->failures = 0;
+  options->failures_dir = 0;
+  options->failures_window = DEFAULT_FAILURES_WINDOW;
+  options->libpython_local = 0;
+  options->log_async = 0;
+  options->log_ident = 0;
+  options->log_level = LOG_INFO;
+  options->log_source = 0;
+  options->log_stderr = 0;
+  options->log_window = DEFAULT_LOG_WINDOW;
+  options->memstats = 0;
+  options->profile = 0;
+  options->profile_rate = 1;
+  options->record = 0;
+  options->rules = 0;
+  options->state_dir = DEFAULT_STATE_DIR;
+  options->stats = 0;
+  memset(options->timeouts, '\0', sizeof(options->timeouts));
+  options->timeout_result = PAM_AUTHINFO_UNAVAIL;
+  options->trace = 0;
+  for (i = 0; i < argc && argv[i] != 0; i += 1)
+  {
+    for (def = pam_option_defs; def < pam_option_defs + arr_size(pam_option_defs); def += 1)
+    {
+      len = strlen(def->name);
+      if (strncmp(argv[i], def->name, len) != 0)
+	continue;
+      if (def->name[len - 1] == '=' || argv[i][len] == '\0')
+	break;
+    }
+    if (def == pam_option_defs + arr_size(pam_option_defs))
+      break;
+    if (def->parse((char*)options + def->offset, argv[i] + len) == -1)
+    {
+      syslog_path_message(MODULE_NAME, "invalid option %s", argv[i]);
+      return -1;
+    }
+  }
+  return i;
+}
+
+/*
+ * The profiler, turned on by the profile= option.  While a handler runs
+ * a profile function is installed, and each time Python calls it (on
+ * every function call and return) it checks the clock.  Once every
+ * PROFILE_INTERVAL it records the current stack.  This avoids the
+ * SIGPROF a timer based profiler would need, which would upset the
+ * application we are loaded into.  Samples are kept as collapsed stacks,
+ * as used by flamegraph.pl, and appended to a file per process in the
+ * profile directory when the handle is destroyed.
+ */
+#define	PROFILE_INTERVAL	0.001	/* Seconds between samples */
+#define	PROFILE_MAX_DEPTH	64	/* Deepest stack recorded */
+
+/*
+ * Decide if this transaction is profiled, returning true if it is.
+ * Processes are usually forked per login and we are reloaded per
+ * transaction, so the decision can't be based on a counter.
+ */
+static int profile_select(int rate)
+{
+  unsigned long long	hash;
+  pid_t			pid = getpid();
+  double		now = monotonic_time();
+
+  if (rate <= 1)
+    return 1;
+  hash = fnv1a(FNV1A_INIT, &pid, sizeof(pid));
+  hash = fnv1a(hash, &now, sizeof(now));
+  return hash % rate == 0;
+}
+
+/*
+ * Record a sample of frame's stack.
+ */
+static void profile_record(
+    PamHandleObject* pamHandle, PyFrameObject* frame,
+    const char* handler_name, const char* c_function, long samples)
+{
+  PyCodeObject*		code;
+  PyObject*		count;
+  int			depth = 0;
+  PyFrameObject*	frames[PROFILE_MAX_DEPTH];
+  int			i;
+  PyObject*		key = 0;
+  char			stack[2048];
+  size_t		len;
+
+  /*
+   * PyFrame_GetBack() returns a new reference, so we hold one to each.
+   */
+  Py_XINCREF(frame);
+  while (frame != 0 && depth < PROFILE_MAX_DEPTH)
+  {
+    frames[depth++] = frame;
+    frame = PyFrame_GetBack(frame);
+  }
+  py_xdecref((PyObject*)frame);
+  len = snprintf(stack, sizeof(stack), "%s", handler_name);
+  for (i = depth; i > 0 && len < sizeof(stack); i -= 1)
+  {
+    code = frame_code(frames[i - 1]);
+    len += snprintf(
+        stack + len, sizeof(stack) - len, ";%s:%s",
+	unicode_utf8(code->co_filename, "?"), unicode_utf8(code->co_name, "?"));
+  }
+  if (c_function != 0 && len < sizeof(stack))
+    snprintf(stack + len, sizeof(stack) - len, ";[%s]", c_function);
+  key = PyUnicode_FromString(stack);
+  if (key == 0)
+    goto error_exit;
+  count = PyDict_GetItem(pamHandle->profile_stacks, key);
+  if (count != 0)
+    samples += PyLong_AsLong(count);
+  count = PyLong_FromLong(samples);
+  if (count == 0)
+    goto error_exit;
+  PyDict_SetItem(pamHandle->profile_stacks, key, count);
+  Py_DECREF(count);
+
+error_exit:
+  py_xdecref(key);
+  while (depth > 0)
+    Py_DECREF(frames[--depth]);
+  PyErr_Clear();
+}
+
+/*
+ * The profile function Python calls.  obj is a tuple of the pamHandle
+ * and the handler's name.
+ */
+static int profile_function(
+    PyObject* obj, PyFrameObject* frame, int what, PyObject* arg)
+{
+  const char*		c_function = 0;
+  PamHandleObject*	pamHandle;
+  double		now = monotonic_time();
+  long			samples;
+
+  pamHandle = (PamHandleObject*)PyTuple_GET_ITEM(obj, 0);
+  if (now < pamHandle->profile_next)
+    return 0;
+  samples = 1 + (long)((now - pamHandle->profile_next) / PROFILE_INTERVAL);
+  pamHandle->profile_next += samples * PROFILE_INTERVAL;
+  if ((what == PyTrace_C_RETURN || what == PyTrace_C_EXCEPTION) &&
+      PyCFunction_Check(arg))
+    c_function = ((PyCFunctionObject*)arg)->m_ml->ml_name;
+  profile_record(
+      pamHandle, frame, unicode_utf8(PyTuple_GET_ITEM(obj, 1), "?"),
+      c_function, samples);
+  return 0;
+}
+
+/*
+ * Start profiling a handler, if this transaction is being profiled.
+ * Returns the object profile_stop() needs, or 0 if not profiling.
+ */
+static PyObject* profile_start(
+    PamHandleObject* pamHandle, const char* handler_name)
+{
+  PyObject*		profile_arg;
+
+  if (pamHandle->profile_stacks == 0)
+    return 0;
+  profile_arg = Py_BuildValue("(Os)", pamHandle, handler_name);
+  if (profile_arg == 0)
+  {
+    PyErr_Clear();
+    return 0;
+  }
+  pamHandle->profile_next = monotonic_time() + PROFILE_INTERVAL;
+  PyEval_SetProfile(profile_function, profile_arg);
+  return profile_arg;
+}
+
+static void profile_stop(PyObject* profile_arg)
+{
+  if (profile_arg == 0)
+    return;
+  PyEval_SetProfile(0, 0);
+  Py_DECREF(profile_arg);
+}
+
+/*
+ * Append the samples to this process's file in the profile directory.
+ */
+static void profile_write(PamHandleObject* pamHandle)
+{
+  PyObject*		count;
+  int			fd;
+  FILE*			fp;
+  PyObject*		key;
+  const char*		name;
+  char			path[PATH_MAX];
+  Py_ssize_t		pos = 0;
+  const char*		profile_dir;
+  const char*		stack;
+
+  if (pamHandle->profile_stacks == 0 ||
+      PyDict_Size(pamHandle->profile_stacks) == 0)
+    return;
+  profile_dir = unicode_utf8(pamHandle->profile_dir, 0);
+  if (profile_dir == 0)
+    return;
+  name = PyModule_GetName(pamHandle->module);
+  if (name == 0)
+  {
+    PyErr_Clear();
+    name = MODULE_NAME;
+  }
+  mkdir(profile_dir, 0700);
+  snprintf(
+      path, sizeof(path), "%s/%s.%ld.collapsed",
+      profile_dir, name, (long)getpid());
+  fd = open(
+      path, O_WRONLY|O_APPEND|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0600);
+  if (fd == -1)
+  {
+    syslog_message(
+        pamHandle, "Can't write profile %s: %s", path, strerror(errno));
+    return;
+  }
+  fp = fdopen(fd, "a");
+  if (fp == 0)
+  {
+    close(fd);
+    return;
+  }
+  while (PyDict_Next(pamHandle->profile_stacks, &pos, &key, &count))
+  {
+    stack = unicode_utf8(key, 0);
+    if (stack != 0)
+      fprintf(fp, "%s %ld\n", stack, PyLong_AsLong(count));
+  }
+  fclose(fp);
+  PyDict_Clear(pamHandle->profile_stacks);
+}
+
+/*
+ * Transaction spans, turned on by the trace= option.  A PAM transaction
+ * (the life of the pam handle) is one span, recording which handlers
+ * were called, how long they spent waiting on the conversation function
+ * as opposed to running Python, and any child spans the module created
+ * with pamh.span().  When the handle is destroyed the span is written as
+ * one line of JSON, with a single write to a file opened O_NONBLOCK, or
+ * a single datagram sent MSG_DONTWAIT if the path is a unix socket.  If
+ * that can't be done at once the span is dropped.
+ *
+ * If the PAM environment or our environment has a W3C TRACEPARENT its
+ * trace id is used and its span becomes our parent, so logins can be
+ * tied to whatever started them.
+ */
+typedef struct
+{
+  char*			data;		/* The JSON so far */
+  int			failed;		/* Out of memory */
+  size_t		len;		/* strlen(data) */
+  size_t		size;		/* Bytes allocated for data */
+} TraceBuffer;
+
+/*
+ * Append to a TraceBuffer.
+ */
+static void trace_printf(TraceBuffer* buffer, const char* fmt, ...)
+{
+  va_list		ap;
+  char*			data;
+  int			len;
+
+  for (;;)
+  {
+    if (buffer->failed)
+      return;
+    va_start(ap, fmt);
+    len = vsnprintf(
+        buffer->data + buffer->len, buffer->size - buffer->len, fmt, ap);
+    va_end(ap);
+    if (len >= 0 && buffer->len + len < buffer->size)
+      break;
+    data = realloc(buffer->data, buffer->size * 2 + len + 256);
+    if (data == 0)
+    {
+      buffer->failed = 1;
+      return;
+    }
+    buffer->data = data;
+    buffer->size = buffer->size * 2 + len + 256;
+  }
+  buffer->len += len;
+}
+
+/*
+ * Append a JSON string, or null if the string is 0.
+ */
+static void trace_string(TraceBuffer* buffer, const char* string)
+{
+  const unsigned char*	c;
+
+  if (string == 0)
+  {
+    trace_printf(buffer, "null");
+    return;
+  }
+  trace_printf(buffer, "\"");
+  for (c = (const unsigned char*)string; *c != '\0'; c += 1)
+  {
+    if (*c == '"' || *c == '\\')
+      trace_printf(buffer, "\\%c", *c);
+    else if (*c < ' ')
+      trace_printf(buffer, "\\u%04x", *c);
+    else
+      trace_printf(buffer, "%c", *c);
+  }
+  trace_printf(buffer, "\"");
+}
+
+/*
+ * Append a Python string or None.
+ */
+static void trace_object(TraceBuffer* buffer, PyObject* object)
+{
+  trace_string(buffer, unicode_utf8(object, 0));
+}
+
+/*
+ * Return true if the string is len lower case hex digits.
+ */
+static int is_hex(const char* string, size_t len)
+{
+  return strspn(string, "0123456789abcdef") >= len;
+}
+
+/*
+ * Start the transaction's span.  start is monotonic_time() when the
+ * transaction began.  Returns -1 if it didn't work.
+ */
+static int trace_start(
+    PamHandleObject* pamHandle, const char* path, double start)
+{
+  const char*		traceparent;
+
+  pamHandle->trace_conv = 0;
+  pamHandle->trace_start = start;
+  pamHandle->trace_start_ns =
+      realtime_ns() - (long long)((monotonic_time() - start) * 1e9);
+  pamHandle->trace_path = PyUnicode_FromString(path);
+  pamHandle->trace_handlers = PyList_New(0);
+  pamHandle->trace_open = PyList_New(0);
+  pamHandle->trace_spans = PyList_New(0);
+  pamHandle->trace_span_id = random_hex_id(8);
+  /*
+   * A traceparent looks like 00-<32 hex trace id>-<16 hex span id>-<flags>.
+   */
+  traceparent = pam_getenv(pamHandle->pamh, "TRACEPARENT");
+  if (traceparent == 0)
+    traceparent = getenv("TRACEPARENT");
+  if (traceparent != 0 && strlen(traceparent) == 55 &&
+      strncmp(traceparent, "00-", 3) == 0 && is_hex(traceparent + 3, 32) &&
+      traceparent[35] == '-' && is_hex(traceparent + 36, 16))
+  {
+    pamHandle->trace_id = PyUnicode_FromStringAndSize(traceparent + 3, 32);
+    pamHandle->trace_parent = PyUnicode_FromStringAndSize(traceparent + 36, 16);
+  }
+  else
+  {
+    pamHandle->trace_id = random_hex_id(16);
+    pamHandle->trace_parent = Py_None;
+    Py_INCREF(pamHandle->trace_parent);
+  }
+  if (pamHandle->trace_path == 0 || pamHandle->trace_handlers == 0 ||
+      pamHandle->trace_open == 0 || pamHandle->trace_spans == 0 ||
+      pamHandle->trace_span_id == 0 || pamHandle->trace_id == 0 ||
+      pamHandle->trace_parent == 0)
+    return -1;
+  return 0;
+}
+
+/*
+ * Record a call to a handler in the transaction's span.  start is
+ * monotonic_time() when it was called, and conv is trace_conv then.
+ */
+static void trace_handler_call(
+    PamHandleObject* pamHandle, const char* handler_name,
+    double start, double conv, int pam_result)
+{
+  PyObject*		record;
+
+  if (pamHandle->trace_handlers == 0)
+    return;
+  record = Py_BuildValue(
+      "sLLLi", handler_name,
+      pamHandle->trace_start_ns +
+	  (long long)((start - pamHandle->trace_start) * 1e9),
+      (long long)((monotonic_time() - start) * 1e9),
+      (long long)((pamHandle->trace_conv - conv) * 1e9),
+      pam_result);
+  if (record == 0 || PyList_Append(pamHandle->trace_handlers, record) == -1)
+    PyErr_Clear();
+  py_xdecref(record);
+}
+
+/*
+ * Send the span, without waiting.
+ */
+static void trace_send(const char* path, const char* data, size_t len)
+{
+  struct sockaddr_un	addr;
+  int			fd;
+  struct stat		st;
+
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+  {
+    if (strlen(path) >= sizeof(addr.sun_path))
+      return;
+    memset(&addr, '\0', sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+    if (fd == -1)
+      return;
+    sendto(
+        fd, data, len, MSG_DONTWAIT|MSG_NOSIGNAL,
+	(struct sockaddr*)&addr, sizeof(addr));
+  }
+  else
+  {
+    fd = open(
+	path, O_WRONLY|O_APPEND|O_CREAT|O_NONBLOCK|O_NOFOLLOW|O_CLOEXEC,
+	0600);
+    if (fd == -1)
+      return;
+    while (write(fd, data, len) == -1 && errno == EINTR)
+      continue;
+  }
+  close(fd);
+}
+
+/*
+ * Get the key user names are hashed with, which is made when first needed
+ * and kept in the state directory so every process uses the same one.
+ * Returns -1 if there isn't one and it can't be made.
+ */
+#define	TRACE_KEY_NAME		"trace-key"
+#define	TRACE_KEY_SIZE		16
+
+static int trace_key(const char* state_dir, unsigned char key[TRACE_KEY_SIZE])
+{
+  int			fd;
+  size_t		i;
+  int			result = -1;
+
+  fd = state_file_open(state_dir, TRACE_KEY_NAME, TRACE_KEY_SIZE, 1);
+  if (fd == -1)
+    return -1;
+  if (pread(fd, key, TRACE_KEY_SIZE, 0) != TRACE_KEY_SIZE)
+    goto error_exit;
+  for (i = 0; i < TRACE_KEY_SIZE && key[i] == 0; i += 1)
+    continue;
+  if (i == TRACE_KEY_SIZE)
+  {
+    if (getrandom(key, TRACE_KEY_SIZE, GRND_NONBLOCK) != TRACE_KEY_SIZE)
+      goto error_exit;
+    if (pwrite(fd, key, TRACE_KEY_SIZE, 0) != TRACE_KEY_SIZE)
+      goto error_exit;
+  }
+  result = 0;
+
+error_exit:
+  close(fd);
+  return result;
+}
+
+/*
+ * End the transaction's span and send it.
+ */
+static void trace_write(PamHandleObject* pamHandle)
+{
+  TraceBuffer		buffer = {0, 0, 0, 0};
+  long long		compute_ns = 0;
+  long long		conv_ns;
+  unsigned long long	hash;
+  Py_ssize_t		i;
+  unsigned char		key[TRACE_KEY_SIZE];
+  int			pam_result = -1;
+  const char*		path;
+  PyObject*		record;
+  const void*		rhost = 0;
+  const void*		service = 0;
+  const void*		user = 0;
+
+  if (pamHandle->trace_handlers == 0)
+    return;
+  pam_get_item(pamHandle->pamh, PAM_SERVICE, &service);
+  pam_get_item(pamHandle->pamh, PAM_USER, &user);
+  pam_get_item(pamHandle->pamh, PAM_RHOST, &rhost);
+  conv_ns = (long long)(pamHandle->trace_conv * 1e9);
+  trace_printf(&buffer, "{\"trace_id\":");
+  trace_object(&buffer, pamHandle->trace_id);
+  trace_printf(&buffer, ",\"span_id\":");
+  trace_object(&buffer, pamHandle->trace_span_id);
+  trace_printf(&buffer, ",\"parent_span_id\":");
+  trace_object(&buffer, pamHandle->trace_parent);
+  trace_printf(&buffer, ",\"name\":\"pam_python\",\"module\":");
+  trace_string(&buffer, get_module_path(pamHandle));
+  trace_printf(&buffer, ",\"service\":");
+  trace_string(&buffer, service);
+  trace_printf(&buffer, ",\"user_hash\":");
+  if (user == 0 || trace_key(get_state_dir(pamHandle), key) == -1)
+    trace_printf(&buffer, "null");
+  else
+  {
+    hash = siphash24(key, user, strlen(user));
+    trace_printf(&buffer, "\"%016llx\"", hash);
+  }
+  trace_printf(&buffer, ",\"rhost\":");
+  trace_string(&buffer, rhost);
+  trace_printf(
+      &buffer,
+      ",\"start_time_unix_nano\":%lld,\"end_time_unix_nano\":%lld"
+      ",\"handlers\":[",
+      pamHandle->trace_start_ns,
+      pamHandle->trace_start_ns +
+	  (long long)((monotonic_time() - pamHandle->trace_start) * 1e9));
+  for (i = 0; i < PyList_GET_SIZE(pamHandle->trace_handlers); i += 1)
+  {
+    record = PyList_GET_ITEM(pamHandle->trace_handlers, i);
+    trace_printf(
+        &buffer,
+	"%s{\"name\":\"%s\",\"start_time_unix_nano\":%lld"
+	",\"duration_ns\":%lld,\"conversation_ns\":%lld,\"result\":%d}",
+	i == 0 ? "" : ",",
+	unicode_utf8(PyTuple_GET_ITEM(record, 0), "?"),
+	PyLong_AsLongLong(PyTuple_GET_ITEM(record, 1)),
+	PyLong_AsLongLong(PyTuple_GET_ITEM(record, 2)),
+	PyLong_AsLongLong(PyTuple_GET_ITEM(record, 3)),
+	(int)PyLong_AsLong(PyTuple_GET_ITEM(record, 4)));
+    compute_ns += PyLong_AsLongLong(PyTuple_GET_ITEM(record, 2));
+    pam_result = PyLong_AsLong(PyTuple_GET_ITEM(record, 4));
+  }
+  trace_printf(&buffer, "],\"spans\":[");
+  for (i = 0; i < PyList_GET_SIZE(pamHandle->trace_spans); i += 1)
+  {
+    record = PyList_GET_ITEM(pamHandle->trace_spans, i);
+    trace_printf(&buffer, "%s{\"name\":", i == 0 ? "" : ",");
+    trace_object(&buffer, PyTuple_GET_ITEM(record, 0));
+    trace_printf(&buffer, ",\"span_id\":");
+    trace_object(&buffer, PyTuple_GET_ITEM(record, 1));
+    trace_printf(&buffer, ",\"parent_span_id\":");
+    trace_object(&buffer, PyTuple_GET_ITEM(record, 2));
+    trace_printf(
+        &buffer,
+	",\"start_time_unix_nano\":%lld,\"end_time_unix_nano\":%lld"
+	",\"error\":",
+	PyLong_AsLongLong(PyTuple_GET_ITEM(record, 3)),
+	PyLong_AsLongLong(PyTuple_GET_ITEM(record, 4)));
+    trace_object(&buffer, PyTuple_GET_ITEM(record, 5));
+    trace_printf(&buffer, "}");
+  }
+  trace_printf(
+      &buffer,
+      "],\"conversation_ns\":%lld,\"python_ns\":%lld,\"result\":%d}\n",
+      conv_ns, compute_ns - conv_ns, pam_result);
+  PyErr_Clear();
+  path = unicode_utf8(pamHandle->trace_path, 0);
+  if (!buffer.failed && path != 0)
+    trace_send(path, buffer.data, buffer.len);
+  free(buffer.data);
+}
+
+/*
+ * Transaction records, turned on by the record= option.  Everything the
+ * Python module is given during a PAM transaction is recorded, so
+ * replay.c can run the transaction again without a PAM application:
+ * each handler called with its flags and argv, the PAM items and
+ * environment at the time, and the conversation's prompts and responses.
+ * Secrets, ie the authentication tokens and the responses to prompts that
+ * aren't echoed, are replaced by RECORD_SECRET.  The other responses and
+ * the environment's values can be just as private, so only their lengths
+ * are kept, which is all replay needs.  When the handle is destroyed the
+ * record is written the way trace= writes spans.
+ *
+ * A record is a line per event, a transaction line first and an end line
+ * last.  Fields are separated by spaces.  Strings start with "=" and have
+ * spaces, "%" and unprintable characters written as %XX, are "#length" if
+ * only their length was recorded, or are "-" if they are NULL.
+ */
+#define	RECORD_SECRET		"********"
+
+static const struct
+{
+  const char*		name;		/* Its pamh attribute */
+  int			item_type;	/* PAM_... */
+  int			secret;		/* True if it is recorded as a secret */
+} record_items[] =
+{
+  {"authtok",		PAM_AUTHTOK,		1},
 #ifdef	PAM_AUTHTOK_TYPE
-  CONSTANT_GETSET(PAM_AUTHTOK_TYPE),
-#endif
-#ifdef PAM_BAD_ITEM
-  CONSTANT_GETSET(PAM_BAD_ITEM),
-#endif
-#ifdef PAM_BINARY_PROMPT
-  CONSTANT_GETSET(PAM_BINARY_PROMPT),
-#endif
-  CONSTANT_GETSET(PAM_BUF_ERR),
-  CONSTANT_GETSET(PAM_CHANGE_EXPIRED_AUTHTOK),
-  CONSTANT_GETSET(PAM_CONV),
-#ifdef PAM_CONV_AGAIN
-  CONSTANT_GETSET(PAM_CONV_AGAIN),
-#endif
-  CONSTANT_GETSET(PAM_CONV_ERR),
-  CONSTANT_GETSET(PAM_CRED_ERR),
-  CONSTANT_GETSET(PAM_CRED_EXPIRED),
-  CONSTANT_GETSET(PAM_CRED_INSUFFICIENT),
-  CONSTANT_GETSET(PAM_CRED_UNAVAIL),
-#ifdef PAM_DATA_REPLACE
-  CONSTANT_GETSET(PAM_DATA_REPLACE),
-#endif
-#ifdef PAM_DATA_SILENT
-  CONSTANT_GETSET(PAM_DATA_SILENT),
-#endif
-  CONSTANT_GETSET(PAM_DELETE_CRED),
-  CONSTANT_GETSET(PAM_DISALLOW_NULL_AUTHTOK),
-  CONSTANT_GETSET(PAM_ERROR_MSG),
-  CONSTANT_GETSET(PAM_ESTABLISH_CRED),
-#ifdef PAM_FAIL_DELAY
-  CONSTANT_GETSET(PAM_FAIL_DELAY),
-#endif
-  CONSTANT_GETSET(PAM_IGNORE),
-#ifdef PAM_INCOMPLETE
-  CONSTANT_GETSET(PAM_INCOMPLETE),
-#endif
-  CONSTANT_GETSET(PAM_MAX_MSG_SIZE),
-  CONSTANT_GETSET(PAM_MAX_NUM_MSG),
-  CONSTANT_GETSET(PAM_MAX_RESP_SIZE),
-  CONSTANT_GETSET(PAM_MAXTRIES),
-  CONSTANT_GETSET(PAM_MODULE_UNKNOWN),
-  CONSTANT_GETSET(PAM_NEW_AUTHTOK_REQD),
-  CONSTANT_GETSET(PAM_NO_MODULE_DATA),
-  CONSTANT_GETSET(PAM_OLDAUTHTOK),
-  CONSTANT_GETSET(PAM_OPEN_ERR),
-  CONSTANT_GETSET(PAM_PERM_DENIED),
-  CONSTANT_GETSET(PAM_PRELIM_CHECK),
-  CONSTANT_GETSET(PAM_PROMPT_ECHO_OFF),
-  CONSTANT_GETSET(PAM_PROMPT_ECHO_ON),
-#ifdef PAM_RADIO_TYPE
-  CONSTANT_GETSET(PAM_RADIO_TYPE),
-#endif
-  CONSTANT_GETSET(PAM_REFRESH_CRED),
-  CONSTANT_GETSET(PAM_REINITIALIZE_CRED),
-  CONSTANT_GETSET(_PAM_RETURN_VALUES),
-  CONSTANT_GETSET(PAM_RHOST),
-  CONSTANT_GETSET(PAM_RUSER),
-  CONSTANT_GETSET(PAM_SERVICE),
-  CONSTANT_GETSET(PAM_SERVICE_ERR),
-  CONSTANT_GETSET(PAM_SESSION_ERR),
-  CONSTANT_GETSET(PAM_SILENT),
-  CONSTANT_GETSET(PAM_SUCCESS),
-  CONSTANT_GETSET(PAM_SYMBOL_ERR),
-  CONSTANT_GETSET(PAM_SYSTEM_ERR),
-  CONSTANT_GETSET(PAM_TEXT_INFO),
-  CONSTANT_GETSET(PAM_TRY_AGAIN),
-  CONSTANT_GETSET(PAM_TTY),
-  CONSTANT_GETSET(PAM_UPDATE_AUTHTOK),
-  CONSTANT_GETSET(PAM_USER),
-  CONSTANT_GETSET(PAM_USER_PROMPT),
-  CONSTANT_GETSET(PAM_USER_UNKNOWN),
-#ifdef  PAM_XAUTHDATA
-  CONSTANT_GETSET(PAM_XAUTHDATA),
+  {"authtok_type",	PAM_AUTHTOK_TYPE,	0},
 #endif
+  {"oldauthtok",	PAM_OLDAUTHTOK,		1},
+  {"rhost",		PAM_RHOST,		0},
+  {"ruser",		PAM_RUSER,		0},
+  {"service",		PAM_SERVICE,		0},
+  {"tty",		PAM_TTY,		0},
+  {"user",		PAM_USER,		0},
+  {"user_prompt",	PAM_USER_PROMPT,	0},
 #ifdef	PAM_XDISPLAY
-  CONSTANT_GETSET(PAM_XDISPLAY),
+  {"xdisplay",		PAM_XDISPLAY,		0},
 #endif
-  {0,0,0,0,0}        	/* Sentinel */
 };
 
 /*
- * Convert a PamHandleObject.Message style object to a pam_message structure.
+ * Append a string field.
+ */
+static void record_string(TraceBuffer* buffer, const char* string)
+{
+  const unsigned char*	c;
+
+  if (string == 0)
+  {
+    trace_printf(buffer, "-");
+    return;
+  }
+  trace_printf(buffer, "=");
+  for (c = (const unsigned char*)string; *c != '\0'; c += 1)
+  {
+    if (*c <= ' ' || *c == '%' || *c >= 0x7f)
+      trace_printf(buffer, "%%%02X", *c);
+    else
+      trace_printf(buffer, "%c", *c);
+  }
+}
+
+/*
+ * Append a string field whose value is withheld.
+ */
+static void record_length(TraceBuffer* buffer, const char* string)
+{
+  if (string == 0)
+    trace_printf(buffer, "-");
+  else
+    trace_printf(buffer, "#%lu", (unsigned long)strlen(string));
+}
+
+/*
+ * Add what is in the buffer to the record, and empty the buffer.
+ */
+static void record_add(PamHandleObject* pamHandle, TraceBuffer* buffer)
+{
+  PyObject*		lines;
+
+  if (!buffer->failed && buffer->len > 0)
+  {
+    lines = PyBytes_FromStringAndSize(buffer->data, buffer->len);
+    if (lines == 0 || PyList_Append(pamHandle->record, lines) == -1)
+      PyErr_Clear();
+    py_xdecref(lines);
+  }
+  free(buffer->data);
+  memset(buffer, '\0', sizeof(*buffer));
+}
+
+/*
+ * Start recording the transaction.  Returns -1 if that didn't work.
+ */
+static int record_start(PamHandleObject* pamHandle, const char* path)
+{
+  TraceBuffer		buffer = {0, 0, 0, 0};
+
+  pamHandle->record_path = PyUnicode_FromString(path);
+  pamHandle->record = PyList_New(0);
+  if (pamHandle->record_path == 0 || pamHandle->record == 0)
+    return -1;
+  trace_printf(&buffer, "transaction ");
+  record_string(&buffer, get_module_path(pamHandle));
+  trace_printf(&buffer, "\n");
+  record_add(pamHandle, &buffer);
+  return 0;
+}
+
+/*
+ * Record a handler about to be called, and what it will see.
+ */
+static void record_call(
+    PamHandleObject* pamHandle, const char* handler_name,
+    int flags, int argc, const char** argv)
+{
+  TraceBuffer		buffer = {0, 0, 0, 0};
+  char**		envlist;
+  int			i;
+  const void*		item;
+  size_t		r;
+  char*			value;
+
+  trace_printf(&buffer, "call %s %d\nargv", handler_name, flags);
+  for (i = 0; i < argc; i += 1)
+  {
+    trace_printf(&buffer, " ");
+    record_string(&buffer, argv[i]);
+  }
+  trace_printf(&buffer, "\n");
+  for (r = 0; r < arr_size(record_items); r += 1)
+  {
+    item = 0;
+    pam_get_item(pamHandle->pamh, record_items[r].item_type, &item);
+    if (item == 0)
+      continue;
+    trace_printf(&buffer, "item %s ", record_items[r].name);
+    if (record_items[r].secret)
+      trace_printf(&buffer, "=" RECORD_SECRET);
+    else
+      record_string(&buffer, item);
+    trace_printf(&buffer, "\n");
+  }
+  envlist = pam_getenvlist(pamHandle->pamh);
+  for (i = 0; envlist != 0 && envlist[i] != 0; i += 1)
+  {
+    value = strchr(envlist[i], '=');
+    if (value == 0)
+      continue;
+    *value++ = '\0';
+    trace_printf(&buffer, "env ");
+    record_string(&buffer, envlist[i]);
+    trace_printf(&buffer, " ");
+    record_length(&buffer, value);
+    trace_printf(&buffer, "\n");
+  }
+  free_envlist(envlist);
+  record_add(pamHandle, &buffer);
+}
+
+/*
+ * Record what a handler returned.
+ */
+static void record_result(PamHandleObject* pamHandle, int pam_result)
+{
+  TraceBuffer		buffer = {0, 0, 0, 0};
+
+  trace_printf(&buffer, "result %d\n", pam_result);
+  record_add(pamHandle, &buffer);
+}
+
+/*
+ * Record a call to the conversation function.
+ */
+static void record_conversation(
+    PamHandleObject* pamHandle, int count,
+    const struct pam_message* messages,
+    const struct pam_response* responses, int pam_result)
+{
+  TraceBuffer		buffer = {0, 0, 0, 0};
+  int			i;
+
+  for (i = 0; i < count; i += 1)
+  {
+    trace_printf(&buffer, "prompt %d ", messages[i].msg_style);
+    record_string(&buffer, messages[i].msg);
+    trace_printf(&buffer, "\n");
+  }
+  if (pam_result != PAM_SUCCESS || responses == 0)
+    trace_printf(&buffer, "conv_error %d\n", pam_result);
+  else
+  {
+    for (i = 0; i < count; i += 1)
+    {
+      trace_printf(&buffer, "response %d ", responses[i].resp_retcode);
+      if (messages[i].msg_style == PAM_PROMPT_ECHO_OFF &&
+	  responses[i].resp != 0)
+	trace_printf(&buffer, "=" RECORD_SECRET);
+      else
+	record_length(&buffer, responses[i].resp);
+      trace_printf(&buffer, "\n");
+    }
+  }
+  record_add(pamHandle, &buffer);
+}
+
+/*
+ * End the record and write it.
+ */
+static void record_write(PamHandleObject* pamHandle)
+{
+  char*			data;
+  Py_ssize_t		i;
+  size_t		len = sizeof("end\n") - 1;
+  PyObject*		lines;
+  const char*		path;
+
+  if (pamHandle->record == 0)
+    return;
+  for (i = 0; i < PyList_GET_SIZE(pamHandle->record); i += 1)
+    len += PyBytes_GET_SIZE(PyList_GET_ITEM(pamHandle->record, i));
+  data = malloc(len);
+  if (data == 0)
+    return;
+  len = 0;
+  for (i = 0; i < PyList_GET_SIZE(pamHandle->record); i += 1)
+  {
+    lines = PyList_GET_ITEM(pamHandle->record, i);
+    memcpy(data + len, PyBytes_AS_STRING(lines), PyBytes_GET_SIZE(lines));
+    len += PyBytes_GET_SIZE(lines);
+  }
+  memcpy(data + len, "end\n", sizeof("end\n") - 1);
+  len += sizeof("end\n") - 1;
+  path = unicode_utf8(pamHandle->record_path, 0);
+  if (path != 0)
+    trace_send(path, data, len);
+  free(data);
+}
+
+/*
+ * Several threads may be using pam_python at once, each with its own
+ * pam_handle_t.  Python is protected by the GIL, which is taken when we
+ * are entered and released when we return.  pypam_lock protects
+ * pypam_initialize_count and starting and stopping Python.  It is never
+ * taken while the GIL is held.
+ */
+static pthread_mutex_t	pypam_lock = PTHREAD_MUTEX_INITIALIZER;
+static int		pamHandle_live_count = 0;
+static int		pypam_initialize_count = 0;
+static void*		pypam_libpython = 0;
+static int		pypam_libpython_global = 0;
+
+/*
+ * A handler that returns a coroutine (or any other awaitable) has it run
+ * on an event loop that is created the first time one is needed and kept
+ * until Python is finalised, so a module's connection pools and the like
+ * outlive a single transaction.  Only one thread can run a loop at a time,
+ * so event_loop_lock serialises them.  It is only waited on with the GIL
+ * released.
+ */
+static pthread_mutex_t	event_loop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t	event_loop_atfork_once = PTHREAD_ONCE_INIT;
+static PyObject*	event_loop = 0;
+static pid_t		event_loop_pid = 0;
+static pthread_t	event_loop_owner;
+static int		event_loop_running = 0;
+
+/*
+ * event_loop_lock is held while a coroutine handler runs, and the handler
+ * may well fork() (eg to run a subprocess), so unlike the other locks it
+ * can't be held across fork().  Instead a child that didn't fork() from
+ * inside the loop gets it unlocked, as whoever held it isn't there.
+ */
+static void event_loop_atfork_child(void)
+{
+  if (!event_loop_running || !pthread_equal(event_loop_owner, pthread_self()))
+  {
+    pthread_mutex_init(&event_loop_lock, 0);
+    event_loop_running = 0;
+  }
+}
+
+static void event_loop_atfork(void)
+{
+  pthread_atfork(0, 0, event_loop_atfork_child);
+}
+
+/*
+ * A Python PAM module that defines pam_sm_process_init() or
+ * pam_sm_process_fini() is loaded once per interpreter rather than once
+ * per PAM handle, and kept in process_modules keyed by its path.  Each
+ * entry is a (module, pid) tuple.  A process fork()ed after a module was
+ * initialised shares the module but doesn't call its
+ * pam_sm_process_fini(), as what it would tear down is the parent's.
+ * process_lock stops two threads initialising the same module at once.
+ * It is only waited on with the GIL released.
+ */
+static pthread_mutex_t	process_lock = PTHREAD_MUTEX_INITIALIZER;
+static PyObject*	process_modules = 0;
+
+/*
+ * C extension modules Python loads don't link against libpython, so
+ * they need its symbols in the process's global scope, where libpam's
+ * dlopen() of us doesn't put them.  We link against libpython, so it
+ * is already mapped: RTLD_NOLOAD promotes that mapping rather than
+ * loading and relocating it again.  It is closed when Python is
+ * finalised, so once libpam has unloaded us libpython goes too, and
+ * nothing of the interpreter outlives it.  libpython_local skips the
+ * promotion for modules that use no C extension modules.
+ *
+ * Called with pypam_lock held.  Returns -1 if it failed, 1 if libpython
+ * was opened and 0 if there was nothing to do.
+ */
+static int libpython_open(int global)
+{
+  int			flags = RTLD_LAZY;
+  void*			handle;
+
+  if (pypam_libpython != 0 && (pypam_libpython_global || !global))
+    return 0;
+  if (global)
+    flags |= RTLD_GLOBAL;
+  handle = dlopen(libpython_so, flags | RTLD_NOLOAD);
+  if (handle == 0)
+    handle = dlopen(libpython_so, flags);
+  if (handle == 0)
+    return -1;
+  if (pypam_libpython != 0)
+    dlclose(pypam_libpython);
+  pypam_libpython = handle;
+  pypam_libpython_global |= global;
+  return 1;
+}
+
+/*
+ * Drop what libpython_open() opened.  Called with pypam_lock held, once
+ * Python is finalised.
+ */
+static void libpython_close(void)
+{
+  if (pypam_libpython != 0)
+    dlclose(pypam_libpython);
+  pypam_libpython = 0;
+  pypam_libpython_global = 0;
+}
+
+/*
+ * The watchdog enforces the timeout= option.  While a handler runs,
+ * call_python_handler() keeps a Deadline for it on watchdog.deadlines.
+ * If it passes the watchdog thread raises TimeoutError in the handler's
+ * thread.  Python only looks for that between bytecodes, so a handler
+ * blocked in C code (eg reading a socket that has no timeout) only sees it
+ * once that returns.  A coroutine handler is run under asyncio.wait_for(),
+ * which cancels it cleanly even while it waits, so the watchdog gives it
+ * COROUTINE_TIMEOUT_GRACE longer and only steps in if the event loop
+ * itself is stuck.  Whatever the handler then does, a call that overran
+ * returns the timeout_result= code.  The clock is stopped while a handler
+ * is in pamh.conversation(), as that is the user's time rather than the
+ * handler's.  asyncio.wait_for() can't be stopped, so that isn't done
+ * for pamh.conversation_async().
+ *
+ * The GIL is taken before watchdog_lock, so the watchdog thread drops
+ * watchdog_lock while it waits for the GIL.
+ */
+#define	COROUTINE_TIMEOUT_GRACE	100	/* ms */
+
+typedef struct Deadline
+{
+  struct Deadline*	next;		/* Next on watchdog.deadlines */
+  unsigned long		id;		/* Unique, as the memory is reused */
+  struct timespec	expires;	/* CLOCK_MONOTONIC */
+  double		extended;	/* Seconds it was paused for */
+  unsigned long		thread_id;	/* PyThread_get_thread_ident() */
+  int			expired;	/* It passed */
+  int			paused;		/* In the conversation */
+  int			raised;		/* TimeoutError was raised */
+} Deadline;
+
+static struct
+{
+  pthread_cond_t	changed;	/* Signalled when a Deadline is added */
+  Deadline*		deadlines;	/* Handlers running with a timeout */
+  unsigned long		last_id;	/* Last Deadline.id handed out */
+  pid_t			pid;		/* Process the thread runs in */
+  int			stop;		/* Tells the thread to exit */
+  pthread_t		thread;		/* The watchdog */
+} watchdog;
+
+static pthread_mutex_t	watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t	watchdog_atfork_once = PTHREAD_ONCE_INIT;
+
+/*
+ * fork() copies watchdog_lock as it was, so it is held across it.  The
+ * thread isn't copied, so the child starts its own when it needs one.
+ */
+static void watchdog_atfork_prepare(void)
+{
+  pthread_mutex_lock(&watchdog_lock);
+}
+
+static void watchdog_atfork_parent(void)
+{
+  pthread_mutex_unlock(&watchdog_lock);
+}
+
+static void watchdog_atfork_child(void)
+{
+  watchdog.pid = 0;
+  pthread_mutex_unlock(&watchdog_lock);
+}
+
+static void watchdog_atfork(void)
+{
+  pthread_atfork(
+      watchdog_atfork_prepare, watchdog_atfork_parent,
+      watchdog_atfork_child);
+}
+
+static int timespec_before(const struct timespec* a, const struct timespec* b)
+{
+  return a->tv_sec < b->tv_sec ||
+      (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * The watchdog thread.
+ */
+static void* watchdog_thread(void* arg)
+{
+  Deadline*		deadline;
+  PyGILState_STATE	gil;
+  unsigned long		id;
+  Deadline*		next;
+  struct timespec	now;
+
+  (void)arg;
+  pthread_mutex_lock(&watchdog_lock);
+  while (!watchdog.stop)
+  {
+    next = 0;
+    for (deadline = watchdog.deadlines; deadline != 0; deadline = deadline->next)
+    {
+      if (deadline->expired || deadline->paused)
+	continue;
+      if (next == 0 || timespec_before(&deadline->expires, &next->expires))
+	next = deadline;
+    }
+    if (next == 0)
+    {
+      pthread_cond_wait(&watchdog.changed, &watchdog_lock);
+      continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (timespec_before(&now, &next->expires))
+    {
+      pthread_cond_timedwait(
+	  &watchdog.changed, &watchdog_lock, &next->expires);
+      continue;
+    }
+    next->expired = 1;
+    id = next->id;
+    pthread_mutex_unlock(&watchdog_lock);
+    gil = PyGILState_Ensure();
+    pthread_mutex_lock(&watchdog_lock);
+    /*
+     * The handler may have returned while we waited for the GIL.
+     */
+    for (deadline = watchdog.deadlines; deadline != 0; deadline = deadline->next)
+    {
+      if (deadline->id == id)
+      {
+	PyThreadState_SetAsyncExc(deadline->thread_id, PyExc_TimeoutError);
+	deadline->raised = 1;
+	break;
+      }
+    }
+    pthread_mutex_unlock(&watchdog_lock);
+    PyGILState_Release(gil);
+    pthread_mutex_lock(&watchdog_lock);
+  }
+  pthread_mutex_unlock(&watchdog_lock);
+  return 0;
+}
+
+/*
+ * Start the watchdog thread, with watchdog_lock held.  Returns -1 if
+ * that didn't work.
+ */
+static int watchdog_start(void)
+{
+  pthread_condattr_t	attr;
+
+  watchdog.deadlines = 0;		/* Any are the parent's */
+  watchdog.stop = 0;
+  if (pthread_condattr_init(&attr) != 0)
+    return -1;
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  if (pthread_cond_init(&watchdog.changed, &attr) != 0)
+  {
+    pthread_condattr_destroy(&attr);
+    return -1;
+  }
+  pthread_condattr_destroy(&attr);
+  if (pthread_create(&watchdog.thread, 0, watchdog_thread, 0) != 0)
+  {
+    pthread_cond_destroy(&watchdog.changed);
+    return -1;
+  }
+  watchdog.pid = getpid();
+  return 0;
+}
+
+/*
+ * Stop the watchdog thread.  It must be stopped before Python is
+ * finalised and before we are unloaded.  The caller mustn't hold the
+ * GIL, as the thread may be waiting for it.
  */
-static int PamHandle_conversation_2message(
-    struct pam_message* message, PyObject* object)
+static void watchdog_stop(void)
 {
-  PyObject*		msg = 0;
-  PyObject*		msg_style = 0;
-  int			result = -1;
+  pthread_mutex_lock(&watchdog_lock);
+  if (watchdog.pid == getpid())
+  {
+    watchdog.stop = 1;
+    pthread_cond_signal(&watchdog.changed);
+    pthread_mutex_unlock(&watchdog_lock);
+    pthread_join(watchdog.thread, 0);
+    pthread_mutex_lock(&watchdog_lock);
+    pthread_cond_destroy(&watchdog.changed);
+  }
+  watchdog.pid = 0;
+  pthread_mutex_unlock(&watchdog_lock);
+}
 
-  msg_style = PyObject_GetAttrString(object, "msg_style");
-  if (msg_style == 0)
-    goto error_exit;
-  if (!PyInt_Check(msg_style) && !PyLong_Check(msg_style))
+/*
+ * Give the calling thread timeout milliseconds, starting the watchdog if
+ * need be.  Called with the GIL held.  Returns -1 if the watchdog can't
+ * be started.
+ */
+static int watchdog_arm(Deadline* deadline, int timeout)
+{
+  clock_gettime(CLOCK_MONOTONIC, &deadline->expires);
+  deadline->expires.tv_sec += timeout / 1000;
+  deadline->expires.tv_nsec += (timeout % 1000) * 1000000L;
+  if (deadline->expires.tv_nsec >= 1000000000L)
   {
-    PyErr_SetString(PyExc_TypeError, "message.msg_style must be an int");
-    goto error_exit;
+    deadline->expires.tv_sec += 1;
+    deadline->expires.tv_nsec -= 1000000000L;
   }
-  message->msg_style = PyInt_AsLong(msg_style);
-  msg = PyObject_GetAttrString(object, "msg");
-  if (msg == 0)
-    goto error_exit;
-  message->msg = PyString_AsString(msg);
-  if (message->msg == 0)
+  deadline->thread_id = PyThread_get_thread_ident();
+  deadline->expired = 0;
+  deadline->extended = 0;
+  deadline->paused = 0;
+  deadline->raised = 0;
+  pthread_once(&watchdog_atfork_once, watchdog_atfork);
+  pthread_mutex_lock(&watchdog_lock);
+  if (watchdog.pid != getpid() && watchdog_start() == -1)
   {
-    PyErr_SetString(PyExc_TypeError, "message.msg must be a string");
-    goto error_exit;
+    pthread_mutex_unlock(&watchdog_lock);
+    return -1;
   }
-  result = 0;
+  watchdog.last_id += 1;
+  deadline->id = watchdog.last_id;
+  deadline->next = watchdog.deadlines;
+  watchdog.deadlines = deadline;
+  pthread_cond_signal(&watchdog.changed);
+  pthread_mutex_unlock(&watchdog_lock);
+  return 0;
+}
 
-error_exit:
-  py_xdecref(msg);
-  py_xdecref(msg_style);
-  return result;
+/*
+ * Take the deadline off the watchdog's list.  Called with the GIL held.
+ */
+static void watchdog_disarm(Deadline* deadline)
+{
+  Deadline**		link;
+
+  pthread_mutex_lock(&watchdog_lock);
+  for (link = &watchdog.deadlines; *link != 0; link = &(*link)->next)
+  {
+    if (*link == deadline)
+    {
+      *link = deadline->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&watchdog_lock);
+  /*
+   * A TimeoutError Python hasn't got around to delivering would otherwise
+   * go off in whatever the thread runs next.
+   */
+  if (deadline->raised)
+    PyThreadState_SetAsyncExc(deadline->thread_id, 0);
 }
 
 /*
- * Convert a pam_response structure to a PamHandleObject.Response object.
+ * Stop the clock on a deadline while its handler waits for the
+ * conversation function, which is the user's time rather than the
+ * handler's.  Only the handler's own thread counts.  Called with the
+ * GIL held.
  */
-static PyObject* PamHandle_conversation_2response(
-    PamHandleObject* pamHandle, struct pam_response* pam_response)
+static void watchdog_pause(Deadline* deadline)
 {
-  PyObject*		newargs;
-  PyObject*  		result = 0;
+  if (deadline->thread_id != PyThread_get_thread_ident())
+    return;
+  pthread_mutex_lock(&watchdog_lock);
+  deadline->paused = 1;
+  pthread_mutex_unlock(&watchdog_lock);
+}
 
-  newargs = Py_BuildValue("si", pam_response->resp, pam_response->resp_retcode);
-  if (newargs == 0)
-    goto error_exit;
-  result = pamHandle->response->tp_new(pamHandle->response, newargs, 0);
-  if (result == 0)
-    goto error_exit;
+/*
+ * Start the clock again, seconds after watchdog_pause() stopped it.
+ */
+static void watchdog_resume(Deadline* deadline, double seconds)
+{
+  long long		ns = (long long)(seconds * 1e9);
+
+  if (deadline->thread_id != PyThread_get_thread_ident())
+    return;
+  pthread_mutex_lock(&watchdog_lock);
+  deadline->expires.tv_sec += ns / 1000000000LL;
+  deadline->expires.tv_nsec += ns % 1000000000LL;
+  if (deadline->expires.tv_nsec >= 1000000000L)
+  {
+    deadline->expires.tv_sec += 1;
+    deadline->expires.tv_nsec -= 1000000000L;
+  }
+  deadline->extended += seconds;
+  deadline->paused = 0;
+  pthread_cond_signal(&watchdog.changed);
+  pthread_mutex_unlock(&watchdog_lock);
+}
 
-error_exit:
-  py_xdecref(newargs);
-  return result;
+/*
+ * The scheduler runs the functions pamh.schedule() is given on a thread
+ * of its own, so a module can refresh what its handlers read without a
+ * login waiting for it.  scheduler.tasks is only changed with
+ * scheduler_lock held, and holds a reference to each task on it.
+ * Python objects are only touched with the GIL held, and like the
+ * watchdog the thread drops scheduler_lock while it waits for the GIL.
+ * A task is never taken off the list while it is running, as the
+ * reference it holds is what keeps it alive.
+ *
+ * A task a process module schedules runs until Python is finalised.  Any
+ * other task is cancelled when the PAM handle that scheduled it is
+ * destroyed, but one that is running carries on, and the handle's
+ * methods that use PAM fail from then on as the handle's pamh is gone.
+ * The thread doesn't survive fork(), so a child forgets the tasks it
+ * inherited.
+ *
+ * Stopping the thread waits SCHEDULER_STOP_SECONDS for a running task.
+ * If it is still running the thread is left to exit once it returns, so
+ * a stuck task can't hang pam_end().
+ */
+#define	SCHEDULER_STOP_SECONDS	2
+
+static struct
+{
+  int			abandoned;	/* Stopping gave up waiting */
+  pthread_cond_t	changed;	/* Signalled when a task is added */
+  int			exited;		/* The thread is done with Python */
+  pid_t			pid;		/* Process the thread runs in */
+  unsigned long long	random;		/* xorshift64 state, for jitter */
+  int			stop;		/* Tells the thread to exit */
+  PamTaskObject*	tasks;		/* Scheduled tasks */
+  pid_t			tasks_pid;	/* Process tasks belong to */
+  pthread_t		thread;		/* The scheduler */
+} scheduler;
+
+static pthread_mutex_t	scheduler_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t	scheduler_atfork_once = PTHREAD_ONCE_INIT;
+
+/*
+ * fork() copies scheduler_lock as it was, so it is held across it.
+ */
+static void scheduler_atfork_prepare(void)
+{
+  pthread_mutex_lock(&scheduler_lock);
+}
+
+static void scheduler_atfork_parent(void)
+{
+  pthread_mutex_unlock(&scheduler_lock);
+}
+
+static void scheduler_atfork_child(void)
+{
+  scheduler.pid = 0;
+  pthread_mutex_unlock(&scheduler_lock);
+}
+
+static void scheduler_atfork(void)
+{
+  pthread_atfork(
+      scheduler_atfork_prepare, scheduler_atfork_parent,
+      scheduler_atfork_child);
 }
 
 /*
- * Run a PAM "conversation".
+ * Set task->due to now plus its interval, varied by up to task->jitter
+ * of it either way so processes started together don't all refresh at
+ * once.  Called with scheduler_lock held.
  */
-static PyObject* PamHandle_conversation(
-    PyObject* self, PyObject* args, PyObject* kwds)
+static void scheduler_due(PamTaskObject* task)
 {
-  int			err;
-  PamHandleObject*	pamHandle = (PamHandleObject*)self;
-  PyObject*		prompts = 0;
-  PyObject*		result_tuple = 0;
-  struct pam_message*	message_array = 0;
-  struct pam_message**	message_vector = 0;
-  struct pam_response*	response_array = 0;
-  PyObject*		result = 0;
-  PyObject*		response = 0;
-  const struct pam_conv*conv;
-  int			prompt_count;
-  int			i;
-  int			pam_result;
-  int			prompts_is_sequence;
-  int			py_result;
-  static char*		kwlist[] = {"prompts", NULL};
+  double		seconds;
+  long long		ns;
+
+  scheduler.random ^= scheduler.random << 13;
+  scheduler.random ^= scheduler.random >> 7;
+  scheduler.random ^= scheduler.random << 17;
+  seconds = task->interval * (1 + task->jitter *
+      ((double)(scheduler.random >> 11) / (double)(1ULL << 53) * 2 - 1));
+  ns = (long long)(seconds * 1e9);
+  clock_gettime(CLOCK_MONOTONIC, &task->due);
+  task->due.tv_sec += ns / 1000000000L;
+  task->due.tv_nsec += ns % 1000000000L;
+  if (task->due.tv_nsec >= 1000000000L)
+  {
+    task->due.tv_sec += 1;
+    task->due.tv_nsec -= 1000000000L;
+  }
+}
 
-  err = PyArg_ParseTupleAndKeywords(
-      args, kwds, "O:conversation", kwlist,
-      &prompts);
-  if (!err)
-    goto error_exit;
-  pam_result = pam_get_item(pamHandle->pamh, PAM_CONV, (const void**)&conv);
-  if (check_pam_result(pamHandle, pam_result) == -1)
-    goto error_exit;
-  prompts_is_sequence = PySequence_Check(prompts);
-  if (!prompts_is_sequence)
-    prompt_count = 1;
-  else
+/*
+ * Take the tasks done() says are finished off scheduler.tasks and return
+ * them as a list, linked through next.  Called with scheduler_lock held.
+ */
+static PamTaskObject* scheduler_unlink(
+    int (*done)(PamTaskObject* task, PamTaskObject* match, void* owner),
+    PamTaskObject* match, void* owner)
+{
+  PamTaskObject**	link;
+  PamTaskObject*	removed = 0;
+  PamTaskObject*	task;
+
+  link = &scheduler.tasks;
+  while (*link != 0)
   {
-    prompt_count = PySequence_Size(prompts);
-    if (prompt_count == 0)
+    task = *link;
+    if (!done(task, match, owner))
     {
-      result = prompts;
-      Py_INCREF(result);
-      goto error_exit;
+      link = &task->next;
+      continue;
     }
+    *link = task->next;
+    task->next = removed;
+    removed = task;
   }
-  message_array = PyMem_Malloc(prompt_count * sizeof(*message_array));
-  if (message_array == 0)
-  {
-    PyErr_NoMemory();
-    goto error_exit;
-  }
-  if (!prompts_is_sequence)
+  return removed;
+}
+
+/*
+ * Drop the references to tasks scheduler_unlink() returned.  Called with
+ * the GIL held but not scheduler_lock, as freeing a task can run any
+ * Python code.
+ */
+static void scheduler_release(PamTaskObject* removed)
+{
+  PamTaskObject*	task;
+
+  while (removed != 0)
   {
-    py_result = PamHandle_conversation_2message(message_array, prompts);
-    if (py_result == -1)
-      goto error_exit;
+    task = removed;
+    removed = task->next;
+    task->next = 0;
+    task->cancelled = 1;
+    Py_DECREF(task);
   }
-  else
+}
+
+static int scheduler_done_all(
+    PamTaskObject* task, PamTaskObject* match, void* owner)
+{
+  (void)task;
+  (void)match;
+  (void)owner;
+  return 1;
+}
+
+static int scheduler_done_cancelled(
+    PamTaskObject* task, PamTaskObject* match, void* owner)
+{
+  (void)match;
+  (void)owner;
+  return task->cancelled && !task->running;
+}
+
+/*
+ * Cancel the task match, or every task owner scheduled.
+ */
+static int scheduler_done_cancel(
+    PamTaskObject* task, PamTaskObject* match, void* owner)
+{
+  if (task == match || (owner != 0 && task->owner == owner))
+    task->cancelled = 1;
+  return task->cancelled && !task->running;
+}
+
+/*
+ * The tasks on scheduler.tasks in a fork()ed child are its parent's.
+ * Return them so they can be released.  Called with scheduler_lock
+ * held.
+ */
+static PamTaskObject* scheduler_forget_parent(void)
+{
+  if (scheduler.tasks == 0 || scheduler.tasks_pid == getpid())
+    return 0;
+  return scheduler_unlink(scheduler_done_all, 0, 0);
+}
+
+/*
+ * The scheduler thread.
+ */
+static void* scheduler_thread(void* arg)
+{
+  PyGILState_STATE	gil;
+  PamTaskObject*	next;
+  struct timespec	now;
+  PyObject*		old_value;
+  PamTaskObject*	removed;
+  PyObject*		result;
+  PamTaskObject*	task;
+
+  (void)arg;
+  pthread_mutex_lock(&scheduler_lock);
+  while (!scheduler.stop)
   {
-    for (i = 0; i < prompt_count; i += 1)
+    next = 0;
+    for (task = scheduler.tasks; task != 0; task = task->next)
     {
-      PyObject* message = PySequence_ITEM(prompts, i);
-      if (message == 0)
-        goto error_exit;
-      py_result = PamHandle_conversation_2message(&message_array[i], message);
-      Py_DECREF(message);
-      if (py_result == -1)
-        goto error_exit;
+      if (task->cancelled)
+	continue;
+      if (next == 0 || timespec_before(&task->due, &next->due))
+	next = task;
+    }
+    if (next == 0)
+    {
+      pthread_cond_wait(&scheduler.changed, &scheduler_lock);
+      continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (timespec_before(&now, &next->due))
+    {
+      pthread_cond_timedwait(&scheduler.changed, &scheduler_lock, &next->due);
+      continue;
+    }
+    next->running = 1;
+    pthread_mutex_unlock(&scheduler_lock);
+    gil = PyGILState_Ensure();
+    result = PyObject_CallNoArgs(next->function);
+    if (result == 0)
+    {
+      next->failures += 1;
+      syslog_path_traceback(unicode_utf8(next->module_path, MODULE_NAME), 0);
+    }
+    else
+    {
+      old_value = next->value;
+      next->value = result;
+      next->runs += 1;
+      py_xdecref(old_value);
     }
+    pthread_mutex_lock(&scheduler_lock);
+    next->running = 0;
+    scheduler_due(next);
+    removed = scheduler_unlink(scheduler_done_cancelled, 0, 0);
+    pthread_mutex_unlock(&scheduler_lock);
+    scheduler_release(removed);
+    PyGILState_Release(gil);
+    pthread_mutex_lock(&scheduler_lock);
   }
-  message_vector = PyMem_Malloc(prompt_count * sizeof(*message_vector));
-  if (message_vector == 0)
+  /*
+   * Whoever stopped us is finished with the tasks.
+   */
+  removed = scheduler_unlink(scheduler_done_all, 0, 0);
+  pthread_mutex_unlock(&scheduler_lock);
+  if (removed != 0)
   {
-    PyErr_NoMemory();
-    goto error_exit;
+    gil = PyGILState_Ensure();
+    scheduler_release(removed);
+    PyGILState_Release(gil);
   }
-  for (i = 0; i < prompt_count; i += 1)
-    message_vector[i] = &message_array[i];
-  pam_result = conv->conv(
-    prompt_count, (const struct pam_message**)message_vector,
-    &response_array, conv->appdata_ptr);
-  if (check_pam_result(pamHandle, pam_result) == -1)
-    goto error_exit;
-  if (!prompts_is_sequence)
-    result = PamHandle_conversation_2response(pamHandle, response_array);
+  /*
+   * If scheduler_stop() gave up on us no one will join us, so we tidy up
+   * after ourselves and let the scheduler be started again.
+   */
+  pthread_mutex_lock(&scheduler_lock);
+  scheduler.exited = 1;
+  if (!scheduler.abandoned)
+    pthread_cond_broadcast(&scheduler.changed);
   else
   {
-    result_tuple = PyTuple_New(prompt_count);
-    if (result_tuple == 0)
-      goto error_exit;
-    for (i = 0; i < prompt_count; i += 1)
-    {
-      response = PamHandle_conversation_2response(
-          pamHandle, &response_array[i]);
-      if (response == 0)
-        goto error_exit;
-      if (PyTuple_SetItem(result_tuple, i, response) == -1)
-	goto error_exit;
-      response = 0;			/* was stolen */
-    }
-    result = result_tuple;
-    result_tuple = 0;
+    pthread_cond_destroy(&scheduler.changed);
+    scheduler.abandoned = 0;
+    scheduler.pid = 0;
+  }
+  pthread_mutex_unlock(&scheduler_lock);
+  return 0;
+}
+
+/*
+ * Start the scheduler thread.  Called with scheduler_lock held.
+ */
+static int scheduler_start(void)
+{
+  pthread_condattr_t	attr;
+
+  pthread_once(&scheduler_atfork_once, scheduler_atfork);
+  scheduler.abandoned = 0;
+  scheduler.exited = 0;
+  scheduler.stop = 0;
+  if (scheduler.random == 0 &&
+      getrandom(&scheduler.random, sizeof(scheduler.random), GRND_NONBLOCK) !=
+	  (ssize_t)sizeof(scheduler.random))
+    scheduler.random = (unsigned long long)realtime_ns() ^ getpid();
+  scheduler.random |= 1;
+  if (pthread_condattr_init(&attr) != 0)
+    return -1;
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  if (pthread_cond_init(&scheduler.changed, &attr) != 0)
+  {
+    pthread_condattr_destroy(&attr);
+    return -1;
+  }
+  pthread_condattr_destroy(&attr);
+  if (pthread_create(&scheduler.thread, 0, scheduler_thread, 0) != 0)
+  {
+    pthread_cond_destroy(&scheduler.changed);
+    return -1;
   }
+  scheduler.pid = getpid();
+  return 0;
+}
 
-error_exit:
-  py_xdecref(response);
-  py_xdecref(result_tuple);
-  PyMem_Free(message_array);
-  PyMem_Free(message_vector);
-  if (response_array != 0)
-   free(response_array);
-  return result;
+/*
+ * Schedule task to run as soon as possible, and every task->interval
+ * seconds after that, starting the scheduler if need be.  Called with the
+ * GIL held.  Returns -1 with a Python exception set if the scheduler
+ * can't be started.
+ */
+static int scheduler_add(PamTaskObject* task)
+{
+  PamTaskObject*	removed;
+
+  pthread_mutex_lock(&scheduler_lock);
+  removed = scheduler_forget_parent();
+  if (scheduler.pid == getpid() && scheduler.stop)
+  {
+    pthread_mutex_unlock(&scheduler_lock);
+    scheduler_release(removed);
+    PyErr_SetString(PyExc_RuntimeError, "the scheduler thread is stopping");
+    return -1;
+  }
+  if (scheduler.pid != getpid() && scheduler_start() == -1)
+  {
+    pthread_mutex_unlock(&scheduler_lock);
+    scheduler_release(removed);
+    PyErr_SetString(PyExc_RuntimeError, "can't start the scheduler thread");
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &task->due);
+  Py_INCREF(task);
+  task->next = scheduler.tasks;
+  scheduler.tasks = task;
+  scheduler.tasks_pid = getpid();
+  pthread_cond_signal(&scheduler.changed);
+  pthread_mutex_unlock(&scheduler_lock);
+  scheduler_release(removed);
+  return 0;
+}
+
+/*
+ * Cancel task, or if it is 0 every task owner scheduled.  One that is
+ * running is taken off the list by the scheduler thread once it returns.
+ * Called with the GIL held.
+ */
+static void scheduler_cancel(PamTaskObject* task, void* owner)
+{
+  PamTaskObject*	removed;
+  PamTaskObject*	stale;
+
+  pthread_mutex_lock(&scheduler_lock);
+  stale = scheduler_forget_parent();
+  removed = scheduler_unlink(scheduler_done_cancel, task, owner);
+  pthread_mutex_unlock(&scheduler_lock);
+  if (task != 0)
+    task->cancelled = 1;
+  scheduler_release(stale);
+  scheduler_release(removed);
 }
 
 /*
- * Set the fail delay.
+ * Tasks a PAM handle scheduled while its module was becoming a process
+ * module now belong to the module.  Called with the GIL held.
  */
-static PyObject* PamHandle_fail_delay(
-    PyObject* self, PyObject* args, PyObject* kwds)
+static void scheduler_adopt(void* owner)
 {
-  int			err;
-  int			micro_sec = 0;
-  int			pam_result;
-  PyObject*		result = 0;
-  static char*		kwlist[] = {"micro_sec", NULL};
+  PamTaskObject*	task;
 
-  err = PyArg_ParseTupleAndKeywords(
-      args, kwds, "i:fail_delay", kwlist,
-      &micro_sec);
-  if (!err)
-    goto error_exit;
-#ifndef HAVE_PAM_FAIL_DELAY
-  (void)self;
-#else
+  pthread_mutex_lock(&scheduler_lock);
+  for (task = scheduler.tasks; task != 0; task = task->next)
   {
-    PamHandleObject*	pamHandle = (PamHandleObject*)self;
-    pam_result = pam_fail_delay(pamHandle->pamh, micro_sec);
-    if (check_pam_result(pamHandle, pam_result) == -1)
-      goto error_exit;
+    if (task->owner == owner)
+      task->owner = 0;
   }
-#endif
-  result = Py_None;
-  Py_INCREF(result);
-
-error_exit:
-  return result;
+  pthread_mutex_unlock(&scheduler_lock);
 }
 
 /*
- * Get the user's name, promping if it isn't known.
+ * Stop the scheduler thread, which drops the tasks.  It must be stopped
+ * before Python is finalised and before we are unloaded.  If idle is
+ * set it is left running if a process module's task is scheduled, as
+ * then we stay loaded.  The caller mustn't hold the GIL, as the thread
+ * may be waiting for it.  Returns -1 if a task is still running after
+ * SCHEDULER_STOP_SECONDS, in which case the thread is left to finish
+ * it, we stay loaded and Python mustn't be finalised.
  */
-static PyObject* PamHandle_get_user(
-    PyObject* self, PyObject* args, PyObject* kwds)
+static int scheduler_stop(int idle)
 {
-  PamHandleObject*	pamHandle = (PamHandleObject*)self;
-  char*			prompt = 0;
-  PyObject*		result = 0;
-  int			pam_result;
-  const char*		user = 0;
-  static char*		kwlist[] = {"prompt", NULL};
+  Dl_info		pam_python_so;
+  PamTaskObject*	task;
+  struct timespec	until;
 
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|z:get_user", kwlist, &prompt))
-    goto error_exit;
-  pam_result = pam_get_user(pamHandle->pamh, &user, prompt);
-  if (check_pam_result(pamHandle, pam_result) == -1)
-    goto error_exit;
-  if (user != 0)
-    result = PyString_FromString(user);
-  else
+  pthread_mutex_lock(&scheduler_lock);
+  for (task = scheduler.tasks; idle && task != 0; task = task->next)
   {
-    result = Py_None;
-    Py_INCREF(result);
+    if (task->owner == 0 && !task->cancelled)
+    {
+      pthread_mutex_unlock(&scheduler_lock);
+      return 0;
+    }
   }
-  if (result == 0)
-    goto error_exit;
+  if (scheduler.pid == getpid() && scheduler.abandoned)
+  {
+    pthread_mutex_unlock(&scheduler_lock);
+    return -1;
+  }
+  if (scheduler.pid == getpid())
+  {
+    scheduler.stop = 1;
+    pthread_cond_signal(&scheduler.changed);
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += SCHEDULER_STOP_SECONDS;
+    while (!scheduler.exited &&
+	pthread_cond_timedwait(
+	    &scheduler.changed, &scheduler_lock, &until) != ETIMEDOUT)
+      continue;
+    if (!scheduler.exited)
+    {
+      scheduler.abandoned = 1;
+      pthread_detach(scheduler.thread);
+      pthread_mutex_unlock(&scheduler_lock);
+      if (dladdr((void*)scheduler_thread, &pam_python_so) != 0)
+	dlopen(pam_python_so.dli_fname, RTLD_LAZY|RTLD_NOLOAD|RTLD_NODELETE);
+      syslog_write(
+	  MODULE_NAME, LOG_ERR,
+	  "a scheduled task is still running after %d seconds, "
+	  "leaving it to finish", SCHEDULER_STOP_SECONDS);
+      return -1;
+    }
+    pthread_mutex_unlock(&scheduler_lock);
+    pthread_join(scheduler.thread, 0);
+    pthread_mutex_lock(&scheduler_lock);
+    pthread_cond_destroy(&scheduler.changed);
+  }
+  scheduler.pid = 0;
+  pthread_mutex_unlock(&scheduler_lock);
+  return 0;
+}
 
-error_exit:
-  return result;
+/*
+ * Close the event loop, letting its async generators and executor threads
+ * finish first.  A loop inherited over fork() is just closed, as the
+ * threads that served it weren't.  Errors are ignored: there is nowhere
+ * left to report them.
+ */
+static void event_loop_close(void)
+{
+  PyObject*		coroutine;
+  PyObject*		result;
+  size_t		i;
+  static const char*	shutdowns[] =
+      {"shutdown_asyncgens", "shutdown_default_executor"};
+
+  if (event_loop == 0)
+    return;
+  for (i = 0; event_loop_pid == getpid() && i < arr_size(shutdowns); i += 1)
+  {
+    coroutine = PyObject_CallMethod(event_loop, shutdowns[i], 0);
+    if (coroutine == 0)
+      break;
+    result = PyObject_CallMethod(
+	event_loop, "run_until_complete", "O", coroutine);
+    Py_DECREF(coroutine);
+    if (result == 0)
+      break;
+    Py_DECREF(result);
+  }
+  PyErr_Restore(0, 0, 0);
+  result = PyObject_CallMethod(event_loop, "close", 0);
+  py_xdecref(result);
+  PyErr_Restore(0, 0, 0);
+  Py_DECREF(event_loop);
+  event_loop = 0;
 }
 
 /*
- * Set a PAM environment variable.
+ * Run an awaitable returned by a handler to completion on the event loop,
+ * creating the loop if need be.  Unless timeout_at is 0 it is cancelled
+ * if it is still running at that monotonic_time().  Returns what it
+ * returned, or 0 with a Python exception set.
  */
-static PyObject* PamHandle_strerror(
-    PyObject* self, PyObject* args, PyObject* kwds)
+static PyObject* event_loop_run(PyObject* awaitable, double timeout_at)
 {
-  PamHandleObject*	pamHandle = (PamHandleObject*)self;
-  const char*		err;
-  int			errnum;
+  PyObject*		asyncio = 0;
+  Dl_info		pam_python_so;
   PyObject*		result = 0;
-  const int		debug_magic = 0x4567abcd;
-  static char*		kwlist[] = {"errnum", NULL};
+  PyObject*		wait_for = 0;
 
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "i:strerror", kwlist, &errnum))
+  if (event_loop_running && pthread_equal(event_loop_owner, pthread_self()))
+  {
+    PyErr_SetString(
+	PyExc_RuntimeError,
+	"a coroutine handler can't be called from inside another one");
     goto error_exit;
-  /*
-   * A kludge so we can test exceptions.
-   */
-  if (errnum >= debug_magic && errnum < debug_magic + _PAM_RETURN_VALUES)
+  }
+  pthread_once(&event_loop_atfork_once, event_loop_atfork);
+  if (pthread_mutex_trylock(&event_loop_lock) != 0)
   {
-    if (check_pam_result(pamHandle, errnum - debug_magic) == -1)
-      goto error_exit;
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&event_loop_lock);
+    Py_END_ALLOW_THREADS
   }
-  err = pam_strerror(pamHandle->pamh, errnum);
-  if (err == 0)
+  event_loop_owner = pthread_self();
+  event_loop_running = 1;
+  if (event_loop != 0 && event_loop_pid != getpid())
+    event_loop_close();
+  asyncio = PyImport_ImportModule("asyncio");
+  if (asyncio == 0)
+    goto unlock_exit;
+  if (event_loop == 0)
   {
-    result = Py_None;
-    Py_INCREF(result);
+    event_loop = PyObject_CallMethod(asyncio, "new_event_loop", 0);
+    if (event_loop == 0)
+      goto unlock_exit;
+    event_loop_pid = getpid();
+    /*
+     * The loop's executor threads may still hold our objects when libpam
+     * unloads us, and a reloaded copy wouldn't know about this loop, so
+     * once there is one we stay loaded.
+     */
+    if (dladdr((void*)event_loop_run, &pam_python_so) != 0)
+      dlopen(pam_python_so.dli_fname, RTLD_LAZY|RTLD_NOLOAD|RTLD_NODELETE);
   }
-  else
+  if (timeout_at != 0)
   {
-    result = PyString_FromString(err);
-    if (result == 0)
-      goto error_exit;
+    wait_for = PyObject_CallMethod(
+	asyncio, "wait_for", "Od", awaitable,
+	timeout_at > monotonic_time() ? timeout_at - monotonic_time() : 0);
+    if (wait_for == 0)
+      goto unlock_exit;
+    awaitable = wait_for;
   }
+  result = PyObject_CallMethod(
+      event_loop, "run_until_complete", "O", awaitable);
 
+unlock_exit:
+  event_loop_running = 0;
+  pthread_mutex_unlock(&event_loop_lock);
 error_exit:
+  py_xdecref(asyncio);
+  py_xdecref(wait_for);
   return result;
 }
 
-static PyMethodDef PamHandle_Methods[] =
+/*
+ * Return a new reference to the process module for module_path, or 0 if
+ * there isn't one.
+ */
+static PyObject* process_module_find(const char* module_path)
 {
+  PyObject*		entry;
+  PyObject*		module;
+
+  if (process_modules == 0)
+    return 0;
+  entry = PyDict_GetItemString(process_modules, module_path);
+  if (entry == 0)
+    return 0;
+  module = PyTuple_GET_ITEM(entry, 0);
+  Py_INCREF(module);
+  return module;
+}
+
+/*
+ * Call pam_sm_process_fini() of every process module this process
+ * initialised, most recently initialised first, and forget them.  Called
+ * with the GIL held, before Python is finalised.  An exception is logged
+ * and the rest are still called.
+ */
+static void process_modules_fini(void)
+{
+  PyObject*		entry;
+  PyObject*		entries;
+  PyObject*		handler_function;
+  const char*		module_path;
+  PyObject*		modules = process_modules;
+  PyObject*		py_resultobj;
+  Py_ssize_t		i;
+
+  if (modules == 0)
+    return;
+  process_modules = 0;
+  entries = PyDict_Items(modules);
+  if (entries == 0)
+    PyErr_Restore(0, 0, 0);
+  for (i = entries != 0 ? PyList_GET_SIZE(entries) : 0; i > 0; i -= 1)
   {
-    "conversation",
-    PyCFunctionKwds_cast PamHandle_conversation,
-    METH_VARARGS|METH_KEYWORDS,
-    MODULE_NAME "." PAMHANDLE_NAME "." "conversation(prompts)\n"
-    "  Ask the application to issue the prompts to the user and return the\n"
-    "  users responses.  The 'prompts' can be one, or a list of\n"
-    "  " MODULE_NAME "." PAMHANDLE_NAME "." PAMMESSAGE_NAME " objects.  The return value is one,\n"
-    "  or an array of " MODULE_NAME "." PAMHANDLE_NAME "." PAMRESPONSE_NAME " objects."
-  },
-  {
-    "fail_delay",
-    PyCFunctionKwds_cast PamHandle_fail_delay,
-    METH_VARARGS|METH_KEYWORDS,
-    MODULE_NAME "." PAMHANDLE_NAME "." "fail_delay(micro_sec)\n"
-    "  Sets the amount of time a failed authenticate attempt should delay for\n"
-    "  in micro seconds.  This amount reset to 0 after every authenticate\n"
-    "  attempt."
-  },
-  {
-    "get_user",
-    PyCFunctionKwds_cast PamHandle_get_user,
-    METH_VARARGS|METH_KEYWORDS,
-    MODULE_NAME "." PAMHANDLE_NAME "." "getuser([prompt])\n"
-    "  If " PAMHANDLE_NAME ".user isn't None return it, otherwise ask the\n"
-    "  application to display the string 'prompt' and enter the user name.  The\n"
-    "  user name (a string) is returned.  It will be None if it isn't known."
-  },
-  {
-    "strerror",
-    PyCFunctionKwds_cast PamHandle_strerror,
-    METH_VARARGS|METH_KEYWORDS,
-    MODULE_NAME "." PAMHANDLE_NAME "." "strerror(errnum)\n"
-    "  Return a string describing the pam error errnum."
-  },
-  {0,0,0,0}        	/* Sentinel */
+    module_path = unicode_utf8(
+	PyTuple_GET_ITEM(PyList_GET_ITEM(entries, i - 1), 0), MODULE_NAME);
+    entry = PyTuple_GET_ITEM(PyList_GET_ITEM(entries, i - 1), 1);
+    if (PyLong_AsLong(PyTuple_GET_ITEM(entry, 1)) != (long)getpid())
+      continue;
+    handler_function = PyObject_GetAttrString(
+	PyTuple_GET_ITEM(entry, 0), "pam_sm_process_fini");
+    if (handler_function == 0)
+    {
+      PyErr_Restore(0, 0, 0);
+      continue;
+    }
+    py_resultobj = PyObject_CallNoArgs(handler_function);
+    if (py_resultobj == 0)
+      syslog_path_traceback(module_path, 0);
+    py_xdecref(py_resultobj);
+    Py_DECREF(handler_function);
+  }
+  py_xdecref(entries);
+  Py_DECREF(modules);
+}
+
+/*
+ * Python calls this when it exits, so the process modules of an
+ * interpreter we didn't start are finalised too.  Their tasks are
+ * stopped first.
+ */
+static PyObject* process_modules_atexit(PyObject* self, PyObject* args)
+{
+  PyObject*		result;
+
+  (void)self;
+  (void)args;
+  Py_BEGIN_ALLOW_THREADS
+  scheduler_stop(0);
+  Py_END_ALLOW_THREADS
+  process_modules_fini();
+  result = Py_None;
+  Py_INCREF(result);
+  return result;
+}
+
+static PyMethodDef process_modules_atexit_def =
+{
+  "pam_python_process_fini", process_modules_atexit, METH_NOARGS, 0
 };
 
-static PyMemberDef PamHandle_Members[] =
+/*
+ * pamHandle->module has just been loaded.  If it defines
+ * pam_sm_process_init() or pam_sm_process_fini() make it the process
+ * module for module_path, calling pam_sm_process_init() first.  If
+ * another thread got there first pamHandle->module is replaced by its
+ * module.  Returns PAM_SUCCESS if it worked, the PAM error code
+ * otherwise, in which case the module isn't kept, the tasks
+ * pam_sm_process_init() scheduled are cancelled and the next PAM handle
+ * tries again.
+ */
+static int process_module_init(
+    PamHandleObject* pamHandle, const char* module_path)
 {
+  PyObject*		atexit_module = 0;
+  PyObject*		atexit_function = 0;
+  PyObject*		entry = 0;
+  PyObject*		handler_function = 0;
+  PyObject*		module;
+  Dl_info		pam_python_so;
+  PyObject*		py_resultobj = 0;
+  int			pam_result;
+  int			timed_out = 0;
+
+  if (!PyObject_HasAttrString(pamHandle->module, "pam_sm_process_init") &&
+      !PyObject_HasAttrString(pamHandle->module, "pam_sm_process_fini"))
+    return PAM_SUCCESS;
+  if (pthread_mutex_trylock(&process_lock) != 0)
   {
-    "env",
-    T_OBJECT_EX,
-    offsetof(PamHandleObject, env),
-    READONLY,
-    "The PAM environment mapping."
-  },
-  {
-    "exception",
-    T_OBJECT_EX,
-    offsetof(PamHandleObject, exception),
-    READONLY,
-    "Exception raised when a call to PAM fails."
-  },
-  {
-    "libpam_version",
-    T_STRING,
-    offsetof(PamHandleObject, libpam_version),
-    READONLY,
-    "The runtime PAM version."
-  },
-  {
-    "Message",
-    T_OBJECT,
-    offsetof(PamHandleObject, message),
-    READONLY,
-    "Message class that can be passed to " MODULE_NAME "." PAMHANDLE_NAME ".conversation()"
-  },
-  {
-    "module",
-    T_OBJECT,
-    offsetof(PamHandleObject, module),
-    READONLY,
-    "The user module (ie you!)"
-  },
-  {
-    "pamh",
-    T_LONG,
-    offsetof(PamHandleObject, pamh),
-    READONLY,
-    "The PAM handle."
-  },
-  {
-    "py_initialized",
-    T_INT,
-    offsetof(PamHandleObject, py_initialized),
-    READONLY,
-    "True if Py_Initialize was called."
-  },
-  {
-    "Response",
-    T_OBJECT,
-    offsetof(PamHandleObject, response),
-    READONLY,
-    "Response class returned by " MODULE_NAME "." PAMHANDLE_NAME ".conversation()"
-  },
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&process_lock);
+    Py_END_ALLOW_THREADS
+  }
+  module = process_module_find(module_path);
+  if (module != 0)
   {
-    "XAuthData",
-    T_OBJECT,
-    offsetof(PamHandleObject, xauthdata),
-    READONLY,
-    "XAuthData class used by " MODULE_NAME "." PAMHANDLE_NAME ".xauthdata"
-  },
-  {0,0,0,0,0},        	/* End of Python visible members */
+    Py_DECREF(pamHandle->module);
+    pamHandle->module = module;
+    pam_result = PAM_SUCCESS;
+    goto error_exit;
+  }
+  if (process_modules == 0)
   {
-    "syslogFile",
-    T_OBJECT,
-    offsetof(PamHandleObject, syslogFile),
-    READONLY,
-    "File like object that writes to syslog"
-  },
-  {0,0,0,0,0}		/* Sentinal */
-};
-
-static char PamHandle_Doc[] =
-  MODULE_NAME "." PAMHANDLE_NAME "\n"
-  "  A an instance of this class makes the PAM API available to the Python\n"
-  "  module.  It is the first argument to every method PAM calls in the module.";
+    atexit_module = PyImport_ImportModule("atexit");
+    if (atexit_module != 0)
+      atexit_function = PyCFunction_New(&process_modules_atexit_def, 0);
+    if (atexit_function != 0)
+      py_resultobj = PyObject_CallMethod(
+	  atexit_module, "register", "O", atexit_function);
+    if (py_resultobj != 0)
+      process_modules = PyDict_New();
+    if (process_modules == 0)
+    {
+      pam_result = syslog_exception(pamHandle, "Can't create process_modules");
+      goto error_exit;
+    }
+    Py_DECREF(py_resultobj);
+    py_resultobj = 0;
+    /*
+     * A process module may hold our objects for the rest of the process,
+     * so once there is one we stay loaded.
+     */
+    if (dladdr((void*)process_module_init, &pam_python_so) != 0)
+      dlopen(pam_python_so.dli_fname, RTLD_LAZY|RTLD_NOLOAD|RTLD_NODELETE);
+  }
+  handler_function =
+      PyObject_GetAttrString(pamHandle->module, "pam_sm_process_init");
+  if (handler_function == 0)
+    PyErr_Restore(0, 0, 0);
+  else
+  {
+    pam_result = call_python_handler(
+	&py_resultobj, pamHandle, handler_function,
+	"pam_sm_process_init", 0, 0, 0, 0, &timed_out);
+    if (pam_result != PAM_SUCCESS)
+      goto error_exit;
+  }
+  entry = Py_BuildValue("(Ol)", pamHandle->module, (long)getpid());
+  if (entry == 0 ||
+      PyDict_SetItemString(process_modules, module_path, entry) == -1)
+  {
+    pam_result = syslog_exception(pamHandle, "Can't add to process_modules");
+    goto error_exit;
+  }
+  scheduler_adopt(pamHandle);
+  pam_result = PAM_SUCCESS;
 
-static int	pypam_initialize_count = 0;
+error_exit:
+  pthread_mutex_unlock(&process_lock);
+  if (pam_result != PAM_SUCCESS)
+    scheduler_cancel(0, pamHandle);
+  py_xdecref(atexit_module);
+  py_xdecref(atexit_function);
+  py_xdecref(entry);
+  py_xdecref(handler_function);
+  py_xdecref(py_resultobj);
+  return pam_result;
+}
 
 static void cleanup_pamHandle(pam_handle_t* pamh, void* data, int error_status)
 {
   PamHandleObject*	pamHandle = (PamHandleObject*)data;
-  void*			dlhandle = pamHandle->dlhandle;
+  double		conv;
+  PyGILState_STATE	gil;
   PyObject*		py_resultobj = 0;
   PyObject*		handler_function = 0;
+  int			memstats = pamHandle->memstats;
+  MemSample		memstats_before;
+  int			timed_out = 0;
+  char			module_path[PATH_MAX];
+  int			pam_result;
   int			py_initialized;
+  double		start;
+  char			state_dir[PATH_MAX];
+  StatsFile*		stats_file = pamHandle->stats_file;
   static const char*	handler_name = "pam_sm_end";
 
   (void)pamh;
   (void)error_status;
+  gil = PyGILState_Ensure();
   handler_function =
       PyObject_GetAttrString(pamHandle->module, (char*)handler_name);
   if (handler_function == 0)
     PyErr_Restore(0, 0, 0);
   else
   {
-    call_python_handler(
+    start = monotonic_time();
+    conv = pamHandle->trace_conv;
+    if (memstats != 0)
+      memstats_sample(&memstats_before, 1);
+    if (pamHandle->record != 0)
+      record_call(pamHandle, handler_name, 0, 0, 0);
+    pam_result = call_python_handler(
         &py_resultobj, pamHandle, handler_function,
-	handler_name, 0, 0, 0);
+	handler_name, 0, 0, 0, pamHandle->timeout_end, &timed_out);
+    if (pamHandle->record != 0)
+      record_result(pamHandle, pam_result);
+    if (memstats != 0)
+      memstats_handler_call(pamHandle, handler_name, &memstats_before);
+    stats_handler_call(
+        pamHandle->stats, handler_name, pam_result,
+	pam_result != PAM_SUCCESS && !timed_out, timed_out,
+	monotonic_time() - start);
+    trace_handler_call(pamHandle, handler_name, start, conv, pam_result);
   }
   py_xdecref(py_resultobj);
   py_xdecref(handler_function);
+  scheduler_cancel(0, pamHandle);
+  profile_write(pamHandle);
+  trace_write(pamHandle);
+  record_write(pamHandle);
+  exception_buckets_flush(get_state_dir(pamHandle), pamHandle->log_window);
+  /*
+   * pamh is freed once we return.  Wait for other threads' calls still
+   * using it, and then forget it, so libpam fails whatever a thread
+   * holding pamh tries next.
+   */
+  while (pamHandle->pam_calls > pam_calls_own(pamHandle))
+  {
+    Py_BEGIN_ALLOW_THREADS
+    usleep(1000);
+    Py_END_ALLOW_THREADS
+  }
+  pamHandle->pamh = 0;
+  if (memstats != 0)
+  {
+    memstats_log_handle(pamHandle);
+    memstats_before = pamHandle->memstats_start;
+    snprintf(module_path, sizeof(module_path), "%s", get_module_path(pamHandle));
+    snprintf(state_dir, sizeof(state_dir), "%s", get_state_dir(pamHandle));
+  }
   py_initialized = pamHandle->py_initialized;
   Py_DECREF(pamHandle);
+  stats_close(stats_file);
+  PyGILState_Release(gil);
+  pthread_mutex_lock(&pypam_lock);
   if (py_initialized)
   {
     pypam_initialize_count -= 1;
     if (pypam_initialize_count == 0)
-      Py_Finalize();
+    {
+      /*
+       * This needn't be the thread that started Python, so it gets a
+       * thread state of its own rather than borrowing that thread's.  A
+       * scheduled task that won't finish leaves Python running, and the
+       * next handle uses it like an interpreter someone else started.
+       */
+      watchdog_stop();
+      if (scheduler_stop(0) == 0)
+      {
+	PyGILState_Ensure();
+	process_modules_fini();
+	event_loop_close();
+	Py_Finalize();
+	libpython_close();
+      }
+    }
+  }
+  pthread_mutex_unlock(&pypam_lock);
+  if (memstats != 0)
+    memstats_log_end(state_dir, module_path, memstats, &memstats_before);
+  /*
+   * We may be unloaded once the last handle goes, so the watchdog, the
+   * scheduler and the log writer must be finished by then.
+   */
+  if (__atomic_sub_fetch(&pamHandle_live_count, 1, __ATOMIC_ACQ_REL) == 0)
+  {
+    watchdog_stop();
+    scheduler_stop(1);
+    exception_buckets_close();
+    log_queue_stop();
   }
-  dlclose(dlhandle);
 }
 
 /*
@@ -2298,90 +8532,100 @@ error_exit:
 }
 
 /*
- * Create a new Python type on the heap.  This differs from creating a static
- * type in non-obvious ways.
+ * Create a new Python type on the heap from a PyType_Spec.  name is
+ * "module.type", and isn't copied so must be static.  Types that have no
+ * tp_new can't be instantiated from Python.  slots has any slots the
+ * type needs beyond these, and is 0 terminated.
  */
 static PyTypeObject* newHeapType(
   PyObject*		module,		/* Module declaring type (required) */
   const char*		name,		/* tp_name (required) */
   int			basicsize,	/* tp_basicsize (required) */
-  char*			doc, 		/* tp_doc (optional) */
-  inquiry		clear,		/* tp_clear (optional) */
+  const char*		doc, 		/* tp_doc (optional) */
+  traverseproc		traverse,	/* tp_traverse (required) */
+  inquiry		clear,		/* tp_clear (required) */
   struct PyMethodDef*	methods,	/* tp_methods (optional) */
   struct PyMemberDef*	members,	/* tp_members (optional) */
   struct PyGetSetDef*	getset,		/* tp_getset (optional) */
-  newfunc		new		/* tp_new (optional) */
+  newfunc		new,		/* tp_new (optional) */
+  const PyType_Slot*	slots		/* More slots (optional) */
 )
 {
-  PyObject*		pyName = 0;
   PyTypeObject*		result = 0;
+  PyType_Spec		spec;
+  PyType_Slot		spec_slots[16];
+  size_t		slot_count = 0;
   PyTypeObject*		type = 0;
 
-  pyName = PyString_FromString(name);
-  if (pyName == 0)
-    goto error_exit;
-  type = (PyTypeObject*)PyType_Type.tp_alloc(&PyType_Type, 0);
+#define	ADD_SLOT(id, value) \
+    do { \
+      if ((value) != 0) \
+      { \
+	spec_slots[slot_count].slot = (id); \
+	spec_slots[slot_count].pfunc = (void*)(value); \
+	slot_count += 1; \
+      } \
+    } while (0)
+  ADD_SLOT(Py_tp_dealloc, generic_dealloc);
+  ADD_SLOT(Py_tp_traverse, traverse);
+  ADD_SLOT(Py_tp_clear, clear);
+  ADD_SLOT(Py_tp_doc, doc);
+  ADD_SLOT(Py_tp_methods, methods);
+  ADD_SLOT(Py_tp_members, members);
+  ADD_SLOT(Py_tp_getset, getset);
+  ADD_SLOT(Py_tp_new, new);
+  for (; slots != 0 && slots->slot != 0; slots += 1)
+    ADD_SLOT(slots->slot, slots->pfunc);
+#undef	ADD_SLOT
+  spec_slots[slot_count].slot = 0;
+  spec_slots[slot_count].pfunc = 0;
+  spec.name = name;
+  spec.basicsize = basicsize;
+  spec.itemsize = 0;
+  spec.flags = Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_GC;
+#ifdef	Py_TPFLAGS_DISALLOW_INSTANTIATION
+  if (new == 0)
+    spec.flags |= Py_TPFLAGS_DISALLOW_INSTANTIATION;
+#endif
+  spec.slots = spec_slots;
+  type = (PyTypeObject*)PyType_FromModuleAndSpec(module, &spec, 0);
   if (type == 0)
     goto error_exit;
-  type->tp_flags = Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HEAPTYPE|Py_TPFLAGS_HAVE_GC;
-  type->tp_basicsize = basicsize;
-  type->tp_dealloc = generic_dealloc;
-  if (doc != 0)
-  {
-    char *doc_string = PyMem_Malloc(strlen(doc)+1);
-    if (doc_string == 0)
-    {
-      PyErr_NoMemory();
-      goto error_exit;
-    }
-    strcpy(doc_string, doc);
-    type->tp_doc = doc_string;
-  }
-  type->tp_traverse = generic_traverse;
-  type->tp_clear = clear != 0 ? clear : generic_clear;
-  type->tp_methods = methods;
-  type->tp_members = members;
-  type->tp_getset = getset;
-  type->tp_name = PyString_AsString(pyName);
-#if PY_VERSION_HEX < 0x02050000
-  ((PyHeapTypeObject*)type)->name = pyName;
-#else
-  ((PyHeapTypeObject*)type)->ht_name = pyName;
+#ifndef	Py_TPFLAGS_DISALLOW_INSTANTIATION
+  if (new == 0)
+    type->tp_new = 0;
 #endif
-  pyName = 0;
-  PyType_Ready(type);
-  type->tp_new = new;
-  if (PyDict_SetItemString(type->tp_dict, "__module__", module) == -1)
-    goto error_exit;
   result = type;
   type = 0;
 
 error_exit:
-  py_xdecref(pyName);
   py_xdecref((PyObject*)type);
   return result;
 }
 
 /*
  * Create a type and return an instance of that type.  The newly created
- * type object is discarded.
+ * type object is kept alive by the instance.
  */
 static PyObject* newSingletonObject(
   PyObject*		module,		/* Module declaring type (required) */
   const char*		name,		/* tp_name (required) */
   int			basicsize,	/* tp_basicsize (required) */
-  char*			doc, 		/* tp_doc (optional) */
-  inquiry		clear,		/* tp_clear (optional) */
+  const char*		doc, 		/* tp_doc (optional) */
+  traverseproc		traverse,	/* tp_traverse (required) */
+  inquiry		clear,		/* tp_clear (required) */
   struct PyMethodDef*	methods,	/* tp_methods (optional) */
   struct PyMemberDef*	members,	/* tp_members (optional) */
-  struct PyGetSetDef*	getset		/* tp_getset (optional) */
+  struct PyGetSetDef*	getset,		/* tp_getset (optional) */
+  const PyType_Slot*	slots		/* More slots (optional) */
 )
 {
   PyObject*		result = 0;
   PyTypeObject*  	type = 0;
 
   type = newHeapType(
-      module, name, basicsize, doc, clear, methods, members, getset, 0);
+      module, name, basicsize, doc, traverse, clear, methods, members,
+      getset, 0, slots);
   if (type != 0)
     result = type->tp_alloc(type, 0);
   py_xdecref((PyObject*)type);
@@ -2391,23 +8635,32 @@ static PyObject* newSingletonObject(
 /*
  * Find the PamHandle object used by the pamh instance, creating one if it
  * doesn't exist.  Returns a pam_result, which will be PAM_SUCCESS if it
- * works.
+ * works, in which case the GIL is held and must be released with *gil.
  */
 static int get_pamHandle(
-  PamHandleObject** result, pam_handle_t* pamh, const char** argv)
+  PamHandleObject** result, PyGILState_STATE* gil, pam_handle_t* pamh,
+  const char** argv, const PamOptions* options)
 {
-  void*			dlhandle = 0;
+  int			cold = 0;
   int			do_initialize;
+  int			gil_held = 0;
+  double		import_seconds;
+  double		init_seconds = 0;
+  int			libpython_opened;
+  double		libpython_seconds;
+  MemSample		memstats_start;
   char*			module_dir;
   char*			module_path = 0;
   char*			module_data_name = 0;
   PyObject*		user_module = 0;
+  PamCacheObject*	pamCache = 0;
   PamEnvObject*		pamEnv = 0;
+  PamFailuresObject*	pamFailures = 0;
   PamHandleObject*	pamHandle = 0;
   PyObject*		pamHandle_module = 0;
-  SyslogFileObject*	syslogFile = 0;
-  PyObject*		tracebackModule = 0;
   int			pam_result;
+  int			shared;
+  double		start = monotonic_time();
 
   /*
    * Figure out where the module lives.
@@ -2444,16 +8697,25 @@ static int get_pamHandle(
   pam_result = pam_get_data(pamh, module_data_name, (void*)result);
   if (pam_result == PAM_SUCCESS)
   {
+    *gil = PyGILState_Ensure();
     (*result)->pamh = pamh;
     Py_INCREF(*result);
+    if ((*result)->stats != 0)
+      __atomic_fetch_add(&(*result)->stats->reused, 1, __ATOMIC_RELAXED);
     goto error_exit;
   }
+  if (options->memstats != 0)
+    memstats_sample(&memstats_start, 0);
   /*
    * Initialize Python if required.
    */
-  dlhandle = dlopen(libpython_so, RTLD_NOW|RTLD_GLOBAL);
-  if (dlhandle == 0)
+  pthread_mutex_lock(&pypam_lock);
+  libpython_seconds = monotonic_time();
+  libpython_opened = libpython_open(!options->libpython_local);
+  libpython_seconds = monotonic_time() - libpython_seconds;
+  if (libpython_opened == -1)
   {
+    pthread_mutex_unlock(&pypam_lock);
     pam_result = syslog_path_message(
         module_path,
 	"Can't load python library %s: %s", libpython_so, dlerror());
@@ -2463,9 +8725,24 @@ static int get_pamHandle(
   if (do_initialize)
   {
     if (pypam_initialize_count == 0)
-      initialise_python();
+    {
+      init_seconds = monotonic_time();
+      if (initialise_python() == -1)
+      {
+	pthread_mutex_unlock(&pypam_lock);
+	pam_result = syslog_path_message(
+	    module_path, "Can't initialise the python interpreter");
+	goto error_exit;
+      }
+      PyEval_SaveThread();
+      init_seconds = monotonic_time() - init_seconds;
+      cold = 1;
+    }
     pypam_initialize_count += 1;
   }
+  pthread_mutex_unlock(&pypam_lock);
+  *gil = PyGILState_Ensure();
+  gil_held = 1;
   /*
    * Create a throw away module because heap types need one, apparently.
    */
@@ -2482,13 +8759,15 @@ static int get_pamHandle(
    */
   pamHandle = (PamHandleObject*)newSingletonObject(
       pamHandle_module,			/* __module__ */
-      PAMHANDLE_NAME "_type",		/* tp_name */
+      MODULE_NAME "." PAMHANDLE_NAME "_type",	/* tp_name */
       sizeof(PamHandleObject),		/* tp_basicsize */
       PamHandle_Doc,			/* tp_doc */
-      0,				/* tp_clear */
+      PamHandle_traverse,		/* tp_traverse */
+      PamHandle_clear,			/* tp_clear */
       PamHandle_Methods,		/* tp_methods */
       PamHandle_Members,		/* tp_members */
-      PamHandle_Getset);		/* tp_getset */
+      PamHandle_Getset,			/* tp_getset */
+      0);				/* slots */
   if (pamHandle == 0)
   {
     pam_result = syslog_path_exception(module_path, "Can't create pamh Object");
@@ -2496,57 +8775,58 @@ static int get_pamHandle(
   }
   if (PyObject_IS_GC((PyObject*)pamHandle))
     PyObject_GC_UnTrack(pamHandle);	/* No refs are visible to python */
-  pamHandle->dlhandle = dlhandle;
-  dlhandle = 0;
   pamHandle->libpam_version =
       __STRING(__LINUX_PAM__) "." __STRING(__LINUX_PAM_MINOR__);
   pamHandle->pamh = pamh;
   pamHandle->py_initialized = do_initialize;
   pamHandle->exception = PyErr_NewException(
-    PAMHANDLE_NAME "." PAMHANDLEEXCEPTION_NAME, PyExc_StandardError, NULL);
+    PAMHANDLE_NAME "." PAMHANDLEEXCEPTION_NAME, PyExc_Exception, NULL);
   if (pamHandle->exception == NULL)
     goto error_exit;
+  pamHandle->log_level = options->log_level;
+  pamHandle->log_source = options->log_source;
+  pamHandle->log_window = options->log_window;
+  pamHandle->memstats = options->memstats;
+  pamHandle->timeout_end = options->timeouts[stats_handler_index("pam_sm_end")];
+  if (pamHandle->memstats != 0)
+    pamHandle->memstats_start = memstats_start;
+  pamHandle->state_dir = PyUnicode_FromString(options->state_dir);
+  if (pamHandle->state_dir == 0)
+    goto error_exit;
   /*
    * Create the object we use to handle the PAM environment.
    */
   pamEnv = (PamEnvObject*)newSingletonObject(
       pamHandle_module,			/* __module__ */
-      PAMENV_NAME "_type",		/* tp_name */
+      MODULE_NAME "." PAMENV_NAME "_type",	/* tp_name */
       sizeof(PamEnvObject),		/* tp_basicsize */
       0,				/* tp_doc */
-      0,				/* tp_clear */
+      PamEnv_traverse,			/* tp_traverse */
+      PamEnv_clear,			/* tp_clear */
       PamEnv_Methods,			/* tp_methods */
       PamEnv_Members,			/* tp_members */
-      0);				/* tp_getset */
+      0,				/* tp_getset */
+      PamEnv_slots);			/* slots */
   if (pamEnv == 0)
   {
     pam_result = syslog_path_exception(module_path, "Can't create pamh.env");
     goto error_exit;
   }
-  pamEnv->ob_type->tp_as_mapping = &PamEnv_as_mapping;
-  pamEnv->ob_type->tp_iter = PamEnv_iter;
   pamEnv->pamHandle = pamHandle;
   pamEnv->pamEnvIter_type = newHeapType(
       pamHandle_module,			/* __module__ */
-      PAMENVITER_NAME "_type",		/* tp_name */
+      MODULE_NAME "." PAMENVITER_NAME "_type",	/* tp_name */
       sizeof(PamEnvIterObject),		/* tp_basicsize */
       0,				/* tp_doc */
-      0,				/* tp_clear */
+      PamEnvIter_traverse,		/* tp_traverse */
+      PamEnvIter_clear,			/* tp_clear */
       0,				/* tp_methods */
       PamEnvIter_Members,		/* tp_members */
       0,				/* tp_getset */
-      0);				/* tp_new */
+      0,				/* tp_new */
+      PamEnvIter_slots);		/* slots */
   if (pamEnv->pamEnvIter_type == 0)
     goto error_exit;
-  if (PyObject_IS_GC((PyObject*)pamEnv->pamEnvIter_type))
-  {
-    /*
-     * No refs are visible to python.
-     */
-    PyObject_GC_UnTrack(pamEnv->pamEnvIter_type);
-  }
-  pamEnv->pamEnvIter_type->tp_iter = PyObject_SelfIter;
-  pamEnv->pamEnvIter_type->tp_iternext = PamEnvIter_iternext;
   pamHandle->env = (PyObject*)pamEnv;
   pamEnv = 0;
   /*
@@ -2554,14 +8834,16 @@ static int get_pamHandle(
    */
   pamHandle->message = newHeapType(
       pamHandle_module,			/* __module__ */
-      PAMMESSAGE_NAME "_type",		/* tp_name */
+      MODULE_NAME "." PAMMESSAGE_NAME "_type",	/* tp_name */
       sizeof(PamMessageObject),		/* tp_basicsize */
       PamMessage_doc,			/* tp_doc */
-      0,				/* tp_clear */
+      PamMessage_traverse,		/* tp_traverse */
+      PamMessage_clear,			/* tp_clear */
       0,				/* tp_methods */
       PamMessage_members,		/* tp_members */
       0,				/* tp_getset */
-      PamMessage_new);			/* tp_new */
+      PamMessage_new,			/* tp_new */
+      0);				/* slots */
   if (pamHandle->message == 0)
   {
     pam_result = syslog_path_exception(
@@ -2573,14 +8855,16 @@ static int get_pamHandle(
    */
   pamHandle->response = newHeapType(
       pamHandle_module,			/* __module__ */
-      PAMRESPONSE_NAME "_type",		/* tp_name */
+      MODULE_NAME "." PAMRESPONSE_NAME "_type",	/* tp_name */
       sizeof(PamResponseObject),	/* tp_basicsize */
       PamResponse_doc,			/* tp_doc */
-      0,				/* tp_clear */
+      PamResponse_traverse,		/* tp_traverse */
+      PamResponse_clear,		/* tp_clear */
       0,				/* tp_methods */
       PamResponse_members,		/* tp_members */
       0,				/* tp_getset */
-      PamResponse_new);			/* tp_new */
+      PamResponse_new,			/* tp_new */
+      0);				/* slots */
   if (pamHandle->response == 0)
   {
     pam_result = syslog_path_exception(
@@ -2589,62 +8873,83 @@ static int get_pamHandle(
     goto error_exit;
   }
   /*
-   * Create the Syslogfile Type & Object.
+   * Create the type for the PamSpanObject.
    */
-  syslogFile = (SyslogFileObject*)newSingletonObject(
+  pamHandle->span = newHeapType(
       pamHandle_module,			/* __module__ */
-      SYSLOGFILE_NAME "_type",		/* tp_name */
-      sizeof(SyslogFileObject),		/* tp_basicsize */
-      0,				/* tp_doc */
-      SyslogFile_clear,			/* tp_clear */
-      SyslogFile_Methods,		/* tp_methods */
-      0,				/* tp_members */
-      0);				/* tp_getset */
-  if (syslogFile == 0)
+      MODULE_NAME "." PAMSPAN_NAME "_type",	/* tp_name */
+      sizeof(PamSpanObject),		/* tp_basicsize */
+      PamSpan_doc,			/* tp_doc */
+      PamSpan_traverse,			/* tp_traverse */
+      PamSpan_clear,			/* tp_clear */
+      PamSpan_Methods,			/* tp_methods */
+      PamSpan_members,			/* tp_members */
+      0,				/* tp_getset */
+      0,				/* tp_new */
+      0);				/* slots */
+  if (pamHandle->span == 0)
   {
     pam_result = syslog_path_exception(
-        module_path,
-	"Can't create pamh.syslogFile");
+        module_path, "Can't create pamh.Span");
     goto error_exit;
   }
-  syslogFile->buffer = 0;
-  syslogFile->size = 0;
-  pamHandle->syslogFile = (PyObject*)syslogFile;
-  syslogFile = 0;
   /*
-   * The traceback object.
+   * Create the type for the PamBreakerObject.
    */
-  tracebackModule = PyImport_ImportModule("traceback");
-  if (tracebackModule == 0)
+  pamHandle->breaker = newHeapType(
+      pamHandle_module,			/* __module__ */
+      MODULE_NAME "." PAMBREAKER_NAME "_type",	/* tp_name */
+      sizeof(PamBreakerObject),		/* tp_basicsize */
+      PamBreaker_doc,			/* tp_doc */
+      PamBreaker_traverse,		/* tp_traverse */
+      PamBreaker_clear,			/* tp_clear */
+      PamBreaker_Methods,		/* tp_methods */
+      PamBreaker_members,		/* tp_members */
+      PamBreaker_Getset,		/* tp_getset */
+      0,				/* tp_new */
+      0);				/* slots */
+  if (pamHandle->breaker == 0)
   {
     pam_result = syslog_path_exception(
-        module_path,
-	"PyImport_ImportModule('traceback') failed");
+        module_path, "Can't create pamh.Breaker");
     goto error_exit;
   }
-  pamHandle->print_exception =
-    PyObject_GetAttrString(tracebackModule, "print_exception");
-  if (pamHandle->print_exception == 0)
+  /*
+   * Create the type for the PamTaskObject.
+   */
+  pamHandle->task = newHeapType(
+      pamHandle_module,			/* __module__ */
+      MODULE_NAME "." PAMTASK_NAME "_type",	/* tp_name */
+      sizeof(PamTaskObject),		/* tp_basicsize */
+      PamTask_doc,			/* tp_doc */
+      PamTask_traverse,			/* tp_traverse */
+      PamTask_clear,			/* tp_clear */
+      PamTask_Methods,			/* tp_methods */
+      PamTask_members,			/* tp_members */
+      0,				/* tp_getset */
+      0,				/* tp_new */
+      0);				/* slots */
+  if (pamHandle->task == 0)
   {
     pam_result = syslog_path_exception(
-        module_path,
-	"PyObject_GetAttrString(traceback, 'print_exception') failed");
+        module_path, "Can't create pamh.Task");
     goto error_exit;
   }
-  Py_INCREF(pamHandle->print_exception); /* Borrowed reference */
   /*
    * Create the type for the PamXAuthDataObject.
    */
   pamHandle->xauthdata = newHeapType(
       pamHandle_module,			/* __module__ */
-      PAMXAUTHDATA_NAME "_type",	/* tp_name */
+      MODULE_NAME "." PAMXAUTHDATA_NAME "_type",	/* tp_name */
       sizeof(PamXAuthDataObject),	/* tp_basicsize */
       PamXAuthData_doc,			/* tp_doc */
-      0,				/* tp_clear */
+      PamXAuthData_traverse,		/* tp_traverse */
+      PamXAuthData_clear,		/* tp_clear */
       0,				/* tp_methods */
       PamXAuthData_members,		/* tp_members */
       0,				/* tp_getset */
-      PamXAuthData_new);		/* tp_new */
+      PamXAuthData_new,			/* tp_new */
+      0);				/* slots */
   if (pamHandle->xauthdata == 0)
   {
     pam_result = syslog_path_exception(
@@ -2652,20 +8957,192 @@ static int get_pamHandle(
     goto error_exit;
   }
   /*
-   * Now we have error reporting set up import the module.
+   * Create pamh.cache, which is None unless asked for.
    */
-  pam_result = load_user_module(&user_module, pamHandle, module_path);
-  if (pam_result != PAM_SUCCESS)
+  if (options->cache == 0)
+  {
+    pamHandle->cache = Py_None;
+    Py_INCREF(pamHandle->cache);
+  }
+  else
+  {
+    pamCache = (PamCacheObject*)newSingletonObject(
+	pamHandle_module,		/* __module__ */
+	MODULE_NAME "." PAMCACHE_NAME "_type",	/* tp_name */
+	sizeof(PamCacheObject),		/* tp_basicsize */
+	0,				/* tp_doc */
+	PamCache_traverse,		/* tp_traverse */
+	PamCache_clear,			/* tp_clear */
+	PamCache_Methods,		/* tp_methods */
+	0,				/* tp_members */
+	0,				/* tp_getset */
+	0);				/* slots */
+    if (pamCache == 0)
+    {
+      pam_result = syslog_path_exception(module_path, "Can't create pamh.cache");
+      goto error_exit;
+    }
+    pamCache->file = cache_open(
+	options->state_dir, module_path, options->cache, &pamCache->size);
+    if (pamCache->file == 0)
+    {
+      pam_result = syslog_path_message(
+	  module_path, "Can't map a cache of %d slots", options->cache);
+      goto error_exit;
+    }
+    pamHandle->cache = (PyObject*)pamCache;
+    pamCache = 0;
+  }
+  /*
+   * Create pamh.failures, which is None unless asked for.
+   */
+  if (options->failures == 0)
+  {
+    pamHandle->failures = Py_None;
+    Py_INCREF(pamHandle->failures);
+  }
+  else
+  {
+    pamFailures = (PamFailuresObject*)newSingletonObject(
+	pamHandle_module,		/* __module__ */
+	MODULE_NAME "." PAMFAILURES_NAME "_type",	/* tp_name */
+	sizeof(PamFailuresObject),	/* tp_basicsize */
+	0,				/* tp_doc */
+	PamFailures_traverse,		/* tp_traverse */
+	PamFailures_clear,		/* tp_clear */
+	PamFailures_Methods,		/* tp_methods */
+	PamFailures_Members,		/* tp_members */
+	0,				/* tp_getset */
+	0);				/* slots */
+    if (pamFailures == 0)
+    {
+      pam_result = syslog_path_exception(
+	  module_path, "Can't create pamh.failures");
+      goto error_exit;
+    }
+    pamFailures->file = failures_open(
+	options->failures_dir != 0 ? options->failures_dir : options->state_dir,
+	module_path, options->failures, options->failures_window,
+	&pamFailures->size, &shared);
+    if (pamFailures->file == 0)
+    {
+      pam_result = syslog_path_message(
+	  module_path, "Can't map failure counts of %d slots",
+	  options->failures);
+      goto error_exit;
+    }
+    pamFailures->shared = shared;
+    pamFailures->window = pamFailures->file->window;
+    pamHandle->failures = (PyObject*)pamFailures;
+    pamFailures = 0;
+  }
+  /*
+   * Now we have error reporting set up import the module, unless it is a
+   * process module that is already loaded.
+   */
+  import_seconds = 0;
+  user_module = process_module_find(module_path);
+  if (user_module != 0)
+  {
+    pamHandle->module = user_module;
+    Py_INCREF(pamHandle->module);
+    pam_result = PAM_SUCCESS;
+  }
+  else
+  {
+    PROBE2(module__load__start, module_path, probe_service(pamh));
+    import_seconds = monotonic_time();
+    pam_result = load_user_module(&user_module, pamHandle, module_path);
+    import_seconds = monotonic_time() - import_seconds;
+    PROBE3(module__load__end, module_path, probe_service(pamh), pam_result);
+    if (pam_result != PAM_SUCCESS)
+      goto error_exit;
+    pamHandle->module = user_module;
+    Py_INCREF(pamHandle->module);
+    pam_result = process_module_init(pamHandle, module_path);
+    if (pam_result != PAM_SUCCESS)
+      goto error_exit;
+  }
+  /*
+   * pamh.log() identifies itself as the module unless told otherwise.
+   */
+  if (options->log_ident != 0)
+    pamHandle->log_ident = PyUnicode_FromString(options->log_ident);
+  else
+    pamHandle->log_ident = PyObject_GetAttrString(user_module, "__name__");
+  if (pamHandle->log_ident == 0)
+  {
+    pam_result = syslog_path_exception(
+        module_path, "Can't create pamh.log_ident");
+    goto error_exit;
+  }
+  /*
+   * Is this transaction being profiled?
+   */
+  if (options->profile != 0 && profile_select(options->profile_rate))
+  {
+    pamHandle->profile_dir = PyUnicode_FromString(options->profile);
+    pamHandle->profile_stacks = PyDict_New();
+    if (pamHandle->profile_dir == 0 || pamHandle->profile_stacks == 0)
+    {
+      pam_result = syslog_path_exception(
+          module_path, "Can't create pamh.profile_stacks");
+      goto error_exit;
+    }
+  }
+  if (options->trace != 0 &&
+      trace_start(pamHandle, options->trace, start) == -1)
+  {
+    pam_result = syslog_path_exception(module_path, "Can't start trace span");
+    goto error_exit;
+  }
+  if (options->record != 0 &&
+      record_start(pamHandle, options->record) == -1)
+  {
+    pam_result = syslog_path_exception(
+        module_path, "Can't start transaction record");
     goto error_exit;
-  pamHandle->module = user_module;
-  Py_INCREF(pamHandle->module);
+  }
   /*
    * That worked.  Save a reference to it.
    */
   Py_INCREF(pamHandle);
+  if (options->stats)
+  {
+    pamHandle->stats = stats_open(
+        options->state_dir, module_path, &pamHandle->stats_file);
+  }
+  if (pamHandle->stats != 0)
+  {
+    __atomic_fetch_add(
+        cold ? &pamHandle->stats->cold : &pamHandle->stats->warm, 1,
+	__ATOMIC_RELAXED);
+    stats_histogram_add(&pamHandle->stats->create, monotonic_time() - start);
+    stats_histogram_add(&pamHandle->stats->import, import_seconds);
+    if (cold)
+      stats_histogram_add(&pamHandle->stats->init, init_seconds);
+    if (libpython_opened)
+      stats_histogram_add(&pamHandle->stats->libpython, libpython_seconds);
+  }
+  if (cold)
+  {
+    PROBE3(
+        handle__cold, module_path, probe_service(pamh),
+	(long)((monotonic_time() - start) * 1e6));
+  }
+  else
+  {
+    PROBE3(
+        handle__warm, module_path, probe_service(pamh),
+	(long)((monotonic_time() - start) * 1e6));
+  }
+  if (pamHandle->memstats != 0)
+    memstats_sample(&pamHandle->memstats_created, 1);
   pam_set_data(pamh, module_data_name, pamHandle, cleanup_pamHandle);
+  __atomic_add_fetch(&pamHandle_live_count, 1, __ATOMIC_ACQ_REL);
   *result = pamHandle;
   pamHandle = 0;
+  gil_held = 0;
 
 error_exit:
   if (module_path != 0)
@@ -2673,29 +9150,40 @@ error_exit:
   if (module_data_name != 0)
     free(module_data_name);
   py_xdecref(user_module);
+  py_xdecref((PyObject*)pamCache);
   py_xdecref((PyObject*)pamEnv);
+  py_xdecref((PyObject*)pamFailures);
   py_xdecref((PyObject*)pamHandle);
   py_xdecref(pamHandle_module);
-  py_xdecref((PyObject*)syslogFile);
-  py_xdecref(tracebackModule);
+  if (gil_held)
+    PyGILState_Release(*gil);
   return pam_result;
 }
 
 /*
- * Call the python handler.
+ * Call the python handler.  If timeout isn't 0 it is given that many
+ * milliseconds, and if it overran *timed_out is set and an error
+ * returned.
  */
 static int call_python_handler(
     PyObject** result, PamHandleObject* pamHandle,
     PyObject* handler_function, const char* handler_name,
-    int flags, int argc, const char** argv)
+    int flags, int argc, const char** argv, int timeout, int* timed_out)
 {
   PyObject*		arg_object = 0;
   PyObject*		argv_object = 0;
+  PyObject*		awaitable = 0;
+  Deadline		deadline;
+  int			deadline_armed = 0;
+  struct Deadline*	deadline_outer;
+  double		timeout_at = 0;
   PyObject*		flags_object = 0;
   PyObject*		handler_args = 0;
+  PyObject*		profile_arg;
   PyObject*		py_resultobj = 0;
   int			i;
   int			pam_result;
+  int			remaining;
 
   if (!PyCallable_Check(handler_function))
   {
@@ -2711,10 +9199,10 @@ static int call_python_handler(
     handler_args = Py_BuildValue("(O)", pamHandle);
   else
   {
-    flags_object = PyInt_FromLong(flags);
+    flags_object = PyLong_FromLong(flags);
     if (flags_object == 0)
     {
-      pam_result = syslog_exception(pamHandle, "PyInt_FromLong(flags) failed");
+      pam_result = syslog_exception(pamHandle, "PyLong_FromLong(flags) failed");
       goto error_exit;
     }
     argv_object = PyList_New(argc);
@@ -2725,12 +9213,12 @@ static int call_python_handler(
     }
     for (i = 0; i < argc; i += 1)
     {
-      arg_object = PyString_FromString(argv[i]);
+      arg_object = PyUnicode_FromString(argv[i]);
       if (arg_object == 0)
       {
 	pam_result = syslog_exception(
 	    pamHandle,
-	    "PyString_FromString(argv[i]) failed");
+	    "PyUnicode_FromString(argv[i]) failed");
 	goto error_exit;
       }
       PyList_SET_ITEM(argv_object, i, arg_object);
@@ -2749,15 +9237,59 @@ static int call_python_handler(
   /*
    * Call the Python handler function.
    */
-  py_resultobj = PyEval_CallObject(handler_function, handler_args);
+  profile_arg = profile_start(pamHandle, handler_name);
+  if (timeout != 0)
+  {
+    timeout_at = monotonic_time() + timeout / 1000.0;
+    if (watchdog_arm(&deadline, timeout) == -1)
+      syslog_message(pamHandle, "Can't start the timeout= watchdog.");
+    else
+      deadline_armed = 1;
+  }
+  deadline_outer = pamHandle->deadline;
+  if (deadline_armed)
+    pamHandle->deadline = &deadline;
+  py_resultobj = PyObject_CallObject(handler_function, handler_args);
+  pamHandle->deadline = deadline_outer;
+  if (deadline_armed)
+    timeout_at += deadline.extended;
+  /*
+   * An async def handler returns a coroutine; its answer is what the
+   * coroutine returns.
+   */
+  if (py_resultobj != 0 &&
+      Py_TYPE(py_resultobj)->tp_as_async != 0 &&
+      Py_TYPE(py_resultobj)->tp_as_async->am_await != 0)
+  {
+    awaitable = py_resultobj;
+    if (deadline_armed)
+    {
+      watchdog_disarm(&deadline);
+      remaining = (int)((timeout_at - monotonic_time()) * 1000);
+      deadline_armed = watchdog_arm(
+	  &deadline,
+	  (remaining > 0 ? remaining : 0) + COROUTINE_TIMEOUT_GRACE) == 0;
+    }
+    py_resultobj = event_loop_run(awaitable, timeout_at);
+  }
+  if (deadline_armed)
+    watchdog_disarm(&deadline);
+  *timed_out = timeout_at != 0 && monotonic_time() >= timeout_at;
+  profile_stop(profile_arg);
   /*
-   * Did it throw an exception?
+   * Did it throw an exception?  The traceback says where a handler that
+   * timed out had got to.
    */
   if (py_resultobj == 0)
-  {
     pam_result = syslog_traceback(pamHandle);
+  if (*timed_out)
+  {
+    pam_result = syslog_message(
+	pamHandle, "%s() took longer than %dms.", handler_name, timeout);
     goto error_exit;
   }
+  if (py_resultobj == 0)
+    goto error_exit;
   *result = py_resultobj;
   py_resultobj = 0;
   pam_result = PAM_SUCCESS;
@@ -2765,12 +9297,304 @@ static int call_python_handler(
 error_exit:
   py_xdecref(arg_object);
   py_xdecref(argv_object);
+  py_xdecref(awaitable);
   py_xdecref(flags_object);
   py_xdecref(handler_args);
   py_xdecref(py_resultobj);
   return pam_result;
 }
 
+/*
+ * Native rules, turned on by the rules= option.  They are checked before
+ * Python is started, and stay mapped between calls, so a transaction they
+ * decide costs a stat() and a few hash lookups.  pam_python_rules.h describes the compiled file.
+ *
+ * Look up key in the rules, returning the index of the first rule with
+ * that key that applies to handler, rule_count if there is none, or
+ * RULES_BROKEN if a slot it looked at points outside the file.  Only the
+ * slots a lookup touches are checked, so it costs the same whatever the
+ * number of rules.
+ */
+#define	RULES_BROKEN	UINT_MAX
+
+static unsigned int rules_lookup(
+    const RulesHeader* header, unsigned int handler,
+    const unsigned char* key, size_t key_len)
+{
+  const unsigned char*	keys;
+  unsigned int		mask = header->slot_count - 1;
+  unsigned int		probes;
+  unsigned int		result = header->rule_count;
+  const RulesRule*	rules = (const RulesRule*)(header + 1);
+  unsigned int		slot;
+  const RulesSlot*	slots;
+
+  slots = (const RulesSlot*)(rules + header->rule_count);
+  keys = (const unsigned char*)(slots + header->slot_count);
+  slot = rules_hash(key, key_len) & mask;
+  for (probes = 0;
+      probes < header->slot_count && slots[slot].key_len != 0;
+      probes += 1, slot = (slot + 1) & mask)
+  {
+    if (slots[slot].key > header->key_size ||
+	slots[slot].key_len > header->key_size - slots[slot].key ||
+	slots[slot].rule >= header->rule_count)
+      return RULES_BROKEN;
+    if (slots[slot].key_len == key_len &&
+	slots[slot].rule < result &&
+	(rules[slots[slot].rule].handlers & handler) != 0 &&
+	memcmp(keys + slots[slot].key, key, key_len) == 0)
+      result = slots[slot].rule;
+  }
+  return result;
+}
+
+/*
+ * The compiled rules stay mapped between calls.  pam_python_rules
+ * replaces the file by renaming a new one over it, so they are only
+ * mapped again when stat() shows a different file.  rules_lock is held
+ * while they are used.
+ */
+static struct
+{
+  RulesHeader*		header;		/* The mapped file, or 0 */
+  char			path[PATH_MAX];	/* Its name */
+  struct stat		st;		/* It when mapped */
+} rules_mapped;
+
+static pthread_mutex_t	rules_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t	rules_atfork_once = PTHREAD_ONCE_INIT;
+
+/*
+ * fork() copies rules_lock as it was, so it is held across it.
+ */
+static void rules_atfork_prepare(void)
+{
+  pthread_mutex_lock(&rules_lock);
+}
+
+static void rules_atfork_parent(void)
+{
+  pthread_mutex_unlock(&rules_lock);
+}
+
+static void rules_atfork_child(void)
+{
+  pthread_mutex_unlock(&rules_lock);
+}
+
+static void rules_atfork(void)
+{
+  pthread_atfork(
+      rules_atfork_prepare, rules_atfork_parent, rules_atfork_child);
+}
+
+/*
+ * Forget the mapped rules.  The caller holds rules_lock.
+ */
+static void rules_unmap(void)
+{
+  if (rules_mapped.header == 0)
+    return;
+  munmap(rules_mapped.header, rules_mapped.st.st_size);
+  rules_mapped.header = 0;
+}
+
+/*
+ * libpam unloads us at pam_end(), and the rules may have been used
+ * without a PAM handle ever being made, so they are unmapped then.
+ */
+__attribute__((destructor)) static void rules_unload(void)
+{
+  rules_unmap();
+}
+
+/*
+ * Get the rules at path, mapping them if they aren't already.  Returns 0
+ * if they can't be mapped or the header is wrong.  The caller holds
+ * rules_lock.
+ */
+static const RulesHeader* rules_map(const char* path)
+{
+  int			fd;
+  RulesHeader*		header;
+  struct stat		st;
+
+  if (stat(path, &st) == -1)
+    return 0;
+  if (rules_mapped.header != 0 &&
+      strcmp(rules_mapped.path, path) == 0 &&
+      rules_mapped.st.st_dev == st.st_dev &&
+      rules_mapped.st.st_ino == st.st_ino &&
+      rules_mapped.st.st_size == st.st_size &&
+      rules_mapped.st.st_mtime == st.st_mtime)
+    return rules_mapped.header;
+  rules_unmap();
+  if (strlen(path) >= sizeof(rules_mapped.path))
+    return 0;
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return 0;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*header))
+  {
+    close(fd);
+    return 0;
+  }
+  header = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (header == MAP_FAILED)
+    return 0;
+  if (header->magic != RULES_MAGIC || header->version != RULES_VERSION ||
+      header->slot_count == 0 ||
+      (header->slot_count & (header->slot_count - 1)) != 0 ||
+      header->rule_count >= header->slot_count ||
+      (size_t)st.st_size != sizeof(*header) +
+	  (size_t)header->rule_count * sizeof(RulesRule) +
+	  (size_t)header->slot_count * sizeof(RulesSlot) + header->key_size)
+  {
+    munmap(header, st.st_size);
+    return 0;
+  }
+  rules_mapped.header = header;
+  strcpy(rules_mapped.path, path);
+  rules_mapped.st = st;
+  return header;
+}
+
+/*
+ * Run the rules at path for handler_name.  Returns the PAM result the
+ * first matching rule gives, or RULES_PYTHON if Python must decide.
+ * Broken rules are logged and leave it to Python.
+ */
+static int rules_check(
+    const char* path, const char* handler_name, pam_handle_t* pamh)
+{
+  unsigned char		cidr[1 + 16];
+  size_t		cidr_len;
+  unsigned int		found;
+  unsigned int		handler;
+  const RulesHeader*	header;
+  size_t		item;
+  unsigned char		key[RULES_KEY_MAX];
+  size_t		len;
+  int			match;
+  int			pam_result = RULES_PYTHON;
+  unsigned int		prefix_len;
+  unsigned int		rule;
+  const RulesRule*	rules;
+  const void*		value;
+
+  pthread_once(&rules_atfork_once, rules_atfork);
+  pthread_mutex_lock(&rules_lock);
+  header = rules_map(path);
+  if (header == 0)
+    goto broken;
+  handler = 1U << stats_handler_index(handler_name);
+  rule = header->rule_count;
+  for (item = 0; item < RULES_ITEM_COUNT; item += 1)
+  {
+    if (pam_get_item(pamh, rules_items[item].item, &value) != PAM_SUCCESS ||
+	value == 0)
+      continue;
+    len = strlen(value);
+    if (len <= RULES_VALUE_MAX)
+    {
+      found = rules_lookup(
+	  header, handler, key,
+	  rules_key(key, item, RULES_MATCH_EXACT, value, len));
+      if (found == RULES_BROKEN)
+	goto broken;
+      rule = found < rule ? found : rule;
+    }
+    for (len = len < RULES_VALUE_MAX ? len : RULES_VALUE_MAX; ; len -= 1)
+    {
+      if (rules_length_used(header->lengths[item][RULES_MATCH_PREFIX], len))
+      {
+	found = rules_lookup(
+	    header, handler, key,
+	    rules_key(key, item, RULES_MATCH_PREFIX, value, len));
+	if (found == RULES_BROKEN)
+	  goto broken;
+	rule = found < rule ? found : rule;
+      }
+      if (len == 0)
+	break;
+    }
+    /*
+     * A CIDR key is the block's length followed by the masked address.
+     */
+    if (inet_pton(AF_INET, value, cidr + 1) == 1)
+    {
+      match = RULES_MATCH_INET;
+      cidr_len = 1 + 4;
+    }
+    else if (inet_pton(AF_INET6, value, cidr + 1) == 1)
+    {
+      match = RULES_MATCH_INET6;
+      cidr_len = 1 + 16;
+    }
+    else
+      continue;
+    for (prefix_len = (cidr_len - 1) * 8; ; prefix_len -= 1)
+    {
+      if (rules_length_used(header->lengths[item][match], prefix_len))
+      {
+	cidr[0] = prefix_len;
+	rules_mask(cidr + 1, cidr_len - 1, prefix_len);
+	found = rules_lookup(
+	    header, handler, key,
+	    rules_key(key, item, match, cidr, cidr_len));
+	if (found == RULES_BROKEN)
+	  goto broken;
+	rule = found < rule ? found : rule;
+      }
+      if (prefix_len == 0)
+	break;
+    }
+  }
+  rules = (const RulesRule*)(header + 1);
+  if (rule < header->rule_count)
+  {
+    if (!rules_result_valid(rules[rule].pam_result))
+      goto broken;
+    pam_result = rules[rule].pam_result;
+  }
+  goto error_exit;
+
+broken:
+  syslog_path_message(MODULE_NAME, "can't use rules %s", path);
+error_exit:
+  pthread_mutex_unlock(&rules_lock);
+  return pam_result;
+}
+
+/*
+ * Count a call the rules decided, for the stats option.  There is no
+ * PamHandle holding the stats file open, so it is opened just for this.
+ */
+static void rules_stats(
+    const PamOptions* options, const char* module, const char* handler_name)
+{
+  size_t		h;
+  char			module_path[PATH_MAX];
+  StatsModule*		stats;
+  StatsFile*		stats_file;
+
+  h = stats_handler_index(handler_name);
+  if (module == 0 || h == STATS_HANDLER_COUNT)
+    return;
+  if (snprintf(
+	  module_path, sizeof(module_path), "%s%s",
+	  module[0] == '/' ? "" : DEFAULT_SECURITY_DIR, module) >=
+      (int)sizeof(module_path))
+    return;
+  stats = stats_open(options->state_dir, module_path, &stats_file);
+  if (stats == 0)
+    return;
+  __atomic_fetch_add(&stats->handlers[h].rules, 1, __ATOMIC_RELAXED);
+  stats_close(stats_file);
+}
+
 /*
  * Calls the Python method that will handle PAM's request to the module.
  */
@@ -2778,17 +9602,58 @@ static int call_handler(
   const char* handler_name, pam_handle_t* pamh,
   int flags, int argc, const char** argv)
 {
+  int			exception = 0;
+  PyGILState_STATE	gil = PyGILState_UNLOCKED;
   PyObject*		handler_function = 0;
+  int			option_count;
+  PamOptions		options;
+  MemSample		memstats_before;
   PamHandleObject*	pamHandle = 0;
   PyObject*		py_resultobj = 0;
+  double		conv = 0;
   int			pam_result;
+  double		start = 0;
+  int			timed_out = 0;
 
+  /*
+   * Our own options come first.  The rest of argv belongs to the module.
+   */
+  option_count = parse_options(&options, argc, argv);
+  if (option_count == -1)
+  {
+    pam_result = PAM_SERVICE_ERR;
+    goto error_exit;
+  }
+  argc -= option_count;
+  argv = argc > 0 ? argv + option_count : 0;
+  if (options.log_async)
+    __atomic_store_n(&log_queue.enabled, 1, __ATOMIC_RELEASE);
+  if (options.log_stderr)
+    syslog_stderr = 1;
+  PROBE3(
+      handler__entry, probe_string(argv != 0 ? argv[0] : 0),
+      probe_service(pamh), handler_name);
+  /*
+   * The native rules may decide without Python.
+   */
+  if (options.rules != 0)
+  {
+    pam_result = rules_check(options.rules, handler_name, pamh);
+    if (pam_result != RULES_PYTHON)
+    {
+      if (options.stats)
+	rules_stats(&options, argv != 0 ? argv[0] : 0, handler_name);
+      goto error_exit;
+    }
+  }
   /*
    * Initialise Python, and get a copy of our object.
    */
-  pam_result = get_pamHandle(&pamHandle, pamh, argv);
+  pam_result = get_pamHandle(&pamHandle, &gil, pamh, argv, &options);
   if (pam_result != PAM_SUCCESS)
     goto error_exit;
+  if (pamHandle->record != 0)
+    record_call(pamHandle, handler_name, flags, argc, argv);
   /*
    * See if the function we have to call has been defined.
    */
@@ -2796,66 +9661,101 @@ static int call_handler(
       PyObject_GetAttrString(pamHandle->module, (char*)handler_name);
   if (handler_function == 0)
   {
+    PyErr_Restore(0, 0, 0);
     syslog_message(pamHandle, "%s() isn't defined.", handler_name);
     pam_result = PAM_SYMBOL_ERR;
     goto error_exit;
   }
+  if (pamHandle->stats != 0 || pamHandle->trace_handlers != 0)
+  {
+    start = monotonic_time();
+    conv = pamHandle->trace_conv;
+  }
+  if (pamHandle->memstats != 0)
+    memstats_sample(&memstats_before, 1);
   pam_result = call_python_handler(
       &py_resultobj, pamHandle, handler_function, handler_name,
-      flags, argc, argv);
+      flags, argc, argv,
+      options.timeouts[stats_handler_index(handler_name)], &timed_out);
+  if (pamHandle->memstats != 0)
+    memstats_handler_call(pamHandle, handler_name, &memstats_before);
+  if (timed_out)
+  {
+    pam_result = options.timeout_result;
+    goto error_exit;
+  }
   if (pam_result != PAM_SUCCESS)
+  {
+    exception = 1;
     goto error_exit;
+  }
   /*
    * It must return an integer.
    */
-  if (!PyInt_Check(py_resultobj) && !PyLong_Check(py_resultobj))
+  if (!PyLong_Check(py_resultobj))
   {
     pam_result = syslog_message(
 	pamHandle,
 	"%s() did not return an integer.", handler_name);
     goto error_exit;
   }
-  pam_result = PyInt_AsLong(py_resultobj);
+  pam_result = PyLong_AsLong(py_resultobj);
 
 error_exit:
-  py_xdecref(handler_function);
-  py_xdecref((PyObject*)pamHandle);
-  py_xdecref(py_resultobj);
+  if (start != 0)
+  {
+    stats_handler_call(
+	pamHandle->stats, handler_name, pam_result, exception, timed_out,
+	monotonic_time() - start);
+    trace_handler_call(pamHandle, handler_name, start, conv, pam_result);
+  }
+  if (pamHandle != 0 && pamHandle->record != 0)
+    record_result(pamHandle, pam_result);
+  PROBE4(
+      handler__return, probe_string(argv != 0 ? argv[0] : 0),
+      probe_service(pamh), handler_name, pam_result);
+  if (pamHandle != 0)
+  {
+    py_xdecref(handler_function);
+    py_xdecref(py_resultobj);
+    Py_DECREF(pamHandle);
+    PyGILState_Release(gil);
+  }
   return pam_result;
 }
 
 
-PAM_EXTERN int pam_sm_authenticate(
+PAM_PYTHON_EXPORT PAM_EXTERN int pam_sm_authenticate(
   pam_handle_t* pamh, int flags, int argc, const char** argv)
 {
   return call_handler("pam_sm_authenticate", pamh, flags, argc, argv);
 }
 
-PAM_EXTERN int pam_sm_setcred(
+PAM_PYTHON_EXPORT PAM_EXTERN int pam_sm_setcred(
   pam_handle_t* pamh, int flags, int argc, const char** argv)
 {
   return call_handler("pam_sm_setcred", pamh, flags, argc, argv);
 }
 
-PAM_EXTERN int pam_sm_acct_mgmt(
+PAM_PYTHON_EXPORT PAM_EXTERN int pam_sm_acct_mgmt(
   pam_handle_t* pamh, int flags, int argc, const char** argv)
 {
   return call_handler("pam_sm_acct_mgmt", pamh, flags, argc, argv);
 }
 
-PAM_EXTERN int pam_sm_open_session(
+PAM_PYTHON_EXPORT PAM_EXTERN int pam_sm_open_session(
   pam_handle_t* pamh, int flags, int argc, const char** argv)
 {
   return call_handler("pam_sm_open_session", pamh, flags, argc, argv);
 }
 
-PAM_EXTERN int pam_sm_close_session(
+PAM_PYTHON_EXPORT PAM_EXTERN int pam_sm_close_session(
   pam_handle_t* pamh, int flags, int argc, const char** argv)
 {
   return call_handler("pam_sm_close_session", pamh, flags, argc, argv);
 }
 
-PAM_EXTERN int pam_sm_chauthtok(
+PAM_PYTHON_EXPORT PAM_EXTERN int pam_sm_chauthtok(
   pam_handle_t* pamh, int flags, int argc, const char** argv)
 {
   return call_handler("pam_sm_chauthtok", pamh, flags, argc, argv);
@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2007-2012,2014,2016,2019 Russell Stuart
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * The copyright holders grant you an additional permission under Section 7
+ * of the GNU Affero General Public License, version 3, exempting you from
+ * the requirement in Section 6 of the GNU General Public License, version 3,
+ * to accompany Corresponding Source with Installation Information for the
+ * Program or any work based on the Program. You are still required to
+ * comply with all other Section 6 requirements to provide Corresponding
+ * Source.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compile the rules pam_python.so's rules= option checks before it calls
+ * Python.
+ *
+ *   pam_python_rules source compiled
+ *
+ * Each line of the source is a rule:
+ *
+ *   handlers item test value result
+ *
+ * handlers is * or a comma separated list of handlers without their
+ * pam_sm_ prefix, eg authenticate,acct_mgmt.  item is rhost, ruser,
+ * service, tty or user.  test is "is" (the item is value), "prefix" (it
+ * starts with value) or "in" (it is an IP address in the CIDR block
+ * value, eg 10.0.0.0/8 or fd00::/8).  result is a PAM result code's name
+ * in lower case without the PAM_ prefix, eg success or perm_denied, or
+ * python to call Python after all.  The first rule that matches wins.
+ * Everything after a # is a comment.
+ *
+ * The compiled rules are written to a temporary file that is then renamed,
+ * so a process never sees a half written file.
+ */
+#define	_GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pam_python_stat.h"
+#include "pam_python_rules.h"
+
+typedef struct
+{
+  RulesRule		rule;
+  unsigned char		key[RULES_KEY_MAX];
+  size_t		key_len;
+} SourceRule;
+
+#define arr_size(x)	(sizeof(x) / sizeof(*(x)))
+
+static const char*	source_path;
+static unsigned int	source_line;
+
+static void usage(const char* argv0)
+{
+  fprintf(stderr, "usage: %s source compiled\n", argv0);
+  exit(2);
+}
+
+/*
+ * Report an error in the source and exit.
+ */
+static void source_error(const char* message, const char* word)
+{
+  fprintf(
+      stderr, "%s:%u: %s%s%s\n", source_path, source_line, message,
+      word != 0 ? ": " : "", word != 0 ? word : "");
+  exit(1);
+}
+
+/*
+ * Parse the handlers a rule applies to.
+ */
+static unsigned int parse_handlers(char* word)
+{
+  unsigned int		handlers = 0;
+  size_t		h;
+  char*			name;
+  char*			save;
+  static const char	prefix[] = "pam_sm_";
+
+  if (strcmp(word, "*") == 0)
+    return (1U << STATS_HANDLER_COUNT) - 1;
+  for (name = strtok_r(word, ",", &save); name != 0; name = strtok_r(0, ",", &save))
+  {
+    for (h = 0; h < STATS_HANDLER_COUNT; h += 1)
+    {
+      if (strcmp(stats_handler_names[h] + sizeof(prefix) - 1, name) == 0)
+	break;
+    }
+    if (h == STATS_HANDLER_COUNT)
+      source_error("unknown handler", name);
+    handlers |= 1U << h;
+  }
+  return handlers;
+}
+
+/*
+ * Parse the PAM result a rule gives, by name or number.
+ */
+static int parse_result(const char* word)
+{
+  char*			end;
+  long			number;
+  size_t		i;
+
+  for (i = 0; i < RULES_RESULT_COUNT; i += 1)
+  {
+    if (strcmp(word, rules_results[i].name) == 0)
+      return rules_results[i].pam_result;
+  }
+  number = strtol(word, &end, 10);
+  if (*word == '\0' || *end != '\0' || number < 0 || number >= _PAM_RETURN_VALUES)
+    source_error("unknown result", word);
+  return number;
+}
+
+/*
+ * Parse a CIDR block into value, the prefix length followed by the masked
+ * address, returning value's length and setting *match.
+ */
+static size_t parse_cidr(char* word, unsigned char* value, int* match)
+{
+  size_t		address_len;
+  char*			end;
+  long			prefix_len;
+  char*			slash;
+
+  slash = strchr(word, '/');
+  if (slash == 0)
+    source_error("CIDR block has no /length", word);
+  *slash = '\0';
+  if (inet_pton(AF_INET, word, value + 1) == 1)
+  {
+    *match = RULES_MATCH_INET;
+    address_len = 4;
+  }
+  else if (inet_pton(AF_INET6, word, value + 1) == 1)
+  {
+    *match = RULES_MATCH_INET6;
+    address_len = 16;
+  }
+  else
+    source_error("not an IP address", word);
+  prefix_len = strtol(slash + 1, &end, 10);
+  if (slash[1] == '\0' || *end != '\0' ||
+      prefix_len < 0 || prefix_len > (long)address_len * 8)
+    source_error("bad CIDR block length", slash + 1);
+  value[0] = prefix_len;
+  rules_mask(value + 1, address_len, prefix_len);
+  return 1 + address_len;
+}
+
+/*
+ * Parse one line of the source into rule.  Returns 0 if it is empty.
+ */
+static int parse_rule(char* line, RulesHeader* header, SourceRule* rule)
+{
+  char*			comment;
+  size_t		item;
+  size_t		len;
+  int			match;
+  char*			save;
+  unsigned char		value[RULES_VALUE_MAX];
+  char*			word;
+  char*			words[5];
+  size_t		word_count;
+
+  comment = strchr(line, '#');
+  if (comment != 0)
+    *comment = '\0';
+  word_count = 0;
+  for (word = strtok_r(line, " \t\r\n", &save);
+      word != 0;
+      word = strtok_r(0, " \t\r\n", &save))
+  {
+    if (word_count == arr_size(words))
+      source_error("unexpected", word);
+    words[word_count++] = word;
+  }
+  if (word_count == 0)
+    return 0;
+  if (word_count != arr_size(words))
+    source_error("expected: handlers item test value result", 0);
+  rule->rule.handlers = parse_handlers(words[0]);
+  for (item = 0; item < RULES_ITEM_COUNT; item += 1)
+  {
+    if (strcmp(words[1], rules_items[item].name) == 0)
+      break;
+  }
+  if (item == RULES_ITEM_COUNT)
+    source_error("unknown item", words[1]);
+  len = strlen(words[3]);
+  if (strcmp(words[2], "in") == 0)
+  {
+    len = parse_cidr(words[3], value, &match);
+    header->lengths[item][match][value[0] / 32] |= 1U << (value[0] % 32);
+  }
+  else if (strcmp(words[2], "is") == 0 || strcmp(words[2], "prefix") == 0)
+  {
+    if (len > RULES_VALUE_MAX)
+      source_error("value is too long", words[3]);
+    match = words[2][1] == 's' ? RULES_MATCH_EXACT : RULES_MATCH_PREFIX;
+    memcpy(value, words[3], len);
+    if (match == RULES_MATCH_PREFIX)
+      header->lengths[item][match][len / 32] |= 1U << (len % 32);
+  }
+  else
+    source_error("unknown test", words[2]);
+  rule->key_len = rules_key(rule->key, item, match, value, len);
+  rule->rule.pam_result = parse_result(words[4]);
+  rule->rule.line = source_line;
+  return 1;
+}
+
+int main(int argc, char** argv)
+{
+  int			fd;
+  FILE*			file;
+  RulesHeader		header;
+  size_t		i;
+  char*			line = 0;
+  size_t		line_size = 0;
+  size_t		mask;
+  mode_t		mode_mask;
+  SourceRule*		rules = 0;
+  size_t		rule_count = 0;
+  size_t		rule_size = 0;
+  size_t		slot;
+  RulesSlot*		slots;
+  char			tmp_path[4096];
+
+  if (argc != 3)
+    usage(argv[0]);
+  source_path = argv[1];
+  file = fopen(source_path, "r");
+  if (file == 0)
+  {
+    fprintf(stderr, "%s: %s: %s\n", argv[0], source_path, strerror(errno));
+    return 1;
+  }
+  memset(&header, '\0', sizeof(header));
+  while (getline(&line, &line_size, file) != -1)
+  {
+    source_line += 1;
+    if (rule_count == rule_size)
+    {
+      rule_size = rule_size == 0 ? 64 : rule_size * 2;
+      rules = realloc(rules, rule_size * sizeof(*rules));
+      if (rules == 0)
+      {
+	fprintf(stderr, "%s: out of memory\n", argv[0]);
+	return 1;
+      }
+    }
+    rule_count += parse_rule(line, &header, &rules[rule_count]);
+  }
+  fclose(file);
+  free(line);
+  /*
+   * Keep the table at most half full so probes stay short.
+   */
+  header.magic = RULES_MAGIC;
+  header.version = RULES_VERSION;
+  header.rule_count = rule_count;
+  for (header.slot_count = 8; header.slot_count < rule_count * 2; header.slot_count *= 2)
+    continue;
+  slots = calloc(header.slot_count, sizeof(*slots));
+  if (slots == 0)
+  {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return 1;
+  }
+  mask = header.slot_count - 1;
+  for (i = 0; i < rule_count; i += 1)
+  {
+    slot = rules_hash(rules[i].key, rules[i].key_len) & mask;
+    while (slots[slot].key_len != 0)
+      slot = (slot + 1) & mask;
+    slots[slot].key = header.key_size;
+    slots[slot].key_len = rules[i].key_len;
+    slots[slot].rule = i;
+    header.key_size += rules[i].key_len;
+  }
+  /*
+   * mkstemp() makes a file no one else can have created or linked first.
+   * It is 0600, so give it the mode fopen() would have.
+   */
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", argv[2]) >=
+      (int)sizeof(tmp_path))
+  {
+    fprintf(stderr, "%s: %s: %s\n", argv[0], argv[2], strerror(ENAMETOOLONG));
+    return 1;
+  }
+  umask(mode_mask = umask(0));
+  fd = mkstemp(tmp_path);
+  if (fd == -1 || fchmod(fd, 0666 & ~mode_mask) == -1 ||
+      (file = fdopen(fd, "w")) == 0)
+  {
+    fprintf(stderr, "%s: %s: %s\n", argv[0], tmp_path, strerror(errno));
+    if (fd != -1)
+    {
+      close(fd);
+      unlink(tmp_path);
+    }
+    return 1;
+  }
+  fwrite(&header, sizeof(header), 1, file);
+  for (i = 0; i < rule_count; i += 1)
+    fwrite(&rules[i].rule, sizeof(rules[i].rule), 1, file);
+  fwrite(slots, sizeof(*slots), header.slot_count, file);
+  for (i = 0; i < rule_count; i += 1)
+    fwrite(rules[i].key, rules[i].key_len, 1, file);
+  if (ferror(file) || fclose(file) != 0 || rename(tmp_path, argv[2]) == -1)
+  {
+    fprintf(stderr, "%s: %s: %s\n", argv[0], argv[2], strerror(errno));
+    unlink(tmp_path);
+    return 1;
+  }
+  free(rules);
+  free(slots);
+  return 0;
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2007-2012,2014,2016,2019 Russell Stuart
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * The copyright holders grant you an additional permission under Section 7
+ * of the GNU Affero General Public License, version 3, exempting you from
+ * the requirement in Section 6 of the GNU General Public License, version 3,
+ * to accompany Corresponding Source with Installation Information for the
+ * Program or any work based on the Program. You are still required to
+ * comply with all other Section 6 requirements to provide Corresponding
+ * Source.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The layout of the compiled rules file pam_python_rules writes and
+ * pam_python.so's rules= option reads.  The rules are checked before
+ * Python is involved, so a transaction they decide never starts it.
+ *
+ * Each rule tests one PAM item: for equality, for a prefix or, if the item
+ * is an IP address, for being in a CIDR block.  If several rules match the
+ * one that came first in the source wins.  Every test is a lookup in one
+ * open addressed hash table.  Its keys are the item, the kind of test and
+ * the bytes tested, so an equality test hashes the whole item, a prefix
+ * test the item's first n bytes for each n a prefix rule for that item
+ * uses, and a CIDR test the address masked to each block size in use.
+ *
+ * The file is a RulesHeader followed by rule_count RulesRule's, then
+ * slot_count RulesSlot's, then key_size bytes of keys.  There are always
+ * more slots than rules, so a probe ends at an empty slot.
+ */
+#ifndef PAM_PYTHON_RULES_H
+#define PAM_PYTHON_RULES_H
+
+#include <security/pam_appl.h>
+#include <string.h>
+
+#define	RULES_MAGIC		0x70797275	/* "pyru" */
+#define	RULES_VERSION		1
+
+#define	RULES_PYTHON		-1	/* A rule result: call Python */
+#define	RULES_VALUE_MAX		255	/* Longest value a rule can test */
+#define	RULES_KEY_MAX		(2 + RULES_VALUE_MAX)
+#define	RULES_LENGTH_WORDS	((RULES_VALUE_MAX + 1 + 31) / 32)
+
+/*
+ * The kinds of test.
+ */
+enum
+{
+  RULES_MATCH_EXACT,
+  RULES_MATCH_PREFIX,
+  RULES_MATCH_INET,
+  RULES_MATCH_INET6,
+  RULES_MATCH_COUNT
+};
+
+/*
+ * The PAM items rules can test, in the order they are kept.
+ */
+static const struct
+{
+  const char*		name;
+  int			item;
+} rules_items[] =
+{
+  {"rhost",		PAM_RHOST},
+  {"ruser",		PAM_RUSER},
+  {"service",		PAM_SERVICE},
+  {"tty",		PAM_TTY},
+  {"user",		PAM_USER},
+};
+
+#define	RULES_ITEM_COUNT	(sizeof(rules_items) / sizeof(*rules_items))
+
+/*
+ * The results a rule can give, by the name used in the source.
+ */
+static const struct
+{
+  const char*		name;
+  int			pam_result;
+} rules_results[] =
+{
+  {"abort",		PAM_ABORT},
+  {"auth_err",		PAM_AUTH_ERR},
+  {"authinfo_unavail",	PAM_AUTHINFO_UNAVAIL},
+  {"ignore",		PAM_IGNORE},
+  {"perm_denied",	PAM_PERM_DENIED},
+  {"python",		RULES_PYTHON},
+  {"service_err",	PAM_SERVICE_ERR},
+  {"success",		PAM_SUCCESS},
+  {"system_err",	PAM_SYSTEM_ERR},
+  {"try_again",		PAM_TRY_AGAIN},
+};
+
+#define	RULES_RESULT_COUNT	(sizeof(rules_results) / sizeof(*rules_results))
+
+/*
+ * True if a rule can give pam_result: RULES_PYTHON or a PAM result code.
+ */
+static inline int rules_result_valid(int pam_result)
+{
+  return
+      pam_result == RULES_PYTHON ||
+      (pam_result >= 0 && pam_result < _PAM_RETURN_VALUES);
+}
+
+typedef struct
+{
+  unsigned int		magic;		/* RULES_MAGIC */
+  unsigned int		version;	/* RULES_VERSION */
+  unsigned int		rule_count;	/* RulesRule's */
+  unsigned int		slot_count;	/* RulesSlot's, a power of 2 */
+  unsigned int		key_size;	/* Bytes of keys */
+  /*
+   * Bit n is set if a prefix or CIDR rule tests the first n bytes or
+   * bits of the item.
+   */
+  unsigned int		lengths[RULES_ITEM_COUNT][RULES_MATCH_COUNT][RULES_LENGTH_WORDS];
+} RulesHeader;
+
+typedef struct
+{
+  unsigned int		handlers;	/* Bit n is stats_handler_names[n] */
+  int			pam_result;	/* What it returns, or RULES_PYTHON */
+  unsigned int		line;		/* Where it is in the source */
+} RulesRule;
+
+typedef struct
+{
+  unsigned int		key;		/* Offset of the key in the keys */
+  unsigned int		key_len;	/* Its length, 0 if the slot is empty */
+  unsigned int		rule;		/* Index of the rule */
+} RulesSlot;
+
+/*
+ * Build the key for a test of item (an index into rules_items) of the
+ * given kind on len bytes of value.  Returns the key's length.
+ */
+static inline size_t rules_key(
+    unsigned char* key, size_t item, int match,
+    const void* value, size_t len)
+{
+  key[0] = item;
+  key[1] = match;
+  memcpy(key + 2, value, len);
+  return 2 + len;
+}
+
+/*
+ * Clear the bits of the address after the first prefix_len.
+ */
+static inline void rules_mask(
+    unsigned char* address, size_t len, unsigned int prefix_len)
+{
+  size_t		i;
+
+  for (i = 0; i < len; i += 1)
+  {
+    if (prefix_len >= 8)
+      prefix_len -= 8;
+    else
+    {
+      address[i] &= (unsigned char)(0xff00 >> prefix_len);
+      prefix_len = 0;
+    }
+  }
+}
+
+/*
+ * The hash of a key, FNV-1a.
+ */
+static inline unsigned long long rules_hash(const unsigned char* key, size_t len)
+{
+  unsigned long long	hash = 14695981039346656037ULL;
+
+  while (len-- > 0)
+    hash = (hash ^ *key++) * 1099511628211ULL;
+  return hash;
+}
+
+/*
+ * True if a prefix or CIDR rule tests len bytes or bits.
+ */
+static inline int rules_length_used(const unsigned int* lengths, size_t len)
+{
+  return (lengths[len / 32] >> (len % 32)) & 1;
+}
+
+#endif
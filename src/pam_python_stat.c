@@ -0,0 +1,557 @@
+/*
+ * Copyright (c) 2007-2012,2014,2016,2019 Russell Stuart
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * The copyright holders grant you an additional permission under Section 7
+ * of the GNU Affero General Public License, version 3, exempting you from
+ * the requirement in Section 6 of the GNU General Public License, version 3,
+ * to accompany Corresponding Source with Installation Information for the
+ * Program or any work based on the Program. You are still required to
+ * comply with all other Section 6 requirements to provide Corresponding
+ * Source.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Print the statistics pam_python.so keeps when given the stats option.
+ *
+ *   pam_python_stat [-d state_dir] [-p]
+ *
+ * By default a table is printed.  -p prints them in the Prometheus text
+ * format instead, suitable for node_exporter's textfile collector, eg:
+ *
+ *   pam_python_stat -p >/var/lib/node_exporter/pam_python.prom.$$ &&
+ *     mv /var/lib/node_exporter/pam_python.prom.$$ \
+ *       /var/lib/node_exporter/pam_python.prom
+ */
+#define	_GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pam_python_stat.h"
+
+#define	DEFAULT_STATE_DIR	"/run/pam_python"
+
+/*
+ * The upper bound of a histogram bucket in microseconds, or 0 for the
+ * last one which has no upper bound.
+ */
+static unsigned long long bucket_limit(int bucket)
+{
+  if (bucket == STATS_LATENCY_BUCKETS - 1)
+    return 0;
+  return 1ULL << bucket;
+}
+
+/*
+ * Estimate a percentile from a histogram, in microseconds.  It returns
+ * the upper bound of the bucket the percentile falls in.
+ */
+static double histogram_percentile(
+    const StatsHistogram* histogram, double percentile)
+{
+  int			bucket;
+  unsigned long long	seen = 0;
+  unsigned long long	wanted;
+
+  if (histogram->count == 0)
+    return 0;
+  wanted = (unsigned long long)(histogram->count * percentile / 100 + 0.5);
+  if (wanted == 0)
+    wanted = 1;
+  for (bucket = 0; bucket < STATS_LATENCY_BUCKETS - 1; bucket += 1)
+  {
+    seen += histogram->buckets[bucket];
+    if (seen >= wanted)
+      return bucket_limit(bucket);
+  }
+  return bucket_limit(STATS_LATENCY_BUCKETS - 2) * 2;
+}
+
+static double histogram_mean(const StatsHistogram* histogram)
+{
+  if (histogram->count == 0)
+    return 0;
+  return (double)histogram->sum_usec / histogram->count;
+}
+
+/*
+ * True if a breaker slot is in use and its name has been written.
+ */
+static int breaker_used(const StatsBreaker* breaker)
+{
+  unsigned long long	hash;
+
+  hash = __atomic_load_n(&breaker->hash, __ATOMIC_ACQUIRE);
+  return hash != 0 && hash != STATS_BREAKER_CLAIMED;
+}
+
+/*
+ * The name of a circuit breaker's state.
+ */
+static const char* breaker_state(const StatsBreaker* breaker)
+{
+  if (breaker->state >= sizeof(stats_breaker_states) / sizeof(*stats_breaker_states))
+    return "unknown";
+  return stats_breaker_states[breaker->state];
+}
+
+/*
+ * Print the stats as a table.
+ */
+static void print_table(const StatsFile* file)
+{
+  size_t		b;
+  const StatsBreaker*	breaker;
+  const StatsHandler*	handler;
+  const StatsModule*	module;
+  size_t		h;
+  int			r;
+
+  for (module = file->modules; module < file->modules + STATS_MODULE_COUNT; module += 1)
+  {
+    if (module->hash == 0)
+      continue;
+    printf("%s\n", module->path);
+    printf(
+        "  handles: cold %llu, warm %llu, reused %llu, "
+	"create mean %.0fus p99 <%.0fus\n",
+	module->cold, module->warm, module->reused,
+	histogram_mean(&module->create),
+	histogram_percentile(&module->create, 99));
+    printf(
+        "  create phases: libpython mean %.0fus p99 <%.0fus, "
+	"init mean %.0fus p99 <%.0fus, "
+	"import mean %.0fus p99 <%.0fus\n",
+	histogram_mean(&module->libpython),
+	histogram_percentile(&module->libpython, 99),
+	histogram_mean(&module->init),
+	histogram_percentile(&module->init, 99),
+	histogram_mean(&module->import),
+	histogram_percentile(&module->import, 99));
+    printf(
+	"  %-20s %10s %10s %10s %10s %10s %10s %10s %10s  %s\n",
+	"handler", "calls", "exceptions", "timeouts", "rules", "mean(us)",
+	"p50(us)", "p90(us)", "p99(us)", "results");
+    for (h = 0; h < STATS_HANDLER_COUNT; h += 1)
+    {
+      handler = &module->handlers[h];
+      if (handler->calls == 0 && handler->rules == 0)
+	continue;
+      printf(
+	  "  %-20s %10llu %10llu %10llu %10llu %10.0f %10.0f %10.0f %10.0f ",
+	  stats_handler_names[h], handler->calls, handler->exceptions,
+	  handler->timeouts, handler->rules,
+	  histogram_mean(&handler->latency),
+	  histogram_percentile(&handler->latency, 50),
+	  histogram_percentile(&handler->latency, 90),
+	  histogram_percentile(&handler->latency, 99));
+      for (r = 0; r < STATS_RESULT_COUNT; r += 1)
+      {
+	if (handler->results[r] == 0)
+	  continue;
+	if (r == STATS_RESULT_COUNT - 1)
+	  printf(" other=%llu", handler->results[r]);
+	else
+	  printf(" %d=%llu", r, handler->results[r]);
+      }
+      printf("\n");
+    }
+    for (b = 0; b < STATS_BREAKER_COUNT; b += 1)
+    {
+      breaker = &module->breakers[b];
+      if (!breaker_used(breaker))
+	continue;
+      printf(
+	  "  breaker %s: %s, opened %llu, rejected %llu\n",
+	  breaker->name, breaker_state(breaker), breaker->opened,
+	  breaker->rejected);
+    }
+  }
+}
+
+/*
+ * Print a string as a Prometheus label value.
+ */
+static void print_label(const char* value)
+{
+  for (; *value != '\0'; value += 1)
+  {
+    if (*value == '\\' || *value == '"')
+      printf("\\%c", *value);
+    else if (*value == '\n')
+      printf("\\n");
+    else
+      putchar(*value);
+  }
+}
+
+/*
+ * Print a histogram in the Prometheus text format.  handler_name is 0 if
+ * the histogram is for the module as a whole.
+ */
+static void print_prometheus_histogram(
+    const char* name, const StatsHistogram* histogram,
+    const char* module_path, const char* handler_name)
+{
+  int			bucket;
+  unsigned long long	cumulative = 0;
+
+  for (bucket = 0; bucket < STATS_LATENCY_BUCKETS; bucket += 1)
+  {
+    cumulative += histogram->buckets[bucket];
+    printf("%s_bucket{module=\"", name);
+    print_label(module_path);
+    if (handler_name != 0)
+      printf("\",handler=\"%s", handler_name);
+    if (bucket_limit(bucket) == 0)
+      printf("\",le=\"+Inf\"} %llu\n", cumulative);
+    else
+      printf("\",le=\"%g\"} %llu\n", bucket_limit(bucket) / 1e6, cumulative);
+  }
+  printf("%s_sum{module=\"", name);
+  print_label(module_path);
+  if (handler_name != 0)
+    printf("\",handler=\"%s", handler_name);
+  printf("\"} %g\n", histogram->sum_usec / 1e6);
+  printf("%s_count{module=\"", name);
+  print_label(module_path);
+  if (handler_name != 0)
+    printf("\",handler=\"%s", handler_name);
+  printf("\"} %llu\n", histogram->count);
+}
+
+/*
+ * Print a counter kept per handler.
+ */
+static void print_prometheus_handler_counter(
+    const StatsFile* file, const char* name, const char* help,
+    size_t offset)
+{
+  const StatsHandler*	handler;
+  const StatsModule*	module;
+  size_t		h;
+
+  printf("# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+  for (module = file->modules; module < file->modules + STATS_MODULE_COUNT; module += 1)
+  {
+    if (module->hash == 0)
+      continue;
+    for (h = 0; h < STATS_HANDLER_COUNT; h += 1)
+    {
+      handler = &module->handlers[h];
+      printf("%s{module=\"", name);
+      print_label(module->path);
+      printf(
+	  "\",handler=\"%s\"} %llu\n", stats_handler_names[h],
+	  *(const unsigned long long*)((const char*)handler + offset));
+    }
+  }
+}
+
+/*
+ * Print a counter kept per circuit breaker.
+ */
+static void print_prometheus_breaker_counter(
+    const StatsFile* file, const char* name, const char* help,
+    size_t offset)
+{
+  size_t		b;
+  const StatsBreaker*	breaker;
+  const StatsModule*	module;
+
+  printf("# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+  for (module = file->modules; module < file->modules + STATS_MODULE_COUNT; module += 1)
+  {
+    if (module->hash == 0)
+      continue;
+    for (b = 0; b < STATS_BREAKER_COUNT; b += 1)
+    {
+      breaker = &module->breakers[b];
+      if (!breaker_used(breaker))
+	continue;
+      printf("%s{module=\"", name);
+      print_label(module->path);
+      printf("\",breaker=\"");
+      print_label(breaker->name);
+      printf(
+	  "\"} %llu\n",
+	  *(const unsigned long long*)((const char*)breaker + offset));
+    }
+  }
+}
+
+/*
+ * Print the circuit breakers' states, one series per state that is 1
+ * for the state it is in.
+ */
+static void print_prometheus_breakers(const StatsFile* file)
+{
+  size_t		b;
+  const StatsBreaker*	breaker;
+  const StatsModule*	module;
+  size_t		s;
+
+  printf(
+      "# HELP pam_python_breaker_state "
+      "State of each pamh.breaker() circuit breaker.\n"
+      "# TYPE pam_python_breaker_state gauge\n");
+  for (module = file->modules; module < file->modules + STATS_MODULE_COUNT; module += 1)
+  {
+    if (module->hash == 0)
+      continue;
+    for (b = 0; b < STATS_BREAKER_COUNT; b += 1)
+    {
+      breaker = &module->breakers[b];
+      if (!breaker_used(breaker))
+	continue;
+      for (s = 0; s < sizeof(stats_breaker_states) / sizeof(*stats_breaker_states); s += 1)
+      {
+	printf("pam_python_breaker_state{module=\"");
+	print_label(module->path);
+	printf("\",breaker=\"");
+	print_label(breaker->name);
+	printf(
+	    "\",state=\"%s\"} %d\n", stats_breaker_states[s],
+	    breaker->state == s);
+      }
+    }
+  }
+  print_prometheus_breaker_counter(
+      file, "pam_python_breaker_opened_total",
+      "Times each circuit breaker opened.",
+      offsetof(StatsBreaker, opened));
+  print_prometheus_breaker_counter(
+      file, "pam_python_breaker_rejected_total",
+      "Calls each circuit breaker refused while open.",
+      offsetof(StatsBreaker, rejected));
+}
+
+/*
+ * Print the stats in the Prometheus text format.
+ */
+static void print_prometheus(const StatsFile* file)
+{
+  static const char* const kinds[] = {"cold", "warm", "reused"};
+  const StatsHandler*	handler;
+  const StatsModule*	module;
+  unsigned long long	counts[3];
+  size_t		h;
+  size_t		k;
+  int			r;
+
+  printf(
+      "# HELP pam_python_handles_total "
+      "PamHandle objects created or reused.\n"
+      "# TYPE pam_python_handles_total counter\n");
+  for (module = file->modules; module < file->modules + STATS_MODULE_COUNT; module += 1)
+  {
+    if (module->hash == 0)
+      continue;
+    counts[0] = module->cold;
+    counts[1] = module->warm;
+    counts[2] = module->reused;
+    for (k = 0; k < sizeof(kinds) / sizeof(*kinds); k += 1)
+    {
+      printf("pam_python_handles_total{module=\"");
+      print_label(module->path);
+      printf("\",kind=\"%s\"} %llu\n", kinds[k], counts[k]);
+    }
+  }
+  printf(
+      "# HELP pam_python_handle_create_seconds "
+      "Time taken to create a PamHandle object.\n"
+      "# TYPE pam_python_handle_create_seconds histogram\n");
+  for (module = file->modules; module < file->modules + STATS_MODULE_COUNT; module += 1)
+  {
+    if (module->hash != 0)
+    {
+      print_prometheus_histogram(
+	  "pam_python_handle_create_seconds", &module->create,
+	  module->path, 0);
+    }
+  }
+  printf(
+      "# HELP pam_python_libpython_seconds "
+      "Time taken to open libpython, when it wasn't already open.\n"
+      "# TYPE pam_python_libpython_seconds histogram\n");
+  for (module = file->modules; module < file->modules + STATS_MODULE_COUNT; module += 1)
+  {
+    if (module->hash != 0)
+    {
+      print_prometheus_histogram(
+	  "pam_python_libpython_seconds", &module->libpython, module->path, 0);
+    }
+  }
+  printf(
+      "# HELP pam_python_init_seconds "
+      "Time taken to start Python, for cold PamHandle objects.\n"
+      "# TYPE pam_python_init_seconds histogram\n");
+  for (module = file->modules; module < file->modules + STATS_MODULE_COUNT; module += 1)
+  {
+    if (module->hash != 0)
+    {
+      print_prometheus_histogram(
+	  "pam_python_init_seconds", &module->init, module->path, 0);
+    }
+  }
+  printf(
+      "# HELP pam_python_import_seconds "
+      "Time taken to load the Python module.\n"
+      "# TYPE pam_python_import_seconds histogram\n");
+  for (module = file->modules; module < file->modules + STATS_MODULE_COUNT; module += 1)
+  {
+    if (module->hash != 0)
+    {
+      print_prometheus_histogram(
+	  "pam_python_import_seconds", &module->import, module->path, 0);
+    }
+  }
+  print_prometheus_handler_counter(
+      file, "pam_python_calls_total",
+      "Calls to each Python handler.",
+      offsetof(StatsHandler, calls));
+  print_prometheus_handler_counter(
+      file, "pam_python_exceptions_total",
+      "Python handler calls that raised an exception.",
+      offsetof(StatsHandler, exceptions));
+  print_prometheus_handler_counter(
+      file, "pam_python_timeouts_total",
+      "Python handler calls that took longer than their timeout.",
+      offsetof(StatsHandler, timeouts));
+  print_prometheus_handler_counter(
+      file, "pam_python_rules_total",
+      "Calls rules= decided without calling the Python handler.",
+      offsetof(StatsHandler, rules));
+  printf(
+      "# HELP pam_python_results_total "
+      "PAM result codes returned by each Python handler.\n"
+      "# TYPE pam_python_results_total counter\n");
+  for (module = file->modules; module < file->modules + STATS_MODULE_COUNT; module += 1)
+  {
+    if (module->hash == 0)
+      continue;
+    for (h = 0; h < STATS_HANDLER_COUNT; h += 1)
+    {
+      handler = &module->handlers[h];
+      for (r = 0; r < STATS_RESULT_COUNT; r += 1)
+      {
+	if (handler->results[r] == 0)
+	  continue;
+	printf("pam_python_results_total{module=\"");
+	print_label(module->path);
+	printf("\",handler=\"%s\",result=\"", stats_handler_names[h]);
+	if (r == STATS_RESULT_COUNT - 1)
+	  printf("other");
+	else
+	  printf("%d", r);
+	printf("\"} %llu\n", handler->results[r]);
+      }
+    }
+  }
+  printf(
+      "# HELP pam_python_handler_seconds "
+      "Time taken by each Python handler.\n"
+      "# TYPE pam_python_handler_seconds histogram\n");
+  for (module = file->modules; module < file->modules + STATS_MODULE_COUNT; module += 1)
+  {
+    if (module->hash == 0)
+      continue;
+    for (h = 0; h < STATS_HANDLER_COUNT; h += 1)
+    {
+      print_prometheus_histogram(
+	  "pam_python_handler_seconds", &module->handlers[h].latency,
+	  module->path, stats_handler_names[h]);
+    }
+  }
+  print_prometheus_breakers(file);
+}
+
+static void usage(const char* argv0)
+{
+  fprintf(stderr, "usage: %s [-d state_dir] [-p]\n", argv0);
+  exit(2);
+}
+
+int main(int argc, char** argv)
+{
+  int			fd;
+  const StatsFile*	file;
+  int			opt;
+  char			path[4096];
+  int			prometheus = 0;
+  const char*		state_dir = DEFAULT_STATE_DIR;
+  struct stat		st;
+
+  while ((opt = getopt(argc, argv, "d:p")) != -1)
+  {
+    switch (opt)
+    {
+      case 'd':
+	state_dir = optarg;
+	break;
+      case 'p':
+	prometheus = 1;
+	break;
+      default:
+	usage(argv[0]);
+    }
+  }
+  if (optind != argc)
+    usage(argv[0]);
+  snprintf(path, sizeof(path), "%s/%s", state_dir, STATS_FILE_NAME);
+  fd = open(path, O_RDONLY|O_CLOEXEC);
+  if (fd == -1)
+  {
+    /*
+     * No file just means nothing has been recorded yet.
+     */
+    if (errno == ENOENT && prometheus)
+      return 0;
+    fprintf(stderr, "%s: %s: %s\n", argv[0], path, strerror(errno));
+    return 1;
+  }
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*file))
+  {
+    fprintf(stderr, "%s: %s: file is too short\n", argv[0], path);
+    return 1;
+  }
+  file = mmap(0, sizeof(*file), PROT_READ, MAP_SHARED, fd, 0);
+  if (file == MAP_FAILED)
+  {
+    fprintf(stderr, "%s: %s: %s\n", argv[0], path, strerror(errno));
+    return 1;
+  }
+  close(fd);
+  if (file->magic != STATS_MAGIC || file->version != STATS_VERSION)
+  {
+    fprintf(
+	stderr, "%s: %s: not a version %d stats file\n",
+	argv[0], path, STATS_VERSION);
+    return 1;
+  }
+  if (prometheus)
+    print_prometheus(file);
+  else
+    print_table(file);
+  return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2007-2012,2014,2016,2019 Russell Stuart
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * The copyright holders grant you an additional permission under Section 7
+ * of the GNU Affero General Public License, version 3, exempting you from
+ * the requirement in Section 6 of the GNU General Public License, version 3,
+ * to accompany Corresponding Source with Installation Information for the
+ * Program or any work based on the Program. You are still required to
+ * comply with all other Section 6 requirements to provide Corresponding
+ * Source.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The layout of the stats file pam_python.so writes when given the stats
+ * option, and pam_python_stat reads.  The file is mapped by every process
+ * using pam_python, and the counters in it are only ever updated with
+ * atomic adds, so the totals are for the whole machine.
+ */
+#ifndef PAM_PYTHON_STAT_H
+#define PAM_PYTHON_STAT_H
+
+#define	STATS_MAGIC		0x70797374	/* "pyst" */
+#define	STATS_VERSION		7
+
+/*
+ * The version is in the file's name, so processes running pam_python.so
+ * versions with different layouts never share a file.
+ */
+#define	STATS_STRING(x)		#x
+#define	STATS_FILE_NAME_(v)	"stats-" STATS_STRING(v)
+#define	STATS_FILE_NAME		STATS_FILE_NAME_(STATS_VERSION)
+
+#define	STATS_MODULE_COUNT	32	/* Python modules tracked */
+#define	STATS_RESULT_COUNT	32	/* PAM results, last is "other" */
+#define	STATS_LATENCY_BUCKETS	26	/* Bucket i is < 2**i microseconds */
+#define	STATS_BREAKER_COUNT	8	/* Circuit breakers per module */
+#define	STATS_BREAKER_CLAIMED	(~0ULL)	/* Breaker hash while name is written */
+
+/*
+ * A log2 latency histogram.  The sum lets the mean be computed.
+ */
+typedef struct
+{
+  unsigned long long	buckets[STATS_LATENCY_BUCKETS];
+  unsigned long long	count;		/* Samples recorded */
+  unsigned long long	sum_usec;	/* Total of all samples */
+} StatsHistogram;
+
+/*
+ * The Python handlers PAM calls, in the order they are kept.
+ */
+static const char* const stats_handler_names[] =
+{
+  "pam_sm_authenticate",
+  "pam_sm_setcred",
+  "pam_sm_acct_mgmt",
+  "pam_sm_open_session",
+  "pam_sm_close_session",
+  "pam_sm_chauthtok",
+  "pam_sm_end",
+};
+
+#define	STATS_HANDLER_COUNT \
+    (sizeof(stats_handler_names) / sizeof(*stats_handler_names))
+
+typedef struct
+{
+  unsigned long long	calls;		/* Times it was called */
+  unsigned long long	exceptions;	/* Times it raised an exception */
+  unsigned long long	rules;		/* Times rules= decided instead */
+  unsigned long long	timeouts;	/* Times it overran timeout= */
+  StatsHistogram	latency;	/* How long it took */
+  unsigned long long	results[STATS_RESULT_COUNT];
+} StatsHandler;
+
+/*
+ * A pamh.breaker() circuit breaker.  state is one of these.
+ */
+enum
+{
+  STATS_BREAKER_CLOSED,			/* Calls go to the backend */
+  STATS_BREAKER_OPEN,			/* Calls are refused */
+  STATS_BREAKER_HALF_OPEN		/* One trial call is allowed */
+};
+
+static const char* const stats_breaker_states[] =
+{
+  "closed",
+  "open",
+  "half_open",
+};
+
+typedef struct
+{
+  unsigned long long	hash;		/* Hash of name, 0 if slot unused */
+  char			name[64];	/* As given to pamh.breaker() */
+  unsigned int		state;		/* STATS_BREAKER_... */
+  unsigned int		failures;	/* Failures in a row while closed */
+  long long		retry_ns;	/* CLOCK_BOOTTIME of the next trial */
+  unsigned long long	opened;		/* Times it opened */
+  unsigned long long	rejected;	/* Calls refused while open */
+} StatsBreaker;
+
+typedef struct
+{
+  unsigned long long	hash;		/* Hash of path, 0 if slot unused */
+  char			path[256];	/* The Python module */
+  StatsBreaker		breakers[STATS_BREAKER_COUNT];
+  unsigned long long	cold;		/* Handles that started Python */
+  StatsHistogram	create;		/* How long creating a handle took */
+  StatsHandler		handlers[STATS_HANDLER_COUNT];
+  StatsHistogram	import;		/* Loading the Python module */
+  StatsHistogram	init;		/* Starting Python, cold handles */
+  StatsHistogram	libpython;	/* Opening libpython, once a load */
+  unsigned long long	reused;		/* Handles found in the pam_handle */
+  unsigned long long	warm;		/* Handles, Python already running */
+} StatsModule;
+
+typedef struct
+{
+  unsigned int		magic;		/* STATS_MAGIC */
+  unsigned int		version;	/* STATS_VERSION */
+  StatsModule		modules[STATS_MODULE_COUNT];
+} StatsFile;
+
+/*
+ * The histogram bucket a latency goes in.
+ */
+static inline int stats_latency_bucket(unsigned long long usec)
+{
+  int			bucket = 0;
+
+  while (usec > 0 && bucket < STATS_LATENCY_BUCKETS - 1)
+  {
+    usec >>= 1;
+    bucket += 1;
+  }
+  return bucket;
+}
+
+#endif
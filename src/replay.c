@@ -0,0 +1,566 @@
+/*
+ * Replay transactions recorded by pam_python's record= option, calling
+ * pam_python.so's pam_sm_* functions directly as fast as it can.  No
+ * PAM application, and no PAM configuration, is involved, which means
+ * libpam won't let it use the handle as a module, so it must be linked
+ * against fakepam.c's libpam.  Best run using the Makefile target
+ * "replay-test".  To compile and run manually:
+ *   gcc -O2 -Wall -o replay replay.c -Lfakepam -Wl,-rpath,$PWD/fakepam -lpam -ldl
+ *   ./replay -m $PWD/new_module.py transactions.rec
+ *
+ * Before each handler call the PAM items and environment are set to what
+ * the module saw when it was recorded, and its conversations are answered
+ * with the recorded responses.  Secrets were replaced when recorded, so a
+ * module checking passwords will see the placeholder, and responses and
+ * environment values that were recorded only as a length are replaced by
+ * that many "x"s.  pam_sm_end's call is recorded but it isn't replayed
+ * directly: pam_end calls it.  -m replaces the
+ * recorded Python module, so a new version can be measured against the
+ * traffic the old one saw.  It reports how long each handler took and how
+ * many returned something other than what was recorded.
+ */
+#define	_GNU_SOURCE
+
+#include <dlfcn.h>
+#include <limits.h>
+#include <security/pam_appl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	REPLAY_MAX_FIELDS	64
+
+typedef int (*Handler)(pam_handle_t*, int, int, const char**);
+
+/*
+ * The handlers, in the order pam_python_stat.h keeps them.
+ */
+static const char* const handler_names[] =
+{
+  "pam_sm_authenticate",
+  "pam_sm_setcred",
+  "pam_sm_acct_mgmt",
+  "pam_sm_open_session",
+  "pam_sm_close_session",
+  "pam_sm_chauthtok",
+};
+
+#define	HANDLER_COUNT	(sizeof(handler_names) / sizeof(*handler_names))
+
+static const struct
+{
+  const char*	name;
+  int		item_type;
+} items[] =
+{
+  {"authtok",		PAM_AUTHTOK},
+#ifdef	PAM_AUTHTOK_TYPE
+  {"authtok_type",	PAM_AUTHTOK_TYPE},
+#endif
+  {"oldauthtok",	PAM_OLDAUTHTOK},
+  {"rhost",		PAM_RHOST},
+  {"ruser",		PAM_RUSER},
+  {"service",		PAM_SERVICE},
+  {"tty",		PAM_TTY},
+  {"user",		PAM_USER},
+  {"user_prompt",	PAM_USER_PROMPT},
+#ifdef	PAM_XDISPLAY
+  {"xdisplay",		PAM_XDISPLAY},
+#endif
+};
+
+#define	ITEM_COUNT	(sizeof(items) / sizeof(*items))
+
+/*
+ * A line of the record, split into fields with strings decoded.  A field
+ * that was "-" (NULL) is 0.  A "#length" field becomes that many "x"s.
+ */
+struct line {
+  char*		fields[REPLAY_MAX_FIELDS];
+  int		count;
+};
+
+/*
+ * Latencies of one handler, in seconds.
+ */
+struct samples {
+  double*	data;
+  long		count;
+  long		size;
+};
+
+/*
+ * Where the conversation function is up to.
+ */
+struct replay_conv {
+  const struct line*	next;		/* The next recorded line */
+  const struct line*	end;		/* The handler's result line */
+};
+
+static double now(void)
+{
+  struct timespec	ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_sample(struct samples* samples, double seconds)
+{
+  if (samples->count == samples->size)
+  {
+    samples->size = samples->size == 0 ? 1024 : samples->size * 2;
+    samples->data = realloc(samples->data, samples->size * sizeof(double));
+    if (samples->data == 0)
+    {
+      fprintf(stderr, "out of memory\n");
+      exit(2);
+    }
+  }
+  samples->data[samples->count++] = seconds;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+  double	x = *(const double*)a;
+  double	y = *(const double*)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const struct samples* samples, double p)
+{
+  long		i;
+
+  i = (long)(samples->count * p);
+  if (i >= samples->count)
+    i = samples->count - 1;
+  return samples->data[i];
+}
+
+static int hex(int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+/*
+ * Decode a string field in place.  Returns 0 for "-".
+ */
+static char* decode(char* field)
+{
+  char*		in;
+  char*		out;
+
+  if (field[0] != '=')
+    return 0;
+  for (in = out = field + 1; *in != '\0'; in += 1)
+  {
+    if (in[0] == '%' && hex(in[1]) != -1 && hex(in[2]) != -1)
+    {
+      *out++ = (char)(hex(in[1]) * 16 + hex(in[2]));
+      in += 2;
+    }
+    else
+      *out++ = *in;
+  }
+  *out = '\0';
+  return field + 1;
+}
+
+/*
+ * Make up a string for a "#length" field, whose value wasn't recorded.
+ */
+static char* withheld(const char* field)
+{
+  char*		string;
+  size_t	len;
+
+  len = strtoul(field + 1, 0, 10);
+  string = malloc(len + 1);
+  if (string == 0)
+  {
+    fprintf(stderr, "out of memory\n");
+    exit(2);
+  }
+  memset(string, 'x', len);
+  string[len] = '\0';
+  return string;
+}
+
+/*
+ * Read the record.  Returns the number of lines.
+ */
+static long read_record(const char* path, struct line** lines)
+{
+  char*		buf = 0;
+  size_t	buf_size = 0;
+  long		count = 0;
+  FILE*		f;
+  char*		field;
+  ssize_t	len;
+  struct line*	line;
+  char*		save;
+  long		size = 0;
+
+  f = path == 0 ? stdin : fopen(path, "r");
+  if (f == 0)
+  {
+    perror(path);
+    exit(2);
+  }
+  *lines = 0;
+  while ((len = getline(&buf, &buf_size, f)) != -1)
+  {
+    if (len > 0 && buf[len - 1] == '\n')
+      buf[len - 1] = '\0';
+    if (count == size)
+    {
+      size = size == 0 ? 1024 : size * 2;
+      *lines = realloc(*lines, size * sizeof(**lines));
+      if (*lines == 0)
+      {
+	fprintf(stderr, "out of memory\n");
+	exit(2);
+      }
+    }
+    line = &(*lines)[count];
+    line->count = 0;
+    for (field = strtok_r(strdup(buf), " ", &save); field != 0;
+	field = strtok_r(0, " ", &save))
+    {
+      if (line->count == REPLAY_MAX_FIELDS)
+	break;
+      if (line->count > 0 && (field[0] == '=' || strcmp(field, "-") == 0))
+	field = decode(field);
+      else if (line->count > 0 && field[0] == '#')
+	field = withheld(field);
+      line->fields[line->count++] = field;
+    }
+    if (line->count > 0)
+      count += 1;
+  }
+  free(buf);
+  if (f != stdin)
+    fclose(f);
+  return count;
+}
+
+static int is(const struct line* line, const char* word)
+{
+  return line->count > 0 && strcmp(line->fields[0], word) == 0;
+}
+
+/*
+ * The conversation function.  It answers with the recorded responses,
+ * failing if the module asks something other than what was recorded.
+ */
+static int conv(
+    int num_msg, const struct pam_message** msg, struct pam_response** resp,
+    void* appdata_ptr)
+{
+  struct replay_conv*	state = appdata_ptr;
+  const struct line*	line;
+  int			i;
+  int			pam_result;
+
+  *resp = 0;
+  for (i = 0; i < num_msg; i += 1)
+  {
+    line = state->next + i;
+    if (line >= state->end || !is(line, "prompt") ||
+	atoi(line->fields[1]) != msg[i]->msg_style)
+      return PAM_CONV_ERR;
+  }
+  line = state->next + num_msg;
+  if (line < state->end && is(line, "conv_error"))
+  {
+    state->next = line + 1;
+    pam_result = atoi(line->fields[1]);
+    return pam_result == PAM_SUCCESS ? PAM_CONV_ERR : pam_result;
+  }
+  *resp = calloc(num_msg, sizeof(**resp));
+  if (*resp == 0)
+    return PAM_BUF_ERR;
+  for (i = 0; i < num_msg; i += 1, line += 1)
+  {
+    if (line >= state->end || !is(line, "response") || line->count < 3)
+      goto error_exit;
+    (*resp)[i].resp_retcode = atoi(line->fields[1]);
+    if (line->fields[2] != 0)
+      (*resp)[i].resp = strdup(line->fields[2]);
+  }
+  state->next = line;
+  return PAM_SUCCESS;
+
+error_exit:
+  for (i = 0; i < num_msg; i += 1)
+    free((*resp)[i].resp);
+  free(*resp);
+  *resp = 0;
+  return PAM_CONV_ERR;
+}
+
+static int handler_index(const char* name)
+{
+  size_t	i;
+
+  for (i = 0; i < HANDLER_COUNT; i += 1)
+  {
+    if (strcmp(name, handler_names[i]) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/*
+ * Set the items and environment from the lines following a call line.
+ * Returns the first line that isn't one of them.
+ */
+static const struct line* set_state(
+    pam_handle_t* pamh, const struct line* line, const struct line* end)
+{
+  char*		env;
+  const char*	values[ITEM_COUNT];
+  size_t	i;
+
+  memset(values, '\0', sizeof(values));
+  for (; line < end; line += 1)
+  {
+    if (is(line, "item") && line->count == 3)
+    {
+      for (i = 0; i < ITEM_COUNT; i += 1)
+      {
+	if (strcmp(line->fields[1], items[i].name) == 0)
+	  values[i] = line->fields[2];
+      }
+    }
+    else if (is(line, "env") && line->count == 3 &&
+	line->fields[1] != 0 && line->fields[2] != 0)
+    {
+      env = malloc(strlen(line->fields[1]) + strlen(line->fields[2]) + 2);
+      if (env == 0)
+      {
+	fprintf(stderr, "out of memory\n");
+	exit(2);
+      }
+      sprintf(env, "%s=%s", line->fields[1], line->fields[2]);
+      pam_putenv(pamh, env);
+      free(env);
+    }
+    else if (!is(line, "argv"))
+      break;
+  }
+  for (i = 0; i < ITEM_COUNT; i += 1)
+    pam_set_item(pamh, items[i].item_type, values[i]);
+  return line;
+}
+
+/*
+ * Build the argv a call line's handler is given.
+ */
+static int make_argv(
+    const char** argv, int size, const struct line* call,
+    const struct line* end, char** options, int option_count,
+    const char* module)
+{
+  int		argc = 0;
+  const struct line* line;
+  int		i;
+
+  for (i = 0; i < option_count && argc < size; i += 1)
+    argv[argc++] = options[i];
+  for (line = call + 1; line < end && !is(line, "argv"); line += 1)
+  {
+    if (is(line, "call") || is(line, "result") || is(line, "end"))
+      return argc;
+  }
+  if (line == end)
+    return argc;
+  for (i = 1; i < line->count && argc < size; i += 1)
+  {
+    if (i == 1 && module != 0)
+      argv[argc++] = module;
+    else
+      argv[argc++] = line->fields[i] != 0 ? line->fields[i] : "";
+  }
+  return argc;
+}
+
+static void usage(const char* me)
+{
+  fprintf(
+    stderr,
+    "usage: %s [-n times] [-m module] [-o options] [-p pam_python.so] "
+    "[record]\n"
+    "  -n times   Replay the record this many times (default 1).\n"
+    "  -m module  Use this Python module rather than the recorded one.\n"
+    "  -o options pam_python options, eg \"stats\".\n"
+    "  -p path    pam_python.so (default ./pam_python.so).\n"
+    "  record     What record= wrote (default stdin).\n",
+    me);
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  const char*		call_argv[REPLAY_MAX_FIELDS * 2];
+  int			call_argc;
+  const struct line*	call;
+  struct pam_conv	convstruct;
+  void*			dlhandle;
+  double		elapsed;
+  const struct line*	end;
+  Handler		handlers[HANDLER_COUNT];
+  int			h;
+  long			i;
+  struct line*		lines;
+  long			line_count;
+  long			mismatches = 0;
+  const char*		module = 0;
+  long			n;
+  int			opt;
+  char*			options[REPLAY_MAX_FIELDS];
+  int			option_count = 0;
+  char*			options_arg = 0;
+  char			pam_python[PATH_MAX];
+  const char*		pam_python_arg = "pam_python.so";
+  pam_handle_t*		pamh = 0;
+  int			pam_result = PAM_SUCCESS;
+  struct samples	samples[HANDLER_COUNT];
+  char*			save;
+  double		start;
+  double		started;
+  struct replay_conv	state;
+  long			times = 1;
+  long			transactions = 0;
+  char*			word;
+
+  while ((opt = getopt(argc, argv, "m:n:o:p:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'm': module = optarg; break;
+      case 'n': times = atol(optarg); break;
+      case 'o': options_arg = strdup(optarg); break;
+      case 'p': pam_python_arg = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (times <= 0 || optind + 1 < argc)
+    usage(argv[0]);
+  if (module != 0 && module[0] != '/')
+  {
+    fprintf(stderr, "-m needs an absolute path\n");
+    exit(2);
+  }
+  for (word = options_arg == 0 ? 0 : strtok_r(options_arg, " ", &save);
+      word != 0 && option_count < REPLAY_MAX_FIELDS;
+      word = strtok_r(0, " ", &save))
+    options[option_count++] = word;
+  line_count = read_record(optind < argc ? argv[optind] : 0, &lines);
+  if (realpath(pam_python_arg, pam_python) == 0)
+  {
+    perror(pam_python_arg);
+    exit(2);
+  }
+  dlhandle = dlopen(pam_python, RTLD_NOW|RTLD_GLOBAL);
+  if (dlhandle == 0)
+  {
+    fprintf(stderr, "%s\n", dlerror());
+    exit(2);
+  }
+  for (h = 0; h < (int)HANDLER_COUNT; h += 1)
+    *(void**)&handlers[h] = dlsym(dlhandle, handler_names[h]);
+  memset(samples, '\0', sizeof(samples));
+  convstruct.conv = conv;
+  convstruct.appdata_ptr = &state;
+  end = lines + line_count;
+  started = now();
+  for (n = 0; n < times; n += 1)
+  {
+    for (call = lines; call < end; call += 1)
+    {
+      if (is(call, "transaction"))
+      {
+	if (pamh != 0)
+	  pam_end(pamh, pam_result);
+	if (pam_start("pam_python-replay", 0, &convstruct, &pamh) != PAM_SUCCESS)
+	{
+	  fprintf(stderr, "pam_start failed\n");
+	  exit(2);
+	}
+	pam_result = PAM_SUCCESS;
+	transactions += 1;
+	continue;
+      }
+      if (is(call, "end") && pamh != 0)
+      {
+	pam_end(pamh, pam_result);
+	pamh = 0;
+	continue;
+      }
+      if (!is(call, "call") || call->count < 3 || pamh == 0)
+	continue;
+      h = handler_index(call->fields[1]);
+      if (h == -1 || handlers[h] == 0)
+	continue;
+      call_argc = make_argv(
+	  call_argv, sizeof(call_argv) / sizeof(*call_argv), call, end,
+	  options, option_count, module);
+      state.next = set_state(pamh, call + 1, end);
+      for (state.end = state.next; state.end < end; state.end += 1)
+      {
+	if (is(state.end, "result") || is(state.end, "call") ||
+	    is(state.end, "end"))
+	  break;
+      }
+      start = now();
+      pam_result = handlers[h](pamh, atoi(call->fields[2]), call_argc, call_argv);
+      add_sample(&samples[h], now() - start);
+      if (state.end < end && is(state.end, "result") &&
+	  atoi(state.end->fields[1]) != pam_result)
+	mismatches += 1;
+      call = state.end < end && is(state.end, "result") ?
+	  state.end : state.end - 1;
+    }
+    if (pamh != 0)
+    {
+      pam_end(pamh, pam_result);
+      pamh = 0;
+    }
+  }
+  elapsed = now() - started;
+  printf(
+    "%ld transactions in %.3fs, %.1f transactions/s, "
+    "%ld results differed from the record\n",
+    transactions, elapsed, transactions / elapsed, mismatches);
+  printf(
+    "%-22s %9s %10s %10s %10s %10s %10s\n",
+    "handler", "count", "mean us", "p50 us", "p99 us", "p999 us", "max us");
+  for (h = 0; h < (int)HANDLER_COUNT; h += 1)
+  {
+    double	total = 0;
+
+    if (samples[h].count == 0)
+      continue;
+    for (i = 0; i < samples[h].count; i += 1)
+      total += samples[h].data[i];
+    qsort(samples[h].data, samples[h].count, sizeof(double), compare_double);
+    printf(
+      "%-22s %9ld %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+      handler_names[h], samples[h].count, total / samples[h].count * 1e6,
+      percentile(&samples[h], 0.5) * 1e6, percentile(&samples[h], 0.99) * 1e6,
+      percentile(&samples[h], 0.999) * 1e6,
+      samples[h].data[samples[h].count - 1] * 1e6);
+    free(samples[h].data);
+  }
+  return mismatches != 0;
+}
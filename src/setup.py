@@ -1,14 +1,15 @@
-#!/usr/bin/python -W default
+#!/usr/bin/python3 -W default
 import warnings; warnings.simplefilter('default')
 
-import distutils.sysconfig
-import os 
-import sys
+import os
+import sysconfig
 
 try:
   from setuptools import setup, Extension
+  from setuptools.command.build_ext import build_ext
 except ImportError:
   from distutils.core import setup, Extension
+  from distutils.command.build_ext import build_ext
 
 long_description = """\
 Embeds the Python interpreter into PAM \
@@ -25,20 +26,29 @@ classifiers = [
   "Topic :: Software Development :: Libraries :: Python Modules",
   "Topic :: System :: Systems Administration :: Authentication/Directory"]
 
-if not os.environ.has_key("Py_DEBUG"):
+if "Py_DEBUG" not in os.environ:
   Py_DEBUG = []
 else:
   Py_DEBUG = [('Py_DEBUG',1)]
 
-libpython_so = distutils.sysconfig.get_config_var('INSTSONAME')
+#
+# pam_python.so is loaded by libpam, not imported by Python, so it doesn't
+# get the interpreter's extension module suffix.
+#
+class build_pam_module(build_ext):
+  def get_ext_filename(self, ext_name):
+    return ext_name + ".so"
+
+libpython_so = sysconfig.get_config_var('INSTSONAME')
 ext_modules = [
     Extension(
       "pam_python",
       sources=["pam_python.c"],
+      depends=["pam_python_rules.h", "pam_python_stat.h"],
       include_dirs = [],
       library_dirs=[],
       define_macros=[('LIBPYTHON_SO','"'+libpython_so+'"')] + Py_DEBUG,
-      libraries=["pam","python%d.%d" % sys.version_info[:2]],
+      libraries=["pam","pthread","python" + sysconfig.get_config_var('LDVERSION')],
     ), ]
 
 setup(
@@ -54,4 +64,5 @@ setup(
   license="AGPL-3.0",
   classifiers=classifiers,
   ext_modules=ext_modules,
+  cmdclass={"build_ext": build_pam_module},
 )
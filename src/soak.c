@@ -0,0 +1,184 @@
+/*
+ * A soak test.  It loops pam_start(), pam_authenticate(), pam_end() in one
+ * process, which loads, initialises, finalises and unloads Python every
+ * time around, until the process's memory stops growing.  Best run using
+ * the Makefile target "soak-test", which runs it against fakepam so it
+ * needs no root.  To compile and run manually:
+ *   gcc -O0 -g -Wall -o soak soak.c -lpam
+ *   LD_LIBRARY_PATH=fakepam FAKEPAM_CONFDIR=. ./soak
+ *
+ * Every -s transactions the resident set size and the malloc heap are
+ * sampled.  Memory has settled once neither has grown by more than -t
+ * kilobytes over the last -w samples, and it exits with status 0.  If it
+ * is still growing after -n transactions it exits with status 1.  Adding
+ * memstats=N to the PAM rule shows where the growth comes from.
+ */
+#define	_GNU_SOURCE
+
+#include <fcntl.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <security/pam_appl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define	SOAK_SAMPLES_MAX	4096
+
+struct sample {
+  long long	heap;		/* malloc bytes in use, -1 if unknown */
+  long long	rss;		/* Resident set size in bytes */
+};
+
+static int conv(
+    int num_msg, const struct pam_message** msg, struct pam_response** resp, void *appdata_ptr)
+{
+  int		i;
+
+  (void)appdata_ptr;
+  *resp = malloc(num_msg * sizeof(**resp));
+  for (i = 0; i < num_msg; i += 1)
+  {
+    (*resp)[i].resp = strdup((*msg)[i].msg);
+    (*resp)[i].resp_retcode = (*msg)[i].msg_style;
+  }
+  return 0;
+}
+
+static void take_sample(struct sample* sample)
+{
+  char		buf[128];
+  int		fd;
+  ssize_t	len;
+  unsigned long	resident = 0;
+#if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2, 33)
+  struct mallinfo2 info;
+#else
+  struct mallinfo info;
+#endif
+#endif
+
+  sample->heap = -1;
+#if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+#if __GLIBC_PREREQ(2, 33)
+  info = mallinfo2();
+#else
+  info = mallinfo();
+#endif
+#pragma GCC diagnostic pop
+  sample->heap = (long long)info.uordblks + (long long)info.hblkhd;
+#endif
+  fd = open("/proc/self/statm", O_RDONLY);
+  if (fd != -1)
+  {
+    len = read(fd, buf, sizeof(buf) - 1);
+    if (len > 0)
+    {
+      buf[len] = '\0';
+      sscanf(buf, "%*u %lu", &resident);
+    }
+    close(fd);
+  }
+  sample->rss = (long long)resident * sysconf(_SC_PAGESIZE);
+}
+
+static void usage(const char* me)
+{
+  fprintf(
+    stderr,
+    "usage: %s [-n max] [-s every] [-t kb] [-w window] [service [user]]\n"
+    "  -n max     Give up after this many transactions (default 20000).\n"
+    "  -s every   Sample memory every this many transactions (default 100).\n"
+    "  -t kb      Growth tolerated over the window (default 64).\n"
+    "  -w window  Samples memory must be flat for (default 10).\n"
+    "  service    PAM service (default test-pam_python.pam).\n"
+    "  user       User to authenticate (default none).\n",
+    me);
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  struct pam_conv	convstruct;
+  long			every = 100;
+  long			i;
+  long			max = 20000;
+  struct sample*	now;
+  int			opt;
+  pam_handle_t*		pamh;
+  int			pam_result;
+  long			sample_count = 0;
+  static struct sample	samples[SOAK_SAMPLES_MAX];
+  const char*		service = "test-pam_python.pam";
+  struct sample*	then;
+  long long		tolerance = 64;
+  const char*		user = "";
+  long			window = 10;
+
+  while ((opt = getopt(argc, argv, "n:s:t:w:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n': max = atol(optarg); break;
+      case 's': every = atol(optarg); break;
+      case 't': tolerance = atoll(optarg); break;
+      case 'w': window = atol(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (every <= 0 || window <= 0 || max <= 0 || tolerance < 0)
+    usage(argv[0]);
+  if (optind < argc)
+    service = argv[optind++];
+  if (optind < argc)
+    user = argv[optind++];
+  if (optind < argc)
+    usage(argv[0]);
+  convstruct.conv = conv;
+  convstruct.appdata_ptr = 0;
+  printf("%12s %14s %14s\n", "transactions", "rss", "heap");
+  for (i = 1; i <= max; i += 1)
+  {
+    if (pam_start(service, user, &convstruct, &pamh) != PAM_SUCCESS)
+    {
+      fprintf(stderr, "pam_start failed\n");
+      return 2;
+    }
+    pam_result = pam_authenticate(pamh, 0);
+    if (pam_result != PAM_SUCCESS)
+    {
+      fprintf(
+	stderr, "pam_authenticate failed: %d %s\n",
+	pam_result, pam_strerror(pamh, pam_result));
+      pam_end(pamh, pam_result);
+      return 2;
+    }
+    pam_end(pamh, pam_result);
+    if (i % every != 0)
+      continue;
+    now = &samples[sample_count % SOAK_SAMPLES_MAX];
+    take_sample(now);
+    printf("%12ld %14lld %14lld\n", i, now->rss, now->heap);
+    fflush(stdout);
+    sample_count += 1;
+    /*
+     * The first two windows are ignored while caches fill.
+     */
+    if (sample_count <= window * 2 || window >= SOAK_SAMPLES_MAX)
+      continue;
+    then = &samples[(sample_count - 1 - window) % SOAK_SAMPLES_MAX];
+    if (now->rss - then->rss <= tolerance * 1024 &&
+	now->heap - then->heap <= tolerance * 1024)
+    {
+      printf("Memory settled after %ld transactions.\n", i);
+      return 0;
+    }
+  }
+  printf("Memory still growing after %ld transactions.\n", max);
+  return 1;
+}
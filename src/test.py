@@ -1,11 +1,11 @@
-#!/usr/bin/python -W default
+#!/usr/bin/python3 -W default
 #
 # This is the test script for libpython-pam.  There aren't many stones
 # left unturned.
 #
 # Best run from the Makefile using the target 'test'.  To run manually:
 #   sudo ln -s $PWD/test-pam_python.pam /etc/pam.d
-#   python test.py
+#   python3 test.py
 #   sudo rm /etc/pam.d/test-pam_python.pam 
 #
 import warnings; warnings.simplefilter('default')
@@ -13,6 +13,8 @@ import os
 import sys
 
 TEST_PAM_MODULE	= "test-pam_python.pam"
+TEST_PAM_LOG_MODULE = "test-pam_python-log.pam"
+TEST_PAM_TIMEOUT_MODULE = "test-pam_python-timeout.pam"
 TEST_PAM_USER	= "root"
 
 #
@@ -33,6 +35,21 @@ def pam_sm_close_session(pamh, flags, argv):
 def pam_sm_chauthtok(pamh, flags, argv):
   return test(pam_sm_chauthtok, pamh, flags, argv)
 
+#
+# Defining pam_sm_process_init or pam_sm_process_fini keeps the module
+# loaded for the rest of the process, so only the child run_process
+# starts has them.
+#
+if os.environ.get("TEST_PROCESS_CHILD"):
+  process_state = []
+  def pam_sm_process_init(pamh):
+    global process_task
+    process_state.append(pamh.module.__name__)
+    process_task = pamh.schedule(0.01, lambda: "refreshed")
+  def pam_sm_process_fini():
+    sys.stdout.write(
+        "pam_sm_process_fini %r %r\n" % (process_state, process_task.cancelled))
+
 def test(who, pamh, flags, argv):
   import test
   if not hasattr(test, "test_function"):# only true if not called via "main"
@@ -68,7 +85,7 @@ def assert_results(expected_results, results):
 # Test all the calls happen.
 #
 def test_basic_calls(results, who, pamh, flags, argv):
-  results.append((who.func_name, flags, argv))
+  results.append((who.__name__, flags, argv))
   return pamh.PAM_SUCCESS
   
 def run_basic_calls(results):
@@ -82,13 +99,13 @@ def run_basic_calls(results):
   del pam
   me = os.path.join(os.getcwd(), __file__)
   expected_results = [
-      (pam_sm_authenticate.func_name, 0, [me]),
-      (pam_sm_acct_mgmt.func_name, 0, [me, 'arg1', 'arg2']),
-      (pam_sm_chauthtok.func_name, 16384, [me]),
-      (pam_sm_chauthtok.func_name, 8192, [me]),
-      (pam_sm_open_session.func_name, 0, [me]),
-      (pam_sm_close_session.func_name, 0, [me]),
-      (pam_sm_end.func_name, None, None)]
+      (pam_sm_authenticate.__name__, 0, [me]),
+      (pam_sm_acct_mgmt.__name__, 0, [me, 'arg1', 'arg2']),
+      (pam_sm_chauthtok.__name__, 16384, [me]),
+      (pam_sm_chauthtok.__name__, 8192, [me]),
+      (pam_sm_open_session.__name__, 0, [me]),
+      (pam_sm_close_session.__name__, 0, [me]),
+      (pam_sm_end.__name__, None, None)]
   assert_results(expected_results, results)
 
 #
@@ -170,7 +187,7 @@ PAM_CONSTANTS = {
     "PAM_DATA_REPLACE":			0x20000000,
   }
 def test_constants(results, who, pamh, flags, argv):
-  results.append(who.func_name)
+  results.append(who.__name__)
   if who != pam_sm_authenticate:
     return pamh.PAM_SUCCESS
   pam_constants = dict([
@@ -181,7 +198,7 @@ def test_constants(results, who, pamh, flags, argv):
   try:
     pamh.PAM_SUCCESS = 1
     results.append("Opps, pamh.PAM_SUCCESS = 1 worked!")
-  except StandardError, e:
+  except Exception as e:
     results.append("except: %s" % e)
   return pamh.PAM_SUCCESS
 
@@ -191,16 +208,16 @@ def run_constants(results):
   pam.authenticate(0)
   pam.close_session()
   del pam
-  assert results[0] == pam_sm_authenticate.func_name, (results[0], pam_sm_authenticate.func_name)
-  assert results[2] == "except: attribute 'PAM_SUCCESS' of 'PamHandle_type' objects is not writable", results[2]
-  assert results[3] == pam_sm_close_session.func_name, (results[3], pam_sm_close_session.func_name)
-  assert results[4] == pam_sm_end.func_name, (results[4], pam_sm_end.func_name)
+  assert results[0] == pam_sm_authenticate.__name__, (results[0], pam_sm_authenticate.__name__)
+  assert results[2] == "except: attribute 'PAM_SUCCESS' of 'libpam_python.PamHandle_type' objects is not writable", results[2]
+  assert results[3] == pam_sm_close_session.__name__, (results[3], pam_sm_close_session.__name__)
+  assert results[4] == pam_sm_end.__name__, (results[4], pam_sm_end.__name__)
   consts = results[1]
   for var in PAM_CONSTANTS.keys():
-    assert consts.has_key(var), var
+    assert var in consts, var
     assert consts[var] == PAM_CONSTANTS[var], (var, consts[var], PAM_CONSTANTS[var])
   for var in consts.keys():
-    assert PAM_CONSTANTS.has_key(var), var
+    assert var in PAM_CONSTANTS, var
     assert PAM_CONSTANTS[var] == consts[var], (var, PAM_CONSTANTS[var], consts[var])
   assert len(results) == 5, len(results)
 
@@ -208,14 +225,14 @@ def run_constants(results):
 # Test the environment calls.
 #
 def test_environment(results, who, pamh, flags, argv):
-  results.append(who.func_name)
+  results.append(who.__name__)
   if who != pam_sm_acct_mgmt:
     return pamh.PAM_SUCCESS
   def test_exception(func):
     try:
       func()
       return str(None)
-    except Exception, e:
+    except Exception as e:
       return e.__class__.__name__ + ": " + str(e)
   #
   # A few things to test here.  First that PamEnv_as_mapping works.
@@ -233,6 +250,8 @@ def test_environment(results, who, pamh, flags, argv):
   results.append(test_exception(lambda: pamh.env[1]))
   results.append(test_exception(lambda: pamh.env['a=']))
   results.append(test_exception(lambda: pamh.env['']))
+  def t(): pamh.env['\ud800'] = 'x'
+  results.append(test_exception(t))
   #
   # Now the dict functions.
   #
@@ -263,27 +282,29 @@ def run_environment(results):
   pam.close_session()
   del pam
   expected_results = [
-      pam_sm_authenticate.func_name, pam_sm_acct_mgmt.func_name,
+      pam_sm_authenticate.__name__, pam_sm_acct_mgmt.__name__,
       3, '1', 'y', 'z',
       'TypeError: PAM environment value must be a string',
       "KeyError: 'yy'",
       'TypeError: PAM environment key must be a string',
       "ValueError: PAM environment key can't contain '='",
       "ValueError: PAM environment key mustn't be 0 length",
+      "UnicodeEncodeError: 'utf-8' codec can't encode character '\\ud800' "
+	  "in position 0: surrogates not allowed",
       False, True, False, True,
       "KeyError: 'not in'",
       None, 'default', 'x', 'x',
       [('x2', '2'), ('x3', '3'), ('xx', 'x')],
       ['x2', 'x3', 'xx'],
       ['2', '3', 'x'],
-      pam_sm_close_session.func_name, pam_sm_end.func_name]
+      pam_sm_close_session.__name__, pam_sm_end.__name__]
   assert_results(expected_results, results)
 
 #
 # Test strerror().
 #
 def test_strerror(results, who, pamh, flags, argv):
-  results.append(who.func_name)
+  results.append(who.__name__)
   if who != pam_sm_authenticate:
     return pamh.PAM_SUCCESS
   results.extend([(e, pamh.strerror(e).lower()) for e in (0, 1, 30, 31)])
@@ -295,19 +316,19 @@ def run_strerror(results):
   pam.authenticate(0)
   del pam
   expected_results = [
-      pam_sm_authenticate.func_name,
+      pam_sm_authenticate.__name__,
       ( 0, 'success'),
       ( 1, 'failed to load module'),
       (30, 'conversation is waiting for event'),
       (31, 'application needs to call libpam again'),
-      pam_sm_end.func_name]
+      pam_sm_end.__name__]
   assert_results(expected_results, results)
 
 #
 # Test items.
 #
 def test_items(results, who, pamh, flags, argv):
-  results.append(who.func_name)
+  results.append(who.__name__)
   if not who in (pam_sm_open_session, pam_sm_close_session):
     return pamh.PAM_SUCCESS
   items = {
@@ -321,9 +342,7 @@ def test_items(results, who, pamh, flags, argv):
 	"user":		"user-module",
 	"xdisplay":	"xdisplay-module",
       }
-  keys = items.keys()
-  keys.sort()
-  for key in keys:
+  for key in sorted(items):
     results.append((key, getattr(pamh, key)))
     value = items[key]
     if value != None:
@@ -331,7 +350,7 @@ def test_items(results, who, pamh, flags, argv):
   try:
     setattr(pamh, "tty", 1)
     results.append("%r = %r" % (key, value))
-  except StandardError, e:
+  except Exception as e:
     results.append("except: %s" % e)
   results.append(pamh.get_user("a prompt"))
   return pamh.PAM_SUCCESS
@@ -348,15 +367,13 @@ def run_items(results):
       9:	"user_prompt",
       11:	"xdisplay",
       13:	"authtok_type"}
-  items_list = items.keys()
-  items_list.sort()
-  for item in items_list:
+  for item in sorted(items):
     pam.set_item(item, items[item])
   pam.open_session()
   pam.close_session()
   del pam
   expected_results = [
-      pam_sm_authenticate.func_name, pam_sm_open_session.func_name,
+      pam_sm_authenticate.__name__, pam_sm_open_session.__name__,
       ('authtok',	None),
       ('authtok_type',	'authtok_type'),
       ('oldauthtok',	None),
@@ -368,7 +385,7 @@ def run_items(results):
       ('xdisplay',	'xdisplay'),
       'except: PAM item PAM_TTY must be set to a string',
       'user-module',
-      pam_sm_close_session.func_name,
+      pam_sm_close_session.__name__,
       ('authtok',	'authtok-module'),
       ('authtok_type',	'authtok_type-module'),
       ('oldauthtok',	'oldauthtok-module'),
@@ -380,14 +397,14 @@ def run_items(results):
       ('xdisplay',	'xdisplay-module'),
       'except: PAM item PAM_TTY must be set to a string',
       'user-module',
-      pam_sm_end.func_name]
+      pam_sm_end.__name__]
   assert_results(expected_results, results)
 
 #
 # Test the xauthdata item.
 #
 def test_xauthdata(results, who, pamh, flags, argv):
-  results.append(who.func_name)
+  results.append(who.__name__)
   if not who in (pam_sm_open_session, pam_sm_close_session):
     return pamh.PAM_SUCCESS
   xauthdata0 = pamh.XAuthData("name-module", "data-module")
@@ -397,12 +414,12 @@ def test_xauthdata(results, who, pamh, flags, argv):
   try:
     xauthdata2 = pamh.XAuthData(None, "x")
     results.append('pamh.XAuthData(%r, %r)' % (xauthdata2.name, xauthdata2.data))
-  except TypeError, e:
+  except TypeError as e:
     results.append('except: %s' % e)
   try:
     xauthdata2 = pamh.XAuthData("x", 1)
     results.append('pamh.XAuthData(%r, %r)' % (xauthdata2.name, xauthdata2.data))
-  except TypeError, e:
+  except TypeError as e:
     results.append('except: %s' % e)
   class XA: pass
   XA.name = "name-XA"
@@ -430,26 +447,26 @@ def run_xauthdata(results):
   pam.close_session()
   del pam
   expected_results = [
-      pam_sm_authenticate.func_name, pam_sm_open_session.func_name,
+      pam_sm_authenticate.__name__, pam_sm_open_session.__name__,
       ("name='name-module', data='data-module'"),
-      'except: XAuthData() argument 1 must be string, not None',
-      'except: XAuthData() argument 2 must be string, not int',
+      'except: XAuthData() argument 1 must be str, not None',
+      'except: XAuthData() argument 2 must be str, not int',
       ("name='name-XA', data='data-XA'"),
       ("name='name-xa', data='data-xa'"),
-      pam_sm_close_session.func_name,
+      pam_sm_close_session.__name__,
       ("name='name-module', data='data-module'"),
-      'except: XAuthData() argument 1 must be string, not None',
-      'except: XAuthData() argument 2 must be string, not int',
+      'except: XAuthData() argument 1 must be str, not None',
+      'except: XAuthData() argument 2 must be str, not int',
       ("name='name-XA', data='data-XA'"),
       ("name='name-xa', data='data-xa'"),
-      pam_sm_end.func_name]
+      pam_sm_end.__name__]
   assert_results(expected_results, results)
 
 #
 # Test having no pam_sm_end.
 #
 def test_no_sm_end(results, who, pamh, flags, argv):
-  results.append(who.func_name)
+  results.append(who.__name__)
   global pam_sm_end
   del pam_sm_end
   return pamh.PAM_SUCCESS
@@ -459,14 +476,14 @@ def run_no_sm_end(results):
   pam.start(TEST_PAM_MODULE, TEST_PAM_USER, pam_conv)
   pam.authenticate(0)
   del pam
-  expected_results = [pam_sm_authenticate.func_name]
+  expected_results = [pam_sm_authenticate.__name__]
   assert_results(expected_results, results)
 
 #
 # Test the conversation mechanism.
 #
 def test_conv(results, who, pamh, flags, argv):
-  results.append(who.func_name)
+  results.append(who.__name__)
   if who == pam_sm_end:
     return
   #
@@ -501,11 +518,11 @@ def run_conv(results):
   pam.acct_mgmt()
   del pam
   expected_results = [
-      pam_sm_authenticate.func_name,
+      pam_sm_authenticate.__name__,
       [('Prompt_echo_off', 1), ('Prompt_echo_on', 2), ('Error_msg', 3), ('Text_info', 4)],
-      pam_sm_acct_mgmt.func_name,
+      pam_sm_acct_mgmt.__name__,
       ('single', 1),
-      pam_sm_end.func_name]
+      pam_sm_end.__name__]
   assert_results(expected_results, results)
 
 #
@@ -521,7 +538,7 @@ def run_pamerr(results):
     results.append(err)
     try:
       pam.authenticate(0)
-    except PAM.error, e:
+    except PAM.error as e:
       results[-1] = -e.args[1]
   del pam
   expected_results = [-r for r in range(PAM._PAM_RETURN_VALUES)]
@@ -559,7 +576,7 @@ def test_exceptions(results, who, pamh, flags, argv):
     try:
       pamh.strerror(debug_magic + err)
       results.append(err)
-    except pamh.exception, e:
+    except pamh.exception as e:
       results.append((-e.pam_result,))
   return pamh.PAM_SUCCESS
 
@@ -572,11 +589,1081 @@ def run_exceptions(results):
   expected_results += [(-r,) for r in range(1, results[0])]
   assert_results(expected_results, results)
 
+#
+# Test logging.
+#
+def test_log(results, who, pamh, flags, argv):
+  results.append(who.__name__)
+  if who != pam_sm_authenticate:
+    return pamh.PAM_SUCCESS
+  import logging
+  def test_exception(func):
+    try:
+      func()
+      return str(None)
+    except Exception as e:
+      return e.__class__.__name__
+  results.append((pamh.LOG_ERR, pamh.LOG_INFO, pamh.LOG_DEBUG))
+  results.append((pamh.log_ident, pamh.log_level))
+  results.append(test_exception(lambda: pamh.log(pamh.LOG_DEBUG, "%d", "x")))
+  results.append(test_exception(lambda: pamh.log(pamh.LOG_INFO, "%d", "x")))
+  results.append(test_exception(lambda: pamh.log(pamh.LOG_INFO, "%d", 1)))
+  results.append(test_exception(lambda: pamh.log(pamh.LOG_INFO)))
+  results.append(test_exception(lambda: pamh.log(-1, "x")))
+  pamh.log_level = pamh.LOG_DEBUG
+  results.append(test_exception(lambda: pamh.log(pamh.LOG_DEBUG, "%d", "x")))
+  handler = pamh.log_handler()
+  results.append(isinstance(handler, logging.Handler))
+  results.append(handler.level)
+  logger = logging.getLogger("test_log")
+  logger.addHandler(handler)
+  try:
+    logger.debug("debug %d", 1)
+    results.append(test_exception(lambda: logger.error("%d", "x")))
+  finally:
+    logger.removeHandler(handler)
+  return pamh.PAM_SUCCESS
+
+def run_log(results):
+  pam = PAM.pam()
+  pam.start(TEST_PAM_MODULE, TEST_PAM_USER, pam_conv)
+  pam.authenticate(0)
+  del pam
+  expected_results = [
+      pam_sm_authenticate.__name__,
+      (3, 6, 7),
+      ("test", 6),
+      'None',
+      'TypeError',
+      'None',
+      'TypeError',
+      'ValueError',
+      'TypeError',
+      True,
+      10,
+      'None',
+      pam_sm_end.__name__]
+  assert_results(expected_results, results)
+
+#
+# Test pamh.span(), which does nothing without the trace= option.
+#
+def test_span(results, who, pamh, flags, argv):
+  results.append(who.__name__)
+  if who != pam_sm_authenticate:
+    return pamh.PAM_SUCCESS
+  with pamh.span("outer") as span:
+    results.append((span.name, span.span_id, span.parent_id))
+  try:
+    with pamh.span("raises"):
+      raise ValueError("x")
+  except ValueError as e:
+    results.append(str(e))
+  try:
+    pamh.span(1)
+  except TypeError:
+    results.append("TypeError")
+  return pamh.PAM_SUCCESS
+
+def run_span(results):
+  pam = PAM.pam()
+  pam.start(TEST_PAM_MODULE, TEST_PAM_USER, pam_conv)
+  pam.authenticate(0)
+  del pam
+  expected_results = [
+      pam_sm_authenticate.__name__,
+      ("outer", None, None),
+      "x",
+      "TypeError",
+      pam_sm_end.__name__]
+  assert_results(expected_results, results)
+
+#
+# Test coroutine handlers, which run on pam_python's event loop.
+#
+def test_async(results, who, pamh, flags, argv):
+  import asyncio
+  async def lookup(name, delay):
+    await asyncio.sleep(delay)
+    results.append(name)
+  async def handler():
+    results.append(who.__name__)
+    if who != pam_sm_authenticate:
+      return pamh.PAM_SUCCESS
+    await asyncio.gather(lookup("slow", 0.02), lookup("fast", 0.01))
+    response = await pamh.conversation_async(
+        pamh.Message(pamh.PAM_PROMPT_ECHO_OFF, "async"))
+    results.append((response.resp, response.resp_retcode))
+    response = None
+    return pamh.PAM_AUTH_ERR
+  if who == pam_sm_authenticate:
+    try:
+      pamh.get_user_async()
+    except RuntimeError:
+      results.append("RuntimeError")
+  return handler()
+
+def run_async(results):
+  pam = PAM.pam()
+  pam.start(TEST_PAM_MODULE, TEST_PAM_USER, pam_conv)
+  try:
+    pam.authenticate(0)
+  except PAM.error as e:
+    results.append(e.args[1])
+  pam.acct_mgmt()
+  del pam
+  expected_results = [
+      "RuntimeError",
+      pam_sm_authenticate.__name__,
+      "fast",
+      "slow",
+      ("async", 1),
+      PAM.PAM_AUTH_ERR,
+      pam_sm_acct_mgmt.__name__,
+      pam_sm_end.__name__]
+  assert_results(expected_results, results)
+
+#
+# Test timeout=, which test-pam_python-timeout.pam gives the session
+# handlers.  Time spent in the conversation isn't counted.
+#
+def test_timeout(results, who, pamh, flags, argv):
+  import asyncio
+  results.append(who.__name__)
+  async def hang():
+    await asyncio.sleep(60)
+    return pamh.PAM_SUCCESS
+  if who == pam_sm_open_session and results.count(who.__name__) == 1:
+    return hang()
+  if who == pam_sm_open_session:
+    pamh.conversation(pamh.Message(pamh.PAM_PROMPT_ECHO_ON, "slow"))
+    return pamh.PAM_SUCCESS
+  if who == pam_sm_close_session:
+    try:
+      while True:
+        pass
+    except TimeoutError:
+      results.append("TimeoutError")
+  return pamh.PAM_SUCCESS
+
+def run_timeout(results):
+  import time
+  def conv(auth, query_list, userData=None):
+    time.sleep(0.5)
+    return [("", 0) for query in query_list]
+  pam = PAM.pam()
+  pam.start(TEST_PAM_TIMEOUT_MODULE, TEST_PAM_USER, conv)
+  for func in ("open_session", "close_session", "open_session"):
+    try:
+      getattr(pam, func)(0)
+      results.append(PAM.PAM_SUCCESS)
+    except PAM.error as e:
+      results.append(e.args[1])
+  #
+  # On newer Pythons asyncio's TimeoutError is caught in a reference cycle
+  # with the frames it passed through, and one of those holds pam.
+  #
+  del pam
+  import gc; gc.collect()
+  expected_results = [
+      pam_sm_open_session.__name__,
+      PAM.PAM_AUTHINFO_UNAVAIL,
+      pam_sm_close_session.__name__,
+      "TimeoutError",
+      PAM.PAM_AUTHINFO_UNAVAIL,
+      pam_sm_open_session.__name__,
+      PAM.PAM_SUCCESS,
+      pam_sm_end.__name__]
+  assert_results(expected_results, results)
+
+#
+# Test that a conversation a timed out coroutine left running in the
+# executor finishes before the handle is destroyed.  The conversation
+# function holds the last reference to pam, so it is the executor thread
+# that calls pam_end, from inside the conversation, and that mustn't
+# wait for itself.
+#
+def test_executor(results, who, pamh, flags, argv):
+  results.append(who.__name__)
+  async def converse():
+    await pamh.conversation_async(
+	pamh.Message(pamh.PAM_PROMPT_ECHO_ON, "slow"))
+    return pamh.PAM_SUCCESS
+  if who == pam_sm_open_session:
+    return converse()
+  return pamh.PAM_SUCCESS
+
+def run_executor(results):
+  import time
+  def conv(auth, query_list, userData=None):
+    time.sleep(1)
+    results.append("conversation returned")
+    return [("", 0) for query in query_list]
+  pam = PAM.pam()
+  pam.start(TEST_PAM_TIMEOUT_MODULE, TEST_PAM_USER, conv)
+  try:
+    pam.open_session(0)
+    results.append(PAM.PAM_SUCCESS)
+  except PAM.error as e:
+    results.append(e.args[1])
+  del pam
+  import gc; gc.collect()
+  for i in range(500):
+    if pam_sm_end.__name__ in results:
+      break
+    time.sleep(0.01)
+  expected_results = [
+      pam_sm_open_session.__name__,
+      PAM.PAM_AUTHINFO_UNAVAIL,
+      "conversation returned",
+      pam_sm_end.__name__]
+  assert_results(expected_results, results)
+
+#
+# Test rules=, which test-pam_python.pam gives the account handler.  Only
+# the transactions test-pam_python.rules doesn't decide reach Python, and
+# damaged rules leave everything to Python.
+#
+def test_rules(results, who, pamh, flags, argv):
+  results.append((who.__name__, pamh.user, pamh.rhost))
+  return pamh.PAM_SUCCESS
+
+def rules_damaged(results, damage):
+  import struct
+  path = os.path.join(
+      os.path.dirname(os.path.abspath(__file__)),
+      "test-pam_python.rules.compiled")
+  with open(path, "rb") as f:
+    contents = f.read()
+  #
+  # A RulesHeader is 5 counts and the prefix lengths, then come the
+  # RulesRule's and RulesSlot's, each 3 unsigned int's.
+  #
+  damaged = bytearray(contents)
+  rule_count, slot_count = struct.unpack_from("=II", damaged, 8)
+  rules = 5 * 4 + 5 * 4 * 8 * 4
+  slots = rules + rule_count * 12
+  if damage == "slot":
+    for slot in range(slots, slots + slot_count * 12, 12):
+      if struct.unpack_from("=I", damaged, slot + 4)[0] != 0:
+        struct.pack_into("=I", damaged, slot, 0xffffff00)
+  else:
+    for rule in range(rules, slots, 12):
+      struct.pack_into("=i", damaged, rule + 4, 1000)
+  with open(path, "wb") as f:
+    f.write(damaged)
+  try:
+    pam = PAM.pam()
+    pam.start(TEST_PAM_MODULE, TEST_PAM_USER, pam_conv)
+    pam.set_item(PAM.PAM_USER, "rules-denied")
+    pam.acct_mgmt(0)
+    results.append(PAM.PAM_SUCCESS)
+    del pam
+  finally:
+    with open(path, "wb") as f:
+      f.write(contents)
+
+#
+# Rules stay mapped between calls, so check a file pam_python_rules
+# replaces is seen by the next call on the same handle.
+#
+def rules_replaced(results):
+  import subprocess
+  directory = os.path.dirname(os.path.abspath(__file__))
+  compiled = os.path.join(directory, "test-pam_python.rules.compiled")
+  compiler = os.path.join(directory, "pam_python_rules")
+  source = compiled + ".replaced"
+  pam = PAM.pam()
+  pam.start(TEST_PAM_MODULE, TEST_PAM_USER, pam_conv)
+  pam.set_item(PAM.PAM_USER, "rules-denied")
+  try:
+    try:
+      pam.acct_mgmt(0)
+    except PAM.error as e:
+      results.append(e.args[1])
+    with open(source, "w") as f:
+      f.write("acct_mgmt\tuser\tis\trules-denied\tpython\n")
+    subprocess.check_call([compiler, source, compiled])
+    pam.acct_mgmt(0)
+    results.append(PAM.PAM_SUCCESS)
+  finally:
+    subprocess.check_call(
+        [compiler, os.path.join(directory, "test-pam_python.rules"), compiled])
+    os.remove(source)
+  del pam
+
+def run_rules(results):
+  pam = PAM.pam()
+  pam.start(TEST_PAM_MODULE, TEST_PAM_USER, pam_conv)
+  items = (
+      ("rules-denied",	None),
+      ("rules-denied",	"192.0.2.7"),
+      ("rules-python-1",None),
+      ("rules-other",	None),
+      (TEST_PAM_USER,	None),
+      (TEST_PAM_USER,	"192.0.2.7"),
+      (TEST_PAM_USER,	"192.0.3.7"),
+      (TEST_PAM_USER,	"2001:db8::1"),
+    )
+  for user, rhost in items:
+    pam.set_item(PAM.PAM_USER, user)
+    pam.set_item(PAM.PAM_RHOST, rhost or "")
+    try:
+      pam.acct_mgmt(0)
+      results.append(PAM.PAM_SUCCESS)
+    except PAM.error as e:
+      results.append(e.args[1])
+  pam.authenticate(0)
+  del pam
+  expected_results = [
+      PAM.PAM_PERM_DENIED,
+      PAM.PAM_PERM_DENIED,
+      (pam_sm_acct_mgmt.__name__, "rules-python-1", ""),
+      PAM.PAM_SUCCESS,
+      PAM.PAM_SERVICE_ERR,
+      (pam_sm_acct_mgmt.__name__, TEST_PAM_USER, ""),
+      PAM.PAM_SUCCESS,
+      PAM.PAM_SUCCESS,
+      (pam_sm_acct_mgmt.__name__, TEST_PAM_USER, "192.0.3.7"),
+      PAM.PAM_SUCCESS,
+      PAM.PAM_AUTH_ERR,
+      (pam_sm_authenticate.__name__, "root", "2001:db8::1"),
+      (pam_sm_end.__name__, "root", "2001:db8::1")]
+  assert_results(expected_results, results)
+  del results[:]
+  rules_damaged(results, "slot")
+  rules_damaged(results, "result")
+  expected_results = [
+      (pam_sm_acct_mgmt.__name__, "rules-denied", None),
+      PAM.PAM_SUCCESS,
+      (pam_sm_end.__name__, "rules-denied", None),
+      (pam_sm_acct_mgmt.__name__, "rules-denied", None),
+      PAM.PAM_SUCCESS,
+      (pam_sm_end.__name__, "rules-denied", None)]
+  assert_results(expected_results, results)
+  del results[:]
+  rules_replaced(results)
+  expected_results = [
+      PAM.PAM_PERM_DENIED,
+      (pam_sm_acct_mgmt.__name__, "rules-denied", None),
+      PAM.PAM_SUCCESS,
+      (pam_sm_end.__name__, "rules-denied", None)]
+  assert_results(expected_results, results)
+
+#
+# Test pamh.cache, which test-pam_python.pam gives the auth handlers.  A
+# child process fills it, and the parent's handler reads what it left.
+# A cache file claiming more slots than it holds is started afresh.
+#
+def test_cache(results, who, pamh, flags, argv):
+  import time
+  if who != pam_sm_authenticate:
+    return pamh.PAM_SUCCESS
+  cache = pamh.cache
+  if os.environ.get("TEST_CACHE_CHILD"):
+    cache.set("child", str(os.getpid()), 60)
+    return pamh.PAM_SUCCESS
+  results.append(cache.get("child"))
+  results.append(cache.delete("child"))
+  results.append(cache.get("child", "gone"))
+  results.append(cache.set("str", "\u00e9t\u00e9", 60))
+  results.append(cache.set("bytes", b"\0\xff", 60))
+  results.append((cache.get("str"), cache.get("bytes")))
+  cache.set("str", "replaced", 60)
+  results.append(cache.get("str"))
+  cache.set("short", "lived", 0.01)
+  time.sleep(0.02)
+  results.append(cache.get("short"))
+  for args in ((1, "v", 60), ("k", 1, 60), ("k", "v" * 300, 60), ("k", "v", 0)):
+    try:
+      cache.set(*args)
+    except Exception as e:
+      results.append(e.__class__.__name__)
+  return pamh.PAM_SUCCESS
+
+def run_cache(results):
+  import glob
+  import struct
+  import subprocess
+  env = dict(os.environ, TEST_CACHE_CHILD="1")
+  child = subprocess.Popen([sys.executable, __file__, "cache_child"], env=env)
+  assert child.wait() == 0
+  pid = child.pid
+  pam = PAM.pam()
+  pam.start(TEST_PAM_MODULE, TEST_PAM_USER, pam_conv)
+  pam.authenticate(0)
+  del pam
+  cache_files = glob.glob(os.path.join(
+      os.path.dirname(os.path.abspath(__file__)), "state", "cache-*"))
+  for cache_file in cache_files:
+    with open(cache_file, "r+b") as f:
+      f.seek(8)
+      f.write(struct.pack("=I", 1 << 20))
+  child = subprocess.Popen([sys.executable, __file__, "cache_child"], env=env)
+  results.append((len(cache_files), child.wait()))
+  expected_results = [
+      str(pid),
+      True,
+      "gone",
+      True,
+      True,
+      ("\u00e9t\u00e9", b"\0\xff"),
+      "replaced",
+      None,
+      "TypeError",
+      "TypeError",
+      "ValueError",
+      "ValueError",
+      (1, 0)]
+  assert_results(expected_results, results)
+
+#
+# Test pamh.failures, which test-pam_python.pam gives the auth handlers,
+# and the password handlers with a one second window.  The counts outlive
+# the PAM handle, so the key is unique to this run.  A child process
+# counts a failure the parent then sees.
+#
+def test_failures(results, who, pamh, flags, argv):
+  import time
+  failures = pamh.failures
+  key = "user:test-%s" % os.environ.get("TEST_FAILURES_PARENT", os.getpid())
+  if who == pam_sm_chauthtok and flags & pamh.PAM_PRELIM_CHECK:
+    results.append(failures.window)
+    results.append(failures.increment(key))
+    time.sleep(1.1)
+    results.append(failures.count(key))
+    return pamh.PAM_SUCCESS
+  if who != pam_sm_authenticate:
+    return pamh.PAM_SUCCESS
+  if os.environ.get("TEST_FAILURES_PARENT"):
+    failures.increment(key)
+    return pamh.PAM_SUCCESS
+  if not results:
+    results.append((failures.window, failures.shared))
+    results.append([failures.increment(key) for i in range(3)])
+    results.append(failures.count("rhost:test-%d" % os.getpid()))
+    return pamh.PAM_SUCCESS
+  results.append(failures.count(key))
+  failures.reset(key)
+  results.append(failures.count(key))
+  try:
+    failures.increment(1)
+  except TypeError as e:
+    results.append("TypeError")
+  return pamh.PAM_SUCCESS
+
+def run_failures(results):
+  import subprocess
+  for i in range(2):
+    pam = PAM.pam()
+    pam.start(TEST_PAM_MODULE, TEST_PAM_USER, pam_conv)
+    pam.authenticate(0)
+    del pam
+  env = dict(os.environ, TEST_FAILURES_PARENT=str(os.getpid()))
+  child = subprocess.Popen(
+      [sys.executable, __file__, "failures_child"], env=env)
+  assert child.wait() == 0
+  pam = PAM.pam()
+  pam.start(TEST_PAM_MODULE, TEST_PAM_USER, pam_conv)
+  pam.authenticate(0)
+  del pam
+  pam = PAM.pam()
+  pam.start(TEST_PAM_MODULE, TEST_PAM_USER, pam_conv)
+  pam.chauthtok(0)
+  del pam
+  expected_results = [
+      (900, True), [1, 2, 3], 0,
+      3, 0, "TypeError",
+      1, 0, "TypeError",
+      1, 1, 0]
+  assert_results(expected_results, results)
+
+#
+# Test pamh.breaker().  Its state is shared, so the second transaction
+# sees the breaker the first one left open.
+#
+def test_breaker(results, who, pamh, flags, argv):
+  import time
+  if who != pam_sm_authenticate:
+    return pamh.PAM_SUCCESS
+  breaker = pamh.breaker("test", threshold=2, reset=0.05)
+  if results:
+    results.append(breaker.state)
+    breaker.success()
+    results.append(breaker.state)
+    return pamh.PAM_SUCCESS
+  breaker.success()
+  results.append((breaker.name, breaker.threshold, breaker.reset))
+  results.append(pamh.breaker("test") is breaker)
+  results.append(pamh.breaker("test", threshold=3).threshold)
+  pamh.breaker("test", threshold=2)
+  for i in range(2):
+    results.append((breaker.allow(), breaker.state))
+    breaker.failure()
+  results.append((breaker.allow(), breaker.state))
+  time.sleep(0.06)
+  results.append((breaker.allow(), breaker.state))
+  results.append((breaker.allow(), breaker.state))
+  breaker.failure()
+  results.append(breaker.state)
+  try:
+    pamh.breaker("bad", threshold=0)
+  except ValueError:
+    results.append("ValueError")
+  errors = 0
+  for i in range(8):
+    try:
+      pamh.breaker("full%d" % i)
+    except RuntimeError:
+      errors += 1
+  results.append(errors)
+  return pamh.PAM_SUCCESS
+
+def run_breaker(results):
+  for i in range(2):
+    pam = PAM.pam()
+    pam.start(TEST_PAM_MODULE, TEST_PAM_USER, pam_conv)
+    pam.authenticate(0)
+    del pam
+  expected_results = [
+      ("test", 2, 0.05),
+      True,
+      3,
+      (True, "closed"),
+      (True, "closed"),
+      (False, "open"),
+      (True, "half_open"),
+      (False, "half_open"),
+      "open",
+      "ValueError",
+      1,
+      "open",
+      "closed"]
+  assert_results(expected_results, results)
+
+#
+# Test pam_sm_process_init and pam_sm_process_fini.  A child process runs
+# two transactions, which share the module pam_sm_process_init set up, and
+# pam_sm_process_fini is called when the child exits.  The task
+# pam_sm_process_init scheduled outlives the first PAM handle.
+#
+def test_process(results, who, pamh, flags, argv):
+  import time
+  if who != pam_sm_authenticate:
+    return pamh.PAM_SUCCESS
+  process_state.append(who.__name__)
+  deadline = time.time() + 5
+  while process_task.runs == 0 and time.time() < deadline:
+    time.sleep(0.005)
+  results.append(
+      (list(process_state), process_task.value, process_task.cancelled))
+  return pamh.PAM_SUCCESS
+
+def run_process(results):
+  import subprocess
+  env = dict(os.environ, TEST_PROCESS_CHILD="1")
+  output = subprocess.check_output(
+      [sys.executable, __file__, "process_child"], env=env,
+      universal_newlines=True)
+  results.extend(output.splitlines())
+  expected_results = [
+      "[(['test', 'pam_sm_authenticate'], 'refreshed', False), "
+	  "(['test', 'pam_sm_authenticate', 'pam_sm_authenticate'], "
+	  "'refreshed', False)]",
+      "pam_sm_process_fini "
+	  "['test', 'pam_sm_authenticate', 'pam_sm_authenticate'] True"]
+  assert_results(expected_results, results)
+
+#
+# Test pamh.schedule().  The first task fails once, and the second is
+# still scheduled when the PAM handle is destroyed, which cancels it.  A
+# third is still running then, and finds the handle no longer works.
+#
+def test_schedule(results, who, pamh, flags, argv):
+  import time
+  if who == pam_sm_end:
+    schedule_ended.append(True)
+  if who != pam_sm_authenticate:
+    return pamh.PAM_SUCCESS
+  calls = []
+  def refresh():
+    calls.append(len(calls) + 1)
+    if len(calls) == 2:
+      raise ValueError("refresh failed")
+    return len(calls)
+  def late():
+    late_started.append(True)
+    while not schedule_ended:
+      time.sleep(0.01)
+    time.sleep(0.1)
+    try:
+      pamh.user
+    except pamh.exception:
+      results.append("ended")
+  task = pamh.schedule(0.01, refresh, jitter=0.5)
+  results.append((task.interval, task.jitter, task.function is refresh))
+  results.append(task.cancelled)
+  deadline = time.time() + 5
+  while task.runs < 2 and time.time() < deadline:
+    time.sleep(0.005)
+  task.cancel()
+  time.sleep(0.05)
+  results.append(
+      (task.failures, task.value == len(calls), task.runs == len(calls) - 1))
+  results.append(task.cancelled)
+  for args in ((0, refresh), (1, refresh, 1), (1, None)):
+    try:
+      pamh.schedule(*args)
+    except Exception as e:
+      results.append(e.__class__.__name__)
+  late_started = []
+  pamh.schedule(60, late)
+  while not late_started and time.time() < deadline:
+    time.sleep(0.005)
+  results.append(pamh.schedule(60, refresh))
+  return pamh.PAM_SUCCESS
+
+schedule_ended = []
+
+def run_schedule(results):
+  pam = PAM.pam()
+  pam.start(TEST_PAM_MODULE, TEST_PAM_USER, pam_conv)
+  pam.authenticate(0)
+  task = results[-1]
+  results[-1] = task.cancelled
+  del pam
+  results.append(task.cancelled)
+  expected_results = [
+      (0.01, 0.5, True),
+      False,
+      (1, True, True),
+      True,
+      "ValueError",
+      "ValueError",
+      "TypeError",
+      False,
+      "ended",
+      True]
+  assert_results(expected_results, results)
+
+#
+# Test a task that is still running when the last PAM handle goes doesn't
+# hold up pam_end().  It is left to finish, and after that tasks can be
+# scheduled again.
+#
+def test_schedule_stuck(results, who, pamh, flags, argv):
+  import time
+  if who != pam_sm_authenticate:
+    return pamh.PAM_SUCCESS
+  def stuck():
+    time.sleep(3.5)
+    results.append("finished")
+  if not results:
+    pamh.schedule(60, stuck)
+    time.sleep(0.1)
+    return pamh.PAM_SUCCESS
+  task = pamh.schedule(60, lambda: "ran")
+  deadline = time.time() + 5
+  while task.runs < 1 and time.time() < deadline:
+    time.sleep(0.005)
+  results.append(task.value)
+  return pamh.PAM_SUCCESS
+
+def run_schedule_stuck(results):
+  import time
+  pam = PAM.pam()
+  pam.start(TEST_PAM_MODULE, TEST_PAM_USER, pam_conv)
+  pam.authenticate(0)
+  start = time.time()
+  del pam
+  results.append(time.time() - start < 3)
+  deadline = time.time() + 5
+  while "finished" not in results and time.time() < deadline:
+    time.sleep(0.01)
+  time.sleep(0.2)
+  pam = PAM.pam()
+  pam.start(TEST_PAM_MODULE, TEST_PAM_USER, pam_conv)
+  pam.authenticate(0)
+  del pam
+  expected_results = [True, "finished", "ran"]
+  assert_results(expected_results, results)
+
+#
+# Run a test in a child process that uses test-pam_python-log.pam, which
+# copies what is logged to stderr.  Returns the lines logged.  Its state
+# directory is made afresh, so nothing an earlier run logged is counted.
+#
+TEST_LOG_STATE_DIR = os.path.join(
+    os.path.dirname(os.path.abspath(__file__)), "state-log")
+
+def run_log_child(test_name, fresh=True):
+  import shutil
+  import subprocess
+  if fresh:
+    shutil.rmtree(TEST_LOG_STATE_DIR, ignore_errors=True)
+    os.mkdir(TEST_LOG_STATE_DIR)
+  env = dict(os.environ)
+  env.pop("TRACEPARENT", None)
+  child = subprocess.Popen(
+      [sys.executable, __file__, "log_child", test_name], env=env,
+      stderr=subprocess.PIPE, universal_newlines=True)
+  output = child.communicate()[1]
+  assert child.returncode == 0, output
+  return output.splitlines()
+
+def log_authenticate():
+  pam = PAM.pam()
+  pam.start(TEST_PAM_LOG_MODULE, TEST_PAM_USER, pam_conv)
+  try:
+    pam.authenticate(0)
+  except PAM.error:
+    pass
+  del pam
+
+#
+# Test that a repeated exception's traceback is logged once per
+# log_window, and what was suppressed is counted.  The state directory
+# can't be made for the first two, so they are counted privately, and the
+# count moves to the shared file once it can be.  The private count is
+# lost if pam_python.so is unloaded, so a handle is kept open throughout.
+# The message differs each time, as it would in an outage.
+#
+def test_log_ratelimit(results, who, pamh, flags, argv):
+  import time
+  if who == pam_sm_authenticate and not results:
+    raise ValueError("backend down at %f" % time.time())
+  return pamh.PAM_SUCCESS
+
+def log_child_ratelimit(results):
+  import time
+  os.rmdir(TEST_LOG_STATE_DIR)
+  holder = PAM.pam()
+  holder.start(TEST_PAM_LOG_MODULE, TEST_PAM_USER, pam_conv)
+  holder.setcred(0)
+  log_authenticate()
+  log_authenticate()
+  os.mkdir(TEST_LOG_STATE_DIR)
+  log_authenticate()
+  time.sleep(1.1)
+  results.append("quiet")
+  log_authenticate()
+  del holder
+
+def run_log_ratelimit(results):
+  import re
+  output = run_log_child("ratelimit")
+  results.append(
+      len([l for l in output if l.endswith("Traceback (most recent call last):")]))
+  results.append(
+      len([l for l in output if re.search(r": ValueError: backend down at [\d.]+$", l)]))
+  results.append(len([
+      l for l in output
+      if re.search(r": 2 more occurrences of ValueError at .*test.py:\d+ in the last \d+s$", l)]))
+  results.append(
+      os.path.exists(os.path.join("state-log", "state", "exceptions-2")))
+  expected_results = [1, 1, 1, True]
+  assert_results(expected_results, results)
+
+#
+# Test log_async, which test-pam_python-log.pam gives the account
+# handlers.  Messages are written by a background thread in the order they
+# were logged, and under their own ident.  The thread stops when the last
+# PAM handle goes, and the next one to log starts it again.
+#
+def test_log_async(results, who, pamh, flags, argv):
+  if who != pam_sm_acct_mgmt:
+    return pamh.PAM_SUCCESS
+  for i in range(3):
+    pamh.log(pamh.LOG_ERR, "message %d", i)
+  results.append(len(os.listdir("/proc/self/task")))
+  if len(results) == 1:
+    raise ValueError("async")
+  return pamh.PAM_SUCCESS
+
+def log_child_async(results):
+  threads = len(os.listdir("/proc/self/task"))
+  for i in range(2):
+    pam = PAM.pam()
+    pam.start(TEST_PAM_LOG_MODULE, TEST_PAM_USER, pam_conv)
+    try:
+      pam.acct_mgmt(0)
+    except PAM.error:
+      pass
+    del pam
+    sys.stderr.write(
+        "threads %d %d\n" %
+	  (results[-1] - threads, len(os.listdir("/proc/self/task")) - threads))
+    sys.stderr.flush()
+
+def run_log_async(results):
+  output = run_log_child("async")
+  for line in output:
+    if ": " not in line:
+      results.append(line)
+    elif line.startswith("test["):
+      results.append(line.split(": ", 1)[1])
+    else:
+      results.append(line.split(": ", 1)[1].split(" ")[0] or "frame")
+  expected_results = [
+      "message 0",
+      "message 1",
+      "message 2",
+      "Traceback",
+      "frame",
+      "frame",
+      "frame",
+      "ValueError:",
+      "threads 1 0",
+      "message 0",
+      "message 1",
+      "message 2",
+      "threads 1 0"]
+  assert_results(expected_results, results)
+
+#
+# Test that an exception is logged after those it was raised from or
+# while handling, unless it was raised "from None".
+#
+def test_log_chain(results, who, pamh, flags, argv):
+  if who != pam_sm_authenticate:
+    return pamh.PAM_SUCCESS
+  results.append(who.__name__)
+  try:
+    try:
+      {}["key"]
+    except KeyError:
+      if len(results) == 2:
+        raise LookupError("from none") from None
+      raise ValueError("context")
+  except ValueError as e:
+    raise RuntimeError("cause") from e
+
+def log_child_chain(results):
+  log_authenticate()
+  log_authenticate()
+
+def run_log_chain(results):
+  output = run_log_child("chain")
+  results.extend(
+      line.split(": ", 1)[1] for line in output
+      if not line.split(": ", 1)[1].startswith("  "))
+  expected_results = [
+      "Traceback (most recent call last):",
+      "KeyError: 'key'",
+      "During handling of the above exception, another exception occurred:",
+      "Traceback (most recent call last):",
+      "ValueError: context",
+      "The above exception was the direct cause of the following exception:",
+      "Traceback (most recent call last):",
+      "RuntimeError: cause",
+      "Traceback (most recent call last):",
+      "LookupError: from none"]
+  assert_results(expected_results, results)
+
+#
+# Test the stats option, which test-pam_python-log.pam gives the auth
+# handlers, and pam_python_stat which reads what it counted.  A stats file
+# that isn't ours is left as it is.
+#
+def test_log_stats(results, who, pamh, flags, argv):
+  return pamh.PAM_SUCCESS
+
+def log_child_stats(results):
+  log_authenticate()
+  log_authenticate()
+
+def run_log_stats(results):
+  import glob
+  import subprocess
+  def pam_python_stat():
+    stat = subprocess.Popen(
+        [os.path.join(os.path.dirname(TEST_LOG_STATE_DIR), "pam_python_stat"),
+	  "-d", os.path.join(TEST_LOG_STATE_DIR, "state")],
+	stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+	universal_newlines=True)
+    output = stat.communicate()
+    return stat.returncode, output[0].splitlines(), output[1]
+  results.append(run_log_child("stats"))
+  returncode, output, errors = pam_python_stat()
+  results.append(returncode)
+  results.extend(
+      line.split()[:3] + line.split()[-1:] for line in output
+      if line.startswith("  pam_sm_authenticate "))
+  stats_files = glob.glob(os.path.join(TEST_LOG_STATE_DIR, "state", "stats-*"))
+  results.append(len(stats_files))
+  with open(stats_files[0], "r+b") as f:
+    f.write(b"\xff" * 8)
+    f.seek(0)
+    contents = f.read()
+  output = run_log_child("stats", fresh=False)
+  results.append(len([l for l in output if "isn't a version" in l]) > 0)
+  with open(stats_files[0], "rb") as f:
+    results.append(f.read() == contents)
+  results.append(pam_python_stat()[0])
+  expected_results = [
+      [],
+      0,
+      ["pam_sm_authenticate", "2", "0", "0=2"],
+      1,
+      True,
+      True,
+      1]
+  assert_results(expected_results, results)
+
+#
+# Test the profiler, which test-pam_python-log.pam gives the password
+# handlers.  The samples, as collapsed stacks, are written when the
+# handle is destroyed, and a C function that blocks gets a frame of its
+# own.
+#
+def test_log_profile(results, who, pamh, flags, argv):
+  import time
+  def busy(deadline):
+    while time.time() < deadline:
+      sum(range(100))
+  if who == pam_sm_chauthtok and flags & pamh.PAM_UPDATE_AUTHTOK:
+    busy(time.time() + 0.02)
+    time.sleep(0.02)
+  return pamh.PAM_SUCCESS
+
+def log_child_profile(results):
+  pam = PAM.pam()
+  pam.start(TEST_PAM_LOG_MODULE, TEST_PAM_USER, pam_conv)
+  pam.chauthtok(0)
+  del pam
+
+def run_log_profile(results):
+  import glob
+  results.append(run_log_child("profile"))
+  profiles = glob.glob(os.path.join(TEST_LOG_STATE_DIR, "profile", "*.collapsed"))
+  results.append(len(profiles))
+  stacks = {}
+  with open(profiles[0]) as f:
+    for line in f:
+      stack, count = line.rsplit(" ", 1)
+      stacks[stack] = int(count)
+  results.append(
+      sorted(set(stack.split(";")[0] for stack in stacks)))
+  results.append(
+      sum(c for s, c in stacks.items() if "test.py:busy" in s) >= 5)
+  results.append(
+      sum(c for s, c in stacks.items() if s.endswith(";[sleep]")) >= 5)
+  expected_results = [[], 1, ["pam_sm_chauthtok"], True, True]
+  assert_results(expected_results, results)
+
+#
+# Test the spans trace= writes, which test-pam_python-log.pam gives the
+# session handlers.  The user name is hashed with a key kept in the state
+# directory, so the same user hashes the same way in every transaction,
+# but not the way an unkeyed hash would.
+#
+def test_log_trace(results, who, pamh, flags, argv):
+  if who == pam_sm_open_session:
+    with pamh.span("lookup"):
+      pass
+  return pamh.PAM_SUCCESS
+
+def log_child_trace(results):
+  for i in range(2):
+    pam = PAM.pam()
+    pam.start(TEST_PAM_LOG_MODULE, TEST_PAM_USER, pam_conv)
+    pam.set_item(PAM.PAM_RHOST, "192.0.2.1")
+    pam.open_session(0)
+    pam.close_session(0)
+    del pam
+
+def run_log_trace(results):
+  import json
+  import stat
+  results.append(run_log_child("trace"))
+  with open(os.path.join(TEST_LOG_STATE_DIR, "trace.json")) as f:
+    spans = [json.loads(line) for line in f]
+  results.append(len(spans))
+  span = spans[0]
+  results.append(sorted(span))
+  results.append((
+      span["name"], span["module"], span["service"], span["rhost"],
+      span["parent_span_id"], span["result"]))
+  results.append([h["name"] for h in span["handlers"]])
+  results.append([(s["name"], s["parent_span_id"]) for s in span["spans"]])
+  results.append((len(span["trace_id"]), len(span["span_id"])))
+  results.append(span["start_time_unix_nano"] <= span["end_time_unix_nano"])
+  fnv1a = 14695981039346656037
+  for c in TEST_PAM_USER.encode():
+    fnv1a = ((fnv1a ^ c) * 1099511628211) % 2**64
+  results.append((
+      len(span["user_hash"]),
+      span["user_hash"] == spans[1]["user_hash"],
+      span["user_hash"] == "%016x" % fnv1a))
+  key = os.stat(os.path.join(TEST_LOG_STATE_DIR, "state", "trace-key"))
+  results.append((key.st_size, stat.S_IMODE(key.st_mode)))
+  expected_results = [
+      [],
+      2,
+      [
+	"conversation_ns", "end_time_unix_nano", "handlers", "module",
+	"name", "parent_span_id", "python_ns", "result", "rhost", "service",
+	"span_id", "spans", "start_time_unix_nano", "trace_id", "user_hash"],
+      (
+	"pam_python", os.path.abspath(__file__), TEST_PAM_LOG_MODULE,
+	"192.0.2.1", None, 0),
+      ["pam_sm_open_session", "pam_sm_close_session", "pam_sm_end"],
+      [("lookup", span["span_id"])],
+      (32, 16),
+      True,
+      (16, True, False),
+      (16, 0o600)]
+  assert_results(expected_results, results)
+
+#
+# Test record=, which test-pam_python-log.pam gives the session handlers.
+# The responses to echoed prompts and the environment's values are
+# recorded only as their lengths, and pam_sm_end is recorded too.
+#
+def test_log_record(results, who, pamh, flags, argv):
+  if who == pam_sm_open_session:
+    pamh.env["RECORD_TOKEN"] = "env-secret"
+    pamh.conversation(pamh.Message(pamh.PAM_PROMPT_ECHO_ON, "Code:"))
+  return pamh.PAM_SUCCESS
+
+def log_child_record(results):
+  def conv(auth, query_list, userData=None):
+    return [("echo-secret", 0) for query in query_list]
+  pam = PAM.pam()
+  pam.start(TEST_PAM_LOG_MODULE, TEST_PAM_USER, conv)
+  pam.open_session(0)
+  pam.close_session(0)
+  del pam
+
+def run_log_record(results):
+  results.append(run_log_child("record"))
+  with open(os.path.join(TEST_LOG_STATE_DIR, "record")) as f:
+    record = f.read()
+  results.append("secret" in record)
+  lines = record.splitlines()
+  results.append([line for line in lines if line.startswith("call ")])
+  results.append([
+      line for line in lines
+      if line.startswith(("prompt ", "response ", "env =RECORD_TOKEN "))])
+  expected_results = [
+      [],
+      False,
+      [
+	"call pam_sm_open_session 0",
+	"call pam_sm_close_session 0",
+	"call pam_sm_end 0"],
+      [
+	"prompt 2 =Code:",
+	"response 0 #11",
+	"env =RECORD_TOKEN #10",
+	"env =RECORD_TOKEN #10"]]
+  assert_results(expected_results, results)
+
 #
 # Test absent entry point.
 #
 def test_absent(results, who, pamh, flags, argv):
-  results.append(who.func_name)
+  results.append(who.__name__)
   if who != pam_sm_authenticate:
     return pamh.PAM_SUCCESS
   global pam_sm_acct_mgmt; del pam_sm_acct_mgmt
@@ -601,7 +1688,7 @@ def run_absent(results):
     try:
       func(0)
       exception = None
-    except Exception, e:
+    except Exception as e:
       exception = e
     results.append((exception.__class__.__name__, str(exception)))
   del pam
@@ -619,6 +1706,40 @@ def run_absent(results):
 # Entry point.
 #
 def main(argv):
+  if argv[1:] == ["cache_child"]:
+    import test
+    test.test_results = []
+    test.test_function = test_cache
+    pam = PAM.pam()
+    pam.start(TEST_PAM_MODULE, TEST_PAM_USER, pam_conv)
+    pam.authenticate(0)
+    return
+  if argv[1:] == ["failures_child"]:
+    import test
+    test.test_results = []
+    test.test_function = test_failures
+    pam = PAM.pam()
+    pam.start(TEST_PAM_MODULE, TEST_PAM_USER, pam_conv)
+    pam.authenticate(0)
+    return
+  if argv[1:] == ["process_child"]:
+    import test
+    test.test_results = []
+    test.test_function = test_process
+    for i in range(2):
+      pam = PAM.pam()
+      pam.start(TEST_PAM_MODULE, TEST_PAM_USER, pam_conv)
+      pam.authenticate(0)
+      del pam
+    sys.stdout.write("%r\n" % test.test_results)
+    sys.stdout.flush()
+    return
+  if argv[1:2] == ["log_child"]:
+    import test
+    test.test_results = []
+    test.test_function = globals()["test_log_" + argv[2]]
+    globals()["log_child_" + argv[2]](test.test_results)
+    return
   run_test(run_basic_calls)
   run_test(run_constants)
   run_test(run_environment)
@@ -630,6 +1751,25 @@ def main(argv):
   run_test(run_pamerr)
   run_test(run_fail_delay)
   run_test(run_exceptions)
+  run_test(run_log)
+  run_test(run_span)
+  run_test(run_async)
+  run_test(run_timeout)
+  run_test(run_executor)
+  run_test(run_rules)
+  run_test(run_cache)
+  run_test(run_failures)
+  run_test(run_breaker)
+  run_test(run_schedule)
+  run_test(run_schedule_stuck)
+  run_test(run_process)
+  run_test(run_log_ratelimit)
+  run_test(run_log_async)
+  run_test(run_log_chain)
+  run_test(run_log_stats)
+  run_test(run_log_profile)
+  run_test(run_log_trace)
+  run_test(run_log_record)
   run_test(run_absent)
 
 #